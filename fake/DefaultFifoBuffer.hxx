@@ -33,6 +33,7 @@
 #pragma once
 
 #include "util/ForeignFifoBuffer.hxx"
+#include "system/BufferPool.hxx"
 
 #include <stdint.h>
 
@@ -40,10 +41,10 @@
  * A frontend for #SliceFifoBuffer which allows to replace it with a
  * simple heap-allocated buffer when some client code gets copied to
  * another project.
+ *
+ * Buffers are obtained from the calling thread's #BufferCache.
  */
 class DefaultFifoBuffer : public ForeignFifoBuffer<uint8_t> {
-	static constexpr size_t SIZE = 8192;
-
 public:
 	DefaultFifoBuffer():ForeignFifoBuffer(nullptr) {}
 
@@ -52,11 +53,15 @@ public:
 	}
 
 	void Allocate() {
-		SetBuffer(new uint8_t[SIZE], SIZE);
+		auto &cache = GetDefaultBufferCache();
+		SetBuffer((uint8_t *)cache.Get(), cache.GetBufferSize());
 	}
 
 	void Free() {
-		delete[] GetBuffer();
+		if (IsNull())
+			return;
+
+		GetDefaultBufferCache().Put(GetBuffer());
 		SetNull();
 	}
 
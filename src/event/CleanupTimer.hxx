@@ -61,6 +61,14 @@ public:
 		event.Cancel();
 	}
 
+	/**
+	 * The callback may use EventLoop::SteadyNow() to check
+	 * #Expiry instances without reading the clock for each one.
+	 */
+	EventLoop &GetEventLoop() noexcept {
+		return event.GetEventLoop();
+	}
+
 	void Enable() noexcept;
 	void Disable() noexcept;
 
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Loop.hxx"
+#include "TimerWheel.hxx"
+#include "util/BindMethod.hxx"
+
+#include <sys/time.h>
+
+/**
+ * Like #TimerEvent, but backed by the #EventLoop's #TimerWheel:
+ * scheduling and canceling is O(1), but the callback may be invoked
+ * up to one TimerWheel::Tick late.  Use it for timeouts which are
+ * refreshed often, e.g. idle timeouts of many connections.
+ */
+class CoarseTimerEvent final : public TimerWheel::Hook {
+	friend class TimerWheel;
+
+	EventLoop &loop;
+
+	const BoundMethod<void()> callback;
+
+	/**
+	 * The tick at which this timer is due.  Only valid if
+	 * IsPending() returns true.
+	 */
+	uint64_t due_tick;
+
+public:
+	CoarseTimerEvent(EventLoop &_loop, BoundMethod<void()> _callback) noexcept
+		:loop(_loop), callback(_callback) {}
+
+	~CoarseTimerEvent() noexcept {
+		Cancel();
+	}
+
+	CoarseTimerEvent(const CoarseTimerEvent &) = delete;
+	CoarseTimerEvent &operator=(const CoarseTimerEvent &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return loop;
+	}
+
+	bool IsPending() const noexcept {
+		return is_linked();
+	}
+
+	void Add(TimerWheel::Clock::duration d) noexcept;
+
+	void Add(const struct timeval &tv) noexcept;
+
+	void Cancel() noexcept;
+
+private:
+	void Run() noexcept {
+		callback();
+	}
+};
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "InjectEvent.hxx"
+
+InjectEvent::~InjectEvent() noexcept
+{
+	if (state.load(std::memory_order_relaxed) != IDLE)
+		/* move this object from the lock-free stack to the
+		   EventLoop's list, which the base hook unlinks
+		   from */
+		loop.FlushInject();
+
+	loop.RemoveInject();
+}
+
+void
+InjectEvent::Schedule() noexcept
+{
+	State s = state.load(std::memory_order_relaxed);
+	while (true) {
+		switch (s) {
+		case IDLE:
+			if (state.compare_exchange_weak(s, QUEUED)) {
+				loop.Inject(*this);
+				return;
+			}
+
+			break;
+
+		case QUEUED:
+			return;
+
+		case CANCELED:
+			/* still linked in the EventLoop; just
+			   re-enable it */
+			if (state.compare_exchange_weak(s, QUEUED))
+				return;
+
+			break;
+		}
+	}
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Loop.hxx"
+#include "util/BindMethod.hxx"
+
+#include <atomic>
+
+/**
+ * Invoke a callback in the #EventLoop thread, triggered by any
+ * thread.  This is the thread-safe counterpart of #DeferEvent: use
+ * it to hand results from worker threads back to the I/O thread.
+ *
+ * Scheduling is lock-free.  Scheduling an event which is already
+ * pending is a no-op, and all injections between two #EventLoop
+ * iterations share one eventfd wakeup.
+ *
+ * The constructor and the destructor must be called in the
+ * #EventLoop thread, and no other thread may call Schedule() while
+ * the destructor runs.
+ */
+class InjectEvent final : public EventLoop::InjectHook {
+	friend class EventLoop;
+
+	EventLoop &loop;
+
+	typedef BoundMethod<void()> Callback;
+	const Callback callback;
+
+	enum State : unsigned {
+		/**
+		 * Not scheduled.
+		 */
+		IDLE,
+
+		/**
+		 * Scheduled; the callback will be invoked.
+		 */
+		QUEUED,
+
+		/**
+		 * Scheduled, but canceled: this object is still
+		 * linked in the #EventLoop, but the callback will not
+		 * be invoked.
+		 */
+		CANCELED,
+	};
+
+	std::atomic<State> state{IDLE};
+
+	/**
+	 * The next item in EventLoop::inject_head.
+	 */
+	InjectEvent *next;
+
+public:
+	/**
+	 * Throws std::system_error on error.
+	 */
+	InjectEvent(EventLoop &_loop, Callback _callback)
+		:loop(_loop), callback(_callback) {
+		loop.AddInject();
+	}
+
+	~InjectEvent() noexcept;
+
+	InjectEvent(const InjectEvent &) = delete;
+	InjectEvent &operator=(const InjectEvent &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return loop;
+	}
+
+	/**
+	 * Schedule the callback.  This method is thread-safe.
+	 */
+	void Schedule() noexcept;
+
+	/**
+	 * Cancel a pending callback.  This method is thread-safe, but
+	 * if it is called from another thread, the callback may
+	 * already be running.
+	 */
+	void Cancel() noexcept {
+		State expected = QUEUED;
+		state.compare_exchange_strong(expected, CANCELED);
+	}
+
+private:
+	/**
+	 * Called by the #EventLoop after this object has been
+	 * removed from its list.
+	 */
+	void Run() noexcept {
+		if (state.exchange(IDLE) == QUEUED)
+			callback();
+	}
+};
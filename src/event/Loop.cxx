@@ -31,6 +31,12 @@
  */
 
 #include "Loop.hxx"
+#include "InjectEvent.hxx"
+#include "CoarseTimerEvent.hxx"
+#include "Duration.hxx"
+#include "system/Error.hxx"
+
+#include <stdint.h>
 
 void
 EventLoop::Defer(DeferEvent &e) noexcept
@@ -47,10 +53,533 @@ EventLoop::CancelDefer(DeferEvent &e) noexcept
 bool
 EventLoop::RunDeferred() noexcept
 {
-	while (!defer.empty())
+	while (!defer.empty()) {
+		++iteration_deferred;
+
+		CallbackTimer timer(*this);
 		defer.pop_front_and_dispose([](DeferEvent *e){
 				e->OnDeferred();
 			});
+	}
+
+	return true;
+}
+
+void
+EventLoop::EndCallback(std::chrono::steady_clock::time_point start) noexcept
+{
+	FlushClockCaches();
+	const auto d = SteadyNow() - start;
+	stats.AddCallback(d);
+	iteration_busy += d;
+}
+
+void
+EventLoop::EndIteration() noexcept
+{
+	++stats.iterations;
+	stats.AddDeferredCallbacks(iteration_deferred);
+	iteration_deferred = 0;
+
+	if (stats_enabled && iteration_started) {
+		FlushClockCaches();
+		const auto now = SteadyNow();
+		stats.AddIteration(now - iteration_start, iteration_busy);
+
+#ifndef ENABLE_EPOLL
+		previous_iteration_end = now;
+		previous_iteration_valid = true;
+#endif
+	}
+
+	iteration_started = false;
+	iteration_busy = EventLoopStats::Duration::zero();
+}
+
+void
+EventLoop::AddCoarseTimer(CoarseTimerEvent &t,
+			  TimerWheel::Clock::duration d) noexcept
+{
+	const auto now = SteadyNow();
+	const uint64_t tick = coarse_timers.Insert(t, now + d, now);
+
+#ifdef ENABLE_EPOLL
+	/* Loop() will consider the new timer when calculating the
+	   epoll_wait() timeout */
+	(void)tick;
+#else
+	ScheduleCoarseTimers(tick);
+#endif
+}
+
+void
+EventLoop::AddInject()
+{
+	if (!inject_fd.IsDefined()) {
+		if (!inject_fd.CreateEventFD())
+			throw MakeErrno("eventfd() failed");
+
+#ifndef ENABLE_EPOLL
+		::event_assign(&inject_event, event_base, inject_fd.Get(),
+			       EV_READ|EV_PERSIST, InjectCallback, this);
+#endif
+	}
+
+	if (n_inject++ == 0) {
+#ifdef ENABLE_EPOLL
+		if (!epoll.Add(inject_fd.Get(), EPOLLIN, INJECT_DATA))
+			throw MakeErrno("epoll_ctl() failed");
+#else
+		::event_add(&inject_event, nullptr);
+#endif
+	}
+}
+
+void
+EventLoop::RemoveInject() noexcept
+{
+	assert(n_inject > 0);
+
+	if (--n_inject == 0) {
+#ifdef ENABLE_EPOLL
+		epoll.Remove(inject_fd.Get());
+		inject_ready = false;
+#else
+		::event_del(&inject_event);
+#endif
+	}
+}
+
+void
+EventLoop::Inject(InjectEvent &e) noexcept
+{
+	InjectEvent *head = inject_head.load(std::memory_order_relaxed);
+	do {
+		e.next = head;
+	} while (!inject_head.compare_exchange_weak(head, &e,
+						    std::memory_order_release,
+						    std::memory_order_relaxed));
+
+	if (head == nullptr) {
+		/* the stack was empty: wake up the EventLoop; if it
+		   was not empty, a wakeup is already pending */
+		static constexpr uint64_t value = 1;
+		(void)inject_fd.Write(&value, sizeof(value));
+	}
+}
+
+void
+EventLoop::FlushInject() noexcept
+{
+	InjectEvent *head = inject_head.exchange(nullptr,
+						 std::memory_order_acquire);
+
+	/* the stack is in LIFO order; reverse it by inserting each
+	   item at the same position */
+	const auto end = inject_list.end();
+	auto position = end;
+	for (InjectEvent *i = head; i != nullptr;) {
+		InjectEvent &e = *i;
+		i = e.next;
+
+		position = inject_list.insert(position, e);
+	}
+}
+
+void
+EventLoop::RunInject() noexcept
+{
+	/* consume the wakeup before taking the stack; an injection
+	   after this point writes to the eventfd again */
+	uint64_t value;
+	(void)inject_fd.Read(&value, sizeof(value));
+
+	FlushInject();
+
+	while (!inject_list.empty()) {
+		auto &e = inject_list.front();
+		inject_list.pop_front();
+
+		CallbackTimer timer(*this);
+		e.Run();
+	}
+}
+
+#ifndef ENABLE_EPOLL
+
+EventLoop::EventLoop() noexcept
+	:event_base(Create())
+{
+	evtimer_assign(&coarse_event, event_base, CoarseCallback, this);
+}
+
+EventLoop::~EventLoop() noexcept
+{
+	assert(defer.empty());
+	assert(n_inject == 0);
+
+	if (coarse_tick != 0)
+		evtimer_del(&coarse_event);
+
+	::event_base_free(event_base);
+}
+
+void
+EventLoop::ScheduleCoarseTimers(uint64_t tick) noexcept
+{
+	if (coarse_tick != 0 && coarse_tick <= tick)
+		/* already scheduled early enough */
+		return;
+
+	const auto now = SteadyNow();
+	const auto due = TimerWheel::TickToTimePoint(tick);
+	const auto d = due > now
+		? std::chrono::duration_cast<std::chrono::microseconds>(due - now)
+		: std::chrono::microseconds::zero();
+
+	const struct timeval tv = ToEventDuration(d);
+	evtimer_add(&coarse_event, &tv);
+	coarse_tick = tick;
+}
+
+void
+EventLoop::CoarseCallback(evutil_socket_t, short, void *ctx) noexcept
+{
+	auto &loop = *(EventLoop *)ctx;
+
+	loop.coarse_tick = 0;
+
+	{
+		CallbackTimer timer(loop);
+		loop.coarse_timers.Run(loop.SteadyNow());
+	}
+
+	const uint64_t next = loop.coarse_timers.GetNextTick();
+	if (next != 0)
+		loop.ScheduleCoarseTimers(next);
+}
+
+void
+EventLoop::InjectCallback(evutil_socket_t, short, void *ctx) noexcept
+{
+	auto &loop = *(EventLoop *)ctx;
+	loop.RunInject();
+}
+
+#endif
+
+#ifdef ENABLE_EPOLL
+
+#include "SocketEvent.hxx"
+#include "TimerEvent.hxx"
+
+#include <algorithm>
+
+#include <errno.h>
+
+EventLoop::EventLoop() noexcept
+{
+}
+
+EventLoop::~EventLoop() noexcept
+{
+	assert(defer.empty());
+	assert(n_inject == 0);
+	assert(coarse_timers.IsEmpty());
+
+	ready_sockets.clear();
+	timers.clear();
+}
+
+void
+EventLoop::Reinit() noexcept
+{
+	epoll = EpollFD();
+
+	if (n_inject > 0)
+		epoll.Add(inject_fd.Get(), EPOLLIN, INJECT_DATA);
+
+	for (size_t fd = 0; fd < slots.size(); ++fd) {
+		auto &slot = slots[fd];
+		if (slot.registered != 0 &&
+		    !epoll.Add(fd, slot.registered, fd))
+			slot.registered = 0;
+	}
+}
+
+void
+EventLoop::DumpEvents(FILE *file) noexcept
+{
+	fprintf(file, "Registered sockets: %u\n", n_sockets);
+
+	for (size_t fd = 0; fd < slots.size(); ++fd) {
+		const auto &slot = slots[fd];
+		if (slot.registered == 0)
+			continue;
+
+		fprintf(file, "  fd=%u epoll=0x%x:", unsigned(fd),
+			unsigned(slot.registered));
+		for (const auto *e = slot.head; e != nullptr;
+		     e = e->next_on_fd)
+			fprintf(file, " [events=0x%x%s]", e->events,
+				e->IsTimerPending() ? " timeout" : "");
+		fprintf(file, "\n");
+	}
+
+	const auto now = SteadyNow();
+	for (const auto &t : timers)
+		fprintf(file, "  timer in %lldms\n",
+			(long long)std::chrono::duration_cast<std::chrono::milliseconds>(t.due - now).count());
+}
+
+bool
+EventLoop::TimerCompare::operator()(const TimerEvent &a,
+				     const TimerEvent &b) const noexcept
+{
+	return a.due < b.due;
+}
+
+void
+EventLoop::AddTimer(TimerEvent &t) noexcept
+{
+	assert(!t.IsPending());
+
+	timers.insert(t);
+}
+
+int
+EventLoop::GetTimeout() const noexcept
+{
+	const auto now = SteadyNow();
+
+	auto d = coarse_timers.GetTimeout(now);
+
+	if (!timers.empty()) {
+		const auto due = timers.begin()->due;
+		const auto t = due > now
+			? due - now
+			: std::chrono::steady_clock::duration::zero();
+		if (d.count() < 0 || t < d)
+			d = t;
+	}
+
+	if (d.count() < 0)
+		return -1;
+
+	/* round up to the next millisecond, or else epoll_wait()
+	   would return too early, and we would spin until the timer
+	   is really due */
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+	return std::min<long long>((us.count() + 999) / 1000, 1000 * 3600);
+}
+
+void
+EventLoop::RunTimers() noexcept
+{
+	const auto now = SteadyNow();
+
+	if (!coarse_timers.IsEmpty()) {
+		CallbackTimer timer(*this);
+		coarse_timers.Run(now);
+	}
+
+	while (!timers.empty() && !break_loop) {
+		auto &t = *timers.begin();
+		if (t.due > now)
+			break;
+
+		t.Cancel();
+
+		CallbackTimer timer(*this);
+		t.Run();
+	}
+}
+
+void
+EventLoop::AddSocket(SocketEvent &e) noexcept
+{
+	assert(e.fd >= 0);
+	assert(e.scheduled);
+
+	const size_t fd = e.fd;
+	if (fd >= slots.size())
+		slots.resize(std::max<size_t>(fd + 1, slots.size() * 2));
+
+	auto &slot = slots[fd];
+	e.next_on_fd = slot.head;
+	slot.head = &e;
+	++n_sockets;
+
+	if ((e.events & SocketEvent::EDGE_TRIGGERED) && slot.ready != 0)
+		/* an edge was reported while nobody was interested; deliver
+		   it now, because epoll will not report it again */
+		e.SetReady(slot.ready);
+}
+
+void
+EventLoop::RemoveSocket(SocketEvent &e) noexcept
+{
+	assert(e.fd >= 0);
+	assert(size_t(e.fd) < slots.size());
+	assert(n_sockets > 0);
+
+	auto &slot = slots[e.fd];
+	for (SocketEvent **i = &slot.head; *i != nullptr; i = &(*i)->next_on_fd) {
+		if (*i == &e) {
+			*i = e.next_on_fd;
+			--n_sockets;
+			return;
+		}
+	}
+
+	assert(false);
+}
+
+static constexpr uint32_t
+ToEpollMask(unsigned events) noexcept
+{
+	return (events & SocketEvent::READ ? uint32_t(EPOLLIN) : 0u) |
+		(events & SocketEvent::WRITE ? uint32_t(EPOLLOUT) : 0u);
+}
+
+static constexpr unsigned
+FromEpollMask(uint32_t mask) noexcept
+{
+	return (mask & (EPOLLIN|EPOLLPRI|EPOLLERR|EPOLLHUP)
+		? SocketEvent::READ : 0u) |
+		(mask & (EPOLLOUT|EPOLLERR|EPOLLHUP)
+		 ? SocketEvent::WRITE : 0u);
+}
+
+bool
+EventLoop::UpdateSocket(int fd) noexcept
+{
+	assert(fd >= 0);
+	assert(size_t(fd) < slots.size());
+
+	auto &slot = slots[fd];
+
+	uint32_t mask = 0;
+	bool edge_triggered = false;
+	for (const auto *e = slot.head; e != nullptr; e = e->next_on_fd) {
+		mask |= ToEpollMask(e->events);
+		if (e->events & SocketEvent::EDGE_TRIGGERED)
+			edge_triggered = true;
+	}
+
+	if (edge_triggered && mask != 0)
+		/* in edge-triggered mode, register all events once, to
+		   avoid epoll_ctl() calls each time one direction gets
+		   scheduled or unscheduled */
+		mask = EPOLLIN|EPOLLOUT|EPOLLET;
+
+	if (mask == slot.registered)
+		return true;
+
+	bool success;
+	if (mask == 0) {
+		/* ignore errors here; the file descriptor may have been
+		   closed already */
+		epoll.Remove(fd);
+		slot.ready = 0;
+		success = true;
+	} else if (slot.registered == 0) {
+		success = epoll.Add(fd, mask, fd);
+	} else {
+		success = epoll.Modify(fd, mask, fd);
+		if (!success && errno == ENOENT)
+			/* the file descriptor was closed and
+			   reopened without unregistering it */
+			success = epoll.Add(fd, mask, fd);
+	}
+
+	slot.registered = success ? mask : 0;
+	return success;
+}
+
+void
+EventLoop::MakeReady(SocketEvent &e, unsigned) noexcept
+{
+	if (!e.ReadyHook::is_linked())
+		ready_sockets.push_back(e);
+}
+
+void
+EventLoop::CollectReadySockets(unsigned n) noexcept
+{
+	for (unsigned i = 0; i < n; ++i) {
+		const auto &re = received_events[i];
+		if (re.data.u64 == INJECT_DATA) {
+			inject_ready = true;
+			continue;
+		}
+
+		const size_t fd = re.data.u64;
+		if (fd >= slots.size())
+			continue;
+
+		auto &slot = slots[fd];
+		const unsigned flags = FromEpollMask(re.events);
+
+		if (slot.registered & EPOLLET)
+			slot.ready |= flags;
+
+		for (auto *e = slot.head; e != nullptr; e = e->next_on_fd)
+			e->SetReady(flags);
+	}
+}
+
+void
+EventLoop::RunReadySockets() noexcept
+{
+	while (!ready_sockets.empty() && !break_loop) {
+		auto &e = ready_sockets.front();
+		ready_sockets.pop_front();
+
+		if (e.events & SocketEvent::EDGE_TRIGGERED)
+			slots[e.fd].ready &= ~e.ready_flags;
+
+		CallbackTimer timer(*this);
+		e.Dispatch();
+	}
+}
+
+bool
+EventLoop::Loop(int flags) noexcept
+{
+	break_loop = false;
+
+	if (IsEmpty())
+		return false;
+
+	FlushClockCaches();
+	BeginIteration();
+
+	int timeout = (flags & LOOP_NONBLOCK) || !ready_sockets.empty()
+		? 0
+		: GetTimeout();
+
+	int n = epoll.Wait(received_events, MAX_EVENTS, timeout);
+
+	/* epoll_wait() may have blocked: read the clock again */
+	if (timeout != 0)
+		FlushClockCaches();
+
+	if (n > 0)
+		CollectReadySockets(n);
+
+	/* dispatch the sockets before the timers (like libevent), so
+	   a timer which calls Break() does not postpone sockets which
+	   were already reported ready */
+	RunReadySockets();
+	RunTimers();
+
+	if (inject_ready && !break_loop) {
+		inject_ready = false;
+		RunInject();
+	}
 
 	return true;
 }
+
+#endif
@@ -34,14 +34,137 @@
 #define EVENT_BASE_HXX
 
 #include "DeferEvent.hxx"
+#include "TimerWheel.hxx"
+#include "LoopStats.hxx"
+#include "io/UniqueFileDescriptor.hxx"
 #include "util/BindMethod.hxx"
+#include "util/Compiler.h"
 
 #include <boost/intrusive/list.hpp>
 
+#include <atomic>
+#include <chrono>
+
+#ifdef ENABLE_EPOLL
+#include "system/EpollFD.hxx"
+
+#include <boost/intrusive/set.hpp>
+
+#include <vector>
+
+#include <stdio.h>
+#else
 #include <event.h>
+#endif
+
+class InjectEvent;
 
 #include <assert.h>
 
+#ifdef ENABLE_EPOLL
+
+class SocketEvent;
+class TimerEvent;
+
+/**
+ * An event loop implemented with Linux epoll, a replacement for the
+ * libevent based implementation below.  It is enabled with the
+ * "epoll" build option (preprocessor macro #ENABLE_EPOLL), and
+ * provides the same API for #SocketEvent, #TimerEvent and
+ * #DeferEvent.
+ */
+class EventLoop {
+	friend class SocketEvent;
+	friend class TimerEvent;
+
+	EpollFD epoll;
+
+	/**
+	 * Per-file-descriptor state, indexed by the file descriptor
+	 * number.  This is needed because more than one #SocketEvent
+	 * may be registered for one file descriptor (e.g. one for
+	 * reading and one for writing), but epoll allows only one
+	 * registration per file descriptor.
+	 */
+	struct SocketSlot {
+		/**
+		 * A linked list of all scheduled #SocketEvent instances
+		 * for this file descriptor (via SocketEvent::next_on_fd).
+		 */
+		SocketEvent *head = nullptr;
+
+		/**
+		 * The event mask which is currently registered with
+		 * epoll; 0 if the file descriptor is not registered.
+		 */
+		uint32_t registered = 0;
+
+		/**
+		 * Edge-triggered readiness (SocketEvent::READ,
+		 * SocketEvent::WRITE) which has not yet been delivered
+		 * to a #SocketEvent.
+		 */
+		unsigned ready = 0;
+	};
+
+	std::vector<SocketSlot> slots;
+
+	/**
+	 * The number of scheduled #SocketEvent instances.
+	 */
+	unsigned n_sockets = 0;
+
+	typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> ReadyHook;
+
+	/**
+	 * #SocketEvent instances which have been reported by epoll and
+	 * whose callback has not yet been invoked.
+	 */
+	boost::intrusive::list<SocketEvent,
+			       boost::intrusive::base_hook<ReadyHook>,
+			       boost::intrusive::constant_time_size<false>> ready_sockets;
+
+	typedef boost::intrusive::set_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> TimerHook;
+
+	struct TimerCompare {
+		gcc_pure
+		bool operator()(const TimerEvent &a,
+				const TimerEvent &b) const noexcept;
+	};
+
+	boost::intrusive::multiset<TimerEvent,
+				   boost::intrusive::base_hook<TimerHook>,
+				   boost::intrusive::compare<TimerCompare>,
+				   boost::intrusive::constant_time_size<false>> timers;
+
+	static constexpr int LOOP_ONCE = 0x1;
+	static constexpr int LOOP_NONBLOCK = 0x2;
+
+	/**
+	 * The maximum number of events returned by one epoll_wait()
+	 * call.  The buffer is allocated once, as part of this object.
+	 */
+	static constexpr unsigned MAX_EVENTS = 256;
+
+	struct epoll_event received_events[MAX_EVENTS];
+
+	/**
+	 * Set by Break(), cleared by Loop(): stop invoking callbacks
+	 * in the current iteration.
+	 */
+	bool break_loop = false;
+
+	/**
+	 * The epoll_event.data value of #inject_fd; it cannot collide
+	 * with a file descriptor number.
+	 */
+	static constexpr uint64_t INJECT_DATA = ~uint64_t(0);
+
+	/**
+	 * Set by CollectReadySockets() if #inject_fd is readable.
+	 */
+	bool inject_ready = false;
+#else
 /**
  * Wrapper for a struct event_base.
  */
@@ -66,6 +189,69 @@ class EventLoop {
 		return ::event_init();
 	}
 
+	static constexpr int LOOP_ONCE = EVLOOP_ONCE;
+	static constexpr int LOOP_NONBLOCK = EVLOOP_NONBLOCK;
+
+	/**
+	 * Watches #inject_fd.
+	 */
+	struct event inject_event;
+
+	/**
+	 * Invokes #coarse_timers.
+	 */
+	struct event coarse_event;
+
+	/**
+	 * The tick for which #coarse_event is scheduled; 0 if it is
+	 * not scheduled.
+	 */
+	uint64_t coarse_tick = 0;
+#endif
+
+	friend class CoarseTimerEvent;
+
+	/**
+	 * #CoarseTimerEvent instances.
+	 */
+	TimerWheel coarse_timers;
+
+	friend class InjectEvent;
+
+	/**
+	 * Lock-free stack of #InjectEvent instances scheduled by other
+	 * threads (linked with InjectEvent::next).  Producers push
+	 * with a CAS; the #EventLoop thread takes the whole stack at
+	 * once.
+	 */
+	std::atomic<InjectEvent *> inject_head{nullptr};
+
+	typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> InjectHook;
+
+	/**
+	 * #InjectEvent instances which have been taken from
+	 * #inject_head, but whose callback has not yet been invoked.
+	 * Only accessed by the #EventLoop thread.
+	 */
+	boost::intrusive::list<InjectEvent,
+			       boost::intrusive::base_hook<InjectHook>,
+			       boost::intrusive::constant_time_size<false>> inject_list;
+
+	/**
+	 * An eventfd which wakes up the #EventLoop after an
+	 * #InjectEvent has been scheduled.  It is only written when
+	 * #inject_head was empty, so many injections between two
+	 * iterations result in one wakeup.  Created on demand by the
+	 * first #InjectEvent.
+	 */
+	UniqueFileDescriptor inject_fd;
+
+	/**
+	 * The number of #InjectEvent instances; #inject_fd is watched
+	 * only while this is non-zero.
+	 */
+	unsigned n_inject = 0;
+
 	boost::intrusive::list<DeferEvent,
 			       boost::intrusive::member_hook<DeferEvent,
 							     DeferEvent::SiblingsHook,
@@ -79,18 +265,75 @@ class EventLoop {
 
 	bool quit;
 
-public:
-	EventLoop() noexcept:event_base(Create()) {}
+	/**
+	 * Cached clock values; see SteadyNow() and SystemNow().
+	 */
+	mutable std::chrono::steady_clock::time_point steady_now;
+	mutable std::chrono::system_clock::time_point system_now;
+	mutable bool steady_now_valid = false, system_now_valid = false;
 
-	~EventLoop() noexcept {
-		assert(defer.empty());
+	EventLoopStats stats;
 
-		::event_base_free(event_base);
-	}
+	/**
+	 * Collect time measurements in #stats?  See
+	 * EnableStatistics().
+	 */
+	bool stats_enabled = false;
+
+	/**
+	 * The number of #DeferEvent callbacks invoked in the current
+	 * iteration.
+	 */
+	unsigned iteration_deferred = 0;
+
+	/**
+	 * Has BeginIteration() initialized #iteration_start since the
+	 * last EndIteration() call?
+	 */
+	bool iteration_started = false;
+
+	/**
+	 * When did the current iteration begin?  Only valid if
+	 * #iteration_started.
+	 */
+	std::chrono::steady_clock::time_point iteration_start;
+
+	/**
+	 * The time spent in callbacks in the current iteration.
+	 */
+	EventLoopStats::Duration iteration_busy = EventLoopStats::Duration::zero();
+
+#ifndef ENABLE_EPOLL
+	/**
+	 * Has EndIteration() initialized #previous_iteration_end?
+	 */
+	bool previous_iteration_valid = false;
+
+	/**
+	 * When did the previous iteration end?  libevent offers no
+	 * hook after its wait, so BeginIteration() is deferred to the
+	 * first callback, and this value marks the begin of the
+	 * iteration instead (to include the wait in
+	 * EventLoopStats::poll_time).
+	 */
+	std::chrono::steady_clock::time_point previous_iteration_end;
+#endif
+
+public:
+	EventLoop() noexcept;
+	~EventLoop() noexcept;
 
 	EventLoop(const EventLoop &other) = delete;
 	EventLoop &operator=(const EventLoop &other) = delete;
 
+#ifdef ENABLE_EPOLL
+	/**
+	 * Re-create the epoll file descriptor after fork(), and
+	 * register all file descriptors again.  Without this, parent
+	 * and child process would share one epoll instance.
+	 */
+	void Reinit() noexcept;
+#else
 	struct event_base *Get() noexcept {
 		return event_base;
 	}
@@ -98,6 +341,7 @@ public:
 	void Reinit() noexcept {
 		event_reinit(event_base);
 	}
+#endif
 
 #ifndef NDEBUG
 	/**
@@ -114,30 +358,38 @@ public:
 		quit = false;
 
 		RunDeferred();
-		while (!quit && Loop(EVLOOP_ONCE) && !quit) {
+		while (!quit && Loop(LOOP_ONCE) && !quit) {
 			RunDeferred();
 			RunPost();
 		}
 	}
 
 	bool LoopNonBlock() noexcept {
-		return RunDeferred() && Loop(EVLOOP_NONBLOCK) &&
+		return RunDeferred() && Loop(LOOP_NONBLOCK) &&
 			RunDeferred() &&
 			RunPost();
 	}
 
 	bool LoopOnce() noexcept {
-		return RunDeferred() && Loop(EVLOOP_ONCE) &&
+		return RunDeferred() && Loop(LOOP_ONCE) &&
 			RunDeferred() &&
 			RunPost();
 	}
 
 	bool LoopOnceNonBlock() noexcept {
-		return RunDeferred() && Loop(EVLOOP_ONCE|EVLOOP_NONBLOCK) &&
+		return RunDeferred() && Loop(LOOP_ONCE|LOOP_NONBLOCK) &&
 			RunDeferred() &&
 			RunPost();
 	}
 
+#ifdef ENABLE_EPOLL
+	void Break() noexcept {
+		quit = true;
+		break_loop = true;
+	}
+
+	void DumpEvents(FILE *file) noexcept;
+#else
 	void Break() noexcept {
 		quit = true;
 		::event_base_loopbreak(event_base);
@@ -146,18 +398,232 @@ public:
 	void DumpEvents(FILE *file) noexcept {
 		event_base_dump_events(event_base, file);
 	}
+#endif
 
 	void Defer(DeferEvent &e) noexcept;
 	void CancelDefer(DeferEvent &e) noexcept;
 
+	/**
+	 * Returns the monotonic time.  The clock is read at most once
+	 * per loop iteration; all callbacks invoked in one iteration
+	 * see the same value.  Use this instead of
+	 * std::chrono::steady_clock::now() where this precision is
+	 * good enough (e.g. for Expiry).
+	 */
+	gcc_pure
+	std::chrono::steady_clock::time_point SteadyNow() const noexcept {
+		if (!steady_now_valid) {
+			steady_now = std::chrono::steady_clock::now();
+			steady_now_valid = true;
+		}
+
+		return steady_now;
+	}
+
+	/**
+	 * Like SteadyNow(), but returns the wall-clock time.
+	 */
+	gcc_pure
+	std::chrono::system_clock::time_point SystemNow() const noexcept {
+		if (!system_now_valid) {
+			system_now = std::chrono::system_clock::now();
+			system_now_valid = true;
+		}
+
+		return system_now;
+	}
+
+	/**
+	 * Discard the cached clock values, e.g. after an operation
+	 * which has blocked for a noticeable amount of time.  This is
+	 * done automatically before each loop iteration.
+	 */
+	void FlushClockCaches() noexcept {
+		steady_now_valid = system_now_valid = false;
+	}
+
+	/**
+	 * Enable or disable the time measurements in
+	 * #EventLoopStats.  This is disabled by default, because it
+	 * reads the clock after each callback (which also refreshes
+	 * the SteadyNow() cache).
+	 */
+	void EnableStatistics(bool value=true) noexcept {
+		stats_enabled = value;
+
+		/* the current iteration (if any) is not measured */
+		iteration_started = false;
+		iteration_busy = EventLoopStats::Duration::zero();
+#ifndef ENABLE_EPOLL
+		previous_iteration_valid = false;
+#endif
+	}
+
+	const EventLoopStats &GetStatistics() const noexcept {
+		return stats;
+	}
+
+	void ResetStatistics() noexcept {
+		stats.Clear();
+	}
+
+	/**
+	 * Measures the duration of one callback invocation if
+	 * statistics are enabled.  The event implementations create
+	 * an instance on the stack around each callback.
+	 */
+	class CallbackTimer {
+		EventLoop &loop;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		explicit CallbackTimer(EventLoop &_loop) noexcept
+			:loop(_loop) {
+			if (loop.stats_enabled) {
+				loop.BeginIteration();
+				start = loop.SteadyNow();
+			}
+		}
+
+		~CallbackTimer() noexcept {
+			if (loop.stats_enabled)
+				loop.EndCallback(start);
+		}
+
+		CallbackTimer(const CallbackTimer &) = delete;
+		CallbackTimer &operator=(const CallbackTimer &) = delete;
+	};
+
 private:
+	void AddCoarseTimer(CoarseTimerEvent &t,
+			    TimerWheel::Clock::duration d) noexcept;
+
+#ifndef ENABLE_EPOLL
+	/**
+	 * Schedule #coarse_event for the given tick (if it is not
+	 * already scheduled earlier).
+	 */
+	void ScheduleCoarseTimers(uint64_t tick) noexcept;
+
+	static void CoarseCallback(evutil_socket_t fd, short events,
+				   void *ctx) noexcept;
+#endif
+
+	/**
+	 * Called by the #InjectEvent constructor.
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void AddInject();
+
+	/**
+	 * Called by the #InjectEvent destructor.
+	 */
+	void RemoveInject() noexcept;
+
+	/**
+	 * Push an #InjectEvent to #inject_head.  This method is
+	 * thread-safe.
+	 */
+	void Inject(InjectEvent &e) noexcept;
+
+	/**
+	 * Move all events from #inject_head to #inject_list.
+	 */
+	void FlushInject() noexcept;
+
+	/**
+	 * Consume the #inject_fd wakeup and invoke all injected
+	 * callbacks.
+	 */
+	void RunInject() noexcept;
+
+#ifndef ENABLE_EPOLL
+	static void InjectCallback(evutil_socket_t fd, short events,
+				   void *ctx) noexcept;
+#endif
+
+#ifdef ENABLE_EPOLL
+	/**
+	 * @return false if there are no registered events
+	 */
+	bool Loop(int flags) noexcept;
+
+	gcc_pure
+	bool IsEmpty() const noexcept {
+		return n_sockets == 0 && n_inject == 0 && timers.empty() &&
+			coarse_timers.IsEmpty() && ready_sockets.empty();
+	}
+
+	void AddTimer(TimerEvent &t) noexcept;
+
+	/**
+	 * Determine the epoll_wait() timeout in milliseconds.
+	 */
+	gcc_pure
+	int GetTimeout() const noexcept;
+
+	void RunTimers() noexcept;
+
+	void AddSocket(SocketEvent &e) noexcept;
+	void RemoveSocket(SocketEvent &e) noexcept;
+
+	/**
+	 * Update the epoll registration of the given file descriptor
+	 * after a #SocketEvent has been added or removed.
+	 *
+	 * @return false on error (errno is set)
+	 */
+	bool UpdateSocket(int fd) noexcept;
+
+	void MakeReady(SocketEvent &e, unsigned flags) noexcept;
+
+	/**
+	 * Translate epoll_wait() results to #SocketEvent
+	 * readiness.
+	 */
+	void CollectReadySockets(unsigned n) noexcept;
+
+	void RunReadySockets() noexcept;
+#else
 	bool Loop(int flags) noexcept {
+		/* don't read the clock here: event_base_loop() may
+		   block, and the first callback after the wait would
+		   see a stale SteadyNow(); the iteration begins
+		   lazily in CallbackTimer instead */
+		FlushClockCaches();
 		return ::event_base_loop(event_base, flags) == 0;
 	}
+#endif
 
 	bool RunDeferred() noexcept;
 
+	void EndCallback(std::chrono::steady_clock::time_point start) noexcept;
+
+	/**
+	 * Called by CallbackTimer before each measured callback and
+	 * (in the epoll build) by Loop() before waiting for events.
+	 * Only the first call after EndIteration() takes effect.
+	 */
+	void BeginIteration() noexcept {
+		if (stats_enabled && !iteration_started) {
+			FlushClockCaches();
+#ifdef ENABLE_EPOLL
+			iteration_start = SteadyNow();
+#else
+			iteration_start = previous_iteration_valid
+				? previous_iteration_end
+				: SteadyNow();
+#endif
+			iteration_started = true;
+		}
+	}
+
+	void EndIteration() noexcept;
+
 	bool RunPost() noexcept {
+		EndIteration();
+
 #ifndef NDEBUG
 		if (post_callback)
 			post_callback();
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LoopPool.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+EventLoopPool::Worker::Worker()
+	:stop_event(loop, BIND_THIS_METHOD(OnStop))
+{
+}
+
+EventLoopPool::Worker::~Worker() noexcept
+{
+	assert(!thread.joinable());
+}
+
+void
+EventLoopPool::Worker::Start()
+{
+	assert(!thread.joinable());
+
+	thread = std::thread(&Worker::Run, this);
+}
+
+void
+EventLoopPool::Worker::Stop() noexcept
+{
+	stop_event.Schedule();
+}
+
+void
+EventLoopPool::Worker::Join() noexcept
+{
+	if (thread.joinable())
+		thread.join();
+}
+
+inline void
+EventLoopPool::Worker::Run() noexcept
+{
+	/* signals are handled by the main thread (e.g. with
+	   #SignalEvent) */
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		/* ignore errors; this is only an optimization */
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	loop.Dispatch();
+}
+
+void
+EventLoopPool::Worker::OnStop() noexcept
+{
+	loop.Break();
+}
+
+/**
+ * Obtain the list of CPUs this process may run on.
+ */
+static std::vector<int>
+GetAllowedCpus()
+{
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+		throw MakeErrno("sched_getaffinity() failed");
+
+	std::vector<int> result;
+	for (int i = 0; i < CPU_SETSIZE; ++i)
+		if (CPU_ISSET(i, &cpus))
+			result.push_back(i);
+
+	return result;
+}
+
+EventLoopPool::EventLoopPool(unsigned n, bool pin_cpu)
+{
+	const auto cpus = n == 0 || pin_cpu
+		? GetAllowedCpus()
+		: std::vector<int>();
+
+	if (n == 0)
+		n = std::max<size_t>(cpus.size(), 1);
+
+	workers.reserve(n);
+	for (unsigned i = 0; i < n; ++i) {
+		workers.emplace_back(new Worker());
+		if (pin_cpu && !cpus.empty())
+			workers.back()->SetCpu(cpus[i % cpus.size()]);
+	}
+}
+
+EventLoopPool::~EventLoopPool() noexcept
+{
+	Stop();
+}
+
+void
+EventLoopPool::Start()
+{
+	for (auto &i : workers)
+		i->Start();
+}
+
+void
+EventLoopPool::Stop() noexcept
+{
+	for (auto &i : workers)
+		i->Stop();
+
+	for (auto &i : workers)
+		i->Join();
+}
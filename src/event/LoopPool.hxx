@@ -0,0 +1,151 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Loop.hxx"
+#include "InjectEvent.hxx"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+ * A pool of #EventLoop instances, each running in its own thread.
+ * Threads may be pinned to CPU cores, which keeps all work done by
+ * one #EventLoop on one core (see #ShardedServerSocket).
+ *
+ * Events may be registered in a pool #EventLoop only before Start()
+ * or from within that #EventLoop's thread.
+ */
+class EventLoopPool {
+	class Worker {
+		EventLoop loop;
+
+		/**
+		 * Triggered by Stop() to break the loop.
+		 */
+		InjectEvent stop_event;
+
+		std::thread thread;
+
+		int cpu = -1;
+
+	public:
+		Worker();
+		~Worker() noexcept;
+
+		EventLoop &GetEventLoop() noexcept {
+			return loop;
+		}
+
+		/**
+		 * @return the CPU the thread is pinned to, or -1
+		 */
+		int GetCpu() const noexcept {
+			return cpu;
+		}
+
+		/**
+		 * @param _cpu the CPU to pin the thread to, or -1
+		 * for no pinning
+		 */
+		void SetCpu(int _cpu) noexcept {
+			cpu = _cpu;
+		}
+
+		/**
+		 * Throws std::system_error on error.
+		 */
+		void Start();
+
+		/**
+		 * Ask the thread to exit.  This method is thread-safe.
+		 */
+		void Stop() noexcept;
+
+		void Join() noexcept;
+
+	private:
+		void Run() noexcept;
+		void OnStop() noexcept;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+
+public:
+	/**
+	 * Throws std::system_error on error.
+	 *
+	 * @param n the number of #EventLoop instances; 0 means one per
+	 * CPU this process is allowed to run on
+	 * @param pin_cpu pin each thread to one CPU?
+	 */
+	explicit EventLoopPool(unsigned n=0, bool pin_cpu=true);
+
+	/**
+	 * Stops and joins all threads.
+	 */
+	~EventLoopPool() noexcept;
+
+	EventLoopPool(const EventLoopPool &) = delete;
+	EventLoopPool &operator=(const EventLoopPool &) = delete;
+
+	unsigned size() const noexcept {
+		return workers.size();
+	}
+
+	EventLoop &GetEventLoop(unsigned i) noexcept {
+		return workers[i]->GetEventLoop();
+	}
+
+	/**
+	 * Returns the CPU the given #EventLoop's thread will be
+	 * pinned to, or -1 if it is not pinned.
+	 */
+	int GetCpu(unsigned i) const noexcept {
+		return workers[i]->GetCpu();
+	}
+
+	/**
+	 * Start all threads.  Each one runs EventLoop::Dispatch().
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void Start();
+
+	/**
+	 * Ask all threads to exit and wait for them.  Must not be
+	 * called from within a pool thread.
+	 */
+	void Stop() noexcept;
+};
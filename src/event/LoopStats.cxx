@@ -0,0 +1,82 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LoopStats.hxx"
+
+#include <stdio.h>
+
+constexpr std::chrono::microseconds EventLoopStats::HISTOGRAM_BASE;
+
+void
+EventLoopStats::AddIteration(Duration total, Duration busy) noexcept
+{
+	if (total > busy)
+		poll_time += total - busy;
+
+	unsigned i = 0;
+	for (Duration limit = HISTOGRAM_BASE;
+	     i < HISTOGRAM_SIZE - 1 && busy >= limit; limit *= 2)
+		++i;
+
+	++busy_histogram[i];
+}
+
+static constexpr unsigned long long
+ToMicroseconds(std::chrono::steady_clock::duration d) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+StringBuffer<512>
+EventLoopStats::ToString() const noexcept
+{
+	StringBuffer<512> result;
+	char *p = result.data();
+	char *const end = p + result.capacity();
+
+	int n = snprintf(p, end - p,
+			 "iterations=%llu callbacks=%llu poll_us=%llu busy_us=%llu longest_us=%llu max_deferred_callbacks=%u histogram=",
+			 (unsigned long long)iterations,
+			 (unsigned long long)callbacks,
+			 ToMicroseconds(poll_time),
+			 ToMicroseconds(busy_time),
+			 ToMicroseconds(longest_callback),
+			 max_deferred_callbacks);
+
+	for (unsigned i = 0; i < HISTOGRAM_SIZE && n > 0 && n < end - p; ++i) {
+		p += n;
+		n = snprintf(p, end - p, i == 0 ? "%llu" : ",%llu",
+			     (unsigned long long)busy_histogram[i]);
+	}
+
+	return result;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "util/StringBuffer.hxx"
+#include "util/Compiler.h"
+
+#include <array>
+#include <chrono>
+
+#include <stdint.h>
+
+/**
+ * Counters collected by the #EventLoop.  Counting iterations and
+ * #DeferEvent invocations is cheap and always done; the time
+ * measurements require reading the clock around each callback and
+ * are only collected after EventLoop::EnableStatistics().
+ */
+struct EventLoopStats {
+	typedef std::chrono::steady_clock::duration Duration;
+
+	/**
+	 * The number of loop iterations.
+	 */
+	uint64_t iterations = 0;
+
+	/**
+	 * The number of measured callback invocations.
+	 */
+	uint64_t callbacks = 0;
+
+	/**
+	 * The total time spent waiting for events (i.e. the time of
+	 * all iterations minus #busy_time).
+	 */
+	Duration poll_time = Duration::zero();
+
+	/**
+	 * The total time spent in callbacks.
+	 */
+	Duration busy_time = Duration::zero();
+
+	/**
+	 * The duration of the slowest callback.
+	 */
+	Duration longest_callback = Duration::zero();
+
+	/**
+	 * The largest number of #DeferEvent callbacks invoked in one
+	 * iteration.  This includes events which were scheduled again
+	 * by deferred callbacks of the same iteration, so it may
+	 * exceed the length of the deferred queue.
+	 */
+	unsigned max_deferred_callbacks = 0;
+
+	/**
+	 * The number of histogram buckets; see #busy_histogram.
+	 */
+	static constexpr unsigned HISTOGRAM_SIZE = 16;
+
+	/**
+	 * The busy time of the first bucket's upper bound.  Each
+	 * following bucket's upper bound is twice the previous one;
+	 * the last one is open-ended.
+	 */
+	static constexpr std::chrono::microseconds HISTOGRAM_BASE{16};
+
+	/**
+	 * The number of iterations by their busy time.
+	 */
+	std::array<uint64_t, HISTOGRAM_SIZE> busy_histogram{};
+
+	void Clear() noexcept {
+		*this = EventLoopStats();
+	}
+
+	void AddCallback(Duration d) noexcept {
+		++callbacks;
+		busy_time += d;
+		if (d > longest_callback)
+			longest_callback = d;
+	}
+
+	void AddDeferredCallbacks(unsigned n) noexcept {
+		if (n > max_deferred_callbacks)
+			max_deferred_callbacks = n;
+	}
+
+	/**
+	 * Account for the time measurements of an iteration.
+	 *
+	 * @param total the duration of the whole iteration
+	 * @param busy the time spent in callbacks during this
+	 * iteration
+	 */
+	void AddIteration(Duration total, Duration busy) noexcept;
+
+	/**
+	 * Format all values as one line (without a trailing newline)
+	 * suitable for a log file.
+	 */
+	gcc_pure
+	StringBuffer<512> ToString() const noexcept;
+};
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "SocketEvent.hxx"
+
+#ifdef ENABLE_EPOLL
+
+#include <utility>
+
+bool
+SocketEvent::Add(const struct timeval *_timeout) noexcept
+{
+	bool success = true;
+
+	if (fd >= 0) {
+		if (!scheduled) {
+			scheduled = true;
+			event_loop.AddSocket(*this);
+		}
+
+		success = event_loop.UpdateSocket(fd);
+	}
+
+	if (_timeout != nullptr) {
+		timeout = *_timeout;
+		has_timeout = true;
+		timeout_event.Add(timeout);
+	} else {
+		has_timeout = false;
+		timeout_event.Cancel();
+	}
+
+	return success;
+}
+
+void
+SocketEvent::Delete() noexcept
+{
+	timeout_event.Cancel();
+	has_timeout = false;
+
+	EventLoop::ReadyHook::unlink();
+	ready_flags = 0;
+
+	if (scheduled) {
+		scheduled = false;
+		event_loop.RemoveSocket(*this);
+		event_loop.UpdateSocket(fd);
+	}
+}
+
+void
+SocketEvent::SetReady(unsigned flags) noexcept
+{
+	assert(scheduled);
+
+	flags &= events & (READ|WRITE);
+	if (flags == 0)
+		return;
+
+	ready_flags |= flags;
+	event_loop.MakeReady(*this, flags);
+}
+
+void
+SocketEvent::Dispatch() noexcept
+{
+	const unsigned flags = std::exchange(ready_flags, 0);
+	assert(flags != 0);
+
+	if (!(events & PERSIST))
+		/* like libevent, a non-persistent event is removed
+		   before its callback gets invoked */
+		Delete();
+	else if (has_timeout)
+		/* the timeout of a persistent event gets refreshed each
+		   time it becomes active */
+		timeout_event.Add(timeout);
+
+	callback(flags);
+}
+
+void
+SocketEvent::OnTimeout() noexcept
+{
+	if (!(events & PERSIST))
+		Delete();
+	else
+		timeout_event.Add(timeout);
+
+	callback(TIMEOUT);
+}
+
+#endif
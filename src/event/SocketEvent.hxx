@@ -33,6 +33,166 @@
 #ifndef SOCKET_EVENT_HXX
 #define SOCKET_EVENT_HXX
 
+#ifdef ENABLE_EPOLL
+
+#include "Loop.hxx"
+#include "TimerEvent.hxx"
+#include "util/BindMethod.hxx"
+
+#include <sys/time.h>
+
+/**
+ * Invoke a callback when a socket becomes readable or writable.
+ * This is the implementation for the native epoll #EventLoop; it is
+ * API-compatible with the libevent based implementation.
+ */
+class SocketEvent final : public EventLoop::ReadyHook {
+	friend class EventLoop;
+
+	EventLoop &event_loop;
+
+	typedef BoundMethod<void(unsigned events)> Callback;
+	const Callback callback;
+
+	/**
+	 * Fires the #TIMEOUT event.
+	 */
+	TimerEvent timeout_event;
+
+	/**
+	 * The timeout passed to Add(); it is used to re-arm the
+	 * #timeout_event of #PERSIST events each time they become
+	 * active.
+	 */
+	struct timeval timeout;
+
+	/**
+	 * The next #SocketEvent on the same file descriptor; see
+	 * EventLoop::SocketSlot.
+	 */
+	SocketEvent *next_on_fd;
+
+	int fd = -1;
+
+	/**
+	 * The flags passed to Set().
+	 */
+	unsigned events = 0;
+
+	/**
+	 * The events which are ready, but whose callback has not yet
+	 * been invoked.
+	 */
+	unsigned ready_flags = 0;
+
+	/**
+	 * Is the file descriptor registered with the #EventLoop (via
+	 * Add())?
+	 */
+	bool scheduled = false;
+
+	/**
+	 * Is #timeout valid?
+	 */
+	bool has_timeout = false;
+
+public:
+	static constexpr unsigned TIMEOUT = 0x01;
+	static constexpr unsigned READ = 0x02;
+	static constexpr unsigned WRITE = 0x04;
+	static constexpr unsigned PERSIST = 0x10;
+
+	/**
+	 * Register the file descriptor in edge-triggered mode.  The
+	 * callback will only be invoked again after the socket has
+	 * become ready again, therefore the handler must consume all
+	 * data (or fill the kernel buffer) until EAGAIN.  This saves
+	 * epoll_ctl() system calls.  All #SocketEvent instances on one
+	 * file descriptor should agree on this flag.
+	 */
+	static constexpr unsigned EDGE_TRIGGERED = 0x20;
+
+	SocketEvent(EventLoop &_event_loop, Callback _callback) noexcept
+		:event_loop(_event_loop), callback(_callback),
+		 timeout_event(_event_loop, BIND_THIS_METHOD(OnTimeout)) {}
+
+	SocketEvent(EventLoop &_event_loop, int _fd, unsigned _events,
+		    Callback _callback) noexcept
+		:SocketEvent(_event_loop, _callback) {
+		Set(_fd, _events);
+	}
+
+	~SocketEvent() noexcept {
+		if (scheduled)
+			Delete();
+	}
+
+	SocketEvent(const SocketEvent &) = delete;
+	SocketEvent &operator=(const SocketEvent &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return event_loop;
+	}
+
+	gcc_pure
+	int GetFd() const noexcept {
+		return fd;
+	}
+
+	gcc_pure
+	unsigned GetEvents() const noexcept {
+		return events;
+	}
+
+	void Set(int _fd, unsigned _events) noexcept {
+		if (scheduled || IsTimerPending())
+			Delete();
+
+		fd = _fd;
+		events = _events;
+	}
+
+	bool Add(const struct timeval *timeout=nullptr) noexcept;
+
+	bool Add(const struct timeval &_timeout) noexcept {
+		return Add(&_timeout);
+	}
+
+	void Delete() noexcept;
+
+	gcc_pure
+	bool IsPending(unsigned _events) const noexcept {
+		unsigned result = 0;
+		if (scheduled)
+			result |= events & (READ|WRITE);
+		if (IsTimerPending())
+			result |= TIMEOUT;
+		return (result & _events) != 0;
+	}
+
+	gcc_pure
+	bool IsTimerPending() const noexcept {
+		return timeout_event.IsPending();
+	}
+
+private:
+	/**
+	 * Called by the #EventLoop when epoll has reported the file
+	 * descriptor as ready.
+	 */
+	void SetReady(unsigned flags) noexcept;
+
+	/**
+	 * Called by the #EventLoop to invoke the callback after
+	 * SetReady().
+	 */
+	void Dispatch() noexcept;
+
+	void OnTimeout() noexcept;
+};
+
+#else
+
 #include "Event.hxx"
 #include "util/BindMethod.hxx"
 
@@ -49,6 +209,7 @@ public:
 	static constexpr unsigned WRITE = EV_WRITE;
 	static constexpr unsigned PERSIST = EV_PERSIST;
 	static constexpr unsigned TIMEOUT = EV_TIMEOUT;
+	static constexpr unsigned EDGE_TRIGGERED = EV_ET;
 
 	SocketEvent(EventLoop &_event_loop, Callback _callback) noexcept
 		:event_loop(_event_loop), callback(_callback) {}
@@ -103,8 +264,11 @@ private:
 	static void EventCallback(gcc_unused evutil_socket_t fd, short events,
 				  void *ctx) noexcept {
 		auto &event = *(SocketEvent *)ctx;
+		EventLoop::CallbackTimer timer(event.event_loop);
 		event.callback(events);
 	}
 };
 
 #endif
+
+#endif
@@ -33,6 +33,58 @@
 #ifndef BENG_PROXY_TIMER_EVENT_HXX
 #define BENG_PROXY_TIMER_EVENT_HXX
 
+#ifdef ENABLE_EPOLL
+
+#include "Loop.hxx"
+#include "util/BindMethod.hxx"
+
+#include <chrono>
+
+/**
+ * Invoke an event callback after a certain amount of time.
+ */
+class TimerEvent final : public EventLoop::TimerHook {
+	friend class EventLoop;
+
+	EventLoop &loop;
+
+	const BoundMethod<void()> callback;
+
+	/**
+	 * When is this timer due?  This is only valid if
+	 * IsPending() returns true.
+	 */
+	std::chrono::steady_clock::time_point due;
+
+public:
+	TimerEvent(EventLoop &_loop, BoundMethod<void()> _callback) noexcept
+		:loop(_loop), callback(_callback) {}
+
+	TimerEvent(const TimerEvent &) = delete;
+	TimerEvent &operator=(const TimerEvent &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return loop;
+	}
+
+	bool IsPending() const noexcept {
+		return is_linked();
+	}
+
+	void Add(const struct timeval &tv) noexcept;
+
+	void Cancel() noexcept {
+		unlink();
+	}
+
+private:
+	void Run() noexcept {
+		callback();
+	}
+};
+
+#else
+
 #include "Event.hxx"
 #include "util/BindMethod.hxx"
 
@@ -40,13 +92,20 @@
  * Invoke an event callback after a certain amount of time.
  */
 class TimerEvent {
+	EventLoop &loop;
+
 	Event event;
 
 	const BoundMethod<void()> callback;
 
 public:
-	TimerEvent(EventLoop &loop, BoundMethod<void()> _callback) noexcept
-		:event(loop, -1, 0, Callback, this), callback(_callback) {}
+	TimerEvent(EventLoop &_loop, BoundMethod<void()> _callback) noexcept
+		:loop(_loop), event(_loop, -1, 0, Callback, this),
+		 callback(_callback) {}
+
+	EventLoop &GetEventLoop() noexcept {
+		return loop;
+	}
 
 	bool IsPending() const noexcept {
 		return event.IsTimerPending();
@@ -65,8 +124,11 @@ private:
 			     gcc_unused short events,
 			     void *ctx) noexcept {
 		auto &event = *(TimerEvent *)ctx;
+		EventLoop::CallbackTimer timer(event.loop);
 		event.callback();
 	}
 };
 
 #endif
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TimerWheel.hxx"
+#include "CoarseTimerEvent.hxx"
+
+#include <algorithm>
+
+#include <assert.h>
+
+TimerWheel::TimerWheel() noexcept
+	:last_tick(ToTick(Clock::now()))
+{
+	non_empty.fill(0);
+}
+
+TimerWheel::~TimerWheel() noexcept
+{
+	for (auto &i : buckets)
+		i.clear();
+}
+
+uint64_t
+TimerWheel::Insert(CoarseTimerEvent &t, Clock::time_point due,
+		   Clock::time_point now) noexcept
+{
+	assert(!t.IsPending());
+
+	if (size == 0)
+		/* the wheel was idle: skip all the ticks which have
+		   passed since then */
+		last_tick = std::max(last_tick, ToTick(now));
+
+	uint64_t tick = ToTickCeil(due);
+	if (tick <= last_tick)
+		tick = last_tick + 1;
+
+	t.due_tick = tick;
+
+	const unsigned i = tick % N_BUCKETS;
+	buckets[i].push_back(t);
+	MarkNonEmpty(i);
+	++size;
+
+	return tick;
+}
+
+void
+TimerWheel::Remove(CoarseTimerEvent &t) noexcept
+{
+	assert(t.IsPending());
+	assert(size > 0);
+
+	t.unlink();
+	--size;
+}
+
+inline void
+TimerWheel::RunBucket(uint64_t tick) noexcept
+{
+	const unsigned i = tick % N_BUCKETS;
+	uint64_t &word = non_empty[i / 64];
+	const uint64_t bit = uint64_t(1) << (i % 64);
+	if ((word & bit) == 0)
+		return;
+
+	auto &bucket = buckets[i];
+
+	/* move all due timers to a local list first, because the
+	   callbacks may add new timers to this bucket */
+	List due;
+	for (auto j = bucket.begin(); j != bucket.end();) {
+		auto &t = *j++;
+		if (t.due_tick <= tick) {
+			t.unlink();
+			due.push_back(t);
+		}
+	}
+
+	if (bucket.empty())
+		word &= ~bit;
+
+	while (!due.empty()) {
+		auto &t = due.front();
+		due.pop_front();
+		--size;
+		t.Run();
+	}
+}
+
+void
+TimerWheel::Run(Clock::time_point now) noexcept
+{
+	const uint64_t now_tick = ToTick(now);
+
+	/* after a full round, all buckets have been visited */
+	if (now_tick > last_tick + N_BUCKETS)
+		last_tick = now_tick - N_BUCKETS;
+
+	while (last_tick < now_tick && size > 0)
+		RunBucket(++last_tick);
+
+	last_tick = std::max(last_tick, now_tick);
+}
+
+uint64_t
+TimerWheel::GetNextTick() const noexcept
+{
+	if (size == 0)
+		return 0;
+
+	uint64_t tick = last_tick + 1;
+	for (unsigned n = 0; n < N_BUCKETS;) {
+		const unsigned i = tick % N_BUCKETS;
+		const uint64_t word = non_empty[i / 64] >> (i % 64);
+		if (word != 0)
+			return tick + __builtin_ctzll(word);
+
+		const unsigned skip = 64 - i % 64;
+		tick += skip;
+		n += skip;
+	}
+
+	/* all bits clear, but size>0: this cannot happen */
+	assert(false);
+	return last_tick + 1;
+}
+
+TimerWheel::Clock::duration
+TimerWheel::GetTimeout(Clock::time_point now) const noexcept
+{
+	const uint64_t tick = GetNextTick();
+	if (tick == 0)
+		return Clock::duration(-1);
+
+	const auto t = TickToTimePoint(tick);
+	return t > now ? t - now : Clock::duration::zero();
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "util/Compiler.h"
+
+#include <boost/intrusive/list.hpp>
+
+#include <array>
+#include <chrono>
+
+#include <stdint.h>
+
+class CoarseTimerEvent;
+
+/**
+ * A hashed timer wheel for #CoarseTimerEvent.  Adding and canceling a
+ * timer is O(1), at the cost of precision: timers fire up to one
+ * #RESOLUTION late.  This suits idle timeouts which are refreshed
+ * often but rarely expire.
+ *
+ * Each bucket holds the timers whose due tick modulo #N_BUCKETS
+ * equals the bucket index; timers which are due in a later round of
+ * the wheel stay in their bucket until then.
+ */
+class TimerWheel {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * The duration of one tick.
+	 */
+	typedef std::chrono::duration<Clock::rep, std::ratio<1, 4>> Tick;
+
+	static constexpr unsigned N_BUCKETS = 1024;
+
+	typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> Hook;
+
+private:
+	typedef boost::intrusive::list<CoarseTimerEvent,
+				       boost::intrusive::base_hook<Hook>,
+				       boost::intrusive::constant_time_size<false>> List;
+
+	std::array<List, N_BUCKETS> buckets;
+
+	/**
+	 * A bit for each bucket which may be non-empty.  A bit may be
+	 * set for an empty bucket (after a timer has been canceled);
+	 * it is cleared the next time the bucket is visited.
+	 */
+	std::array<uint64_t, N_BUCKETS / 64> non_empty;
+
+	/**
+	 * All ticks up to (and including) this one have been
+	 * processed.
+	 */
+	uint64_t last_tick;
+
+	/**
+	 * The number of pending timers.
+	 */
+	unsigned size = 0;
+
+public:
+	TimerWheel() noexcept;
+	~TimerWheel() noexcept;
+
+	TimerWheel(const TimerWheel &) = delete;
+	TimerWheel &operator=(const TimerWheel &) = delete;
+
+	bool IsEmpty() const noexcept {
+		return size == 0;
+	}
+
+	/**
+	 * Schedule the timer to fire at the given time (rounded up to
+	 * the next tick).
+	 *
+	 * @return the tick at which the timer will be processed
+	 */
+	uint64_t Insert(CoarseTimerEvent &t, Clock::time_point due,
+			Clock::time_point now) noexcept;
+
+	void Remove(CoarseTimerEvent &t) noexcept;
+
+	/**
+	 * Invoke all timers which are due.
+	 */
+	void Run(Clock::time_point now) noexcept;
+
+	/**
+	 * Determine the first tick which may have a due timer.
+	 *
+	 * @return the tick number or 0 if there are no timers
+	 */
+	gcc_pure
+	uint64_t GetNextTick() const noexcept;
+
+	/**
+	 * Determine how long to wait until Run() should be called
+	 * again.
+	 *
+	 * @return the duration (may be zero) or a negative value if
+	 * there are no timers
+	 */
+	gcc_pure
+	Clock::duration GetTimeout(Clock::time_point now) const noexcept;
+
+	static constexpr Clock::time_point TickToTimePoint(uint64_t tick) {
+		return Clock::time_point(std::chrono::duration_cast<Clock::duration>(Tick(tick)));
+	}
+
+private:
+	static constexpr uint64_t ToTick(Clock::time_point t) {
+		return std::chrono::duration_cast<Tick>(t.time_since_epoch()).count();
+	}
+
+	/**
+	 * Like ToTick(), but round up.
+	 */
+	static constexpr uint64_t ToTickCeil(Clock::time_point t) {
+		return ToTick(t) + (TickToTimePoint(ToTick(t)) < t);
+	}
+
+	void MarkNonEmpty(unsigned i) noexcept {
+		non_empty[i / 64] |= uint64_t(1) << (i % 64);
+	}
+
+	void RunBucket(uint64_t tick) noexcept;
+};
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "UringQueue.hxx"
+#include "system/Error.hxx"
+
+#include <sys/mman.h>
+
+UringQueue::UringQueue(EventLoop &loop, unsigned entries,
+		       unsigned _n_buffers, size_t _buffer_size)
+	:ring(entries, IORING_SETUP_CLAMP),
+	 event(loop, ring.GetFileDescriptor().Get(),
+	       SocketEvent::READ|SocketEvent::PERSIST,
+	       BIND_THIS_METHOD(OnCompletion)),
+	 submit_event(loop, BIND_THIS_METHOD(Submit)),
+	 n_buffers(_n_buffers), buffer_size(_buffer_size)
+{
+	assert(n_buffers > 0 && n_buffers <= 32768);
+	assert((n_buffers & (n_buffers - 1)) == 0);
+
+	buffers_size = n_buffers * buffer_size;
+	buffers = (uint8_t *)mmap(nullptr, buffers_size,
+				  PROT_READ|PROT_WRITE,
+				  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buffers == MAP_FAILED)
+		throw MakeErrno("Failed to allocate io_uring buffers");
+
+	/* the ring must be page-aligned; mmap() takes care of
+	   that */
+	buffer_ring_size = n_buffers * sizeof(struct io_uring_buf);
+	buffer_ring = (struct io_uring_buf_ring *)
+		mmap(nullptr, buffer_ring_size, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buffer_ring == MAP_FAILED) {
+		const int e = errno;
+		munmap(buffers, buffers_size);
+		throw MakeErrno(e, "Failed to allocate io_uring buffer ring");
+	}
+
+	if (!ring.RegisterBufferRing(buffer_ring, n_buffers, BUFFER_GROUP)) {
+		const int e = errno;
+		munmap(buffer_ring, buffer_ring_size);
+		munmap(buffers, buffers_size);
+		throw MakeErrno(e, "Failed to register io_uring buffer ring");
+	}
+
+	for (unsigned i = 0; i < n_buffers; ++i)
+		AddBuffer(i);
+	PublishBuffers();
+}
+
+UringQueue::~UringQueue() noexcept
+{
+	assert(flush_list.empty());
+
+	buffer_waiters.clear();
+	submit_event.Cancel();
+	event.Delete();
+
+	if (n_pending == 0) {
+		ring.UnregisterBufferRing(BUFFER_GROUP);
+		munmap(buffer_ring, buffer_ring_size);
+		munmap(buffers, buffers_size);
+	}
+	/* else: the kernel may still write to the buffers of
+	   operations which are being canceled; leak them */
+}
+
+void
+UringQueue::ReturnBuffer(unsigned id) noexcept
+{
+	assert(id < n_buffers);
+
+	AddBuffer(id);
+	PublishBuffers();
+
+	if (!buffer_waiters.empty()) {
+		/* re-arm the receive operations which have failed
+		   with ENOBUFS */
+		flush_list.splice(flush_list.end(), buffer_waiters);
+		ScheduleSubmit();
+	}
+}
+
+struct io_uring_sqe *
+UringQueue::GetSubmitEntry() noexcept
+{
+	auto *sqe = ring.GetSubmitEntry();
+	if (sqe == nullptr) {
+		/* the submission queue is full: submit it now to make
+		   room */
+		ring.Submit();
+		sqe = ring.GetSubmitEntry();
+	}
+
+	return sqe;
+}
+
+void
+UringQueue::Push(struct io_uring_sqe &sqe,
+		 UringOperation *operation) noexcept
+{
+	sqe.user_data = (uintptr_t)operation;
+
+	if (n_pending++ == 0)
+		event.Add();
+
+	ScheduleSubmit();
+}
+
+void
+UringQueue::Cancel(UringOperation &operation) noexcept
+{
+	auto *sqe = GetSubmitEntry();
+	if (sqe == nullptr)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&operation;
+	Push(*sqe, nullptr);
+}
+
+void
+UringQueue::Submit() noexcept
+{
+	while (!flush_list.empty()) {
+		auto &f = flush_list.front();
+		f.unlink();
+		f.OnUringFlush();
+	}
+
+	ring.Submit();
+}
+
+void
+UringQueue::OnCompletion(unsigned) noexcept
+{
+	struct io_uring_cqe *cqe;
+	while ((cqe = ring.PeekCompletion()) != nullptr) {
+		auto *operation = (UringOperation *)(uintptr_t)cqe->user_data;
+		const int res = cqe->res;
+		const unsigned flags = cqe->flags;
+		ring.SeenCompletion();
+
+		if (!(flags & IORING_CQE_F_MORE)) {
+			assert(n_pending > 0);
+			if (--n_pending == 0)
+				event.Delete();
+		}
+
+		if (operation != nullptr)
+			operation->OnUringCompletion(res, flags);
+	}
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "SocketEvent.hxx"
+#include "DeferEvent.hxx"
+#include "system/IoUring.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <boost/intrusive/list.hpp>
+
+#include <stdint.h>
+
+/**
+ * An asynchronous operation submitted to a #UringQueue.  Its address
+ * is the "user_data" of all submission and completion queue entries.
+ */
+class UringOperation {
+public:
+	/**
+	 * A completion queue entry for this operation has been
+	 * received.
+	 *
+	 * @param res the "res" field (a negative errno value on
+	 * error)
+	 * @param flags the IORING_CQE_F_* flags; if
+	 * IORING_CQE_F_MORE is not set, this is the last completion
+	 * of this operation
+	 */
+	virtual void OnUringCompletion(int res, unsigned flags) noexcept = 0;
+};
+
+/**
+ * An object which wants to submit operations right before the
+ * #UringQueue submits to the kernel, i.e. at the end of the current
+ * #EventLoop iteration.  This allows collecting many small writes
+ * into one operation.
+ */
+class UringFlushable
+	: public boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> {
+public:
+	virtual void OnUringFlush() noexcept = 0;
+};
+
+/**
+ * An io_uring instance integrated in the #EventLoop.  Submission
+ * entries are collected during a loop iteration and submitted with
+ * one io_uring_enter() system call by a #DeferEvent; completions
+ * are dispatched to the #UringOperation when the ring's file
+ * descriptor becomes readable.
+ *
+ * The queue owns a ring of provided buffers (IORING_REGISTER_PBUF_RING)
+ * which can be used by receive operations with IOSQE_BUFFER_SELECT.
+ * Consumed buffers are given back to the kernel by adding them to the
+ * ring, which does not need a system call.
+ *
+ * One instance should be created per #EventLoop; it must be used
+ * only from the #EventLoop thread.
+ */
+class UringQueue {
+	IoUring ring;
+
+	/**
+	 * Watches the ring's file descriptor for completions.
+	 */
+	SocketEvent event;
+
+	/**
+	 * Submits all queued entries at the end of the current
+	 * iteration.
+	 */
+	DeferEvent submit_event;
+
+	/**
+	 * The number of submitted operations whose last completion
+	 * has not yet been received.  #event is only registered while
+	 * this is non-zero, so an idle queue does not keep the
+	 * #EventLoop alive.
+	 */
+	unsigned n_pending = 0;
+
+	boost::intrusive::list<UringFlushable,
+			       boost::intrusive::constant_time_size<false>> flush_list;
+
+	/**
+	 * Objects waiting for a provided buffer to be returned, after
+	 * a receive operation failed with ENOBUFS.  They are moved to
+	 * #flush_list by ReturnBuffer().
+	 */
+	boost::intrusive::list<UringFlushable,
+			       boost::intrusive::constant_time_size<false>> buffer_waiters;
+
+	static constexpr unsigned BUFFER_GROUP = 0;
+
+	const unsigned n_buffers;
+	const size_t buffer_size;
+
+	/**
+	 * An anonymous mapping containing all provided buffers.
+	 */
+	uint8_t *buffers;
+	size_t buffers_size;
+
+	/**
+	 * The provided buffer ring shared with the kernel; it has
+	 * #n_buffers entries.
+	 */
+	struct io_uring_buf_ring *buffer_ring;
+	size_t buffer_ring_size;
+
+	/**
+	 * The local tail of #buffer_ring; buffers added since the
+	 * last PublishBuffers() call are not yet visible to the
+	 * kernel.
+	 */
+	uint16_t buffer_ring_tail = 0;
+
+public:
+	/**
+	 * Throws std::system_error on error (e.g. if the kernel does
+	 * not support io_uring).
+	 *
+	 * @param entries the size of the submission queue
+	 * @param n_buffers the number of provided buffers; must be a
+	 * power of two not larger than 32768
+	 * @param buffer_size the size of each provided buffer
+	 */
+	explicit UringQueue(EventLoop &loop, unsigned entries=256,
+			    unsigned n_buffers=256,
+			    size_t buffer_size=16384);
+	~UringQueue() noexcept;
+
+	UringQueue(const UringQueue &) = delete;
+	UringQueue &operator=(const UringQueue &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return event.GetEventLoop();
+	}
+
+	/**
+	 * Obtain a submission queue entry.  If the submission queue is
+	 * full, it is submitted first.
+	 *
+	 * @return nullptr on error
+	 */
+	struct io_uring_sqe *GetSubmitEntry() noexcept;
+
+	/**
+	 * Queue the entry obtained by GetSubmitEntry() for submission
+	 * at the end of this #EventLoop iteration.
+	 *
+	 * @param operation the #UringOperation which will receive the
+	 * completions; nullptr to ignore them
+	 */
+	void Push(struct io_uring_sqe &sqe,
+		  UringOperation *operation) noexcept;
+
+	/**
+	 * Submit a request to cancel the given #UringOperation.  Its
+	 * completion handler will be invoked (with -ECANCELED unless
+	 * it has completed meanwhile).
+	 */
+	void Cancel(UringOperation &operation) noexcept;
+
+	/**
+	 * Invoke UringFlushable::OnUringFlush() right before the next
+	 * submission.
+	 */
+	void ScheduleFlush(UringFlushable &f) noexcept {
+		/* it may be in #buffer_waiters; move it */
+		f.unlink();
+		flush_list.push_back(f);
+		ScheduleSubmit();
+	}
+
+	/**
+	 * Like ScheduleFlush(), but wait until a provided buffer has
+	 * been returned.
+	 */
+	void ScheduleFlushOnBuffer(UringFlushable &f) noexcept {
+		if (!f.is_linked())
+			buffer_waiters.push_back(f);
+	}
+
+	/**
+	 * Prepare a receive operation which picks a provided buffer
+	 * (IOSQE_BUFFER_SELECT).  The buffer id is passed to the
+	 * completion handler in the upper 16 bits of the flags.
+	 */
+	void PrepareBufferSelect(struct io_uring_sqe &sqe) const noexcept {
+		sqe.flags |= IOSQE_BUFFER_SELECT;
+		sqe.buf_group = BUFFER_GROUP;
+	}
+
+	/**
+	 * Returns the contents of a provided buffer.
+	 */
+	ConstBuffer<uint8_t> GetBuffer(unsigned id,
+				       size_t length) const noexcept {
+		return {buffers + id * buffer_size, length};
+	}
+
+	/**
+	 * Give a provided buffer back to the kernel after its
+	 * contents have been consumed.
+	 */
+	void ReturnBuffer(unsigned id) noexcept;
+
+	/**
+	 * Submit all queued entries now.
+	 */
+	void Submit() noexcept;
+
+private:
+	/**
+	 * Add a buffer to #buffer_ring.  It will be visible to the
+	 * kernel after PublishBuffers().
+	 */
+	void AddBuffer(unsigned id) noexcept {
+		/* only the address, length and id may be written: the
+		   "resv" field of the first entry is the ring's tail;
+		   the entries are not accessed through
+		   io_uring_buf_ring::bufs, because in C++,
+		   __DECLARE_FLEX_ARRAY() inserts a non-empty dummy
+		   struct which shifts the array by 8 bytes */
+		auto *bufs = (struct io_uring_buf *)(void *)buffer_ring;
+		auto &b = bufs[buffer_ring_tail++ & (n_buffers - 1)];
+		b.addr = (uintptr_t)(buffers + id * buffer_size);
+		b.len = buffer_size;
+		b.bid = id;
+	}
+
+	void PublishBuffers() noexcept {
+		__atomic_store_n(&buffer_ring->tail, buffer_ring_tail,
+				 __ATOMIC_RELEASE);
+	}
+
+	void ScheduleSubmit() noexcept {
+		if (!submit_event.IsPending())
+			submit_event.Schedule();
+	}
+
+	void OnCompletion(unsigned events) noexcept;
+};
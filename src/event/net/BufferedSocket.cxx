@@ -35,9 +35,16 @@
 #include "net/SocketProtocolError.hxx"
 #include "util/ConstBuffer.hxx"
 
+#include <algorithm>
 #include <utility>
 
 #include <errno.h>
+#include <string.h>
+
+/**
+ * The lower bound for BufferedSocket::read_size.
+ */
+static constexpr size_t MIN_READ_SIZE = 4096;
 
 bool
 BufferedSocketHandler::OnBufferedTimeout() noexcept
@@ -74,16 +81,16 @@ BufferedSocket::ClosedByPeer() noexcept
 		return false;
 	}
 
-	const size_t remaining = input.GetAvailable();
+	const size_t remaining = input.GetAvailable() + spare.GetAvailable();
 
 	if (!handler->OnBufferedClosed() ||
 	    !handler->OnBufferedRemaining(remaining))
 		return false;
 
 	assert(!IsConnected());
-	assert(remaining == input.GetAvailable());
+	assert(remaining == input.GetAvailable() + spare.GetAvailable());
 
-	if (input.IsEmpty()) {
+	if (IsEmpty()) {
 		Ended();
 		return false;
 	}
@@ -99,6 +106,11 @@ BufferedSocket::AsFD() noexcept
 		   buffer is empty */
 		return -1;
 
+	if (IsUring())
+		/* the multishot receive operation may already own
+		   more data */
+		return -1;
+
 	return base.AsFD();
 }
 
@@ -118,6 +130,24 @@ BufferedSocket::Consumed(size_t nbytes) noexcept
 	input.Consume(nbytes);
 }
 
+bool
+BufferedSocket::RefillFromSpare() noexcept
+{
+	if (spare.IsEmpty())
+		return false;
+
+	if (input.IsEmpty()) {
+		/* cheap: just exchange the two buffers */
+		input.Swap(spare);
+		spare.FreeIfDefined();
+		return true;
+	}
+
+	const size_t n = input.MoveFrom(spare);
+	spare.FreeIfEmpty();
+	return n > 0;
+}
+
 /**
  * Invokes the data handler, and takes care for
  * #BufferedResult::AGAIN_OPTIONAL and #BufferedResult::AGAIN_EXPECT.
@@ -130,10 +160,16 @@ BufferedSocket::InvokeData() noexcept
 	bool local_expect_more = false;
 
 	while (true) {
-		if (input.IsEmpty())
+		if (input.IsEmpty() && !RefillFromSpare()) {
+			/* the handler has consumed everything; give
+			   the buffer back to the pool right away, so
+			   idle connections don't pin memory */
+			input.Free();
+
 			return expect_more || local_expect_more
 				? BufferedResult::MORE
 				: BufferedResult::OK;
+		}
 
 #ifndef NDEBUG
 		DestructObserver destructed(*this);
@@ -163,6 +199,12 @@ BufferedSocket::InvokeData() noexcept
 			local_expect_more = true;
 		else if (result == BufferedResult::AGAIN_OPTIONAL)
 			local_expect_more = false;
+		else if ((result == BufferedResult::OK ||
+			  result == BufferedResult::MORE) &&
+			 RefillFromSpare())
+			/* more data was received already; submit it
+			   right away */
+			local_expect_more = result == BufferedResult::MORE;
 		else
 			return result;
 	}
@@ -184,7 +226,7 @@ BufferedSocket::SubmitFromBuffer() noexcept
 	case BufferedResult::OK:
 		assert(!expect_more);
 
-		if (input.IsEmpty()) {
+		if (IsEmpty()) {
 			input.Free();
 
 			if (!IsConnected()) {
@@ -308,6 +350,23 @@ BufferedSocket::SubmitDirect() noexcept
 	gcc_unreachable();
 }
 
+void
+BufferedSocket::UpdateReadSize(size_t requested, size_t nbytes) noexcept
+{
+	++read_stats.reads;
+	read_stats.bytes += nbytes;
+
+	if (nbytes >= requested) {
+		/* the socket may have more; try a larger read next
+		   time */
+		++read_stats.full_reads;
+
+		/* #input and #spare have the same size */
+		read_size = std::min(read_size * 2, 2 * input.GetCapacity());
+	} else if (nbytes < read_size / 2)
+		read_size = std::max(read_size / 2, MIN_READ_SIZE);
+}
+
 inline bool
 BufferedSocket::FillBuffer() noexcept
 {
@@ -316,9 +375,49 @@ BufferedSocket::FillBuffer() noexcept
 	if (input.IsNull())
 		input.Allocate();
 
-	ssize_t nbytes = base.ReadToBuffer(input);
+	if (!spare.IsEmpty() && (!RefillFromSpare() || !spare.IsEmpty())) {
+		/* the input buffer is full; wait for the handler to
+		   consume it */
+		UnscheduleRead();
+		return true;
+	}
+
+	ssize_t nbytes;
+	size_t requested;
+
+	auto w = input.Write();
+	if (IsUring() || read_size <= w.size || w.empty()) {
+		requested = w.size;
+		nbytes = base.ReadToBuffer(input);
+	} else {
+		/* the last reads were large: receive the overflow
+		   into the spare buffer with the same system call */
+		spare.AllocateIfNull();
+		auto sw = spare.Write();
+
+		struct iovec v[2];
+		v[0].iov_base = w.data;
+		v[0].iov_len = w.size;
+		v[1].iov_base = sw.data;
+		v[1].iov_len = std::min(sw.size, read_size - w.size);
+		requested = v[0].iov_len + v[1].iov_len;
+
+		nbytes = base.ReadV(v, 2);
+		if (nbytes > (ssize_t)w.size) {
+			input.Append(w.size);
+			spare.Append(nbytes - w.size);
+			++read_stats.spare_reads;
+		} else {
+			if (nbytes > 0)
+				input.Append(nbytes);
+			spare.Free();
+		}
+	}
+
 	if (gcc_likely(nbytes > 0)) {
 		/* success: data was added to the buffer */
+		UpdateReadSize(requested, nbytes);
+
 		expect_more = false;
 		got_data = true;
 
@@ -367,6 +466,8 @@ BufferedSocket::TryRead2() noexcept
 		SubmitFromBuffer();
 		return false;
 	} else if (direct) {
+		assert(!IsUring());
+
 		/* empty the remaining buffer before doing direct transfer */
 		if (!SubmitFromBuffer())
 			return false;
@@ -437,6 +538,29 @@ BufferedSocket::OnSocketWrite() noexcept
 	assert(!destroyed);
 	assert(!ended);
 
+	if (!cork.IsEmpty()) {
+		switch (FlushCork()) {
+		case FlushResult::EMPTY:
+			break;
+
+		case FlushResult::BLOCKING:
+			return true;
+
+		case FlushResult::CLOSED:
+			return false;
+		}
+
+		if (!handler->OnBufferedDrained())
+			return false;
+
+		if (!want_write) {
+			/* the write event was only scheduled to flush
+			   the cork buffer */
+			base.UnscheduleWrite();
+			return true;
+		}
+	}
+
 	try {
 		return handler->OnBufferedWrite();
 	} catch (...) {
@@ -463,6 +587,14 @@ BufferedSocket::OnSocketTimeout() noexcept
 	return handler->OnBufferedTimeout();
 }
 
+bool
+BufferedSocket::OnSocketZeroCopy() noexcept
+{
+	assert(!destroyed);
+
+	return handler->OnBufferedZeroCopy();
+}
+
 /*
  * public API
  *
@@ -478,7 +610,11 @@ BufferedSocket::Init(SocketDescriptor _fd, FdType _fd_type) noexcept
 
 	handler = nullptr;
 	direct = false;
+	auto_cork = false;
+	want_write = false;
 	expect_more = false;
+	read_size = MIN_READ_SIZE;
+	read_stats.Clear();
 	destroyed = false;
 
 #ifndef NDEBUG
@@ -503,7 +639,11 @@ BufferedSocket::Init(SocketDescriptor _fd, FdType _fd_type,
 
 	handler = &_handler;
 	direct = false;
+	auto_cork = false;
+	want_write = false;
 	expect_more = false;
+	read_size = MIN_READ_SIZE;
+	read_stats.Clear();
 	destroyed = false;
 
 #ifndef NDEBUG
@@ -537,6 +677,10 @@ BufferedSocket::Destroy() noexcept
 	assert(!destroyed);
 
 	input.FreeIfDefined();
+	spare.FreeIfDefined();
+
+	defer_flush.Cancel();
+	cork.FreeIfDefined();
 
 	destroyed = true;
 }
@@ -546,7 +690,7 @@ BufferedSocket::IsEmpty() const noexcept
 {
 	assert(!ended);
 
-	return input.IsEmpty();
+	return input.IsEmpty() && spare.IsEmpty();
 }
 
 bool
@@ -577,10 +721,8 @@ BufferedSocket::Read(bool _expect_more) noexcept
 }
 
 ssize_t
-BufferedSocket::Write(const void *data, size_t length) noexcept
+BufferedSocket::CheckWriteResult(ssize_t nbytes) noexcept
 {
-	ssize_t nbytes = base.Write(data, length);
-
 	if (gcc_unlikely(nbytes < 0)) {
 		const int e = errno;
 		if (gcc_likely(e == EAGAIN)) {
@@ -588,7 +730,6 @@ BufferedSocket::Write(const void *data, size_t length) noexcept
 			return WRITE_BLOCKING;
 		} else if (e == EPIPE || e == ECONNRESET) {
 			enum write_result r = handler->OnBufferedBroken();
-
 			if (r == WRITE_BROKEN)
 				UnscheduleWrite();
 
@@ -599,32 +740,186 @@ BufferedSocket::Write(const void *data, size_t length) noexcept
 	return nbytes;
 }
 
+ssize_t
+BufferedSocket::Write(const void *data, size_t length) noexcept
+{
+	if (auto_cork || !cork.IsEmpty()) {
+		struct iovec v = {const_cast<void *>(data), length};
+		return CorkV(&v, 1);
+	}
+
+	return CheckWriteResult(base.Write(data, length));
+}
+
 ssize_t
 BufferedSocket::WriteV(const struct iovec *v, size_t n) noexcept
 {
-	ssize_t nbytes = base.WriteV(v, n);
+	if (auto_cork || !cork.IsEmpty())
+		return CorkV(v, n);
 
-	if (gcc_unlikely(nbytes < 0)) {
-		const int e = errno;
-		if (gcc_likely(e == EAGAIN)) {
-			ScheduleWrite();
-			return WRITE_BLOCKING;
-		} else if (e == EPIPE || e == ECONNRESET) {
-			enum write_result r = handler->OnBufferedBroken();
-			if (r == WRITE_BROKEN)
-				UnscheduleWrite();
+	return CheckWriteResult(base.WriteV(v, n));
+}
 
-			nbytes = ssize_t(r);
+ssize_t
+BufferedSocket::CorkV(const struct iovec *v, size_t n) noexcept
+{
+	size_t length = 0;
+	for (size_t i = 0; i < n; ++i)
+		length += v[i].iov_len;
+
+	cork.AllocateIfNull();
+
+	auto w = cork.Write();
+	if (length <= w.size) {
+		/* fits into the cork buffer: copy it and send it
+		   later together with other writes */
+		for (size_t i = 0; i < n; ++i) {
+			memcpy(w.data, v[i].iov_base, v[i].iov_len);
+			w.data += v[i].iov_len;
 		}
+
+		cork.Append(length);
+		defer_flush.Schedule();
+		return length;
 	}
 
-	return nbytes;
+	/* too large: send the cork buffer and the new data with one
+	   sendmsg() call */
+
+	static constexpr size_t MAX_IOV = 32;
+	if (n >= MAX_IOV) {
+		if (!SendCork())
+			return CheckWriteResult(-1);
+
+		return CheckWriteResult(base.WriteV(v, n));
+	}
+
+	struct iovec gathered[MAX_IOV];
+	const auto r = cork.Read();
+	gathered[0].iov_base = r.data;
+	gathered[0].iov_len = r.size;
+	std::copy_n(v, n, gathered + 1);
+
+	ssize_t nbytes = base.WriteV(gathered, n + 1);
+	if (nbytes < 0)
+		return CheckWriteResult(nbytes);
+
+	if (size_t(nbytes) <= r.size) {
+		/* none of the new data was sent */
+		cork.Consume(nbytes);
+		if (cork.IsEmpty()) {
+			cork.Free();
+			defer_flush.Cancel();
+		}
+
+		errno = EAGAIN;
+		return CheckWriteResult(-1);
+	}
+
+	cork.Free();
+	defer_flush.Cancel();
+	return nbytes - r.size;
+}
+
+bool
+BufferedSocket::SendCork() noexcept
+{
+	const auto r = cork.Read();
+	ssize_t nbytes = base.Write(r.data, r.size);
+	if (nbytes < 0)
+		return false;
+
+	cork.Consume(nbytes);
+	if (!cork.IsEmpty()) {
+		errno = EAGAIN;
+		return false;
+	}
+
+	cork.Free();
+	defer_flush.Cancel();
+	return true;
+}
+
+BufferedSocket::FlushResult
+BufferedSocket::FlushCork() noexcept
+{
+	if (SendCork())
+		return FlushResult::EMPTY;
+
+	const int e = errno;
+	if (e == EAGAIN) {
+		/* OnSocketWrite() will continue */
+		base.ScheduleWrite(write_timeout);
+		return FlushResult::BLOCKING;
+	}
+
+	if (e == EPIPE || e == ECONNRESET) {
+		switch (handler->OnBufferedBroken()) {
+		case WRITE_BROKEN:
+			/* discard the rest and continue reading */
+			cork.Free();
+			if (!want_write)
+				base.UnscheduleWrite();
+			return FlushResult::EMPTY;
+
+		case WRITE_DESTROYED:
+			return FlushResult::CLOSED;
+
+		default:
+			break;
+		}
+	}
+
+	handler->OnBufferedError(std::make_exception_ptr(MakeErrno(e, "Failed to send")));
+	return FlushResult::CLOSED;
+}
+
+void
+BufferedSocket::FlushCorkLast() noexcept
+{
+	defer_flush.Cancel();
+
+	if (!cork.IsEmpty() && base.IsValid())
+		SendCork();
+
+	cork.FreeIfDefined();
+}
+
+void
+BufferedSocket::DeferFlushCallback() noexcept
+{
+	assert(!destroyed);
+
+	if (!base.IsValid() || cork.IsEmpty())
+		return;
+
+	FlushCork();
+}
+
+ssize_t
+BufferedSocket::WriteZeroCopy(const struct iovec *v, size_t n) noexcept
+{
+	if (!cork.IsEmpty() && !SendCork())
+		/* the cork buffer must be sent first to preserve the
+		   order */
+		return CheckWriteResult(-1);
+
+	return CheckWriteResult(base.WriteZeroCopy(v, n));
 }
 
 ssize_t
 BufferedSocket::WriteFrom(int other_fd, FdType other_fd_type,
 			  size_t length) noexcept
 {
+	if (!cork.IsEmpty() && !SendCork()) {
+		if (errno == EAGAIN) {
+			ScheduleWrite();
+			return WRITE_BLOCKING;
+		}
+
+		return WRITE_ERRNO;
+	}
+
 	ssize_t nbytes = base.WriteFrom(other_fd, other_fd_type, length);
 	if (gcc_unlikely(nbytes < 0)) {
 		const int e = errno;
@@ -658,7 +953,8 @@ BufferedSocket::DeferRead(bool _expect_more) noexcept
 
 void
 BufferedSocket::ScheduleReadTimeout(bool _expect_more,
-				    const struct timeval *timeout) noexcept
+				    const struct timeval *timeout,
+				    bool coarse) noexcept
 {
 	assert(!ended);
 	assert(!destroyed);
@@ -667,6 +963,7 @@ BufferedSocket::ScheduleReadTimeout(bool _expect_more,
 		expect_more = true;
 
 	read_timeout = timeout;
+	base.SetCoarseReadTimeout(coarse);
 
 	if (!input.IsEmpty())
 		/* deferred call to Read() to deliver data from the buffer */
@@ -40,7 +40,10 @@
 
 #include <exception>
 
+#include <sys/uio.h>
+
 #include <assert.h>
+#include <stdint.h>
 
 enum class BufferedResult {
 	/**
@@ -247,8 +250,9 @@ public:
 	 * The output buffer was drained, and all data that has been
 	 * passed to BufferedSocket::Write() was written to the socket.
 	 *
-	 * This method is not actually used by #BufferedSocket; it is
-	 * only implemented for #FilteredSocket.
+	 * #BufferedSocket invokes this in auto-cork mode (see
+	 * BufferedSocket::SetAutoCork()) after the socket has become
+	 * writable and the cork buffer has been flushed.
 	 *
 	 * @return false if the method has destroyed the socket
 	 */
@@ -256,6 +260,17 @@ public:
 		return true;
 	}
 
+	/**
+	 * More buffers passed to BufferedSocket::WriteZeroCopy() have
+	 * been released by the kernel; see
+	 * BufferedSocket::IsZeroCopyComplete().
+	 *
+	 * @return false when the socket has been closed
+	 */
+	virtual bool OnBufferedZeroCopy() noexcept {
+		return true;
+	}
+
 	/**
 	 * @return false when the socket has been closed
 	 */
@@ -284,6 +299,44 @@ public:
 	virtual void OnBufferedError(std::exception_ptr e) noexcept = 0;
 };
 
+/**
+ * Read counters of one #BufferedSocket.
+ */
+struct BufferedSocketStats {
+	/**
+	 * The number of successful read calls.
+	 */
+	uint64_t reads = 0;
+
+	/**
+	 * The number of bytes received by all #reads.
+	 */
+	uint64_t bytes = 0;
+
+	/**
+	 * The number of reads which filled all of the requested
+	 * space.
+	 */
+	uint64_t full_reads = 0;
+
+	/**
+	 * The number of reads which overflowed into the spare
+	 * buffer.
+	 */
+	uint64_t spare_reads = 0;
+
+	void Clear() noexcept {
+		*this = BufferedSocketStats();
+	}
+
+	gcc_pure
+	double GetAverageReadSize() const noexcept {
+		return reads > 0
+			? double(bytes) / double(reads)
+			: 0.;
+	}
+};
+
 /**
  * A wrapper for #SocketWrapper that manages an optional input buffer.
  *
@@ -316,11 +369,53 @@ class BufferedSocket final : DebugDestructAnchor, LeakDetector, SocketHandler {
 
 	DefaultFifoBuffer input;
 
+	/**
+	 * A second input buffer which receives data that did not fit
+	 * into #input (see FillBuffer()).  Its contents logically
+	 * follow the contents of #input, and is moved there as soon
+	 * as #input has room.
+	 */
+	DefaultFifoBuffer spare;
+
+	/**
+	 * The number of bytes the next read should request.  It grows
+	 * after reads which filled all of the requested space and
+	 * shrinks after short reads; if it exceeds the free space of
+	 * #input, #spare is used, too.
+	 */
+	size_t read_size;
+
+	BufferedSocketStats read_stats;
+
+	/**
+	 * Output gathered in auto-cork mode (see SetAutoCork()); it
+	 * is flushed by #defer_flush.
+	 */
+	DefaultFifoBuffer cork;
+
+	/**
+	 * Flushes #cork at the end of the current #EventLoop
+	 * iteration.
+	 */
+	DeferEvent defer_flush;
+
 	/**
 	 * Attempt to do "direct" transfers?
 	 */
 	bool direct;
 
+	/**
+	 * Gather Write() calls in #cork?
+	 */
+	bool auto_cork;
+
+	/**
+	 * Has the handler asked for BufferedSocketHandler::OnBufferedWrite()
+	 * calls?  The write event may also be scheduled just to
+	 * flush #cork.
+	 */
+	bool want_write;
+
 	/**
 	 * Does the handler expect more data?  It announced this by
 	 * returning BUFFERED_MORE.
@@ -343,7 +438,8 @@ class BufferedSocket final : DebugDestructAnchor, LeakDetector, SocketHandler {
 public:
 	explicit BufferedSocket(EventLoop &_event_loop) noexcept
 		:base(_event_loop, *this),
-		 defer_read(_event_loop, BIND_THIS_METHOD(DeferReadCallback)) {}
+		 defer_read(_event_loop, BIND_THIS_METHOD(DeferReadCallback)),
+		 defer_flush(_event_loop, BIND_THIS_METHOD(DeferFlushCallback)) {}
 
 	EventLoop &GetEventLoop() noexcept {
 		return defer_read.GetEventLoop();
@@ -378,6 +474,7 @@ public:
 		assert(!destroyed);
 
 		defer_read.Cancel();
+		FlushCorkLast();
 		base.Close();
 	}
 
@@ -391,6 +488,7 @@ public:
 		assert(!destroyed);
 
 		defer_read.Cancel();
+		FlushCorkLast();
 		base.Abandon();
 	}
 
@@ -452,16 +550,84 @@ public:
 		return base.GetType();
 	}
 
+	/**
+	 * Enable "direct" mode, i.e. call
+	 * BufferedSocketHandler::OnBufferedDirect() instead of reading
+	 * into the input buffer.  The io_uring engine receives data
+	 * before the handler is asked, therefore it falls back to
+	 * buffered mode; IsDirect() tells which mode is in effect.
+	 */
 	void SetDirect(bool _direct) noexcept {
-		direct = _direct;
+		direct = _direct && !IsUring();
+	}
+
+	bool IsDirect() const noexcept {
+		return direct;
+	}
+
+#ifdef ENABLE_URING
+	/**
+	 * Switch to the io_uring engine; see
+	 * SocketWrapper::EnableUring().  Must be called after Init().
+	 */
+	void EnableUring(UringQueue &queue) noexcept {
+		assert(!destroyed);
+
+		base.EnableUring(queue);
+
+		/* "direct" mode is not supported by the io_uring
+		   engine; fall back to the input buffer */
+		direct = false;
+	}
+#endif
+
+	/**
+	 * Enable or disable "auto-cork" mode: data passed to Write()
+	 * and WriteV() is copied to a buffer, and all writes issued
+	 * during one #EventLoop iteration are sent with a single
+	 * system call before the loop goes to sleep.  Writes which do
+	 * not fit into the buffer are sent right away together with
+	 * the buffered data.
+	 *
+	 * Close() and Abandon() make one last non-blocking attempt to
+	 * send the buffer; callers which need to be sure that
+	 * everything has been sent should wait for
+	 * BufferedSocketHandler::OnBufferedDrained() (see
+	 * IsCorkEmpty()).
+	 *
+	 * This is ignored with the io_uring engine, which gathers
+	 * output in its own buffer anyway.
+	 */
+	void SetAutoCork(bool _auto_cork) noexcept {
+		auto_cork = _auto_cork && !IsUring();
+	}
+
+	/**
+	 * Has all data gathered in auto-cork mode been sent?
+	 */
+	bool IsCorkEmpty() const noexcept {
+		return cork.IsEmpty();
+	}
+
+	bool IsUring() const noexcept {
+#ifdef ENABLE_URING
+		return base.IsUring();
+#else
+		return false;
+#endif
 	}
 
 	/**
 	 * Returns the socket descriptor and calls Abandon().
-	 * Returns -1 if the input buffer is not empty.
+	 * Returns -1 if the input buffer is not empty or if the
+	 * io_uring engine is used.
 	 */
 	int AsFD() noexcept;
 
+	const BufferedSocketStats &GetReadStats() const noexcept {
+		return read_stats;
+	}
+
 	/**
 	 * Is the input buffer empty?
 	 */
@@ -493,6 +659,10 @@ public:
 	 * this method does not invalidate the buffer passed to
 	 * BufferedSocketHandler::OnBufferedData().  It may be called
 	 * repeatedly.
+	 *
+	 * Once the handler returns with an empty input buffer, the
+	 * buffer is returned to the pool (see #BufferCache), and a
+	 * new one is only allocated when more data arrives.
 	 */
 	void Consumed(size_t nbytes) noexcept;
 
@@ -517,8 +687,14 @@ public:
 	 * features and invokes SocketWrapper::Write() directly.  Use this
 	 * in special cases when you want to push data to the socket right
 	 * before closing it.
+	 *
+	 * Data gathered in auto-cork mode is sent first; if that is
+	 * not possible, this method fails with EAGAIN.
 	 */
 	ssize_t DirectWrite(const void *data, size_t length) noexcept {
+		if (!cork.IsEmpty() && !SendCork())
+			return -1;
+
 		return base.Write(data, length);
 	}
 
@@ -532,6 +708,54 @@ public:
 
 	ssize_t WriteV(const struct iovec *v, size_t n) noexcept;
 
+	/**
+	 * Enable MSG_ZEROCOPY transmission for WriteZeroCopy(); see
+	 * SocketWrapper::EnableZeroCopy().
+	 *
+	 * @return false if zero-copy is not supported
+	 */
+	bool EnableZeroCopy(size_t min_size=SocketWrapper::DEFAULT_ZEROCOPY_MIN_SIZE) noexcept {
+		return base.EnableZeroCopy(min_size);
+	}
+
+	/**
+	 * See SocketWrapper::GetZeroCopyCounter().
+	 */
+	uint32_t GetZeroCopyCounter() const noexcept {
+		return base.GetZeroCopyCounter();
+	}
+
+	/**
+	 * See SocketWrapper::IsZeroCopyComplete().
+	 */
+	gcc_pure
+	bool IsZeroCopyComplete(uint32_t counter) const noexcept {
+		return base.IsZeroCopyComplete(counter);
+	}
+
+	gcc_pure
+	bool HasZeroCopyPending() const noexcept {
+		return base.HasZeroCopyPending();
+	}
+
+	/**
+	 * Like WriteV(), but large writes may be sent with
+	 * MSG_ZEROCOPY.  The caller must then keep the data unmodified
+	 * until IsZeroCopyComplete() returns true for the value
+	 * GetZeroCopyCounter() returned before this call;
+	 * BufferedSocketHandler::OnBufferedZeroCopy() is invoked as
+	 * completions arrive.
+	 *
+	 * @return the positive number of bytes written or a #write_result
+	 * code
+	 */
+	ssize_t WriteZeroCopy(const struct iovec *v, size_t n) noexcept;
+
+	ssize_t WriteZeroCopy(const void *data, size_t length) noexcept {
+		struct iovec v = {const_cast<void *>(data), length};
+		return WriteZeroCopy(&v, 1);
+	}
+
 	/**
 	 * Transfer data from the given file descriptor to the socket.
 	 *
@@ -553,8 +777,14 @@ public:
 	 */
 	void DeferRead(bool _expect_more) noexcept;
 
+	/**
+	 * @param coarse implement the timeout with a
+	 * #CoarseTimerEvent, which is cheaper to refresh but less
+	 * precise; this setting is used until the next call
+	 */
 	void ScheduleReadTimeout(bool _expect_more,
-				 const struct timeval *timeout) noexcept;
+				 const struct timeval *timeout,
+				 bool coarse=false) noexcept;
 
 	/**
 	 * Schedules reading on the socket with timeout disabled, to indicate
@@ -576,6 +806,7 @@ public:
 		assert(!ended);
 		assert(!destroyed);
 
+		want_write = true;
 		base.ScheduleWrite(write_timeout);
 	}
 
@@ -583,7 +814,12 @@ public:
 		assert(!ended);
 		assert(!destroyed);
 
-		base.UnscheduleWrite();
+		want_write = false;
+
+		if (cork.IsEmpty())
+			/* keep the event if it is still needed to
+			   flush the cork buffer */
+			base.UnscheduleWrite();
 	}
 
 private:
@@ -595,8 +831,63 @@ private:
 	bool SubmitDirect() noexcept;
 	bool FillBuffer() noexcept;
 	bool TryRead2() noexcept;
+
+	/**
+	 * Move data from #spare to #input.
+	 *
+	 * @return true if data was moved
+	 */
+	bool RefillFromSpare() noexcept;
+
+	/**
+	 * Adjust #read_size after a successful read.
+	 */
+	void UpdateReadSize(size_t requested, size_t nbytes) noexcept;
+
 	bool TryRead() noexcept;
 
+	/**
+	 * Translate a failed write into a #write_result code,
+	 * scheduling the write event or invoking
+	 * BufferedSocketHandler::OnBufferedBroken() as needed.
+	 */
+	ssize_t CheckWriteResult(ssize_t nbytes) noexcept;
+
+	/**
+	 * Copy the data to #cork, or (if it does not fit) send it
+	 * together with the contents of #cork.
+	 */
+	ssize_t CorkV(const struct iovec *v, size_t n) noexcept;
+
+	/**
+	 * Send as much of #cork as possible, without invoking any
+	 * callbacks.
+	 *
+	 * @return true if #cork is empty now; false with errno set
+	 * otherwise (EAGAIN if the socket is not ready)
+	 */
+	bool SendCork() noexcept;
+
+	enum class FlushResult {
+		EMPTY,
+		BLOCKING,
+		CLOSED,
+	};
+
+	/**
+	 * Like SendCork(), but schedule the write event if the socket
+	 * is not ready, and report errors to the handler.
+	 */
+	FlushResult FlushCork() noexcept;
+
+	/**
+	 * The socket is about to be closed: make one last attempt to
+	 * send #cork and discard what is left.
+	 */
+	void FlushCorkLast() noexcept;
+
+	void DeferFlushCallback() noexcept;
+
 	static bool OnWrite(void *ctx) noexcept;
 	static bool OnRead(void *ctx) noexcept;
 	static bool OnTimeout(void *ctx) noexcept;
@@ -609,4 +900,5 @@ private:
 	bool OnSocketRead() noexcept override;
 	bool OnSocketWrite() noexcept override;
 	bool OnSocketTimeout() noexcept override;
+	bool OnSocketZeroCopy() noexcept override;
 };
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "HappyEyeballs.hxx"
+#include "net/AddressInfo.hxx"
+#include "system/Error.hxx"
+
+#include <stdexcept>
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+constexpr struct timeval HappyEyeballsConnect::DEFAULT_STAGGER_DELAY;
+
+HappyEyeballsConnect::Attempt::Attempt(HappyEyeballsConnect &_parent,
+				       const Address &address)
+	:parent(_parent),
+	 event(parent.timeout_timer.GetEventLoop(), BIND_THIS_METHOD(OnEvent))
+{
+	if (!fd.CreateNonBlock(address.address.GetFamily(),
+			       address.type, address.protocol))
+		throw MakeErrno("Failed to create socket");
+
+	if (!fd.Connect(address.address) && errno != EINPROGRESS)
+		throw MakeErrno("Failed to connect");
+
+	event.Set(fd.Get(), SocketEvent::WRITE);
+	event.Add();
+}
+
+void
+HappyEyeballsConnect::Attempt::OnEvent(unsigned) noexcept
+{
+	int s_err = fd.GetError();
+	if (s_err != 0)
+		parent.OnAttemptError(*this, std::make_exception_ptr(MakeErrno(s_err, "Failed to connect")));
+	else
+		parent.OnAttemptSuccess(*this, std::move(fd));
+}
+
+HappyEyeballsConnect::HappyEyeballsConnect(EventLoop &event_loop,
+					   ConnectSocketHandler &_handler,
+					   const struct timeval &_stagger_delay) noexcept
+	:handler(_handler),
+	 stagger_timer(event_loop, BIND_THIS_METHOD(OnStaggerTimer)),
+	 timeout_timer(event_loop, BIND_THIS_METHOD(OnTimeout)),
+	 stagger_delay(_stagger_delay)
+{
+}
+
+HappyEyeballsConnect::~HappyEyeballsConnect() noexcept
+{
+	if (IsPending())
+		Cancel();
+}
+
+void
+HappyEyeballsConnect::Connect(const AddressInfoList &list,
+			      const struct timeval &timeout) noexcept
+{
+	assert(!IsPending());
+
+	addresses.clear();
+	next = 0;
+	last_error = nullptr;
+
+	/* RFC 8305 4: interleave the address families, starting
+	   with the family of the first (i.e. preferred) address */
+	std::vector<const AddressInfo *> first, second;
+	for (const auto &i : list) {
+		if (first.empty() || i.GetFamily() == first.front()->GetFamily())
+			first.push_back(&i);
+		else
+			second.push_back(&i);
+	}
+
+	addresses.reserve(first.size() + second.size());
+	for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+		if (i < first.size())
+			addresses.push_back({AllocatedSocketAddress(*first[i]),
+					     first[i]->GetType(),
+					     first[i]->GetProtocol()});
+		if (i < second.size())
+			addresses.push_back({AllocatedSocketAddress(*second[i]),
+					     second[i]->GetType(),
+					     second[i]->GetProtocol()});
+	}
+
+	if (addresses.empty()) {
+		handler.OnSocketConnectError(std::make_exception_ptr(std::runtime_error("No address")));
+		return;
+	}
+
+	timeout_timer.Add(timeout);
+	StartNext();
+}
+
+void
+HappyEyeballsConnect::Cancel() noexcept
+{
+	attempts.clear();
+	stagger_timer.Cancel();
+	timeout_timer.Cancel();
+	next = addresses.size();
+}
+
+void
+HappyEyeballsConnect::StartNext() noexcept
+{
+	while (next < addresses.size()) {
+		try {
+			attempts.emplace_back(*this, addresses[next++]);
+
+			if (next < addresses.size())
+				stagger_timer.Add(stagger_delay);
+			return;
+		} catch (...) {
+			/* this address failed immediately; try the
+			   next one right away */
+			last_error = std::current_exception();
+		}
+	}
+
+	if (attempts.empty()) {
+		/* all attempts have failed */
+		timeout_timer.Cancel();
+		handler.OnSocketConnectError(last_error);
+	}
+}
+
+void
+HappyEyeballsConnect::OnAttemptSuccess(Attempt &,
+				       UniqueSocketDescriptor &&fd) noexcept
+{
+	UniqueSocketDescriptor result(std::move(fd));
+	Cancel();
+	handler.OnSocketConnectSuccess(std::move(result));
+}
+
+void
+HappyEyeballsConnect::OnAttemptError(Attempt &attempt,
+				     std::exception_ptr error) noexcept
+{
+	last_error = error;
+
+	attempts.remove_if([&attempt](const Attempt &i){
+			return &i == &attempt;
+		});
+
+	/* RFC 8305 5: don't wait for the stagger delay after a
+	   failure */
+	stagger_timer.Cancel();
+	StartNext();
+}
+
+void
+HappyEyeballsConnect::OnStaggerTimer() noexcept
+{
+	StartNext();
+}
+
+void
+HappyEyeballsConnect::OnTimeout() noexcept
+{
+	Cancel();
+	handler.OnSocketConnectTimeout();
+}
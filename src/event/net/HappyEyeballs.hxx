@@ -0,0 +1,155 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "ConnectSocket.hxx"
+#include "event/TimerEvent.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "util/Cancellable.hxx"
+
+#include <exception>
+#include <list>
+#include <vector>
+
+class AddressInfoList;
+
+/**
+ * Connect to one of several addresses (e.g. all results of a DNS
+ * lookup) with staggered parallel attempts as described in RFC 8305
+ * ("Happy Eyeballs"): addresses are tried in an order which
+ * alternates between IPv6 and IPv4, and a new attempt is started
+ * each time the stagger delay elapses (or as soon as the previous
+ * attempt fails) while older attempts keep running.  The first
+ * connection which succeeds wins; all others are closed.
+ *
+ * The #ConnectSocketHandler is invoked exactly once, unless the
+ * operation is canceled.
+ */
+class HappyEyeballsConnect final : public Cancellable {
+	struct Address {
+		AllocatedSocketAddress address;
+
+		int type, protocol;
+	};
+
+	class Attempt {
+		HappyEyeballsConnect &parent;
+
+		UniqueSocketDescriptor fd;
+
+		SocketEvent event;
+
+	public:
+		/**
+		 * Throws std::system_error on error.
+		 */
+		Attempt(HappyEyeballsConnect &_parent, const Address &address);
+
+		Attempt(const Attempt &) = delete;
+		Attempt &operator=(const Attempt &) = delete;
+
+	private:
+		void OnEvent(unsigned events) noexcept;
+	};
+
+	ConnectSocketHandler &handler;
+
+	/**
+	 * The addresses in the order they will be tried.
+	 */
+	std::vector<Address> addresses;
+
+	/**
+	 * The index of the next address in #addresses.
+	 */
+	size_t next = 0;
+
+	std::list<Attempt> attempts;
+
+	/**
+	 * Starts the next attempt after the stagger delay.
+	 */
+	TimerEvent stagger_timer;
+
+	TimerEvent timeout_timer;
+
+	const struct timeval stagger_delay;
+
+	/**
+	 * The error of the most recent failed attempt.
+	 */
+	std::exception_ptr last_error;
+
+public:
+	/**
+	 * The default delay between two attempts recommended by RFC
+	 * 8305.
+	 */
+	static constexpr struct timeval DEFAULT_STAGGER_DELAY = {0, 250000};
+
+	HappyEyeballsConnect(EventLoop &event_loop,
+			     ConnectSocketHandler &_handler,
+			     const struct timeval &_stagger_delay=DEFAULT_STAGGER_DELAY) noexcept;
+
+	~HappyEyeballsConnect() noexcept;
+
+	bool IsPending() const noexcept {
+		return !attempts.empty() || stagger_timer.IsPending();
+	}
+
+	/**
+	 * Start connecting to the given addresses.  The list is
+	 * copied and may be freed after this method returns.
+	 *
+	 * @param timeout the timeout for the whole operation
+	 */
+	void Connect(const AddressInfoList &list,
+		     const struct timeval &timeout) noexcept;
+
+	/* virtual methods from Cancellable */
+	void Cancel() noexcept override;
+
+private:
+	/**
+	 * Start the next attempt.  If there are no more addresses and
+	 * no attempt is running, report the error.
+	 */
+	void StartNext() noexcept;
+
+	void OnAttemptSuccess(Attempt &attempt,
+			      UniqueSocketDescriptor &&fd) noexcept;
+	void OnAttemptError(Attempt &attempt, std::exception_ptr error) noexcept;
+
+	void OnStaggerTimer() noexcept;
+	void OnTimeout() noexcept;
+};
@@ -34,6 +34,8 @@
 #include "UdpHandler.hxx"
 #include "system/Error.hxx"
 
+#include <stdexcept>
+
 #include <assert.h>
 #include <sys/socket.h>
 
@@ -46,21 +48,80 @@ MultiUdpListener::MultiUdpListener(EventLoop &event_loop,
 	       SocketEvent::READ|SocketEvent::PERSIST,
 	       BIND_THIS_METHOD(EventCallback)),
 	 multi(std::move(_multi)),
+	 defer_flush(event_loop, BIND_THIS_METHOD(OnDeferredFlush)),
 	 handler(_handler)
 {
 	event.Add();
 }
 
+MultiUdpListener::MultiUdpListener(EventLoop &event_loop,
+				   UniqueSocketDescriptor _socket,
+				   MultiReceiveMessage &&_multi,
+				   MultiSendMessage &&_replies,
+				   UdpHandler &_handler)
+	:MultiUdpListener(event_loop, std::move(_socket), std::move(_multi),
+			  _handler)
+{
+	replies.reset(new MultiSendMessage(std::move(_replies)));
+}
+
 MultiUdpListener::~MultiUdpListener() noexcept
 {
 	assert(socket.IsDefined());
 
+	defer_flush.Cancel();
+	event.Delete();
+}
+
+void
+MultiUdpListener::UpdateWriteEvent() noexcept
+{
+	const bool want_write = replies != nullptr && !replies->IsEmpty();
+	const bool has_write = (event.GetEvents() & SocketEvent::WRITE) != 0;
+	if (want_write == has_write)
+		return;
+
+	/* preserve the Enable()/Disable() state */
+	const bool enabled = event.IsPending(SocketEvent::READ);
+
+	unsigned flags = SocketEvent::READ|SocketEvent::PERSIST;
+	if (want_write)
+		flags |= SocketEvent::WRITE;
+
 	event.Delete();
+	event.Set(socket.Get(), flags);
+	if (enabled)
+		event.Add();
 }
 
 void
-MultiUdpListener::EventCallback(unsigned) noexcept
+MultiUdpListener::FlushReplies()
+{
+	if (replies == nullptr)
+		return;
+
+	defer_flush.Cancel();
+
+	try {
+		replies->Send(socket);
+	} catch (...) {
+		UpdateWriteEvent();
+		throw;
+	}
+
+	UpdateWriteEvent();
+}
+
+void
+MultiUdpListener::EventCallback(unsigned events) noexcept
 try {
+	if (events & SocketEvent::WRITE) {
+		FlushReplies();
+
+		if (!(events & SocketEvent::READ))
+			return;
+	}
+
 	if (!multi.Receive(socket)) {
 		handler.OnUdpDatagram(nullptr, 0, nullptr, -1);
 		return;
@@ -75,6 +136,10 @@ try {
 			return;
 
 	multi.Clear();
+
+	/* submit all replies generated by this batch with one
+	   system call */
+	FlushReplies();
 } catch (...) {
 	/* unregister the SocketEvent, just in case the handler does
 	   not destroy us */
@@ -83,12 +148,36 @@ try {
 	handler.OnUdpError(std::current_exception());
 }
 
+void
+MultiUdpListener::OnDeferredFlush() noexcept
+try {
+	FlushReplies();
+} catch (...) {
+	event.Delete();
+
+	handler.OnUdpError(std::current_exception());
+}
+
 void
 MultiUdpListener::Reply(SocketAddress address,
 			const void *data, size_t data_length)
 {
 	assert(socket.IsDefined());
 
+	if (replies != nullptr &&
+	    data_length <= replies->GetMaxPayloadSize()) {
+		if (replies->IsFull())
+			FlushReplies();
+
+		if (!replies->Add(address, data, data_length))
+			throw std::runtime_error("UDP reply queue is full");
+
+		/* if this is called outside of EventCallback(), make
+		   sure the reply gets sent soon */
+		defer_flush.Schedule();
+		return;
+	}
+
 	ssize_t nbytes = sendto(socket.Get(), data, data_length,
 				MSG_DONTWAIT|MSG_NOSIGNAL,
 				address.GetAddress(), address.GetSize());
@@ -33,8 +33,12 @@
 #pragma once
 
 #include "event/SocketEvent.hxx"
+#include "event/DeferEvent.hxx"
 #include "net/UniqueSocketDescriptor.hxx"
 #include "net/MultiReceiveMessage.hxx"
+#include "net/MultiSendMessage.hxx"
+
+#include <memory>
 
 #include <stddef.h>
 
@@ -51,12 +55,36 @@ class MultiUdpListener {
 
 	MultiReceiveMessage multi;
 
+	/**
+	 * If set, then Reply() queues datagrams here, and they are
+	 * submitted with one sendmmsg() call after the current
+	 * receive batch has been handled.
+	 */
+	std::unique_ptr<MultiSendMessage> replies;
+
+	/**
+	 * Flushes #replies which were queued outside of
+	 * EventCallback().
+	 */
+	DeferEvent defer_flush;
+
 	UdpHandler &handler;
 
 public:
 	MultiUdpListener(EventLoop &event_loop, UniqueSocketDescriptor _socket,
 			 MultiReceiveMessage &&_multi,
 			 UdpHandler &_handler) noexcept;
+
+	/**
+	 * Construct a listener which queues replies in the given
+	 * #MultiSendMessage instead of sending them one by one.
+	 *
+	 * Throws std::bad_alloc on error.
+	 */
+	MultiUdpListener(EventLoop &event_loop, UniqueSocketDescriptor _socket,
+			 MultiReceiveMessage &&_multi,
+			 MultiSendMessage &&_replies,
+			 UdpHandler &_handler);
 	~MultiUdpListener() noexcept;
 
 	/**
@@ -83,13 +111,29 @@ public:
 	}
 
 	/**
-	 * Send a reply datagram to a client.
+	 * Send a reply datagram to a client.  If reply batching is
+	 * enabled, the datagram is only queued, and will be sent
+	 * after the current receive batch has been handled.
 	 *
 	 * Throws std::runtime_error on error.
 	 */
 	void Reply(SocketAddress address,
 		   const void *data, size_t data_length);
 
+	/**
+	 * Send all queued replies now (as far as the socket allows).
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	void FlushReplies();
+
 private:
+	/**
+	 * Register or unregister interest in #SocketEvent::WRITE,
+	 * depending on whether there are queued replies.
+	 */
+	void UpdateWriteEvent() noexcept;
+
 	void EventCallback(unsigned events) noexcept;
+	void OnDeferredFlush() noexcept;
 };
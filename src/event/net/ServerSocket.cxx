@@ -39,6 +39,8 @@
 #include "net/AllocatedSocketAddress.hxx"
 #include "system/Error.hxx"
 
+#include <stdexcept>
+
 #include <assert.h>
 #include <stddef.h>
 #include <sys/socket.h>
@@ -182,23 +184,92 @@ ServerSocket::GetLocalAddress() const
 	return fd.GetLocalAddress();
 }
 
-void
-ServerSocket::EventCallback(unsigned)
+bool
+ServerSocket::GetAcceptQueue(unsigned &length,
+			     unsigned &backlog) const noexcept
+{
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+	if (getsockopt(fd.Get(), IPPROTO_TCP, TCP_INFO, &info, &size) < 0)
+		return false;
+
+	/* for listeners, the kernel reports the accept queue in
+	   these fields */
+	length = info.tcpi_unacked;
+	backlog = info.tcpi_sacked;
+	return true;
+}
+
+uint64_t
+ServerSocket::GetListenOverflows()
 {
-	StaticSocketAddress remote_address;
-	auto remote_fd = fd.AcceptNonBlock(remote_address);
-	if (!remote_fd.IsDefined()) {
-		const int e = errno;
-		if (e != EAGAIN && e != EWOULDBLOCK)
-			OnAcceptError(std::make_exception_ptr(MakeErrno(e, "Failed to accept connection")));
-
-		return;
+	FILE *file = fopen("/proc/net/netstat", "r");
+	if (file == nullptr)
+		throw MakeErrno("Failed to open /proc/net/netstat");
+
+	/* the file consists of pairs of lines: one with the counter
+	   names and one with their values */
+	char names[4096], values[4096];
+	while (fgets(names, sizeof(names), file) != nullptr &&
+	       fgets(values, sizeof(values), file) != nullptr) {
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+
+		char *name_save, *value_save;
+		const char *name = strtok_r(names, " \n", &name_save);
+		const char *value = strtok_r(values, " \n", &value_save);
+		while (name != nullptr && value != nullptr) {
+			if (strcmp(name, "ListenOverflows") == 0) {
+				fclose(file);
+				return strtoull(value, nullptr, 10);
+			}
+
+			name = strtok_r(nullptr, " \n", &name_save);
+			value = strtok_r(nullptr, " \n", &value_save);
+		}
 	}
 
-	if (IsTCP(remote_address) && !remote_fd.SetNoDelay()) {
-		OnAcceptError(std::make_exception_ptr(MakeErrno("setsockopt(TCP_NODELAY) failed")));
-		return;
+	fclose(file);
+	throw std::runtime_error("No ListenOverflows in /proc/net/netstat");
+}
+
+void
+ServerSocket::EventCallback(unsigned)
+{
+	++stats.callbacks;
+
+	for (unsigned i = 0; i < accept_batch; ++i) {
+		StaticSocketAddress remote_address;
+		auto remote_fd = fd.AcceptNonBlock(remote_address);
+		if (!remote_fd.IsDefined()) {
+			const int e = errno;
+			if (e != EAGAIN && e != EWOULDBLOCK) {
+				++stats.errors;
+				OnAcceptError(std::make_exception_ptr(MakeErrno(e, "Failed to accept connection")));
+			}
+
+			return;
+		}
+
+		++stats.accepted;
+
+		if (IsTCP(remote_address) && !remote_fd.SetNoDelay()) {
+			++stats.errors;
+			OnAcceptError(std::make_exception_ptr(MakeErrno("setsockopt(TCP_NODELAY) failed")));
+			return;
+		}
+
+		const DestructObserver destructed(*this);
+		OnAccept(std::move(remote_fd), remote_address);
+
+		if (destructed)
+			/* the handler has destroyed this object */
+			return;
+
+		if (!event.IsPending(SocketEvent::READ))
+			/* the handler has called RemoveEvent() */
+			return;
 	}
 
-	OnAccept(std::move(remote_fd), remote_address);
+	++stats.full_batches;
 }
@@ -34,18 +34,65 @@
 
 #include "net/UniqueSocketDescriptor.hxx"
 #include "event/SocketEvent.hxx"
+#include "util/DestructObserver.hxx"
 
 #include <exception>
 
+#include <assert.h>
+#include <stdint.h>
+
 class SocketAddress;
 
+/**
+ * Counters collected by #ServerSocket.
+ */
+struct ServerSocketStats {
+	/**
+	 * The number of accepted connections.
+	 */
+	uint64_t accepted = 0;
+
+	/**
+	 * The number of event callbacks.
+	 */
+	uint64_t callbacks = 0;
+
+	/**
+	 * The number of callbacks which stopped because the batch
+	 * limit was reached, i.e. more connections may have been
+	 * waiting.  If this is a large fraction of #callbacks, the
+	 * batch size should be increased.
+	 */
+	uint64_t full_batches = 0;
+
+	/**
+	 * The number of failed accept() calls (not counting EAGAIN)
+	 * and of accepted sockets which could not be configured.
+	 */
+	uint64_t errors = 0;
+
+	void Clear() noexcept {
+		*this = ServerSocketStats();
+	}
+};
+
 /**
  * A socket that accepts incoming connections.
+ *
+ * OnAccept() and OnAcceptError() may destroy the #ServerSocket.
  */
-class ServerSocket {
+class ServerSocket : DestructAnchor {
 	UniqueSocketDescriptor fd;
 	SocketEvent event;
 
+	/**
+	 * The maximum number of connections accepted in one event
+	 * callback.
+	 */
+	unsigned accept_batch = 16;
+
+	ServerSocketStats stats;
+
 public:
 	explicit ServerSocket(EventLoop &event_loop)
 		:event(event_loop, BIND_THIS_METHOD(EventCallback)) {}
@@ -57,6 +104,10 @@ public:
 
 	~ServerSocket();
 
+	EventLoop &GetEventLoop() noexcept {
+		return event.GetEventLoop();
+	}
+
 	void Listen(UniqueSocketDescriptor _fd);
 
 	/**
@@ -75,10 +126,48 @@ public:
 
 	StaticSocketAddress GetLocalAddress() const;
 
+	SocketDescriptor GetSocket() const noexcept {
+		return fd;
+	}
+
 	bool SetTcpDeferAccept(const int &seconds) {
 		return fd.SetTcpDeferAccept(seconds);
 	}
 
+	/**
+	 * Set the maximum number of connections accepted in one
+	 * #EventLoop iteration.  Larger values drain the listener
+	 * backlog faster during connection storms, smaller values
+	 * leave more time for existing connections.
+	 */
+	void SetAcceptBatch(unsigned _accept_batch) noexcept {
+		assert(_accept_batch > 0);
+
+		accept_batch = _accept_batch;
+	}
+
+	const ServerSocketStats &GetStats() const noexcept {
+		return stats;
+	}
+
+	/**
+	 * Query the length of the kernel's accept queue and the
+	 * listener backlog (TCP listeners only, via TCP_INFO).
+	 *
+	 * @return false on error
+	 */
+	bool GetAcceptQueue(unsigned &length, unsigned &backlog) const noexcept;
+
+	/**
+	 * Returns the number of times (since boot) an incoming TCP
+	 * connection was dropped because a listener backlog was
+	 * full ("ListenOverflows" in /proc/net/netstat).  This
+	 * counter is system-wide, not specific to this listener.
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	static uint64_t GetListenOverflows();
+
 	void AddEvent() {
 		event.Add();
 	}
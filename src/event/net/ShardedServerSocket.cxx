@@ -0,0 +1,121 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ShardedServerSocket.hxx"
+#include "event/LoopPool.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/IPv6Address.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <assert.h>
+#include <sys/socket.h>
+
+ShardedServerSocket::~ShardedServerSocket()
+{
+}
+
+void
+ShardedServerSocket::Listen(SocketAddress address,
+			    bool free_bind,
+			    const char *bind_to_device)
+{
+	assert(shards.empty());
+
+	if (address.GetFamily() != AF_INET && address.GetFamily() != AF_INET6)
+		throw std::runtime_error("Sharded listeners require an IP address");
+
+	try {
+		for (unsigned i = 0; i < pool.size(); ++i) {
+			shards.emplace_back(pool.GetEventLoop(i), *this);
+			shards.back().Listen(address, true,
+					     free_bind, bind_to_device);
+		}
+	} catch (...) {
+		shards.clear();
+		throw;
+	}
+}
+
+void
+ShardedServerSocket::ListenTCP(unsigned port)
+{
+	assert(port > 0);
+
+	try {
+		Listen(IPv6Address(port));
+	} catch (...) {
+		Listen(IPv4Address(port));
+	}
+}
+
+bool
+ShardedServerSocket::SetTcpDeferAccept(const int &seconds)
+{
+	for (auto &i : shards)
+		if (!i.SetTcpDeferAccept(seconds))
+			return false;
+
+	return true;
+}
+
+void
+ShardedServerSocket::SetAcceptBatch(unsigned accept_batch) noexcept
+{
+	for (auto &i : shards)
+		i.SetAcceptBatch(accept_batch);
+}
+
+void
+ShardedServerSocket::EnableCpuSteering()
+{
+	assert(!shards.empty());
+	assert(shards.size() == pool.size());
+
+	std::vector<int> cpus;
+	cpus.reserve(pool.size());
+	for (unsigned i = 0; i < pool.size(); ++i)
+		cpus.push_back(pool.GetCpu(i));
+
+	/* the program may be attached to any socket of the group */
+	auto fd = shards.front().GetSocket();
+
+	const bool success =
+		std::find(cpus.begin(), cpus.end(), -1) == cpus.end()
+		? fd.SetReusePortCpuMap(cpus.data(), cpus.size())
+		: fd.SetReusePortCpuModulo(cpus.size());
+	if (!success)
+		throw MakeErrno("Failed to attach SO_REUSEPORT program");
+}
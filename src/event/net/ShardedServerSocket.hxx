@@ -0,0 +1,132 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "ServerSocket.hxx"
+#include "net/SocketAddress.hxx"
+
+#include <exception>
+#include <list>
+
+class EventLoopPool;
+
+/**
+ * A server socket which is sharded over all #EventLoop instances of
+ * an #EventLoopPool: each #EventLoop gets its own listener socket
+ * bound to the same address with SO_REUSEPORT, and the kernel
+ * distributes incoming connections among them.  Accepted connections
+ * are handled by the #EventLoop (and thus the thread) which accepted
+ * them.
+ *
+ * All methods must be called before EventLoopPool::Start().
+ */
+class ShardedServerSocket {
+	class Shard final : public ServerSocket {
+		ShardedServerSocket &parent;
+
+	public:
+		Shard(EventLoop &_event_loop, ShardedServerSocket &_parent)
+			:ServerSocket(_event_loop), parent(_parent) {}
+
+	protected:
+		void OnAccept(UniqueSocketDescriptor &&_fd,
+			      SocketAddress address) override {
+			parent.OnAccept(GetEventLoop(), std::move(_fd), address);
+		}
+
+		void OnAcceptError(std::exception_ptr ep) override {
+			parent.OnAcceptError(GetEventLoop(), ep);
+		}
+	};
+
+	EventLoopPool &pool;
+
+	std::list<Shard> shards;
+
+public:
+	explicit ShardedServerSocket(EventLoopPool &_pool) noexcept
+		:pool(_pool) {}
+
+	virtual ~ShardedServerSocket();
+
+	ShardedServerSocket(const ShardedServerSocket &) = delete;
+	ShardedServerSocket &operator=(const ShardedServerSocket &) = delete;
+
+	/**
+	 * Create one listener per #EventLoop.  Only IPv4 and IPv6
+	 * addresses are supported, because SO_REUSEPORT has no effect
+	 * on local sockets.
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	void Listen(SocketAddress address,
+		    bool free_bind=false,
+		    const char *bind_to_device=nullptr);
+
+	void ListenTCP(unsigned port);
+
+	bool SetTcpDeferAccept(const int &seconds);
+
+	/**
+	 * @see ServerSocket::SetAcceptBatch()
+	 */
+	void SetAcceptBatch(unsigned accept_batch) noexcept;
+
+	/**
+	 * Attach a BPF program to the SO_REUSEPORT group which lets
+	 * each connection be accepted by the #EventLoop whose thread
+	 * is pinned to the CPU which received it.  Together with
+	 * receive-side scaling, this keeps all processing of a
+	 * connection on one CPU core.  If the threads are not pinned,
+	 * connections are distributed by CPU number modulo the
+	 * number of listeners.
+	 *
+	 * Must be called after Listen().
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void EnableCpuSteering();
+
+protected:
+	/**
+	 * A new incoming connection has been established.  This is
+	 * called from within the thread of the given #EventLoop.
+	 *
+	 * @param fd the socket owned by the callee
+	 */
+	virtual void OnAccept(EventLoop &event_loop,
+			      UniqueSocketDescriptor &&fd,
+			      SocketAddress address) = 0;
+	virtual void OnAcceptError(EventLoop &event_loop,
+				   std::exception_ptr ep) = 0;
+};
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "SocketPool.hxx"
+#include "event/Loop.hxx"
+#include "net/SocketAddress.hxx"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Check whether an idle socket can be reused: the peer must not have
+ * closed it, and there must not be any unexpected data.
+ */
+static bool
+IsReusable(SocketDescriptor fd) noexcept
+{
+	char buffer;
+	ssize_t nbytes = recv(fd.Get(), &buffer, sizeof(buffer),
+			      MSG_PEEK|MSG_DONTWAIT);
+	return nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+bool
+SocketPool::AddressLess::operator()(SocketAddress a,
+				     SocketAddress b) const noexcept
+{
+	if (a.GetSize() != b.GetSize())
+		return a.GetSize() < b.GetSize();
+
+	return memcmp(a.GetAddress(), b.GetAddress(), a.GetSize()) < 0;
+}
+
+SocketPool::SocketPool(EventLoop &event_loop, size_t _max_idle,
+		       std::chrono::steady_clock::duration _idle_timeout) noexcept
+	:cleanup_timer(event_loop,
+		       std::max<unsigned>(std::chrono::duration_cast<std::chrono::seconds>(_idle_timeout).count(), 1),
+		       BIND_THIS_METHOD(OnCleanupTimer)),
+	 idle_timeout(_idle_timeout),
+	 max_idle(_max_idle)
+{
+}
+
+SocketPool::~SocketPool() noexcept
+{
+	Clear();
+}
+
+void
+SocketPool::Trim(Bucket &bucket, size_t size) noexcept
+{
+	while (bucket.size() > size) {
+		bucket.pop_back();
+		--n_idle;
+		++stats.discarded;
+	}
+}
+
+UniqueSocketDescriptor
+SocketPool::Get(SocketAddress address) noexcept
+{
+	auto i = buckets.find(address);
+	if (i == buckets.end()) {
+		++stats.misses;
+		return UniqueSocketDescriptor();
+	}
+
+	auto &bucket = i->second;
+	const Expiry now(GetEventLoop().SteadyNow());
+
+	while (!bucket.empty()) {
+		UniqueSocketDescriptor fd = std::move(bucket.front().fd);
+		const bool expired = bucket.front().expires.IsExpired(now);
+		bucket.pop_front();
+		--n_idle;
+
+		if (!expired && IsReusable(fd)) {
+			if (bucket.empty())
+				buckets.erase(i);
+
+			++stats.hits;
+			return fd;
+		}
+
+		++stats.discarded;
+	}
+
+	buckets.erase(i);
+	++stats.misses;
+	return UniqueSocketDescriptor();
+}
+
+void
+SocketPool::Put(SocketAddress address, UniqueSocketDescriptor fd) noexcept
+{
+	assert(fd.IsDefined());
+
+	if (max_idle == 0) {
+		++stats.discarded;
+		return;
+	}
+
+	auto i = buckets.find(address);
+	if (i == buckets.end())
+		i = buckets.emplace(AllocatedSocketAddress(address),
+				    Bucket()).first;
+
+	auto &bucket = i->second;
+	Trim(bucket, max_idle - 1);
+
+	bucket.emplace_front(std::move(fd),
+			     Expiry::Touched(Expiry(GetEventLoop().SteadyNow()),
+					     idle_timeout));
+	++n_idle;
+
+	cleanup_timer.Enable();
+}
+
+void
+SocketPool::Clear() noexcept
+{
+	buckets.clear();
+	n_idle = 0;
+	cleanup_timer.Disable();
+}
+
+bool
+SocketPool::OnCleanupTimer() noexcept
+{
+	const Expiry now(GetEventLoop().SteadyNow());
+
+	for (auto i = buckets.begin(); i != buckets.end();) {
+		auto &bucket = i->second;
+
+		for (auto j = bucket.begin(); j != bucket.end();) {
+			if (j->expires.IsExpired(now) || !IsReusable(j->fd)) {
+				j = bucket.erase(j);
+				--n_idle;
+				++stats.discarded;
+			} else
+				++j;
+		}
+
+		if (bucket.empty())
+			i = buckets.erase(i);
+		else
+			++i;
+	}
+
+	return n_idle > 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "event/CleanupTimer.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "util/Expiry.hxx"
+
+#include <chrono>
+#include <list>
+#include <map>
+
+#include <stdint.h>
+
+class SocketAddress;
+
+/**
+ * Counters collected by #SocketPool.
+ */
+struct SocketPoolStats {
+	/**
+	 * The number of Get() calls which returned an idle socket.
+	 */
+	uint64_t hits = 0;
+
+	/**
+	 * The number of Get() calls which found no usable idle
+	 * socket.
+	 */
+	uint64_t misses = 0;
+
+	/**
+	 * The number of idle sockets which were closed because they
+	 * had expired, the peer had closed them or the per-address
+	 * limit was exceeded.
+	 */
+	uint64_t discarded = 0;
+};
+
+/**
+ * A pool of idle outgoing connections, to be reused instead of
+ * establishing a new connection (e.g. with #ConnectSocket) for each
+ * request.  Sockets are kept per #SocketAddress and handed out in
+ * LIFO order, because the most recently used connection is the one
+ * most likely still alive and warm in all caches.
+ *
+ * Idle sockets are not watched for events; sockets which have been
+ * closed by the peer are detected by Get() and by a periodic
+ * cleanup.
+ */
+class SocketPool {
+	struct Item {
+		UniqueSocketDescriptor fd;
+
+		Expiry expires;
+
+		Item(UniqueSocketDescriptor &&_fd, Expiry _expires) noexcept
+			:fd(std::move(_fd)), expires(_expires) {}
+	};
+
+	struct AddressLess {
+		typedef void is_transparent;
+
+		gcc_pure
+		bool operator()(SocketAddress a, SocketAddress b) const noexcept;
+	};
+
+	/**
+	 * The idle sockets of one address; the most recently added
+	 * one is at the front.
+	 */
+	typedef std::list<Item> Bucket;
+
+	std::map<AllocatedSocketAddress, Bucket, AddressLess> buckets;
+
+	CleanupTimer cleanup_timer;
+
+	const std::chrono::steady_clock::duration idle_timeout;
+
+	/**
+	 * The maximum number of idle sockets per address.
+	 */
+	const size_t max_idle;
+
+	size_t n_idle = 0;
+
+	SocketPoolStats stats;
+
+public:
+	/**
+	 * @param _max_idle the maximum number of idle sockets per
+	 * address
+	 * @param _idle_timeout idle sockets are closed after this
+	 * duration
+	 */
+	SocketPool(EventLoop &event_loop, size_t _max_idle,
+		   std::chrono::steady_clock::duration _idle_timeout) noexcept;
+
+	~SocketPool() noexcept;
+
+	SocketPool(const SocketPool &) = delete;
+	SocketPool &operator=(const SocketPool &) = delete;
+
+	EventLoop &GetEventLoop() noexcept {
+		return cleanup_timer.GetEventLoop();
+	}
+
+	/**
+	 * Returns the total number of idle sockets.
+	 */
+	size_t GetIdleCount() const noexcept {
+		return n_idle;
+	}
+
+	const SocketPoolStats &GetStats() const noexcept {
+		return stats;
+	}
+
+	/**
+	 * Obtain an idle connection to the given address.  Sockets
+	 * which have expired or which were closed by the peer are
+	 * discarded.
+	 *
+	 * @return the socket (owned by the caller) or an undefined
+	 * socket if there is no usable idle connection; in that case,
+	 * the caller should establish a new one
+	 */
+	UniqueSocketDescriptor Get(SocketAddress address) noexcept;
+
+	/**
+	 * Give an idle connection to the pool.  The caller must make
+	 * sure that the protocol is in a clean state (i.e. no request
+	 * pending and no response data left).  If the per-address
+	 * limit is exceeded, the oldest idle socket is closed.  The
+	 * pool always takes ownership of the socket; it is closed
+	 * right away if the pool does not keep idle connections.
+	 */
+	void Put(SocketAddress address, UniqueSocketDescriptor fd) noexcept;
+
+	/**
+	 * Close all idle sockets.
+	 */
+	void Clear() noexcept;
+
+private:
+	/**
+	 * Remove items from the end of the bucket (the oldest ones)
+	 * until it has at most the given number of items.
+	 */
+	void Trim(Bucket &bucket, size_t size) noexcept;
+
+	bool OnCleanupTimer() noexcept;
+};
@@ -34,18 +34,45 @@
 #include "io/Splice.hxx"
 #include "net/Buffered.hxx"
 
+#ifdef ENABLE_URING
+#include "UringSocket.hxx"
+#endif
+
+#include <utility>
+
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <errno.h>
 
 void
 SocketWrapper::ReadEventCallback(unsigned events) noexcept
 {
 	assert(IsValid());
 
+	if (HasZeroCopyPending() && !HandleZeroCopyCompletions())
+		return;
+
 	if (events & SocketEvent::TIMEOUT)
 		handler.OnSocketTimeout();
-	else
+	else {
+		if (read_timeout_event.IsPending())
+			/* like the SocketEvent timeout of a persistent
+			   event, refresh the timeout each time the
+			   socket becomes readable */
+			read_timeout_event.Add(read_timeout);
+
 		handler.OnSocketRead();
+	}
+}
+
+void
+SocketWrapper::ReadTimeoutCallback() noexcept
+{
+	assert(IsValid());
+
+	handler.OnSocketTimeout();
 }
 
 void
@@ -53,30 +80,105 @@ SocketWrapper::WriteEventCallback(unsigned events) noexcept
 {
 	assert(IsValid());
 
+	if (HasZeroCopyPending() && !HandleZeroCopyCompletions())
+		return;
+
 	if (events & SocketEvent::TIMEOUT)
 		handler.OnSocketTimeout();
 	else
 		handler.OnSocketWrite();
 }
 
+void
+SocketWrapper::ZeroCopyTimerCallback() noexcept
+{
+	assert(IsValid());
+
+	HandleZeroCopyCompletions();
+}
+
 void
 SocketWrapper::Init(SocketDescriptor _fd, FdType _fd_type) noexcept
 {
 	assert(_fd.IsDefined());
 
+#ifdef ENABLE_URING
+	assert(uring == nullptr);
+#endif
+
 	fd = _fd;
 	fd_type = _fd_type;
+	coarse_read_timeout = false;
+	zerocopy.reset();
 
 	read_event.Set(fd.Get(), SocketEvent::READ|SocketEvent::PERSIST);
 	write_event.Set(fd.Get(), SocketEvent::WRITE|SocketEvent::PERSIST);
 }
 
+#ifdef ENABLE_URING
+
+void
+SocketWrapper::EnableUring(UringQueue &queue) noexcept
+{
+	assert(IsValid());
+	assert(uring == nullptr);
+	assert(!read_event.IsPending(SocketEvent::READ));
+	assert(!write_event.IsPending(SocketEvent::WRITE));
+
+	uring = new UringSocket(queue, fd, handler);
+}
+
+void
+SocketWrapper::ScheduleUringRead(const struct timeval *timeout) noexcept
+{
+	uring->ScheduleRead(timeout);
+}
+
+void
+SocketWrapper::ScheduleUringWrite(const struct timeval *timeout) noexcept
+{
+	uring->ScheduleWrite(timeout);
+}
+
+void
+SocketWrapper::UnscheduleUringRead() noexcept
+{
+	uring->UnscheduleRead();
+}
+
+void
+SocketWrapper::UnscheduleUringWrite() noexcept
+{
+	uring->UnscheduleWrite();
+}
+
+bool
+SocketWrapper::IsUringReadPending() const noexcept
+{
+	return uring->IsReadScheduled();
+}
+
+bool
+SocketWrapper::IsUringWritePending() const noexcept
+{
+	return uring->IsWriteScheduled();
+}
+
+#endif
+
 void
 SocketWrapper::Shutdown() noexcept
 {
 	if (!fd.IsDefined())
 		return;
 
+#ifdef ENABLE_URING
+	if (uring != nullptr) {
+		uring->Shutdown();
+		return;
+	}
+#endif
+
 	shutdown(fd.Get(), SHUT_RDWR);
 }
 
@@ -86,8 +188,21 @@ SocketWrapper::Close() noexcept
 	if (!fd.IsDefined())
 		return;
 
+#ifdef ENABLE_URING
+	if (uring != nullptr) {
+		/* the UringSocket closes the socket after all
+		   pending output has been sent */
+		std::exchange(uring, nullptr)->Close();
+		fd = SocketDescriptor::Undefined();
+		return;
+	}
+#endif
+
 	read_event.Delete();
 	write_event.Delete();
+	read_timeout_event.Cancel();
+	if (zerocopy)
+		zerocopy->timer.Cancel();
 
 	fd.Close();
 }
@@ -97,8 +212,16 @@ SocketWrapper::Abandon() noexcept
 {
 	assert(fd.IsDefined());
 
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		std::exchange(uring, nullptr)->Abandon();
+#endif
+
 	read_event.Delete();
 	write_event.Delete();
+	read_timeout_event.Cancel();
+	if (zerocopy)
+		zerocopy->timer.Cancel();
 
 	fd = SocketDescriptor::Undefined();
 }
@@ -118,14 +241,46 @@ SocketWrapper::ReadToBuffer(ForeignFifoBuffer<uint8_t> &buffer) noexcept
 {
 	assert(IsValid());
 
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		return uring->ReadToBuffer(buffer);
+#endif
+
 	return ReceiveToBuffer(fd.Get(), buffer);
 }
 
+ssize_t
+SocketWrapper::ReadV(const struct iovec *v, size_t n) noexcept
+{
+	assert(IsValid());
+
+#ifdef ENABLE_URING
+	assert(uring == nullptr);
+#endif
+
+	struct msghdr m = {
+		.msg_name = nullptr,
+		.msg_namelen = 0,
+		.msg_iov = const_cast<struct iovec *>(v),
+		.msg_iovlen = n,
+		.msg_control = nullptr,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+
+	return recvmsg(fd.Get(), &m, MSG_DONTWAIT);
+}
+
 bool
 SocketWrapper::IsReadyForWriting() const noexcept
 {
 	assert(IsValid());
 
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		return uring->IsReadyForWriting();
+#endif
+
 	return fd.IsReadyForWriting();
 }
 
@@ -134,6 +289,11 @@ SocketWrapper::Write(const void *data, size_t length) noexcept
 {
 	assert(IsValid());
 
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		return uring->Write(data, length);
+#endif
+
 	return send(fd.Get(), data, length, MSG_DONTWAIT|MSG_NOSIGNAL);
 }
 
@@ -142,6 +302,11 @@ SocketWrapper::WriteV(const struct iovec *v, size_t n) noexcept
 {
 	assert(IsValid());
 
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		return uring->WriteV(v, n);
+#endif
+
 	struct msghdr m = {
 		.msg_name = nullptr,
 		.msg_namelen = 0,
@@ -159,5 +324,187 @@ ssize_t
 SocketWrapper::WriteFrom(int other_fd, FdType other_fd_type,
 			 size_t length) noexcept
 {
+#ifdef ENABLE_URING
+	if (uring != nullptr && !uring->IsOutputEmpty()) {
+		/* the output buffer must be sent first to preserve
+		   the order */
+		errno = EAGAIN;
+		return -1;
+	}
+#endif
+
 	return SpliceToSocket(other_fd_type, other_fd, fd.Get(), length);
 }
+
+bool
+SocketWrapper::EnableZeroCopy(size_t min_size) noexcept
+{
+	assert(IsValid());
+
+#ifdef ENABLE_URING
+	if (uring != nullptr)
+		/* the UringSocket copies into its own output buffer */
+		return false;
+#endif
+
+	const int value = 1;
+	if (setsockopt(fd.Get(), SOL_SOCKET, SO_ZEROCOPY,
+		       &value, sizeof(value)) < 0)
+		return false;
+
+	if (zerocopy) {
+		zerocopy->enabled = true;
+		zerocopy->min_size = min_size;
+	} else
+		zerocopy.reset(new ZeroCopyState(GetEventLoop(), min_size,
+						 BIND_THIS_METHOD(ZeroCopyTimerCallback)));
+
+	return true;
+}
+
+ssize_t
+SocketWrapper::WriteZeroCopy(const struct iovec *v, size_t n) noexcept
+{
+	assert(IsValid());
+
+	if (!IsZeroCopy())
+		return WriteV(v, n);
+
+	size_t length = 0;
+	for (size_t i = 0; i < n; ++i)
+		length += v[i].iov_len;
+
+	if (length < zerocopy->min_size)
+		return WriteV(v, n);
+
+	struct msghdr m = {
+		.msg_name = nullptr,
+		.msg_namelen = 0,
+		.msg_iov = const_cast<struct iovec *>(v),
+		.msg_iovlen = n,
+		.msg_control = nullptr,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+
+	ssize_t nbytes = sendmsg(fd.Get(), &m,
+				 MSG_DONTWAIT|MSG_NOSIGNAL|MSG_ZEROCOPY);
+	if (nbytes < 0 && errno == ENOBUFS) {
+		/* too many pinned pages (optmem_max exceeded); fall
+		   back to copying this one */
+		return WriteV(v, n);
+	}
+
+	if (nbytes > 0) {
+		/* the kernel assigns a number to every successful
+		   MSG_ZEROCOPY send */
+		++zerocopy->sent;
+		ScheduleZeroCopyPoll();
+	}
+
+	return nbytes;
+}
+
+void
+SocketWrapper::AddZeroCopyCompletion(uint32_t begin, uint32_t end) noexcept
+{
+	auto &z = *zerocopy;
+
+	if (begin != z.completed) {
+		z.reordered.emplace_back(begin, end);
+		return;
+	}
+
+	z.completed = end;
+
+	bool found;
+	do {
+		found = false;
+		for (auto i = z.reordered.begin();
+		     i != z.reordered.end(); ++i) {
+			if (i->first == z.completed) {
+				z.completed = i->second;
+				z.reordered.erase(i);
+				found = true;
+				break;
+			}
+		}
+	} while (found);
+}
+
+bool
+SocketWrapper::ReceiveZeroCopyCompletions() noexcept
+{
+	const uint32_t old_completed = zerocopy->completed;
+
+	while (HasZeroCopyPending()) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+					sizeof(struct sockaddr_in6))];
+		struct msghdr m = {
+			.msg_name = nullptr,
+			.msg_namelen = 0,
+			.msg_iov = nullptr,
+			.msg_iovlen = 0,
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+			.msg_flags = 0,
+		};
+
+		if (recvmsg(fd.Get(), &m, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+			break;
+
+		for (auto *cmsg = CMSG_FIRSTHDR(&m); cmsg != nullptr;
+		     cmsg = CMSG_NXTHDR(&m, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP &&
+			       cmsg->cmsg_type == IP_RECVERR) ||
+			      (cmsg->cmsg_level == SOL_IPV6 &&
+			       cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			const auto &ee = *(const struct sock_extended_err *)
+				CMSG_DATA(cmsg);
+			if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    ee.ee_errno != 0)
+				continue;
+
+			if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				/* the kernel had to copy anyway (e.g. on
+				   loopback or without scatter-gather);
+				   don't bother pinning pages for future
+				   writes */
+				zerocopy->enabled = false;
+
+			/* ee_info..ee_data is an inclusive range */
+			AddZeroCopyCompletion(ee.ee_info, ee.ee_data + 1);
+		}
+	}
+
+	return zerocopy->completed != old_completed;
+}
+
+bool
+SocketWrapper::HandleZeroCopyCompletions() noexcept
+{
+	if (ReceiveZeroCopyCompletions() && !handler.OnSocketZeroCopy())
+		return false;
+
+	ScheduleZeroCopyPoll();
+	return true;
+}
+
+void
+SocketWrapper::ScheduleZeroCopyPoll() noexcept
+{
+	if (!HasZeroCopyPending() ||
+	    read_event.IsPending(SocketEvent::READ) ||
+	    write_event.IsPending(SocketEvent::WRITE)) {
+		if (zerocopy)
+			zerocopy->timer.Cancel();
+		return;
+	}
+
+	if (!zerocopy->timer.IsPending()) {
+		static constexpr struct timeval poll_interval{0, 10000};
+		zerocopy->timer.Add(poll_interval);
+	}
+}
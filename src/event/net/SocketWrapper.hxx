@@ -34,15 +34,25 @@
 
 #include "io/FdType.hxx"
 #include "event/SocketEvent.hxx"
+#include "event/TimerEvent.hxx"
+#include "event/CoarseTimerEvent.hxx"
 #include "net/SocketDescriptor.hxx"
 #include "util/Compiler.h"
 
+#include <memory>
+#include <vector>
+#include <utility>
+
 #include <sys/types.h>
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 
 template<typename T> class ForeignFifoBuffer;
+#ifdef ENABLE_URING
+class UringQueue;
+class UringSocket;
+#endif
 
 class SocketHandler {
 public:
@@ -64,6 +74,16 @@ public:
 	 * @return false when the socket has been closed
 	 */
 	virtual bool OnSocketTimeout() noexcept = 0;
+
+	/**
+	 * The kernel has completed more MSG_ZEROCOPY transmissions;
+	 * see SocketWrapper::IsZeroCopyComplete().
+	 *
+	 * @return false when the socket has been closed
+	 */
+	virtual bool OnSocketZeroCopy() noexcept {
+		return true;
+	}
 };
 
 class SocketWrapper {
@@ -72,12 +92,90 @@ class SocketWrapper {
 
 	SocketEvent read_event, write_event;
 
+	/**
+	 * The read timeout if #coarse_read_timeout is enabled.
+	 */
+	CoarseTimerEvent read_timeout_event;
+
+	/**
+	 * The read timeout passed to ScheduleRead(), used to refresh
+	 * #read_timeout_event each time the socket becomes readable.
+	 */
+	struct timeval read_timeout;
+
+	/**
+	 * Use #read_timeout_event instead of the #read_event
+	 * timeout?
+	 */
+	bool coarse_read_timeout = false;
+
+	/**
+	 * The MSG_ZEROCOPY bookkeeping; allocated by EnableZeroCopy(),
+	 * so sockets which never use it don't pay for it.
+	 */
+	struct ZeroCopyState {
+		/**
+		 * Use MSG_ZEROCOPY in WriteZeroCopy()?  This is
+		 * cleared when the kernel reports that it had to copy
+		 * the data anyway.
+		 */
+		bool enabled = true;
+
+		/**
+		 * WriteZeroCopy() copies writes smaller than this.
+		 */
+		size_t min_size;
+
+		/**
+		 * The number of successful MSG_ZEROCOPY sends so far;
+		 * the kernel numbers them in the same way, starting
+		 * at zero.
+		 */
+		uint32_t sent = 0;
+
+		/**
+		 * All MSG_ZEROCOPY sends with a lower number have
+		 * been completed.
+		 */
+		uint32_t completed = 0;
+
+		/**
+		 * Completion ranges (begin, end) which were reported
+		 * out of order; they are merged into #completed as
+		 * soon as the gap is closed.
+		 */
+		std::vector<std::pair<uint32_t, uint32_t>> reordered;
+
+		/**
+		 * Polls the error queue while completions are
+		 * outstanding and neither #read_event nor
+		 * #write_event is pending (which would be woken up by
+		 * POLLERR).
+		 */
+		TimerEvent timer;
+
+		ZeroCopyState(EventLoop &event_loop, size_t _min_size,
+			      BoundMethod<void()> callback) noexcept
+			:min_size(_min_size), timer(event_loop, callback) {}
+	};
+
+	std::unique_ptr<ZeroCopyState> zerocopy;
+
+#ifdef ENABLE_URING
+	/**
+	 * The io_uring engine; nullptr if the readiness engine
+	 * (#read_event, #write_event) is used.  See EnableUring().
+	 */
+	UringSocket *uring = nullptr;
+#endif
+
 	SocketHandler &handler;
 
 public:
 	SocketWrapper(EventLoop &event_loop, SocketHandler &_handler) noexcept
 		:read_event(event_loop, BIND_THIS_METHOD(ReadEventCallback)),
 		 write_event(event_loop, BIND_THIS_METHOD(WriteEventCallback)),
+		 read_timeout_event(event_loop, BIND_THIS_METHOD(ReadTimeoutCallback)),
 		 handler(_handler) {}
 
 	SocketWrapper(const SocketWrapper &) = delete;
@@ -88,6 +186,24 @@ public:
 
 	void Init(SocketDescriptor _fd, FdType _fd_type) noexcept;
 
+#ifdef ENABLE_URING
+	/**
+	 * Switch this socket to the io_uring engine: data is received
+	 * by receive operations into the #UringQueue's
+	 * provided buffers, and Write() copies to a buffer which is
+	 * sent at the end of the current #EventLoop iteration.  The
+	 * #SocketHandler is invoked just like with the readiness
+	 * engine.  The setting lasts until Close() or Abandon().
+	 *
+	 * Must be called after Init(), before scheduling any events.
+	 */
+	void EnableUring(UringQueue &queue) noexcept;
+
+	bool IsUring() const noexcept {
+		return uring != nullptr;
+	}
+#endif
+
 	/**
 	 * Shut down the socket gracefully, allowing the TCP stack to
 	 * complete all pending transfers.  If you call Close() without
@@ -122,9 +238,33 @@ public:
 		return fd_type;
 	}
 
+	/**
+	 * Implement the read timeout with a #CoarseTimerEvent instead
+	 * of a #SocketEvent timeout.  This makes refreshing it O(1),
+	 * but it may fire up to one TimerWheel::Tick late.  Takes
+	 * effect with the next ScheduleRead() call.
+	 */
+	void SetCoarseReadTimeout(bool value) noexcept {
+		coarse_read_timeout = value;
+	}
+
 	void ScheduleRead(const struct timeval *timeout) noexcept {
 		assert(IsValid());
 
+#ifdef ENABLE_URING
+		if (uring != nullptr) {
+			ScheduleUringRead(timeout);
+			return;
+		}
+#endif
+
+		if (coarse_read_timeout && timeout != nullptr) {
+			read_timeout = *timeout;
+			read_timeout_event.Add(read_timeout);
+			timeout = nullptr;
+		} else
+			read_timeout_event.Cancel();
+
 		if (timeout == nullptr && read_event.IsTimerPending())
 			/* work around libevent bug: event_add() should disable the
 			   timeout if tv==nullptr, but in fact it does not; workaround:
@@ -135,12 +275,27 @@ public:
 	}
 
 	void UnscheduleRead() noexcept {
+#ifdef ENABLE_URING
+		if (uring != nullptr) {
+			UnscheduleUringRead();
+			return;
+		}
+#endif
+
 		read_event.Delete();
+		read_timeout_event.Cancel();
 	}
 
 	void ScheduleWrite(const struct timeval *timeout) noexcept {
 		assert(IsValid());
 
+#ifdef ENABLE_URING
+		if (uring != nullptr) {
+			ScheduleUringWrite(timeout);
+			return;
+		}
+#endif
+
 		if (timeout == nullptr && write_event.IsTimerPending())
 			/* work around libevent bug: event_add() should disable the
 			   timeout if tv==nullptr, but in fact it does not; workaround:
@@ -151,21 +306,44 @@ public:
 	}
 
 	void UnscheduleWrite() noexcept {
+#ifdef ENABLE_URING
+		if (uring != nullptr) {
+			UnscheduleUringWrite();
+			return;
+		}
+#endif
+
 		write_event.Delete();
 	}
 
 	gcc_pure
 	bool IsReadPending() const noexcept {
+#ifdef ENABLE_URING
+		if (uring != nullptr)
+			return IsUringReadPending();
+#endif
+
 		return read_event.IsPending(SocketEvent::READ);
 	}
 
 	gcc_pure
 	bool IsWritePending() const noexcept {
+#ifdef ENABLE_URING
+		if (uring != nullptr)
+			return IsUringWritePending();
+#endif
+
 		return write_event.IsPending(SocketEvent::WRITE);
 	}
 
 	ssize_t ReadToBuffer(ForeignFifoBuffer<uint8_t> &buffer) noexcept;
 
+	/**
+	 * Receive data into several buffers with one recvmsg() call.
+	 * This is not available with the io_uring engine.
+	 */
+	ssize_t ReadV(const struct iovec *v, size_t n) noexcept;
+
 	gcc_pure
 	bool IsReadyForWriting() const noexcept;
 
@@ -176,7 +354,104 @@ public:
 	ssize_t WriteFrom(int other_fd, FdType other_fd_type,
 			  size_t length) noexcept;
 
+	/**
+	 * Writes smaller than this are copied even in zero-copy
+	 * mode, because page pinning and completion handling cost
+	 * more than copying a few kilobytes.
+	 */
+	static constexpr size_t DEFAULT_ZEROCOPY_MIN_SIZE = 16384;
+
+	/**
+	 * Enable MSG_ZEROCOPY transmission for WriteZeroCopy() (see
+	 * SO_ZEROCOPY).  This setting lasts until Close() or
+	 * Abandon().
+	 *
+	 * @return false if the socket (or the kernel) does not
+	 * support it; WriteZeroCopy() will then copy all data
+	 */
+	bool EnableZeroCopy(size_t min_size=DEFAULT_ZEROCOPY_MIN_SIZE) noexcept;
+
+	bool IsZeroCopy() const noexcept {
+		return zerocopy && zerocopy->enabled;
+	}
+
+	/**
+	 * Returns the number which will be assigned to the next
+	 * MSG_ZEROCOPY send.  Pass it to IsZeroCopyComplete() after
+	 * WriteZeroCopy().
+	 */
+	uint32_t GetZeroCopyCounter() const noexcept {
+		return zerocopy ? zerocopy->sent : 0;
+	}
+
+	/**
+	 * Has the kernel released the buffers of the WriteZeroCopy()
+	 * call which was made when GetZeroCopyCounter() returned the
+	 * given value?  Also returns true if that call did not use
+	 * MSG_ZEROCOPY.
+	 */
+	gcc_pure
+	bool IsZeroCopyComplete(uint32_t counter) const noexcept {
+		return !zerocopy ||
+			int32_t(zerocopy->completed - counter) > 0 ||
+			int32_t(zerocopy->sent - counter) <= 0;
+	}
+
+	gcc_pure
+	bool HasZeroCopyPending() const noexcept {
+		return zerocopy && zerocopy->completed != zerocopy->sent;
+	}
+
+	/**
+	 * Like WriteV(), but large writes are sent with MSG_ZEROCOPY
+	 * if EnableZeroCopy() has succeeded.  In that case, the
+	 * caller must not modify or free the data until
+	 * IsZeroCopyComplete() returns true (which will be announced
+	 * by SocketHandler::OnSocketZeroCopy()).  Completions which
+	 * are still outstanding in Close() are abandoned.
+	 */
+	ssize_t WriteZeroCopy(const struct iovec *v, size_t n) noexcept;
+
 private:
+#ifdef ENABLE_URING
+	void ScheduleUringRead(const struct timeval *timeout) noexcept;
+	void ScheduleUringWrite(const struct timeval *timeout) noexcept;
+	void UnscheduleUringRead() noexcept;
+	void UnscheduleUringWrite() noexcept;
+
+	gcc_pure
+	bool IsUringReadPending() const noexcept;
+
+	gcc_pure
+	bool IsUringWritePending() const noexcept;
+#endif
+
 	void ReadEventCallback(unsigned events) noexcept;
 	void WriteEventCallback(unsigned events) noexcept;
+	void ReadTimeoutCallback() noexcept;
+
+	/**
+	 * Merge a range of completed MSG_ZEROCOPY sends.
+	 */
+	void AddZeroCopyCompletion(uint32_t begin, uint32_t end) noexcept;
+
+	/**
+	 * Read all MSG_ZEROCOPY completions from the socket's error
+	 * queue.
+	 *
+	 * @return true if ZeroCopyState::completed has advanced
+	 */
+	bool ReceiveZeroCopyCompletions() noexcept;
+
+	/**
+	 * Receive completions, notify the #SocketHandler and re-arm
+	 * ZeroCopyState::timer if necessary.
+	 *
+	 * @return false when the socket has been closed
+	 */
+	bool HandleZeroCopyCompletions() noexcept;
+
+	void ScheduleZeroCopyPoll() noexcept;
+
+	void ZeroCopyTimerCallback() noexcept;
 };
@@ -0,0 +1,466 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "UringSocket.hxx"
+#include "SocketWrapper.hxx"
+#include "util/ForeignFifoBuffer.hxx"
+
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+
+UringSocket::UringSocket(UringQueue &_queue, SocketDescriptor _fd,
+			 SocketHandler &_handler) noexcept
+	:queue(_queue), fd(_fd), handler(&_handler),
+	 receive_operation(*this, &UringSocket::OnReceive),
+	 send_operation(*this, &UringSocket::OnSend),
+	 read_ready(queue.GetEventLoop(), BIND_THIS_METHOD(OnReadReady)),
+	 write_ready(queue.GetEventLoop(), BIND_THIS_METHOD(OnWriteReady)),
+	 read_timer(queue.GetEventLoop(), BIND_THIS_METHOD(InvokeTimeout)),
+	 write_timer(queue.GetEventLoop(), BIND_THIS_METHOD(InvokeTimeout))
+{
+}
+
+UringSocket::~UringSocket() noexcept
+{
+	assert(!receive_armed);
+	assert(!send_pending);
+
+	read_ready.Cancel();
+	write_ready.Cancel();
+	DisposeChunks();
+}
+
+void
+UringSocket::DisposeChunks() noexcept
+{
+	for (size_t i = chunk_head; i < chunks.size(); ++i)
+		queue.ReturnBuffer(chunks[i].buffer_id);
+
+	chunks.clear();
+	chunk_head = 0;
+}
+
+void
+UringSocket::CheckDelete() noexcept
+{
+	if (handler != nullptr || dispatching > 0 ||
+	    receive_armed || send_pending ||
+	    (!IsOutputEmpty() && send_error == 0))
+		return;
+
+	if (close_fd)
+		fd.Close();
+
+	delete this;
+}
+
+void
+UringSocket::Close() noexcept
+{
+	assert(handler != nullptr);
+
+	handler = nullptr;
+	UnscheduleRead();
+	UnscheduleWrite();
+	DisposeChunks();
+
+	CheckDelete();
+}
+
+void
+UringSocket::Abandon() noexcept
+{
+	close_fd = false;
+	Close();
+}
+
+void
+UringSocket::Shutdown() noexcept
+{
+	if (IsOutputEmpty())
+		shutdown(fd.Get(), SHUT_RDWR);
+	else
+		/* postpone until the output buffer has been sent */
+		shutdown_pending = true;
+}
+
+void
+UringSocket::ArmReceive() noexcept
+{
+	assert(!receive_armed);
+
+	auto *sqe = queue.GetSubmitEntry();
+	if (sqe == nullptr) {
+		receive_error = EBUSY;
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd.Get();
+	queue.PrepareBufferSelect(*sqe);
+	queue.Push(*sqe, &receive_operation);
+
+	receive_armed = true;
+}
+
+void
+UringSocket::CancelReceive() noexcept
+{
+	if (!receive_armed || receive_canceling)
+		return;
+
+	queue.Cancel(receive_operation);
+	receive_canceling = true;
+}
+
+void
+UringSocket::ScheduleRead(const struct timeval *timeout) noexcept
+{
+	assert(handler != nullptr);
+
+	read_scheduled = true;
+
+	if (timeout != nullptr) {
+		read_timeout = *timeout;
+		read_timer.Add(read_timeout);
+	} else
+		read_timer.Cancel();
+
+	if (HasInput() || receive_eof || receive_error != 0)
+		read_ready.Schedule();
+
+	if (WantReceive())
+		ArmReceive();
+}
+
+void
+UringSocket::UnscheduleRead() noexcept
+{
+	read_scheduled = false;
+	read_ready.Cancel();
+	read_timer.Cancel();
+
+	/* don't take a provided buffer which nobody consumes;
+	   ScheduleRead() arms a new receive */
+	CancelReceive();
+}
+
+void
+UringSocket::ScheduleWrite(const struct timeval *timeout) noexcept
+{
+	assert(handler != nullptr);
+
+	write_scheduled = true;
+
+	if (timeout != nullptr) {
+		write_timeout = *timeout;
+		write_timer.Add(write_timeout);
+	} else
+		write_timer.Cancel();
+
+	if (IsReadyForWriting())
+		write_ready.Schedule();
+}
+
+void
+UringSocket::UnscheduleWrite() noexcept
+{
+	write_scheduled = false;
+	write_ready.Cancel();
+	write_timer.Cancel();
+}
+
+ssize_t
+UringSocket::ReadToBuffer(ForeignFifoBuffer<uint8_t> &buffer) noexcept
+{
+	auto w = buffer.Write();
+	if (w.empty())
+		return -2;
+
+	size_t total = 0;
+	while (HasInput() && !w.empty()) {
+		auto &chunk = chunks[chunk_head];
+		const auto src = queue.GetBuffer(chunk.buffer_id,
+						 chunk.offset + chunk.length);
+		const size_t n = std::min(chunk.length, w.size);
+		memcpy(w.data, src.data + chunk.offset, n);
+		w.skip_front(n);
+		total += n;
+
+		chunk.offset += n;
+		chunk.length -= n;
+		if (chunk.length == 0) {
+			queue.ReturnBuffer(chunk.buffer_id);
+			++chunk_head;
+		}
+	}
+
+	if (chunk_head == chunks.size()) {
+		chunks.clear();
+		chunk_head = 0;
+	}
+
+	if (WantReceive())
+		/* resume after MAX_INPUT_CHUNKS had been reached */
+		ArmReceive();
+
+	if (total > 0) {
+		buffer.Append(total);
+		return total;
+	}
+
+	if (receive_eof)
+		return 0;
+
+	errno = receive_error != 0 ? receive_error : EAGAIN;
+	return -1;
+}
+
+bool
+UringSocket::IsReadyForWriting() const noexcept
+{
+	return send_error != 0 || GetOutputSpace() > 0;
+}
+
+ssize_t
+UringSocket::Write(const void *data, size_t length) noexcept
+{
+	if (send_error != 0) {
+		errno = send_error;
+		return -1;
+	}
+
+	if (!send_pending) {
+		if (IsOutputEmpty())
+			output_head = output_tail = 0;
+		else if (output_head > 0 &&
+			 length > OUTPUT_SIZE - output_tail) {
+			memmove(output, output + output_head,
+				output_tail - output_head);
+			output_tail -= output_head;
+			output_head = 0;
+		}
+	}
+
+	const size_t n = std::min(length, OUTPUT_SIZE - output_tail);
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memcpy(output + output_tail, data, n);
+	output_tail += n;
+
+	if (!send_pending)
+		queue.ScheduleFlush(*this);
+
+	return n;
+}
+
+ssize_t
+UringSocket::WriteV(const struct iovec *v, size_t n) noexcept
+{
+	size_t total = 0;
+
+	for (size_t i = 0; i < n; ++i) {
+		if (v[i].iov_len == 0)
+			continue;
+
+		ssize_t nbytes = Write(v[i].iov_base, v[i].iov_len);
+		if (nbytes < 0)
+			return total > 0 ? ssize_t(total) : nbytes;
+
+		total += nbytes;
+		if (size_t(nbytes) < v[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+
+void
+UringSocket::OnUringFlush() noexcept
+{
+	if (WantReceive())
+		/* retry after ENOBUFS */
+		ArmReceive();
+
+	if (send_pending || IsOutputEmpty() || send_error != 0)
+		return;
+
+	auto *sqe = queue.GetSubmitEntry();
+	if (sqe == nullptr) {
+		send_error = EBUSY;
+		return;
+	}
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd.Get();
+	sqe->addr = (uintptr_t)(output + output_head);
+	sqe->len = output_tail - output_head;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	queue.Push(*sqe, &send_operation);
+
+	send_pending = true;
+}
+
+void
+UringSocket::OnReceive(int res, unsigned flags) noexcept
+{
+	receive_armed = receive_canceling = false;
+
+	if (res > 0) {
+		const unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (handler != nullptr)
+			chunks.push_back({id, 0, size_t(res)});
+		else
+			queue.ReturnBuffer(id);
+	} else {
+		if (flags & IORING_CQE_F_BUFFER)
+			queue.ReturnBuffer(flags >> IORING_CQE_BUFFER_SHIFT);
+
+		if (res == 0)
+			receive_eof = true;
+		else if (res == -ENOBUFS) {
+			/* all provided buffers are in use; try again
+			   after one has been returned */
+			if (handler == nullptr)
+				CheckDelete();
+			else if (read_scheduled)
+				queue.ScheduleFlushOnBuffer(*this);
+			return;
+		} else if (res == -ECANCELED) {
+			/* canceled by UnscheduleRead() */
+			if (handler == nullptr)
+				CheckDelete();
+			else if (WantReceive())
+				ArmReceive();
+			return;
+		} else
+			receive_error = -res;
+	}
+
+	if (handler == nullptr) {
+		CheckDelete();
+		return;
+	}
+
+	if (res > 0 && read_timer.IsPending())
+		/* refresh the timeout each time data arrives */
+		read_timer.Add(read_timeout);
+
+	if (!read_scheduled)
+		return;
+
+	if (WantReceive())
+		ArmReceive();
+
+	InvokeRead();
+}
+
+void
+UringSocket::OnSend(int res, unsigned) noexcept
+{
+	assert(send_pending);
+	send_pending = false;
+
+	if (res > 0) {
+		output_head += res;
+		if (IsOutputEmpty())
+			output_head = output_tail = 0;
+	} else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		send_error = -res;
+		output_head = output_tail = 0;
+	}
+
+	if (!IsOutputEmpty() && send_error == 0)
+		queue.ScheduleFlush(*this);
+	else if (shutdown_pending) {
+		shutdown_pending = false;
+		shutdown(fd.Get(), SHUT_RDWR);
+	}
+
+	if (handler == nullptr) {
+		CheckDelete();
+		return;
+	}
+
+	if (res > 0 && write_timer.IsPending())
+		write_timer.Add(write_timeout);
+
+	if (write_scheduled && IsReadyForWriting())
+		InvokeWrite();
+}
+
+void
+UringSocket::InvokeRead() noexcept
+{
+	assert(handler != nullptr);
+
+	read_ready.Cancel();
+
+	++dispatching;
+	handler->OnSocketRead();
+	--dispatching;
+
+	CheckDelete();
+}
+
+void
+UringSocket::InvokeWrite() noexcept
+{
+	assert(handler != nullptr);
+
+	write_ready.Cancel();
+
+	++dispatching;
+	handler->OnSocketWrite();
+	--dispatching;
+
+	CheckDelete();
+}
+
+void
+UringSocket::InvokeTimeout() noexcept
+{
+	assert(handler != nullptr);
+
+	++dispatching;
+	handler->OnSocketTimeout();
+	--dispatching;
+
+	CheckDelete();
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "event/UringQueue.hxx"
+#include "event/DeferEvent.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "util/Compiler.h"
+
+#include <vector>
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct iovec;
+template<typename T> class ForeignFifoBuffer;
+class SocketHandler;
+
+/**
+ * The io_uring engine of a #SocketWrapper.  Instead of waiting for
+ * readiness and calling recv()/send(), it keeps a receive
+ * operation with provided buffers armed, and copies outgoing data
+ * into a buffer which is sent by the #UringQueue at the end of the
+ * current #EventLoop iteration.  The #SocketHandler is invoked the
+ * same way as with the readiness engine, only driven by
+ * completions.
+ *
+ * The provided buffers are shared by all sockets of the
+ * #UringQueue.  To keep one stalled reader from exhausting them (and
+ * to keep TCP backpressure working), each receive operation takes
+ * only one buffer (a multishot receive would keep filling buffers
+ * at the kernel's pace), it is canceled by UnscheduleRead(), and it
+ * is not re-armed while the socket holds #MAX_INPUT_CHUNKS
+ * unconsumed buffers.
+ *
+ * Instances are allocated on the heap by the #SocketWrapper.  Close()
+ * and Abandon() detach them from the #SocketWrapper; they delete
+ * themselves after all pending operations have completed.
+ *
+ * Timeouts are implemented with #CoarseTimerEvent and may fire up
+ * to one TimerWheel::Tick late.
+ */
+class UringSocket final : UringFlushable {
+	UringQueue &queue;
+
+	SocketDescriptor fd;
+
+	/**
+	 * The handler of the owning #SocketWrapper; nullptr after
+	 * Close() or Abandon().
+	 */
+	SocketHandler *handler;
+
+	class Operation final : public UringOperation {
+		UringSocket &socket;
+		void (UringSocket::*const method)(int res, unsigned flags) noexcept;
+
+	public:
+		Operation(UringSocket &_socket,
+			  void (UringSocket::*_method)(int, unsigned) noexcept) noexcept
+			:socket(_socket), method(_method) {}
+
+		void OnUringCompletion(int res, unsigned flags) noexcept override {
+			(socket.*method)(res, flags);
+		}
+	};
+
+	Operation receive_operation, send_operation;
+
+	DeferEvent read_ready, write_ready;
+
+	CoarseTimerEvent read_timer, write_timer;
+	struct timeval read_timeout, write_timeout;
+
+	/**
+	 * A chunk of received data in a provided buffer.
+	 */
+	struct Chunk {
+		unsigned buffer_id;
+		size_t offset, length;
+	};
+
+	/**
+	 * Received data which has not yet been consumed by
+	 * ReadToBuffer(); the first #chunk_head items have been
+	 * consumed already.
+	 */
+	std::vector<Chunk> chunks;
+	size_t chunk_head = 0;
+
+	/**
+	 * Stop receiving after this number of unconsumed chunks.
+	 */
+	static constexpr size_t MAX_INPUT_CHUNKS = 4;
+
+	/**
+	 * Outgoing data.  The range between #output_head and
+	 * #output_tail is pending; while #send_pending is set, its
+	 * beginning is owned by the kernel and must not be moved.
+	 */
+	static constexpr size_t OUTPUT_SIZE = 16384;
+	size_t output_head = 0, output_tail = 0;
+	uint8_t output[OUTPUT_SIZE];
+
+	/**
+	 * The errno value of a failed receive/send operation, or 0.
+	 */
+	int receive_error = 0, send_error = 0;
+
+	/**
+	 * Nesting level of handler invocations; while non-zero,
+	 * Close() must not delete this object.
+	 */
+	unsigned dispatching = 0;
+
+	bool receive_armed = false, send_pending = false;
+
+	/**
+	 * Has the receive operation been canceled?  Remains set
+	 * until its completion has been received.
+	 */
+	bool receive_canceling = false;
+
+	bool receive_eof = false;
+	bool read_scheduled = false, write_scheduled = false;
+
+	/**
+	 * Shutdown() was called while output was pending; shut down
+	 * the socket after it has been sent.
+	 */
+	bool shutdown_pending = false;
+
+	/**
+	 * Close the socket after all operations have completed?
+	 * Cleared by Abandon().
+	 */
+	bool close_fd = true;
+
+public:
+	UringSocket(UringQueue &_queue, SocketDescriptor _fd,
+		    SocketHandler &_handler) noexcept;
+
+	~UringSocket() noexcept;
+
+	UringSocket(const UringSocket &) = delete;
+	UringSocket &operator=(const UringSocket &) = delete;
+
+	/**
+	 * Detach from the #SocketWrapper; the socket will be closed
+	 * after all pending output has been sent.
+	 */
+	void Close() noexcept;
+
+	/**
+	 * Like Close(), but do not close the socket.  Data which has
+	 * been received but not consumed is discarded.
+	 */
+	void Abandon() noexcept;
+
+	void Shutdown() noexcept;
+
+	void ScheduleRead(const struct timeval *timeout) noexcept;
+	void UnscheduleRead() noexcept;
+
+	bool IsReadScheduled() const noexcept {
+		return read_scheduled;
+	}
+
+	void ScheduleWrite(const struct timeval *timeout) noexcept;
+	void UnscheduleWrite() noexcept;
+
+	bool IsWriteScheduled() const noexcept {
+		return write_scheduled;
+	}
+
+	/**
+	 * Has received data not yet been consumed by ReadToBuffer()?
+	 */
+	bool HasInput() const noexcept {
+		return chunk_head < chunks.size();
+	}
+
+	/**
+	 * Is all outgoing data sent?
+	 */
+	bool IsOutputEmpty() const noexcept {
+		return output_head == output_tail;
+	}
+
+	/**
+	 * Same semantics as ReceiveToBuffer(), but copies the data
+	 * which has been received already.
+	 */
+	ssize_t ReadToBuffer(ForeignFifoBuffer<uint8_t> &buffer) noexcept;
+
+	gcc_pure
+	bool IsReadyForWriting() const noexcept;
+
+	/**
+	 * Append data to the output buffer.  Returns the number of
+	 * bytes which were accepted, or -1 with errno=EAGAIN if the
+	 * output buffer is full.
+	 */
+	ssize_t Write(const void *data, size_t length) noexcept;
+
+	ssize_t WriteV(const struct iovec *v, size_t n) noexcept;
+
+private:
+	/**
+	 * Should a receive operation be armed now?
+	 */
+	gcc_pure
+	bool WantReceive() const noexcept {
+		return handler != nullptr && read_scheduled &&
+			!receive_armed && !receive_eof && receive_error == 0 &&
+			chunks.size() - chunk_head < MAX_INPUT_CHUNKS;
+	}
+
+	void ArmReceive() noexcept;
+	void CancelReceive() noexcept;
+	void DisposeChunks() noexcept;
+
+	/**
+	 * Delete this object if it has been detached and no
+	 * operation is pending.
+	 */
+	void CheckDelete() noexcept;
+
+	size_t GetOutputSpace() const noexcept {
+		/* while a send is pending, the buffer cannot be
+		   shifted */
+		return send_pending
+			? OUTPUT_SIZE - output_tail
+			: OUTPUT_SIZE - (output_tail - output_head);
+	}
+
+	void OnReceive(int res, unsigned flags) noexcept;
+	void OnSend(int res, unsigned flags) noexcept;
+
+	void InvokeRead() noexcept;
+	void InvokeWrite() noexcept;
+	void InvokeTimeout() noexcept;
+
+	void OnReadReady() noexcept {
+		if (read_scheduled)
+			InvokeRead();
+	}
+
+	void OnWriteReady() noexcept {
+		if (write_scheduled)
+			InvokeWrite();
+	}
+
+	/* virtual methods from class UringFlushable */
+	void OnUringFlush() noexcept override;
+};
@@ -40,6 +40,7 @@
 #include <assert.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 namespace Cares {
 
@@ -49,7 +50,7 @@ class Channel::Socket {
 
 	public:
 		Socket(Channel &_channel,
-		       evutil_socket_t fd, unsigned events) noexcept
+		       int fd, unsigned events) noexcept
 			:channel(_channel),
 			 event(channel.GetEventLoop(), fd, events,
 			       BIND_THIS_METHOD(OnSocket)) {
@@ -124,7 +125,7 @@ Channel::DeferredProcess() noexcept
 }
 
 void
-Channel::OnSocket(evutil_socket_t fd, unsigned events) noexcept
+Channel::OnSocket(int fd, unsigned events) noexcept
 {
 	if (events & SocketEvent::READ)
 		FD_SET(fd, &read_ready);
@@ -87,7 +87,7 @@ private:
 		defer_process.Schedule();
 	}
 
-	void OnSocket(evutil_socket_t fd, unsigned events) noexcept;
+	void OnSocket(int fd, unsigned events) noexcept;
 	void OnTimeout() noexcept;
 };
 
@@ -33,6 +33,8 @@
 #include "NetstringClient.hxx"
 #include "util/ConstBuffer.hxx"
 
+#include <stdexcept>
+
 static constexpr timeval send_timeout{10, 0};
 static constexpr timeval recv_timeout{60, 0};
 static constexpr timeval busy_timeout{5, 0};
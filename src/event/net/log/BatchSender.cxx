@@ -0,0 +1,138 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "BatchSender.hxx"
+#include "net/log/Send.hxx"
+
+namespace Net {
+namespace Log {
+
+constexpr size_t BatchSender::DEFAULT_MAX_SIZE;
+
+BatchSender::BatchSender(EventLoop &event_loop, SocketDescriptor _socket,
+			 size_t capacity, size_t _flush_threshold,
+			 size_t max_size)
+	:socket(_socket),
+	 event(event_loop, socket.Get(), SocketEvent::WRITE,
+	       BIND_THIS_METHOD(OnSocketReady)),
+	 defer_flush(event_loop, BIND_THIS_METHOD(Flush)),
+	 queue(capacity, max_size),
+	 flush_threshold(_flush_threshold)
+{
+}
+
+BatchSender::~BatchSender() noexcept
+{
+	Flush();
+
+	defer_flush.Cancel();
+	event.Delete();
+}
+
+void
+BatchSender::Send(const Datagram &d) noexcept
+{
+	auto buffer = queue.Prepare();
+	if (buffer.IsNull()) {
+		++stats.dropped;
+		return;
+	}
+
+	const size_t size = Serialize(buffer.data, buffer.size, d);
+	if (size == 0) {
+		/* too large for the queue: send it directly, but
+		   only if that does not overtake queued datagrams */
+		Flush();
+		if (!queue.IsEmpty()) {
+			++stats.dropped;
+			return;
+		}
+
+		++stats.oversized;
+
+		try {
+			Net::Log::Send(socket, d);
+			++stats.sent;
+		} catch (...) {
+			++stats.errors;
+		}
+
+		return;
+	}
+
+	queue.Commit(SocketAddress::Null(), size);
+
+	if (queue.GetPending() >= flush_threshold)
+		Flush();
+	else
+		defer_flush.Schedule();
+}
+
+void
+BatchSender::Flush() noexcept
+{
+	defer_flush.Cancel();
+
+	while (!queue.IsEmpty()) {
+		++stats.flushes;
+
+		const size_t before = queue.GetPending();
+
+		try {
+			queue.Send(socket);
+		} catch (...) {
+			/* the failed datagram has been discarded;
+			   continue with the next one */
+			++stats.errors;
+			stats.sent += before - queue.GetPending() - 1;
+			continue;
+		}
+
+		stats.sent += before - queue.GetPending();
+		break;
+	}
+
+	if (queue.IsEmpty())
+		event.Delete();
+	else
+		/* the socket is congested: wait until it becomes
+		   writable */
+		event.Add();
+}
+
+void
+BatchSender::OnSocketReady(unsigned) noexcept
+{
+	Flush();
+}
+
+}}
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "event/SocketEvent.hxx"
+#include "event/DeferEvent.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "net/MultiSendMessage.hxx"
+
+#include <stddef.h>
+
+namespace Net {
+namespace Log {
+
+struct Datagram;
+
+struct BatchSenderStats {
+	/**
+	 * The number of datagrams which were submitted to the kernel.
+	 */
+	size_t sent = 0;
+
+	/**
+	 * The number of datagrams which were discarded because the
+	 * queue was full, or because they were too large for the
+	 * queue while older datagrams were still waiting for the
+	 * socket.
+	 */
+	size_t dropped = 0;
+
+	/**
+	 * The number of datagrams which were discarded because of a
+	 * send error.
+	 */
+	size_t errors = 0;
+
+	/**
+	 * The number of datagrams which were too large for the queue
+	 * and were sent directly.
+	 */
+	size_t oversized = 0;
+
+	/**
+	 * The number of sendmmsg() calls.
+	 */
+	size_t flushes = 0;
+};
+
+/**
+ * Sends log datagrams to a Pond server in batches: Send() serializes
+ * the datagram into a preallocated queue, which is flushed with one
+ * sendmmsg() call at the end of the current #EventLoop iteration, or
+ * as soon as a configurable number of datagrams has been queued.
+ *
+ * Send() never blocks: if the queue is full (because the socket is
+ * congested), new datagrams are dropped and counted in
+ * #BatchSenderStats.  Datagrams are never reordered.
+ */
+class BatchSender {
+	SocketDescriptor socket;
+
+	SocketEvent event;
+
+	DeferEvent defer_flush;
+
+	MultiSendMessage queue;
+
+	const size_t flush_threshold;
+
+	BatchSenderStats stats;
+
+public:
+	/**
+	 * The default maximum size of one serialized datagram.
+	 */
+	static constexpr size_t DEFAULT_MAX_SIZE = 4096;
+
+	/**
+	 * @param _socket a datagram socket connected to a Pond server
+	 * (owned by caller)
+	 * @param capacity the maximum number of queued datagrams
+	 * @param _flush_threshold flush immediately after this many
+	 * datagrams have been queued
+	 * @param max_size the maximum size of one serialized
+	 * datagram; larger ones bypass the queue (if it is empty)
+	 */
+	BatchSender(EventLoop &event_loop, SocketDescriptor _socket,
+		    size_t capacity=256, size_t _flush_threshold=64,
+		    size_t max_size=DEFAULT_MAX_SIZE);
+
+	~BatchSender() noexcept;
+
+	BatchSender(const BatchSender &) = delete;
+	BatchSender &operator=(const BatchSender &) = delete;
+
+	const BatchSenderStats &GetStats() const noexcept {
+		return stats;
+	}
+
+	/**
+	 * @return the number of datagrams which have not yet been
+	 * sent
+	 */
+	size_t GetPending() const noexcept {
+		return queue.GetPending();
+	}
+
+	/**
+	 * Queue a log datagram.  Errors are not reported; they are
+	 * only counted in #BatchSenderStats.
+	 */
+	void Send(const Datagram &d) noexcept;
+
+	/**
+	 * Send all queued datagrams now (as far as the socket
+	 * allows).
+	 */
+	void Flush() noexcept;
+
+private:
+	void OnSocketReady(unsigned events) noexcept;
+};
+
+}}
@@ -44,7 +44,7 @@ PipeAdapter::OnLine(WritableBuffer<char> line) noexcept
 
 	// TODO: erase/quote "dangerous" characters?
 
-	datagram.SetTimestamp(std::chrono::system_clock::now());
+	datagram.SetTimestamp(GetEventLoop().SystemNow());
 
 	datagram.message = {line.data, line.size};
 
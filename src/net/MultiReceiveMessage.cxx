@@ -34,26 +34,43 @@
 #include "SocketDescriptor.hxx"
 #include "system/Error.hxx"
 
+#include <algorithm>
+
+#include <assert.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 MultiReceiveMessage::MultiReceiveMessage(size_t _allocated_datagrams,
 					 size_t _max_payload_size,
 					 size_t _max_cmsg_size,
-					 size_t _max_fds)
+					 size_t _max_fds,
+					 bool _gro)
 	:allocated_datagrams(_allocated_datagrams),
-	 max_payload_size(_max_payload_size), max_cmsg_size(_max_cmsg_size),
+	 max_payload_size(_max_payload_size),
+	 max_cmsg_size(_max_cmsg_size + (_gro ? CMSG_SPACE(sizeof(int)) : 0)),
 	 max_fds(_max_fds),
-	 buffer(allocated_datagrams * (max_payload_size + max_cmsg_size
+	 gro(_gro),
+	 buffer(allocated_datagrams * (max_cmsg_size
 				       + sizeof(struct mmsghdr)
-				       + sizeof(struct sockaddr_storage)
-				       + sizeof(struct iovec))),
+				       + sizeof(struct iovec)
+				       + sizeof(struct sockaddr_storage))),
 	 fds(max_fds > 0
 	     ? new UniqueFileDescriptor[allocated_datagrams * max_fds]
-	     : nullptr),
-	 datagrams(new Datagram[allocated_datagrams])
+	     : nullptr)
 {
+	datagrams.reserve(allocated_datagrams);
+
+	slots.reserve(allocated_datagrams);
+	for (size_t i = 0; i < allocated_datagrams; ++i)
+		slots.emplace_back(NewSlot());
+
 	auto *m = GetMmsg();
-	auto *v = (struct iovec *)(m + allocated_datagrams);
+	auto *v = GetIovec();
 	auto *a = (struct sockaddr_storage *)(v + allocated_datagrams);
 
 	/* initialize attributes which will not be modified by
@@ -73,10 +90,61 @@ MultiReceiveMessage::MultiReceiveMessage(size_t _allocated_datagrams,
 	}
 }
 
+struct iovec *
+MultiReceiveMessage::GetIovec() noexcept
+{
+	return (struct iovec *)(GetMmsg() + allocated_datagrams);
+}
+
+const MultiReceiveMessage::Slot &
+MultiReceiveMessage::FindSlot(const void *p) const noexcept
+{
+	for (const auto &i : slots)
+		if (p >= i.get() && p < i.get() + max_payload_size)
+			return i;
+
+	assert(false);
+	gcc_unreachable();
+}
+
+void
+MultiReceiveMessage::RotateSlots()
+{
+	/* recycle slots which have been released */
+	for (auto i = retained_slots.begin(); i != retained_slots.end();) {
+		if (i->use_count() == 1) {
+			if (spare_slots.size() < max_spare_slots)
+				spare_slots.emplace_back(std::move(*i));
+			i = retained_slots.erase(i);
+		} else
+			++i;
+	}
+
+	auto *v = GetIovec();
+	for (size_t i = 0; i < allocated_datagrams; ++i) {
+		if (slots[i].use_count() == 1)
+			continue;
+
+		/* this slot is referenced by a RetainedPayload;
+		   replace it */
+		Slot replacement;
+		if (!spare_slots.empty()) {
+			replacement = std::move(spare_slots.back());
+			spare_slots.pop_back();
+		} else
+			replacement = NewSlot();
+
+		retained_slots.push_back(slots[i]);
+		slots[i] = std::move(replacement);
+		v[i].iov_base = GetPayload(i);
+	}
+}
+
 bool
 MultiReceiveMessage::Receive(SocketDescriptor s)
 {
 	Clear();
+	RotateSlots();
 
 	auto *m = GetMmsg();
 
@@ -102,14 +170,17 @@ MultiReceiveMessage::Receive(SocketDescriptor s)
 
 	for (size_t i = 0; i < n_datagrams; ++i) {
 		auto &mh = m[i].msg_hdr;
-		auto &d = datagrams[i];
+		datagrams.emplace_back();
+		auto &d = datagrams.back();
 		d.address = SocketAddress((const struct sockaddr *)mh.msg_name,
 					  mh.msg_namelen);
 		d.payload = {GetPayload(i), m[i].msg_len};
 		d.cred = nullptr;
-		d.fds.data = &fds[n_fds];
+		d.fds.data = fds.get() + n_fds;
 		d.fds.size = 0;
 
+		size_t segment_size = 0;
+
 #ifdef __clang__
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"
@@ -133,12 +204,18 @@ MultiReceiveMessage::Receive(SocketDescriptor s)
 					} else
 						fd.Close();
 				}
+			} else if (gro && cmsg->cmsg_level == SOL_UDP &&
+				   cmsg->cmsg_type == UDP_GRO) {
+				segment_size = *(const int *)CMSG_DATA(cmsg);
 			}
 		}
 
 #ifdef __clang__
 #pragma GCC diagnostic pop
 #endif
+
+		if (segment_size > 0 && d.payload.size > segment_size)
+			Split(segment_size);
 	}
 
 	return true;
@@ -155,7 +232,39 @@ MultiReceiveMessage::Clear()
 	}
 
 	n_datagrams = 0;
+	datagrams.clear();
 
 	while (n_fds > 0)
 		fds[--n_fds].Close();
 }
+
+void
+MultiReceiveMessage::Split(size_t segment_size)
+{
+	/* copy, because emplace_back() may invalidate the
+	   reference */
+	const Datagram super = datagrams.back();
+
+	auto *p = (uint8_t *)super.payload.data;
+	size_t remaining = super.payload.size;
+
+	/* the first segment replaces the coalesced buffer */
+	datagrams.back().payload.size = segment_size;
+	p += segment_size;
+	remaining -= segment_size;
+
+	while (remaining > 0) {
+		const size_t size = std::min(remaining, segment_size);
+
+		datagrams.emplace_back();
+		auto &d = datagrams.back();
+		d.address = super.address;
+		d.payload = {p, size};
+		d.cred = super.cred;
+		d.fds.data = nullptr;
+		d.fds.size = 0;
+
+		p += size;
+		remaining -= size;
+	}
+}
@@ -37,8 +37,12 @@
 #include "io/UniqueFileDescriptor.hxx"
 #include "util/OffsetPointer.hxx"
 #include "util/WritableBuffer.hxx"
+#include "util/Compiler.h"
 
 #include <memory>
+#include <vector>
+
+#include <stdint.h>
 
 class SocketDescriptor;
 
@@ -46,14 +50,67 @@ class SocketDescriptor;
  * This class helps to receive many network datagrams from a socket
  * efficiently.  To do that, it allocates and manages buffers to be
  * used by recvmmsg().
+ *
+ * Optionally, UDP generic receive offload (GRO) is supported: each
+ * buffer may then contain several coalesced datagrams, which are
+ * split and presented as separate #Datagram instances.
+ *
+ * A payload may be kept beyond Clear() without copying it by calling
+ * Retain().  Each datagram is received into its own buffer (a
+ * "slot"); a retained slot is replaced by a spare one before the
+ * next Receive() call, and it is recycled after all
+ * #RetainedPayload instances referring to it have been destroyed.
+ * Only the slot containing a retained payload is pinned, not the
+ * other datagrams' buffers.
  */
 class MultiReceiveMessage {
 	const size_t allocated_datagrams;
 	const size_t max_payload_size, max_cmsg_size, max_fds;
+
+	/**
+	 * The number of buffers filled by recvmmsg().
+	 */
 	size_t n_datagrams = 0;
 
+	const bool gro;
+
+	/**
+	 * Contains the control message buffers and the arrays of
+	 * "struct mmsghdr", "struct iovec" and "struct
+	 * sockaddr_storage".
+	 */
 	LargeAllocation buffer;
 
+	/**
+	 * A payload buffer of #max_payload_size bytes.  It is in use
+	 * if there is a #RetainedPayload referring to it (i.e. its
+	 * use_count() is larger than 1).
+	 */
+	typedef std::shared_ptr<uint8_t> Slot;
+
+	/**
+	 * The slots which receive datagrams; one for each of
+	 * #allocated_datagrams.
+	 */
+	std::vector<Slot> slots;
+
+	/**
+	 * Slots which have been replaced in #slots because they were
+	 * in use.  They are moved to #spare_slots after they have
+	 * been released.
+	 */
+	std::vector<Slot> retained_slots;
+
+	/**
+	 * Unused slots which are kept for replacing retained ones.
+	 */
+	std::vector<Slot> spare_slots;
+
+	/**
+	 * The maximum size of #spare_slots.
+	 */
+	size_t max_spare_slots = 0;
+
 	std::unique_ptr<UniqueFileDescriptor[]> fds;
 	size_t n_fds = 0;
 
@@ -76,18 +133,69 @@ public:
 
 	typedef Datagram *iterator;
 
+	/**
+	 * A payload which was retained with Retain().  It remains
+	 * valid as long as this object exists, even after the
+	 * #MultiReceiveMessage has been destroyed.
+	 */
+	struct RetainedPayload {
+		std::shared_ptr<const void> lease;
+		WritableBuffer<void> payload;
+	};
+
 private:
-	std::unique_ptr<Datagram[]> datagrams;
+	std::vector<Datagram> datagrams;
 
 public:
+	/**
+	 * @param _gro parse UDP_GRO control messages and split
+	 * coalesced datagrams; the caller is responsible for enabling
+	 * GRO on the socket with SocketDescriptor::SetUdpGro(), and
+	 * #_max_payload_size should be large enough for a coalesced
+	 * buffer (up to 64 kB)
+	 */
 	MultiReceiveMessage(size_t _allocated_datagrams,
 			    size_t _max_payload_size,
 			    size_t _max_cmsg_size=0,
-			    size_t _max_fds=0);
+			    size_t _max_fds=0,
+			    bool _gro=false);
 
 	MultiReceiveMessage(MultiReceiveMessage &&) noexcept = default;
 	MultiReceiveMessage &operator=(MultiReceiveMessage &&) noexcept = default;
 
+	/**
+	 * Set the number of unused payload slots which are kept for
+	 * replacing retained ones.  Additional slots are allocated on
+	 * demand, and released slots exceeding this number are
+	 * freed.
+	 */
+	void SetMaxSpareSlots(size_t n) noexcept {
+		max_spare_slots = n;
+	}
+
+	/**
+	 * @return the number of payload slots owned by this object,
+	 * including unused spare slots and retained slots which have
+	 * not yet been recycled
+	 */
+	size_t GetSlotCount() const noexcept {
+		return slots.size() + retained_slots.size() +
+			spare_slots.size();
+	}
+
+	/**
+	 * Keep the payload of the given #Datagram (which must have
+	 * been returned by the current iteration) beyond the next
+	 * Clear()/Receive() call, without copying it.
+	 *
+	 * Throws std::bad_alloc on error.
+	 */
+	RetainedPayload Retain(const Datagram &d) const {
+		return {std::shared_ptr<const void>(FindSlot(d.payload.data),
+						    d.payload.data),
+			d.payload};
+	}
+
 	/**
 	 * Receive new datagrams.  Any previous ones will be discarded.
 	 *
@@ -105,28 +213,55 @@ public:
 	void Clear();
 
 	iterator begin() {
-		return datagrams.get();
+		return datagrams.data();
 	}
 
 	iterator end() {
-		return datagrams.get() + n_datagrams;
+		return datagrams.data() + datagrams.size();
 	}
 
 private:
-	void *At(size_t offset) {
-		return OffsetPointer(buffer.get(), offset);
+	/**
+	 * Split the last #Datagram (a buffer coalesced by UDP GRO)
+	 * into segments of the given size.
+	 */
+	void Split(size_t segment_size);
+
+	/**
+	 * Find the slot containing the given payload pointer.
+	 */
+	gcc_pure
+	const Slot &FindSlot(const void *p) const noexcept;
+
+	/**
+	 * Allocate a new payload slot.
+	 *
+	 * Throws std::bad_alloc on error.
+	 */
+	Slot NewSlot() const {
+		return Slot(new uint8_t[max_payload_size],
+			    std::default_delete<uint8_t[]>());
 	}
 
+	/**
+	 * Replace all slots which are in use by a #RetainedPayload,
+	 * and recycle the ones which have been released.
+	 *
+	 * Throws std::bad_alloc on error.
+	 */
+	void RotateSlots();
+
 	void *GetPayload(size_t i) noexcept {
-		return At(i * max_payload_size);
+		return slots[i].get();
 	}
 
 	void *GetCmsg(size_t i) noexcept {
-		return OffsetPointer(GetPayload(allocated_datagrams),
-				     i * max_cmsg_size);
+		return OffsetPointer(buffer.get(), i * max_cmsg_size);
 	}
 
 	struct mmsghdr *GetMmsg() noexcept {
 		return (struct mmsghdr *)GetCmsg(allocated_datagrams);
 	}
+
+	struct iovec *GetIovec() noexcept;
 };
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MultiSendMessage.hxx"
+#include "SocketDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+MultiSendMessage::MultiSendMessage(size_t _allocated_datagrams,
+				   size_t _max_payload_size)
+	:allocated_datagrams(_allocated_datagrams),
+	 max_payload_size(_max_payload_size),
+	 buffer(allocated_datagrams * (max_payload_size
+				       + sizeof(struct mmsghdr)
+				       + sizeof(struct sockaddr_storage)
+				       + sizeof(struct iovec)))
+{
+	auto *m = GetMmsg();
+	auto *v = (struct iovec *)(m + allocated_datagrams);
+	auto *a = (struct sockaddr_storage *)(v + allocated_datagrams);
+
+	/* initialize attributes which will not be modified by
+	   Add() */
+	for (size_t i = 0; i < allocated_datagrams; ++i) {
+		v[i] = {GetPayload(i), 0};
+
+		m[i].msg_hdr = {
+			.msg_name = (struct sockaddr *)&a[i],
+			.msg_namelen = 0,
+			.msg_iov = &v[i],
+			.msg_iovlen = 1,
+			.msg_control = nullptr,
+			.msg_controllen = 0,
+			.msg_flags = 0,
+		};
+	}
+}
+
+bool
+MultiSendMessage::Add(SocketAddress address,
+		      const void *data, size_t data_length) noexcept
+{
+	if (IsFull() || data_length > max_payload_size ||
+	    address.GetSize() > sizeof(struct sockaddr_storage))
+		return false;
+
+	memcpy(GetPayload(GetTail()), data, data_length);
+	Commit(address, data_length);
+	return true;
+}
+
+void
+MultiSendMessage::Commit(SocketAddress address, size_t length) noexcept
+{
+	assert(!IsFull());
+	assert(length <= max_payload_size);
+	assert(address.GetSize() <= sizeof(struct sockaddr_storage));
+
+	auto &mh = GetMmsg()[GetTail()].msg_hdr;
+	if (address.IsNull()) {
+		mh.msg_namelen = 0;
+	} else {
+		memcpy(mh.msg_name, address.GetAddress(), address.GetSize());
+		mh.msg_namelen = address.GetSize();
+	}
+
+	mh.msg_iov->iov_len = length;
+
+	++n_pending;
+}
+
+void
+MultiSendMessage::Consume(size_t n) noexcept
+{
+	assert(n <= n_pending);
+
+	n_pending -= n;
+
+	if (n_pending == 0)
+		/* start over at the beginning, which allows the
+		   longest contiguous sendmmsg() batches */
+		head = 0;
+	else {
+		head += n;
+		if (head >= allocated_datagrams)
+			head -= allocated_datagrams;
+	}
+}
+
+size_t
+MultiSendMessage::Send(SocketDescriptor s)
+{
+	auto *m = GetMmsg();
+	size_t n_sent = 0;
+
+	while (!IsEmpty()) {
+		/* sendmmsg() needs a contiguous array; if the ring
+		   wraps around, the rest is sent by the next
+		   iteration */
+		size_t n = allocated_datagrams - head;
+		if (n > n_pending)
+			n = n_pending;
+
+		int result = sendmmsg(s.Get(), m + head, n,
+				      MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno == EAGAIN)
+				break;
+
+			const int e = errno;
+
+			/* discard the datagram which has failed so
+			   the next call can continue with the
+			   remaining ones */
+			Consume(1);
+
+			throw MakeErrno(e, "sendmmsg() failed");
+		}
+
+		/* a partial result means the socket would block or
+		   the next datagram failed; the next iteration will
+		   tell */
+		assert(result > 0);
+		Consume(result);
+		n_sent += result;
+	}
+
+	return n_sent;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "SocketAddress.hxx"
+#include "system/LargeAllocation.hxx"
+#include "util/OffsetPointer.hxx"
+#include "util/WritableBuffer.hxx"
+
+#include <stddef.h>
+
+class SocketDescriptor;
+
+/**
+ * This class helps to send many network datagrams to a socket
+ * efficiently.  Datagrams are queued with Add() (which copies the
+ * payload and the destination address into buffers managed by this
+ * object) and then submitted with a single sendmmsg() call.  It is
+ * the counterpart of #MultiReceiveMessage.
+ *
+ * The slots form a ring buffer: slots of datagrams which have been
+ * sent can be reused immediately, even while later datagrams are
+ * still waiting for the socket to become writable.
+ */
+class MultiSendMessage {
+	const size_t allocated_datagrams;
+	const size_t max_payload_size;
+
+	/**
+	 * The slot of the first datagram which has not yet been
+	 * sent.
+	 */
+	size_t head = 0;
+
+	/**
+	 * The number of datagrams which have been queued and not yet
+	 * sent.
+	 */
+	size_t n_pending = 0;
+
+	LargeAllocation buffer;
+
+public:
+	/**
+	 * Throws std::bad_alloc on error.
+	 */
+	MultiSendMessage(size_t _allocated_datagrams,
+			 size_t _max_payload_size);
+
+	MultiSendMessage(MultiSendMessage &&) noexcept = default;
+
+	size_t GetMaxPayloadSize() const noexcept {
+		return max_payload_size;
+	}
+
+	bool IsEmpty() const noexcept {
+		return n_pending == 0;
+	}
+
+	bool IsFull() const noexcept {
+		return n_pending == allocated_datagrams;
+	}
+
+	/**
+	 * @return the number of datagrams which are waiting to be
+	 * sent
+	 */
+	size_t GetPending() const noexcept {
+		return n_pending;
+	}
+
+	/**
+	 * Copy a datagram into the queue.
+	 *
+	 * @return false if the queue is full or if the payload is
+	 * larger than the maximum payload size
+	 */
+	bool Add(SocketAddress address,
+		 const void *data, size_t data_length) noexcept;
+
+	/**
+	 * Obtain the payload buffer of the next datagram, to allow
+	 * the caller to serialize directly into it.  After that,
+	 * call Commit().
+	 *
+	 * @return the buffer, or nullptr if the queue is full
+	 */
+	WritableBuffer<void> Prepare() noexcept {
+		if (IsFull())
+			return nullptr;
+
+		return {GetPayload(GetTail()), max_payload_size};
+	}
+
+	/**
+	 * Enqueue the datagram which was written into the buffer
+	 * returned by Prepare().
+	 *
+	 * @param address the destination address; may be
+	 * #SocketAddress::Null() for connected sockets
+	 */
+	void Commit(SocketAddress address, size_t length) noexcept;
+
+	/**
+	 * Send as many queued datagrams as possible.  Datagrams which
+	 * could not be sent because the socket would block remain in
+	 * the queue; call this method again once the socket is
+	 * writable.
+	 *
+	 * Throws on error; the datagram which has failed is discarded
+	 * from the queue.
+	 *
+	 * @return the number of datagrams which were sent
+	 */
+	size_t Send(SocketDescriptor s);
+
+	/**
+	 * Discard all queued datagrams.
+	 */
+	void Clear() noexcept {
+		head = n_pending = 0;
+	}
+
+private:
+	/**
+	 * @return the slot for the next datagram
+	 */
+	size_t GetTail() const noexcept {
+		size_t tail = head + n_pending;
+		if (tail >= allocated_datagrams)
+			tail -= allocated_datagrams;
+		return tail;
+	}
+
+	/**
+	 * Remove datagrams which have been sent (or which have
+	 * failed) from the head of the ring.
+	 */
+	void Consume(size_t n) noexcept;
+
+	void *At(size_t offset) const noexcept {
+		return OffsetPointer(buffer.get(), offset);
+	}
+
+	void *GetPayload(size_t i) const noexcept {
+		return At(i * max_payload_size);
+	}
+
+	struct mmsghdr *GetMmsg() const noexcept {
+		return (struct mmsghdr *)GetPayload(allocated_datagrams);
+	}
+};
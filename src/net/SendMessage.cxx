@@ -34,6 +34,15 @@
 #include "SocketDescriptor.hxx"
 #include "system/Error.hxx"
 
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
 /**
  * Wrapper for sendmsg().
  *
@@ -48,3 +57,32 @@ SendMessage(SocketDescriptor s, const MessageHeader &mh, int flags)
 
 	return (size_t)nbytes;
 }
+
+size_t
+SendSegmentedMessage(SocketDescriptor s, const MessageHeader &mh,
+		     unsigned segment_size, int flags)
+{
+	assert(mh.msg_control == nullptr);
+
+	union {
+		char buffer[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} u;
+
+	struct msghdr m = mh;
+	m.msg_control = u.buffer;
+	m.msg_controllen = sizeof(u.buffer);
+
+	auto *cmsg = CMSG_FIRSTHDR(&m);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	const uint16_t value = segment_size;
+	memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+
+	auto nbytes = sendmsg(s.Get(), &m, flags);
+	if (nbytes < 0)
+		throw MakeErrno("sendmsg() failed");
+
+	return (size_t)nbytes;
+}
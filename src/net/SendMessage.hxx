@@ -67,3 +67,18 @@ public:
  */
 size_t
 SendMessage(SocketDescriptor s, const MessageHeader &mh, int flags);
+
+/**
+ * Send a large buffer as a series of UDP datagrams of the given size
+ * (the last one may be shorter) with one sendmsg() call, using UDP
+ * generic segmentation offload (UDP_SEGMENT).  The kernel (or the
+ * network card) splits the buffer, which is much cheaper than
+ * sending each datagram separately.
+ *
+ * The #MessageHeader must not have control data.
+ *
+ * Throws on error.
+ */
+size_t
+SendSegmentedMessage(SocketDescriptor s, const MessageHeader &mh,
+		     unsigned segment_size, int flags);
@@ -106,6 +106,10 @@ SocketConfig::Create(int type) const
 		throw FormatErrno(e, "Failed to bind to %s", address_string);
 	}
 
+	if (reuse_port && reuse_port_cpu_steering > 0 &&
+	    !fd.SetReusePortCpuModulo(reuse_port_cpu_steering))
+		throw MakeErrno("Failed to attach SO_REUSEPORT program");
+
 	if (!multicast_group.IsNull() &&
 	    !fd.AddMembership(multicast_group)) {
 		const int e = errno;
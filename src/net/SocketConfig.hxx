@@ -61,6 +61,15 @@ struct SocketConfig {
 
 	bool reuse_port = false;
 
+	/**
+	 * If non-zero (requires #reuse_port), attach a program to the
+	 * SO_REUSEPORT group which selects the socket by the CPU
+	 * which received the connection.  The value is the number of
+	 * sockets in the group; see
+	 * SocketDescriptor::SetReusePortCpuModulo().
+	 */
+	unsigned reuse_port_cpu_steering = 0;
+
 	bool free_bind = false;
 
 	bool pass_cred = false;
@@ -45,6 +45,24 @@
 #include <netinet/tcp.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#include <vector>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
 int
 SocketDescriptor::GetType() const noexcept
 {
@@ -286,6 +304,19 @@ SocketDescriptor::SetTcpFastOpen(int qlen)
 	return SetOption(SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
 }
 
+bool
+SocketDescriptor::SetUdpGro(bool value)
+{
+	return SetBoolOption(SOL_UDP, UDP_GRO, value);
+}
+
+bool
+SocketDescriptor::SetUdpSegment(unsigned size)
+{
+	const int value = size;
+	return SetOption(SOL_UDP, UDP_SEGMENT, &value, sizeof(value));
+}
+
 bool
 SocketDescriptor::AddMembership(const IPv4Address &address)
 {
@@ -318,6 +349,77 @@ SocketDescriptor::AddMembership(SocketAddress address)
 	}
 }
 
+static constexpr struct sock_filter
+BpfStatement(uint16_t code, uint32_t k)
+{
+	return {code, 0, 0, k};
+}
+
+static constexpr struct sock_filter
+BpfJump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+	return {code, jt, jf, k};
+}
+
+static bool
+AttachReusePortFilter(int fd, const struct sock_filter *code, size_t n)
+{
+	const struct sock_fprog prog = {
+		(unsigned short)n,
+		const_cast<struct sock_filter *>(code),
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &prog, sizeof(prog)) == 0;
+}
+
+bool
+SocketDescriptor::SetReusePortCpuModulo(unsigned n)
+{
+	assert(n > 0);
+
+	const struct sock_filter code[] = {
+		/* A = current CPU */
+		BpfStatement(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+		/* A = A % n */
+		BpfStatement(BPF_ALU|BPF_MOD|BPF_K, n),
+		/* return A */
+		BpfStatement(BPF_RET|BPF_A, 0),
+	};
+
+	return AttachReusePortFilter(fd, code, sizeof(code) / sizeof(code[0]));
+}
+
+bool
+SocketDescriptor::SetReusePortCpuMap(const int *cpus, unsigned n)
+{
+	assert(n > 0);
+
+	if (n > (BPF_MAXINSNS - 2) / 2) {
+		errno = E2BIG;
+		return false;
+	}
+
+	std::vector<struct sock_filter> code;
+	code.reserve(2 + 2 * n);
+
+	/* A = current CPU */
+	code.push_back(BpfStatement(BPF_LD|BPF_W|BPF_ABS,
+				    SKF_AD_OFF + SKF_AD_CPU));
+
+	for (unsigned i = 0; i < n; ++i) {
+		/* if (A == cpus[i]) return i */
+		code.push_back(BpfJump(BPF_JMP|BPF_JEQ|BPF_K, cpus[i], 0, 1));
+		code.push_back(BpfStatement(BPF_RET|BPF_K, i));
+	}
+
+	/* an out-of-range index lets the kernel fall back to its
+	   hash */
+	code.push_back(BpfStatement(BPF_RET|BPF_K, n));
+
+	return AttachReusePortFilter(fd, code.data(), code.size());
+}
+
 #endif
 
 bool
@@ -182,9 +182,41 @@ public:
 
 	bool SetTcpFastOpen(int qlen=16);
 
+	/**
+	 * Enable UDP generic receive offload (UDP_GRO): the kernel
+	 * may coalesce several datagrams from the same peer into one
+	 * buffer, and reports the segment size in a control message.
+	 * See MultiReceiveMessage.
+	 */
+	bool SetUdpGro(bool value=true);
+
+	/**
+	 * Set the default UDP generic segmentation offload size
+	 * (UDP_SEGMENT) for all send calls on this socket; 0 disables
+	 * it.
+	 */
+	bool SetUdpSegment(unsigned size);
+
 	bool AddMembership(const IPv4Address &address);
 	bool AddMembership(const IPv6Address &address);
 	bool AddMembership(SocketAddress address);
+
+	/**
+	 * Attach a classic BPF program to this socket's SO_REUSEPORT
+	 * group (SO_ATTACH_REUSEPORT_CBPF) which selects the socket
+	 * by the CPU which received the packet: connections received
+	 * on CPU "c" go to the socket with index "c % n" (sockets are
+	 * indexed in the order they were bound).  Must be called
+	 * after Bind().
+	 */
+	bool SetReusePortCpuModulo(unsigned n);
+
+	/**
+	 * Like SetReusePortCpuModulo(), but connections received on
+	 * CPU cpus[i] go to the socket with index "i".  Connections
+	 * on other CPUs are distributed by the kernel's hash.
+	 */
+	bool SetReusePortCpuMap(const int *cpus, unsigned n);
 #endif
 
 	bool Bind(SocketAddress address);
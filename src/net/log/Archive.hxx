@@ -0,0 +1,187 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/*
+ * Definitions for the columnar on-disk format for log records.
+ */
+
+#include "Protocol.hxx"
+
+#include <stdint.h>
+
+namespace Net {
+namespace Log {
+namespace Archive {
+
+/*
+
+  An archive segment stores a number of log records.  Each attribute
+  (see enum Attribute) is stored in its own column block, which
+  allows readers to load only the columns they are interested in.
+  All integers are little-endian.
+
+  The file starts with a #SegmentHeader, followed by a
+  #ColumnDescriptor for each column which is present.  Each column
+  block is aligned to 8 bytes and starts with a presence bitmap (one
+  bit per record, padded to 8 bytes), followed by the payload, whose
+  layout depends on the #Encoding.
+
+ */
+
+/**
+ * The magic number at the beginning of each segment file ("NLA1").
+ */
+static constexpr uint32_t MAGIC = 0x31414c4e;
+
+enum class Encoding : uint8_t {
+	/**
+	 * 64 bit integers encoded as the zigzag varint delta to the
+	 * previous present value (the first value relative to zero).
+	 * Only present values are stored.
+	 */
+	DELTA_VARINT = 1,
+
+	/**
+	 * Strings: one 32 bit dictionary index per record (0 if
+	 * absent), followed by the number of dictionary entries (32
+	 * bit), entry offsets (32 bit, one more than there are
+	 * entries) relative to the start of the string data, and the
+	 * null-terminated string data.
+	 */
+	DICTIONARY = 2,
+
+	/**
+	 * Fixed-size integers, one per record (zero if absent).
+	 */
+	FIXED8 = 3,
+	FIXED16 = 4,
+	FIXED64 = 5,
+
+	/**
+	 * Two 64 bit integers per record.
+	 */
+	FIXED64X2 = 6,
+};
+
+struct SegmentHeader {
+	uint32_t magic;
+
+	uint32_t n_records;
+
+	uint32_t n_columns;
+
+	uint32_t reserved;
+
+	/**
+	 * The smallest and largest #Attribute::TIMESTAMP value in
+	 * this segment; only valid if n_records>0 and the timestamp
+	 * column is present.  This allows skipping segments without
+	 * looking at the columns.
+	 */
+	uint64_t min_timestamp, max_timestamp;
+};
+
+static_assert(sizeof(SegmentHeader) == 32, "Wrong struct size");
+
+struct ColumnDescriptor {
+	Attribute attribute;
+
+	Encoding encoding;
+
+	uint16_t reserved;
+
+	uint32_t reserved2;
+
+	/**
+	 * The position of the column block, relative to the start of
+	 * the file.
+	 */
+	uint64_t offset;
+
+	/**
+	 * The size of the column block in bytes.
+	 */
+	uint64_t size;
+};
+
+static_assert(sizeof(ColumnDescriptor) == 24, "Wrong struct size");
+
+/**
+ * Which encoding is used for the given attribute?
+ */
+constexpr Encoding
+GetEncoding(Attribute a) noexcept
+{
+	switch (a) {
+	case Attribute::TIMESTAMP:
+		return Encoding::DELTA_VARINT;
+
+	case Attribute::HTTP_METHOD:
+	case Attribute::TYPE:
+		return Encoding::FIXED8;
+
+	case Attribute::HTTP_STATUS:
+		return Encoding::FIXED16;
+
+	case Attribute::LENGTH:
+	case Attribute::DURATION:
+		return Encoding::FIXED64;
+
+	case Attribute::TRAFFIC:
+		return Encoding::FIXED64X2;
+
+	default:
+		return Encoding::DICTIONARY;
+	}
+}
+
+/**
+ * The highest #Attribute value which may be stored in an archive.
+ */
+static constexpr unsigned MAX_ATTRIBUTE = unsigned(Attribute::TYPE);
+
+/**
+ * A bit mask of columns.
+ */
+typedef uint32_t ColumnMask;
+
+constexpr ColumnMask
+MakeColumnMask(Attribute a) noexcept
+{
+	return ColumnMask(1) << unsigned(a);
+}
+
+static constexpr ColumnMask ALL_COLUMNS = ~ColumnMask(0);
+
+}}}
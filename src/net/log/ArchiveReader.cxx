@@ -0,0 +1,351 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ArchiveReader.hxx"
+#include "Datagram.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "system/Error.hxx"
+#include "util/ByteOrder.hxx"
+#include "util/OffsetPointer.hxx"
+
+#include <stdexcept>
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace Net {
+namespace Log {
+
+using namespace Archive;
+
+static void
+Malformed()
+{
+	throw std::runtime_error("Malformed archive segment");
+}
+
+static uint32_t
+LoadLE32(const uint8_t *p) noexcept
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return FromLE32(value);
+}
+
+static uint64_t
+LoadLE64(const uint8_t *p) noexcept
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return FromLE64(value);
+}
+
+/**
+ * The size of one record in a fixed-size column.
+ */
+static size_t
+GetRecordSize(Encoding encoding)
+{
+	switch (encoding) {
+	case Encoding::FIXED8:
+		return 1;
+
+	case Encoding::FIXED16:
+		return 2;
+
+	case Encoding::DICTIONARY:
+		return 4;
+
+	case Encoding::FIXED64:
+		return 8;
+
+	case Encoding::FIXED64X2:
+		return 16;
+
+	case Encoding::DELTA_VARINT:
+		break;
+	}
+
+	return 0;
+}
+
+ArchiveReader::ArchiveReader(const char *path)
+{
+	UniqueFileDescriptor fd;
+	if (!fd.OpenReadOnly(path))
+		throw FormatErrno("Failed to open %s", path);
+
+	const off_t file_size = fd.GetSize();
+	if (file_size < off_t(sizeof(SegmentHeader)))
+		Malformed();
+
+	mapping_size = file_size;
+	mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED,
+		       fd.Get(), 0);
+	if (mapping == MAP_FAILED)
+		throw FormatErrno("Failed to map %s", path);
+
+	try {
+		SegmentHeader header;
+		memcpy(&header, mapping, sizeof(header));
+
+		if (FromLE32(header.magic) != MAGIC)
+			Malformed();
+
+		n_records = FromLE32(header.n_records);
+		min_timestamp = FromLE64(header.min_timestamp);
+		max_timestamp = FromLE64(header.max_timestamp);
+
+		const size_t n_columns = FromLE32(header.n_columns);
+		if (n_columns > (mapping_size - sizeof(header)) / sizeof(ColumnDescriptor))
+			Malformed();
+
+		const auto *descriptors = (const ColumnDescriptor *)
+			OffsetPointer(mapping, sizeof(header));
+		for (size_t i = 0; i < n_columns; ++i)
+			ParseColumn(descriptors[i]);
+	} catch (...) {
+		munmap(mapping, mapping_size);
+		throw;
+	}
+
+	/* we're going to read the columns sequentially */
+	madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+}
+
+ArchiveReader::~ArchiveReader() noexcept
+{
+	munmap(mapping, mapping_size);
+}
+
+void
+ArchiveReader::ParseColumn(const ColumnDescriptor &cd)
+{
+	const unsigned a = unsigned(cd.attribute);
+	if (a == 0 || a > MAX_ATTRIBUTE)
+		/* unknown attribute: ignore */
+		return;
+
+	const uint64_t offset = FromLE64(cd.offset);
+	const uint64_t size = FromLE64(cd.size);
+	if (offset > mapping_size || size > mapping_size - offset ||
+	    offset % 8 != 0)
+		Malformed();
+
+	const size_t bitmap_size = ((n_records + 7) / 8 + 7) & ~size_t(7);
+	if (size < bitmap_size)
+		Malformed();
+
+	if (cd.encoding != GetEncoding(cd.attribute))
+		Malformed();
+
+	auto &c = columns[a];
+	c.encoding = cd.encoding;
+	c.presence = (const uint8_t *)OffsetPointer(mapping, offset);
+	c.data = c.presence + bitmap_size;
+	c.size = size - bitmap_size;
+
+	if (c.encoding == Encoding::DELTA_VARINT)
+		/* verified while decoding */
+		return;
+
+	const size_t record_size = GetRecordSize(c.encoding);
+	if (record_size == 0 || c.size / record_size < n_records)
+		Malformed();
+
+	if (c.encoding != Encoding::DICTIONARY)
+		return;
+
+	/* verify the dictionary */
+
+	const uint8_t *p = c.data + n_records * 4;
+	const uint8_t *const end = c.data + c.size;
+	if (end - p < 4)
+		Malformed();
+
+	c.n_strings = LoadLE32(p);
+	p += 4;
+
+	if (size_t(end - p) / 4 <= c.n_strings)
+		Malformed();
+
+	c.offsets = p;
+	c.strings = (const char *)(p + (c.n_strings + 1) * 4);
+	const size_t strings_size = end - (const uint8_t *)c.strings;
+
+	/* the offsets must start at zero and increase strictly, so
+	   every string has at least its null terminator */
+	if (LoadLE32(c.offsets) != 0)
+		Malformed();
+
+	uint32_t previous = 0;
+	for (uint32_t i = 0; i < c.n_strings; ++i) {
+		const uint32_t next = LoadLE32(c.offsets + (i + 1) * 4);
+		if (next <= previous || next > strings_size ||
+		    c.strings[next - 1] != 0)
+			Malformed();
+		previous = next;
+	}
+
+	for (size_t i = 0; i < n_records; ++i)
+		if (c.IsPresent(i) && LoadLE32(c.data + i * 4) >= c.n_strings)
+			Malformed();
+}
+
+ArchiveReader::Cursor::Cursor(const ArchiveReader &_reader,
+			      ColumnMask _columns) noexcept
+	:reader(_reader), columns(_columns),
+	 timestamp_position(reader.columns[unsigned(Attribute::TIMESTAMP)].data)
+{
+}
+
+inline const ArchiveReader::Column *
+ArchiveReader::Cursor::Get(Attribute a) const noexcept
+{
+	if (!IsSelected(a))
+		return nullptr;
+
+	const auto &c = reader.columns[unsigned(a)];
+	if (!c.IsDefined() || !c.IsPresent(i))
+		return nullptr;
+
+	return &c;
+}
+
+const char *
+ArchiveReader::Cursor::GetString(Attribute a) const noexcept
+{
+	const auto *c = Get(a);
+	if (c == nullptr)
+		return nullptr;
+
+	const uint32_t index = LoadLE32(c->data + i * 4);
+	return c->strings + LoadLE32(c->offsets + index * 4);
+}
+
+uint64_t
+ArchiveReader::Cursor::NextTimestamp()
+{
+	const auto &c = reader.columns[unsigned(Attribute::TIMESTAMP)];
+	const uint8_t *const end = c.data + c.size;
+
+	uint64_t value = 0;
+	for (unsigned shift = 0;; shift += 7) {
+		if (timestamp_position >= end || shift >= 64)
+			Malformed();
+
+		const uint8_t b = *timestamp_position++;
+		value |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			break;
+	}
+
+	/* undo the zigzag encoding */
+	const uint64_t delta = (value >> 1) ^ -(value & 1);
+	timestamp += delta;
+	return timestamp;
+}
+
+bool
+ArchiveReader::Cursor::Next(Datagram &d)
+{
+	if (i >= reader.n_records)
+		return false;
+
+	d = Datagram();
+
+	const auto &ts = reader.columns[unsigned(Attribute::TIMESTAMP)];
+	if (ts.IsDefined() && ts.IsPresent(i)) {
+		/* the timestamp column must be decoded even if it
+		   was not selected, because each value depends on the
+		   previous one */
+		const uint64_t value = NextTimestamp();
+		if (IsSelected(Attribute::TIMESTAMP)) {
+			d.timestamp = value;
+			d.valid_timestamp = true;
+		}
+	}
+
+	d.remote_host = GetString(Attribute::REMOTE_HOST);
+	d.host = GetString(Attribute::HOST);
+	d.site = GetString(Attribute::SITE);
+	d.forwarded_to = GetString(Attribute::FORWARDED_TO);
+	d.http_uri = GetString(Attribute::HTTP_URI);
+	d.http_referer = GetString(Attribute::HTTP_REFERER);
+	d.user_agent = GetString(Attribute::USER_AGENT);
+
+	if (const auto *c = Get(Attribute::MESSAGE)) {
+		const uint32_t index = LoadLE32(c->data + i * 4);
+		const uint32_t begin = LoadLE32(c->offsets + index * 4);
+		const uint32_t end = LoadLE32(c->offsets + (index + 1) * 4);
+		/* verified by ParseColumn() */
+		assert(end > begin);
+		d.message = {c->strings + begin, end - begin - 1};
+	}
+
+	if (const auto *c = Get(Attribute::HTTP_METHOD)) {
+		d.http_method = http_method_t(c->data[i]);
+		d.valid_http_method = true;
+	}
+
+	if (const auto *c = Get(Attribute::HTTP_STATUS)) {
+		uint16_t value;
+		memcpy(&value, c->data + i * 2, sizeof(value));
+		d.http_status = http_status_t(FromLE16(value));
+		d.valid_http_status = true;
+	}
+
+	if (const auto *c = Get(Attribute::LENGTH)) {
+		d.length = LoadLE64(c->data + i * 8);
+		d.valid_length = true;
+	}
+
+	if (const auto *c = Get(Attribute::TRAFFIC)) {
+		d.traffic_received = LoadLE64(c->data + i * 16);
+		d.traffic_sent = LoadLE64(c->data + i * 16 + 8);
+		d.valid_traffic = true;
+	}
+
+	if (const auto *c = Get(Attribute::DURATION)) {
+		d.duration = LoadLE64(c->data + i * 8);
+		d.valid_duration = true;
+	}
+
+	if (const auto *c = Get(Attribute::TYPE))
+		d.type = Type(c->data[i]);
+
+	++i;
+	return true;
+}
+
+}}
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Archive.hxx"
+#include "util/Compiler.h"
+
+#include <stddef.h>
+
+namespace Net {
+namespace Log {
+
+struct Datagram;
+
+/**
+ * Reads a columnar archive segment file written by #ArchiveWriter.
+ * The file is mapped into memory, and strings returned in #Datagram
+ * instances point into the mapping; they are valid as long as this
+ * object exists.
+ */
+class ArchiveReader {
+	struct Column {
+		Archive::Encoding encoding;
+
+		const uint8_t *presence = nullptr;
+
+		/**
+		 * The payload after the presence bitmap.
+		 */
+		const uint8_t *data;
+		size_t size;
+
+		/**
+		 * For #Archive::Encoding::DICTIONARY.
+		 */
+		const uint8_t *offsets;
+		const char *strings;
+		uint32_t n_strings;
+
+		bool IsDefined() const noexcept {
+			return presence != nullptr;
+		}
+
+		bool IsPresent(size_t i) const noexcept {
+			return presence[i / 8] & (1 << (i % 8));
+		}
+	};
+
+	void *mapping;
+	size_t mapping_size;
+
+	size_t n_records;
+
+	uint64_t min_timestamp, max_timestamp;
+
+	Column columns[Archive::MAX_ATTRIBUTE + 1];
+
+public:
+	/**
+	 * Open and map a segment file and verify its structure.
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	explicit ArchiveReader(const char *path);
+
+	~ArchiveReader() noexcept;
+
+	ArchiveReader(const ArchiveReader &) = delete;
+	ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+	size_t size() const noexcept {
+		return n_records;
+	}
+
+	bool HasColumn(Attribute a) const noexcept {
+		return unsigned(a) <= Archive::MAX_ATTRIBUTE &&
+			columns[unsigned(a)].IsDefined();
+	}
+
+	uint64_t GetMinTimestamp() const noexcept {
+		return min_timestamp;
+	}
+
+	uint64_t GetMaxTimestamp() const noexcept {
+		return max_timestamp;
+	}
+
+	/**
+	 * May this segment contain records with a timestamp in the
+	 * given (inclusive) range?  Use this to skip segments
+	 * quickly.
+	 */
+	gcc_pure
+	bool Overlaps(uint64_t since, uint64_t until) const noexcept {
+		return HasColumn(Attribute::TIMESTAMP) && n_records > 0 &&
+			min_timestamp <= until && max_timestamp >= since;
+	}
+
+	/**
+	 * Iterates over all records, decoding only the selected
+	 * columns.
+	 */
+	class Cursor {
+		const ArchiveReader &reader;
+		const Archive::ColumnMask columns;
+
+		size_t i = 0;
+
+		/**
+		 * The position in the delta-encoded timestamp
+		 * column.
+		 */
+		const uint8_t *timestamp_position;
+
+		uint64_t timestamp = 0;
+
+	public:
+		Cursor(const ArchiveReader &_reader,
+		       Archive::ColumnMask _columns) noexcept;
+
+		/**
+		 * Decode the next record into the given #Datagram.
+		 * Attributes of columns which were not selected are
+		 * reset.
+		 *
+		 * Throws std::runtime_error if the timestamp column
+		 * is malformed.
+		 *
+		 * @return false if there are no more records
+		 */
+		bool Next(Datagram &d);
+
+	private:
+		bool IsSelected(Attribute a) const noexcept {
+			return columns & Archive::MakeColumnMask(a);
+		}
+
+		const Column *Get(Attribute a) const noexcept;
+
+		const char *GetString(Attribute a) const noexcept;
+
+		uint64_t NextTimestamp();
+	};
+
+	Cursor Select(Archive::ColumnMask mask=Archive::ALL_COLUMNS) const noexcept {
+		return Cursor(*this, mask);
+	}
+
+private:
+	void ParseColumn(const Archive::ColumnDescriptor &cd);
+};
+
+}}
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ArchiveWriter.hxx"
+#include "Datagram.hxx"
+#include "io/FileWriter.hxx"
+#include "util/ByteOrder.hxx"
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace Net {
+namespace Log {
+
+using namespace Archive;
+
+static void
+AppendRaw(std::vector<uint8_t> &v, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	v.insert(v.end(), p, p + size);
+}
+
+template<typename T>
+static void
+AppendLE(std::vector<uint8_t> &v, T value)
+{
+	/* all supported CPUs are little-endian; use ByteOrder.hxx
+	   to be safe */
+	switch (sizeof(T)) {
+	case 1:
+		break;
+
+	case 2:
+		value = ToLE16(value);
+		break;
+
+	case 4:
+		value = ToLE32(value);
+		break;
+
+	case 8:
+		value = ToLE64(value);
+		break;
+	}
+
+	AppendRaw(v, &value, sizeof(value));
+}
+
+static void
+AppendVarint(std::vector<uint8_t> &v, uint64_t value)
+{
+	while (value >= 0x80) {
+		v.push_back(uint8_t(value) | 0x80);
+		value >>= 7;
+	}
+
+	v.push_back(uint8_t(value));
+}
+
+void
+ArchiveWriter::AppendString(Attribute a, StringView value)
+{
+	auto &c = columns[unsigned(a)];
+
+	uint32_t index = 0;
+	if (!value.IsNull()) {
+		std::string s(value.data, value.size);
+		auto i = c.dictionary.find(s);
+		if (i == c.dictionary.end()) {
+			i = c.dictionary.emplace(std::move(s),
+						 c.strings.size()).first;
+			c.strings.push_back(&i->first);
+		}
+
+		index = i->second;
+		c.SetPresent(n_records);
+	}
+
+	AppendLE<uint32_t>(c.data, index);
+}
+
+void
+ArchiveWriter::AppendTimestamp(uint64_t value)
+{
+	auto &c = columns[unsigned(Attribute::TIMESTAMP)];
+	c.SetPresent(n_records);
+
+	/* zigzag encoding, because timestamps are not necessarily
+	   monotonic */
+	const int64_t delta = int64_t(value - last_timestamp);
+	AppendVarint(c.data, (uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+	last_timestamp = value;
+
+	min_timestamp = std::min(min_timestamp, value);
+	max_timestamp = std::max(max_timestamp, value);
+}
+
+template<typename T>
+void
+ArchiveWriter::AppendFixed(Attribute a, bool present, T value)
+{
+	auto &c = columns[unsigned(a)];
+	if (present)
+		c.SetPresent(n_records);
+	else
+		value = 0;
+
+	AppendLE<T>(c.data, value);
+}
+
+static StringView
+ToStringView(const char *s) noexcept
+{
+	return s != nullptr ? StringView(s) : StringView(nullptr);
+}
+
+void
+ArchiveWriter::Append(const Datagram &d)
+{
+	if (n_records % 8 == 0)
+		for (auto &c : columns)
+			c.presence.push_back(0);
+
+	if (d.valid_timestamp)
+		AppendTimestamp(d.timestamp);
+
+	AppendString(Attribute::REMOTE_HOST, ToStringView(d.remote_host));
+	AppendString(Attribute::SITE, ToStringView(d.site));
+	AppendFixed<uint8_t>(Attribute::HTTP_METHOD, d.valid_http_method,
+			     d.http_method);
+	AppendString(Attribute::HTTP_URI, ToStringView(d.http_uri));
+	AppendString(Attribute::HTTP_REFERER, ToStringView(d.http_referer));
+	AppendString(Attribute::USER_AGENT, ToStringView(d.user_agent));
+	AppendFixed<uint16_t>(Attribute::HTTP_STATUS, d.valid_http_status,
+			      d.http_status);
+	AppendFixed<uint64_t>(Attribute::LENGTH, d.valid_length, d.length);
+	AppendFixed<uint64_t>(Attribute::TRAFFIC, d.valid_traffic,
+			      d.traffic_received);
+	AppendLE<uint64_t>(columns[unsigned(Attribute::TRAFFIC)].data,
+			   d.valid_traffic ? d.traffic_sent : 0);
+	AppendFixed<uint64_t>(Attribute::DURATION, d.valid_duration,
+			      d.duration);
+	AppendString(Attribute::HOST, ToStringView(d.host));
+	AppendString(Attribute::MESSAGE, d.message);
+	AppendString(Attribute::FORWARDED_TO, ToStringView(d.forwarded_to));
+	AppendFixed<uint8_t>(Attribute::TYPE,
+			     d.type != Type::UNSPECIFIED, uint8_t(d.type));
+
+	++n_records;
+}
+
+static constexpr size_t
+Align8(size_t size) noexcept
+{
+	return (size + 7) & ~size_t(7);
+}
+
+/**
+ * Is any bit set in this presence bitmap?
+ */
+static bool
+AnyPresent(const std::vector<uint8_t> &presence) noexcept
+{
+	return std::any_of(presence.begin(), presence.end(),
+			   [](uint8_t b){ return b != 0; });
+}
+
+void
+ArchiveWriter::Write(const char *path) const
+{
+	/* build the column blocks; columns without any present value
+	   are omitted */
+	std::vector<ColumnDescriptor> descriptors;
+	std::vector<std::vector<uint8_t>> blocks;
+
+	const size_t bitmap_size = Align8((n_records + 7) / 8);
+
+	for (unsigned a = 1; a <= MAX_ATTRIBUTE; ++a) {
+		const auto &c = columns[a];
+		if (!AnyPresent(c.presence))
+			continue;
+
+		const auto encoding = GetEncoding(Attribute(a));
+
+		std::vector<uint8_t> block(c.presence);
+		block.resize(bitmap_size);
+		AppendRaw(block, c.data.data(), c.data.size());
+
+		if (encoding == Encoding::DICTIONARY) {
+			AppendLE<uint32_t>(block, c.strings.size());
+
+			uint32_t offset = 0;
+			for (const auto *s : c.strings) {
+				AppendLE<uint32_t>(block, offset);
+				offset += s->length() + 1;
+			}
+			AppendLE<uint32_t>(block, offset);
+
+			for (const auto *s : c.strings)
+				AppendRaw(block, s->c_str(), s->length() + 1);
+		}
+
+		ColumnDescriptor cd{};
+		cd.attribute = Attribute(a);
+		cd.encoding = encoding;
+		cd.size = ToLE64(block.size());
+		descriptors.push_back(cd);
+
+		block.resize(Align8(block.size()));
+		blocks.emplace_back(std::move(block));
+	}
+
+	uint64_t offset = Align8(sizeof(SegmentHeader) +
+				 descriptors.size() * sizeof(ColumnDescriptor));
+	for (size_t i = 0; i < descriptors.size(); ++i) {
+		descriptors[i].offset = ToLE64(offset);
+		offset += blocks[i].size();
+	}
+
+	SegmentHeader header{};
+	header.magic = ToLE32(MAGIC);
+	header.n_records = ToLE32(n_records);
+	header.n_columns = ToLE32(descriptors.size());
+	if (min_timestamp <= max_timestamp) {
+		header.min_timestamp = ToLE64(min_timestamp);
+		header.max_timestamp = ToLE64(max_timestamp);
+	}
+
+	FileWriter fw(path);
+	fw.Allocate(offset);
+	fw.Write(&header, sizeof(header));
+	if (!descriptors.empty())
+		fw.Write(descriptors.data(),
+			 descriptors.size() * sizeof(descriptors.front()));
+
+	static constexpr uint8_t padding[8]{};
+	const size_t header_size = sizeof(SegmentHeader) +
+		descriptors.size() * sizeof(ColumnDescriptor);
+	if (header_size % 8 != 0)
+		fw.Write(padding, 8 - header_size % 8);
+
+	for (const auto &block : blocks)
+		fw.Write(block.data(), block.size());
+
+	fw.Commit();
+}
+
+void
+ArchiveWriter::Clear() noexcept
+{
+	for (auto &c : columns)
+		c = {};
+
+	n_records = 0;
+	last_timestamp = 0;
+	min_timestamp = UINT64_MAX;
+	max_timestamp = 0;
+}
+
+}}
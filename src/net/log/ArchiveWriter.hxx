@@ -0,0 +1,113 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Archive.hxx"
+#include "util/StringView.hxx"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+
+namespace Net {
+namespace Log {
+
+struct Datagram;
+
+/**
+ * Collects log records in memory and writes them to a columnar
+ * archive segment file (see Archive.hxx).  Strings are stored in a
+ * per-column dictionary, and timestamps are delta-encoded.
+ */
+class ArchiveWriter {
+	struct Column {
+		std::vector<uint8_t> presence;
+		std::vector<uint8_t> data;
+
+		/**
+		 * For #Encoding::DICTIONARY: maps each string to its
+		 * index in #strings.
+		 */
+		std::map<std::string, uint32_t, std::less<>> dictionary;
+		std::vector<const std::string *> strings;
+
+		void SetPresent(size_t i) noexcept {
+			presence[i / 8] |= 1 << (i % 8);
+		}
+	};
+
+	Column columns[Archive::MAX_ATTRIBUTE + 1];
+
+	size_t n_records = 0;
+
+	uint64_t last_timestamp = 0;
+	uint64_t min_timestamp = UINT64_MAX, max_timestamp = 0;
+
+public:
+	size_t size() const noexcept {
+		return n_records;
+	}
+
+	bool empty() const noexcept {
+		return n_records == 0;
+	}
+
+	/**
+	 * Add a record to the segment.  The #Datagram is copied.
+	 */
+	void Append(const Datagram &d);
+
+	/**
+	 * Write the segment to a file (replacing an existing file
+	 * atomically).
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	void Write(const char *path) const;
+
+	/**
+	 * Discard all records.
+	 */
+	void Clear() noexcept;
+
+private:
+	void AppendString(Attribute a, StringView value);
+	void AppendTimestamp(uint64_t value);
+
+	template<typename T>
+	void AppendFixed(Attribute a, bool present, T value);
+};
+
+}}
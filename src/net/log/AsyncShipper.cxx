@@ -0,0 +1,229 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AsyncShipper.hxx"
+#include "Send.hxx"
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <sys/socket.h>
+
+namespace Net {
+namespace Log {
+
+constexpr size_t AsyncShipper::DEFAULT_MAX_SIZE;
+
+/**
+ * Submit at most this many datagrams with one sendmmsg() call.
+ */
+static constexpr size_t MAX_BATCH = 64;
+
+/**
+ * Wait this long before reconnecting after an error.
+ */
+static constexpr std::chrono::seconds RECONNECT_DELAY(1);
+
+static constexpr size_t
+AlignSlotSize(size_t size) noexcept
+{
+	return (size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+}
+
+AsyncShipper::AsyncShipper(SocketAddress _address,
+			   size_t capacity, size_t max_size)
+	:address(_address),
+	 n_slots(capacity),
+	 slot_size(AlignSlotSize(sizeof(size_t) + max_size)),
+	 ring(n_slots * slot_size)
+{
+	thread = std::thread(&AsyncShipper::Run, this);
+}
+
+AsyncShipper::~AsyncShipper() noexcept
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+		cond.notify_one();
+	}
+
+	thread.join();
+}
+
+AsyncShipperStats
+AsyncShipper::GetStats() const noexcept
+{
+	return {
+		n_sent.load(std::memory_order_relaxed),
+		n_dropped.load(std::memory_order_relaxed),
+		n_oversized.load(std::memory_order_relaxed),
+		n_errors.load(std::memory_order_relaxed),
+		n_connects.load(std::memory_order_relaxed),
+	};
+}
+
+void
+AsyncShipper::Send(const Datagram &d) noexcept
+{
+	const size_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) >= n_slots) {
+		n_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	size_t *slot = GetSlot(t);
+	const size_t size = Serialize(slot + 1, slot_size - sizeof(*slot), d);
+	if (size == 0) {
+		n_oversized.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	*slot = size;
+
+	/* sequentially consistent, pairs with the "waiting" store in
+	   Wait() */
+	tail.store(t + 1);
+
+	if (waiting.load())
+		WakeUp();
+}
+
+void
+AsyncShipper::WakeUp() noexcept
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	cond.notify_one();
+}
+
+bool
+AsyncShipper::Wait() noexcept
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	waiting.store(true);
+	cond.wait(lock, [this]{
+			return quit || tail.load() != head.load(std::memory_order_relaxed);
+		});
+	waiting.store(false);
+	return !quit;
+}
+
+bool
+AsyncShipper::Connect() noexcept
+{
+	if (socket.IsDefined())
+		return true;
+
+	if (!socket.Create(address.GetFamily(), SOCK_DGRAM, 0))
+		return false;
+
+	if (!socket.Connect(address)) {
+		socket.Close();
+		return false;
+	}
+
+	n_connects.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void
+AsyncShipper::Drain() noexcept
+{
+	struct mmsghdr m[MAX_BATCH];
+	struct iovec v[MAX_BATCH];
+
+	while (true) {
+		const size_t h = head.load(std::memory_order_relaxed);
+		const size_t n = std::min(tail.load(std::memory_order_acquire) - h,
+					  MAX_BATCH);
+		if (n == 0)
+			break;
+
+		if (!Connect()) {
+			/* can't connect: wait a bit, but don't
+			   block the producer; it will drop datagrams
+			   when the ring is full */
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait_for(lock, RECONNECT_DELAY,
+				      [this]{ return quit; });
+			if (quit)
+				break;
+			continue;
+		}
+
+		for (size_t i = 0; i < n; ++i) {
+			size_t *slot = GetSlot(h + i);
+			v[i] = {slot + 1, *slot};
+			m[i].msg_hdr = {
+				.msg_name = nullptr,
+				.msg_namelen = 0,
+				.msg_iov = &v[i],
+				.msg_iovlen = 1,
+				.msg_control = nullptr,
+				.msg_controllen = 0,
+				.msg_flags = 0,
+			};
+		}
+
+		/* this is a blocking socket: if the server applies
+		   backpressure, only this thread waits */
+		int result = sendmmsg(socket.Get(), m, n, MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* discard the failed datagram and reconnect;
+			   e.g. ECONNREFUSED means the server has
+			   been restarted */
+			n_errors.fetch_add(1, std::memory_order_relaxed);
+			socket.Close();
+			result = 1;
+		} else
+			n_sent.fetch_add(result, std::memory_order_relaxed);
+
+		/* release the slots to the producer */
+		head.store(h + result, std::memory_order_release);
+	}
+}
+
+void
+AsyncShipper::Run() noexcept
+{
+	while (Wait())
+		Drain();
+
+	/* final attempt to send the remaining datagrams */
+	Drain();
+}
+
+}}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/LargeAllocation.hxx"
+#include "util/OffsetPointer.hxx"
+#include "util/Compiler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <stddef.h>
+
+namespace Net {
+namespace Log {
+
+struct Datagram;
+
+struct AsyncShipperStats {
+	/**
+	 * The number of datagrams which were submitted to the kernel.
+	 */
+	size_t sent;
+
+	/**
+	 * The number of datagrams which were discarded because the
+	 * ring was full.
+	 */
+	size_t dropped;
+
+	/**
+	 * The number of datagrams which were discarded because they
+	 * were larger than the ring's slot size.
+	 */
+	size_t oversized;
+
+	/**
+	 * The number of datagrams which were discarded because of a
+	 * send error.
+	 */
+	size_t errors;
+
+	/**
+	 * The number of times the socket was (re)connected.
+	 */
+	size_t connects;
+};
+
+/**
+ * Sends log datagrams to a Pond server from a dedicated thread.
+ * Send() serializes the datagram into a preallocated
+ * single-producer/single-consumer ring and returns immediately; it
+ * never blocks and never allocates memory.  The thread drains the
+ * ring with sendmmsg() into its own socket, which is reconnected
+ * after send errors.  If the server applies backpressure, the ring
+ * fills up and further datagrams are dropped (and counted).
+ *
+ * Send() may only be called from one thread at a time.
+ */
+class AsyncShipper {
+	const AllocatedSocketAddress address;
+
+	const size_t n_slots, slot_size;
+
+	/**
+	 * The ring; each slot is a size_t (the datagram length)
+	 * followed by the serialized datagram.
+	 */
+	LargeAllocation ring;
+
+	/**
+	 * The number of datagrams ever consumed; written only by the
+	 * thread.
+	 */
+	std::atomic_size_t head{0};
+
+	/**
+	 * The number of datagrams ever produced; written only by
+	 * Send().
+	 */
+	std::atomic_size_t tail{0};
+
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	/**
+	 * Is the thread waiting for #cond?  This allows Send() to
+	 * avoid locking the mutex in the common case.
+	 */
+	std::atomic_bool waiting{false};
+
+	bool quit = false;
+
+	std::atomic_size_t n_sent{0}, n_dropped{0}, n_oversized{0};
+	std::atomic_size_t n_errors{0}, n_connects{0};
+
+	/**
+	 * The socket; only accessed by the thread.
+	 */
+	UniqueSocketDescriptor socket;
+
+	std::thread thread;
+
+public:
+	/**
+	 * The default maximum size of one serialized datagram.
+	 */
+	static constexpr size_t DEFAULT_MAX_SIZE = 4096;
+
+	/**
+	 * Start the thread.
+	 *
+	 * Throws on error.
+	 *
+	 * @param _address the address of the Pond server
+	 * @param capacity the number of ring slots
+	 * @param max_size the maximum size of one serialized datagram
+	 */
+	explicit AsyncShipper(SocketAddress _address,
+			      size_t capacity=1024,
+			      size_t max_size=DEFAULT_MAX_SIZE);
+
+	/**
+	 * Stop the thread after it has attempted to send all pending
+	 * datagrams.
+	 */
+	~AsyncShipper() noexcept;
+
+	AsyncShipper(const AsyncShipper &) = delete;
+	AsyncShipper &operator=(const AsyncShipper &) = delete;
+
+	gcc_pure
+	AsyncShipperStats GetStats() const noexcept;
+
+	/**
+	 * Queue a log datagram.  This method is lock-free unless the
+	 * thread needs to be woken up.
+	 */
+	void Send(const Datagram &d) noexcept;
+
+private:
+	size_t *GetSlot(size_t i) const noexcept {
+		return (size_t *)OffsetPointer(ring.get(),
+					       (i % n_slots) * slot_size);
+	}
+
+	void WakeUp() noexcept;
+
+	/**
+	 * Wait until the ring is not empty or #quit is set.
+	 *
+	 * @return false if the thread shall quit
+	 */
+	bool Wait() noexcept;
+
+	/**
+	 * Connect #socket if it is not already.
+	 */
+	bool Connect() noexcept;
+
+	/**
+	 * Send all datagrams which are currently in the ring.
+	 */
+	void Drain() noexcept;
+
+	void Run() noexcept;
+};
+
+}}
@@ -32,14 +32,14 @@
 
 #pragma once
 
-#include <boost/crc.hpp>
+#include "util/Crc32.hxx"
 
 namespace Net {
 namespace Log {
 
 /**
- * The CRC algorithm.
+ * The CRC algorithm; this is compatible with boost::crc_32_type.
  */
-using Crc = boost::crc_32_type;
+using Crc = Crc32;
 
 }}
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "DatagramView.hxx"
+#include "Datagram.hxx"
+#include "Parser.hxx"
+#include "util/ByteOrder.hxx"
+
+#include <string.h>
+
+namespace Net {
+namespace Log {
+
+DatagramView::DatagramView(ConstBuffer<void> _d)
+	:offsets()
+{
+	const auto d = ConstBuffer<uint8_t>::FromVoid(VerifyDatagram(_d));
+	begin = scan_position = d.data;
+	end = d.data + d.size;
+
+	/* a datagram is never larger than 64 kB, so the offsets fit
+	   into 16 bits */
+	if (end - begin >= 0xffff)
+		throw ProtocolError();
+}
+
+/**
+ * Determine the size of an attribute's payload.
+ *
+ * Throws #ProtocolError if the datagram is truncated.
+ */
+static size_t
+GetPayloadSize(Attribute a, const uint8_t *p, const uint8_t *end)
+{
+	size_t size;
+
+	switch (a) {
+	case Attribute::NOP:
+		return 0;
+
+	case Attribute::HTTP_METHOD:
+	case Attribute::TYPE:
+		size = 1;
+		break;
+
+	case Attribute::HTTP_STATUS:
+		size = 2;
+		break;
+
+	case Attribute::TIMESTAMP:
+	case Attribute::LENGTH:
+	case Attribute::DURATION:
+		size = 8;
+		break;
+
+	case Attribute::TRAFFIC:
+		size = 16;
+		break;
+
+	case Attribute::REMOTE_HOST:
+	case Attribute::HOST:
+	case Attribute::SITE:
+	case Attribute::FORWARDED_TO:
+	case Attribute::HTTP_URI:
+	case Attribute::HTTP_REFERER:
+	case Attribute::USER_AGENT:
+	case Attribute::MESSAGE: {
+		/* a null-terminated string */
+		const void *nul = memchr(p, 0, end - p);
+		if (nul == nullptr)
+			throw ProtocolError();
+
+		return (const uint8_t *)nul + 1 - p;
+	}
+
+	default:
+		/* unknown attribute: like ParseDatagram(), ignore
+		   just this byte */
+		return 0;
+	}
+
+	if (size_t(end - p) < size)
+		throw ProtocolError();
+
+	return size;
+}
+
+const uint8_t *
+DatagramView::Find(Attribute a) const
+{
+	const unsigned i = unsigned(a);
+	if (i == 0 || i > unsigned(Attribute::TYPE))
+		return nullptr;
+
+	if (offsets[i] > 0)
+		return begin + offsets[i] - 1;
+
+	while (scan_position < end) {
+		const auto attribute = Attribute(*scan_position);
+		const uint8_t *payload = scan_position + 1;
+		const size_t size = GetPayloadSize(attribute, payload, end);
+
+		scan_position = payload + size;
+
+		const unsigned j = unsigned(attribute);
+		if (j > 0 && j <= unsigned(Attribute::TYPE) &&
+		    offsets[j] == 0) {
+			offsets[j] = payload - begin + 1;
+			if (j == i)
+				return payload;
+		}
+	}
+
+	return nullptr;
+}
+
+static uint16_t
+LoadBE16(const uint8_t *p) noexcept
+{
+	uint16_t value;
+	memcpy(&value, p, sizeof(value));
+	return FromBE16(value);
+}
+
+static uint64_t
+LoadBE64(const uint8_t *p) noexcept
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return FromBE64(value);
+}
+
+bool
+DatagramView::GetUint64(Attribute a, uint64_t &value_r) const
+{
+	const uint8_t *p = Find(a);
+	if (p == nullptr)
+		return false;
+
+	value_r = LoadBE64(p);
+	return true;
+}
+
+bool
+DatagramView::GetHttpMethod(http_method_t &value_r) const
+{
+	const uint8_t *p = Find(Attribute::HTTP_METHOD);
+	if (p == nullptr)
+		return false;
+
+	value_r = http_method_t(*p);
+	if (!http_method_is_valid(value_r))
+		throw ProtocolError();
+
+	return true;
+}
+
+bool
+DatagramView::GetHttpStatus(http_status_t &value_r) const
+{
+	const uint8_t *p = Find(Attribute::HTTP_STATUS);
+	if (p == nullptr)
+		return false;
+
+	value_r = http_status_t(LoadBE16(p));
+	if (!http_status_is_valid(value_r))
+		throw ProtocolError();
+
+	return true;
+}
+
+bool
+DatagramView::GetTraffic(uint64_t &received_r, uint64_t &sent_r) const
+{
+	const uint8_t *p = Find(Attribute::TRAFFIC);
+	if (p == nullptr)
+		return false;
+
+	received_r = LoadBE64(p);
+	sent_r = LoadBE64(p + 8);
+	return true;
+}
+
+Type
+DatagramView::GetType() const
+{
+	const uint8_t *p = Find(Attribute::TYPE);
+	if (p != nullptr && Type(*p) != Type::UNSPECIFIED)
+		return Type(*p);
+
+	if (GetHttpUri() != nullptr)
+		/* old clients don't send a type; attempt to guess the
+		   type */
+		return Has(Attribute::MESSAGE)
+			? Type::HTTP_ERROR
+			: Type::HTTP_ACCESS;
+
+	return Type::UNSPECIFIED;
+}
+
+Datagram
+DatagramView::ToDatagram() const
+{
+	Datagram d;
+
+	d.valid_timestamp = GetTimestamp(d.timestamp);
+	d.remote_host = GetRemoteHost();
+	d.host = GetHost();
+	d.site = GetSite();
+	d.forwarded_to = GetForwardedTo();
+	d.valid_http_method = GetHttpMethod(d.http_method);
+	d.http_uri = GetHttpUri();
+	d.http_referer = GetHttpReferer();
+	d.user_agent = GetUserAgent();
+	d.message = GetMessage();
+	d.valid_http_status = GetHttpStatus(d.http_status);
+	d.valid_length = GetLength(d.length);
+	d.valid_traffic = GetTraffic(d.traffic_received, d.traffic_sent);
+	d.valid_duration = GetDuration(d.duration);
+	d.type = GetType();
+
+	return d;
+}
+
+}}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "Protocol.hxx"
+#include "http/Method.h"
+#include "http/Status.h"
+#include "util/ConstBuffer.hxx"
+#include "util/StringView.hxx"
+
+#include <stdint.h>
+
+namespace Net {
+namespace Log {
+
+struct Datagram;
+
+/**
+ * A lazy alternative to ParseDatagram(): the constructor only
+ * verifies the magic and the CRC, and attributes are located on
+ * demand.  The accessors return values which point into the
+ * datagram buffer, which must therefore remain valid as long as
+ * this object is used.
+ *
+ * Attributes are scanned incrementally: looking up an attribute
+ * only scans until it has been found, and the positions of all
+ * attributes seen so far are remembered in a small offset table.
+ * If an attribute occurs more than once, the first one is used.
+ */
+class DatagramView {
+	const uint8_t *begin, *end;
+
+	/**
+	 * The scanner has not yet looked beyond this point.
+	 */
+	mutable const uint8_t *scan_position;
+
+	/**
+	 * The payload offset (relative to #begin) of each attribute
+	 * plus one; 0 means the attribute has not been found (yet).
+	 */
+	mutable uint16_t offsets[unsigned(Attribute::TYPE) + 1];
+
+public:
+	/**
+	 * Throws #ProtocolError if the magic or the CRC is wrong.
+	 */
+	explicit DatagramView(ConstBuffer<void> d);
+
+	/**
+	 * Throws #ProtocolError if the datagram is malformed.
+	 */
+	bool Has(Attribute a) const {
+		return Find(a) != nullptr;
+	}
+
+	/**
+	 * Return the value of a string attribute, or nullptr if it
+	 * does not exist.
+	 *
+	 * Throws #ProtocolError if the datagram is malformed.
+	 */
+	const char *GetString(Attribute a) const {
+		return (const char *)Find(a);
+	}
+
+	const char *GetRemoteHost() const {
+		return GetString(Attribute::REMOTE_HOST);
+	}
+
+	const char *GetHost() const {
+		return GetString(Attribute::HOST);
+	}
+
+	const char *GetSite() const {
+		return GetString(Attribute::SITE);
+	}
+
+	const char *GetForwardedTo() const {
+		return GetString(Attribute::FORWARDED_TO);
+	}
+
+	const char *GetHttpUri() const {
+		return GetString(Attribute::HTTP_URI);
+	}
+
+	const char *GetHttpReferer() const {
+		return GetString(Attribute::HTTP_REFERER);
+	}
+
+	const char *GetUserAgent() const {
+		return GetString(Attribute::USER_AGENT);
+	}
+
+	StringView GetMessage() const {
+		return GetString(Attribute::MESSAGE);
+	}
+
+	/*
+	 * The following methods return false if the attribute does
+	 * not exist.  They throw #ProtocolError if the datagram is
+	 * malformed.
+	 */
+
+	bool GetTimestamp(uint64_t &value_r) const {
+		return GetUint64(Attribute::TIMESTAMP, value_r);
+	}
+
+	bool GetHttpMethod(http_method_t &value_r) const;
+	bool GetHttpStatus(http_status_t &value_r) const;
+
+	bool GetLength(uint64_t &value_r) const {
+		return GetUint64(Attribute::LENGTH, value_r);
+	}
+
+	bool GetTraffic(uint64_t &received_r, uint64_t &sent_r) const;
+
+	bool GetDuration(uint64_t &value_r) const {
+		return GetUint64(Attribute::DURATION, value_r);
+	}
+
+	/**
+	 * Returns the record type; like ParseDatagram(), it guesses
+	 * the type if the client did not specify it.
+	 */
+	Type GetType() const;
+
+	/**
+	 * Parse all attributes into a #Datagram.
+	 *
+	 * Throws #ProtocolError if the datagram is malformed.
+	 */
+	Datagram ToDatagram() const;
+
+private:
+	/**
+	 * Find the payload of the given attribute.
+	 *
+	 * Throws #ProtocolError if the datagram is malformed.
+	 *
+	 * @return a pointer to the payload or nullptr if the
+	 * attribute does not exist
+	 */
+	const uint8_t *Find(Attribute a) const;
+
+	bool GetUint64(Attribute a, uint64_t &value_r) const;
+};
+
+}}
@@ -32,33 +32,29 @@
 
 #include "OneLine.hxx"
 #include "Datagram.hxx"
-#include "io/FileDescriptor.hxx"
-#include "util/StringBuffer.hxx"
+#include "system/Error.hxx"
+#include "util/Compiler.h"
 
-#include <stdio.h>
-#include <time.h>
+#include <algorithm>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 template<size_t capacity>
 static const char *
-FormatTimestamp(StringBuffer<capacity> &buffer, uint64_t value)
+FormatTimestamp(StringBuffer<capacity> &buffer, time_t t)
 {
-	time_t t = value / 1000000;
 	struct tm tm;
 	strftime(buffer.data(), buffer.capacity(),
 		 "%d/%b/%Y:%H:%M:%S %z", localtime_r(&t, &tm));
 	return buffer.c_str();
 }
 
-template<size_t capacity>
-static const char *
-FormatOptionalTimestamp(StringBuffer<capacity> &buffer, bool valid,
-			uint64_t value)
-{
-	return valid
-		? FormatTimestamp(buffer, value)
-		: "-";
-}
-
 static const char *
 OptionalString(const char *p)
 {
@@ -68,138 +64,329 @@ OptionalString(const char *p)
 	return p;
 }
 
-static bool
+static constexpr bool
 IsHarmlessChar(signed char ch)
 {
 	return ch >= 0x20 && ch != '"' && ch != '\\';
 }
 
+/**
+ * Find the first character which needs to be escaped.
+ *
+ * @return the position of that character or #end if there is none
+ */
+gcc_pure
+static const char *
+FindHarmfulCharGeneric(const char *p, const char *const end) noexcept
+{
+	while (p < end && IsHarmlessChar(*p))
+		++p;
+	return p;
+}
+
+#ifdef __SSE2__
+
+/**
+ * Check 16 characters at a time.  The signed comparison with 0x20
+ * catches both control characters and non-ASCII bytes.
+ */
+gcc_pure
+static const char *
+FindHarmfulCharSSE2(const char *p, const char *const end) noexcept
+{
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+
+	while (end - p >= 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)p);
+		const __m128i harmful =
+			_mm_or_si128(_mm_cmplt_epi8(v, space),
+				     _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+						  _mm_cmpeq_epi8(v, backslash)));
+		const unsigned mask = _mm_movemask_epi8(harmful);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+
+		p += 16;
+	}
+
+	return FindHarmfulCharGeneric(p, end);
+}
+
+/**
+ * Same as FindHarmfulCharSSE2(), but check 32 characters at a
+ * time.
+ */
+__attribute__((target("avx2")))
+gcc_pure
 static const char *
-EscapeString(const char *value, char *const buffer, size_t buffer_size)
-{
-	char *p = buffer, *const buffer_limit = buffer + buffer_size - 4;
-	char ch;
-	while (p < buffer_limit && (ch = *value++) != 0) {
-		if (IsHarmlessChar(ch))
-			*p++ = ch;
-		else
-			p += sprintf(p, "\\x%02X", (unsigned char)ch);
+FindHarmfulCharAVX2(const char *p, const char *const end) noexcept
+{
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+
+	while (end - p >= 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+		const __m256i harmful =
+			_mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+					_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+							_mm256_cmpeq_epi8(v, backslash)));
+		const unsigned mask = _mm256_movemask_epi8(harmful);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+
+		p += 32;
 	}
 
-	*p = 0;
-	return buffer;
+	return FindHarmfulCharSSE2(p, end);
+}
+
+static bool
+HasAVX2() noexcept
+{
+	static const bool value = __builtin_cpu_supports("avx2");
+	return value;
+}
+
+gcc_pure
+static const char *
+FindHarmfulChar(const char *p, const char *end) noexcept
+{
+	/* the AVX2 loop is only worth it for longer strings */
+	if (end - p >= 64 && HasAVX2())
+		return FindHarmfulCharAVX2(p, end);
+
+	return FindHarmfulCharSSE2(p, end);
 }
 
+#else
+
+gcc_pure
 static const char *
-EscapeString(StringView value, char *const buffer, size_t buffer_size)
+FindHarmfulChar(const char *p, const char *end) noexcept
+{
+	return FindHarmfulCharGeneric(p, end);
+}
+
+#endif
+
+static char *
+AppendChar(char *p, char *end, char ch) noexcept
+{
+	if (p < end)
+		*p++ = ch;
+	return p;
+}
+
+/**
+ * Copy a string, truncating it if it does not fit.
+ */
+static char *
+Append(char *p, char *end, StringView s) noexcept
+{
+	const size_t n = std::min(s.size, size_t(end - p));
+	memcpy(p, s.data, n);
+	return p + n;
+}
+
+static char *
+AppendUnsigned(char *p, char *end, uint64_t value) noexcept
+{
+	char buffer[24], *q = buffer + sizeof(buffer);
+
+	do {
+		*--q = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	return Append(p, end, {q, size_t(buffer + sizeof(buffer) - q)});
+}
+
+static char *
+AppendOptionalUnsigned(char *p, char *end, bool valid, uint64_t value) noexcept
+{
+	return valid
+		? AppendUnsigned(p, end, value)
+		: AppendChar(p, end, '-');
+}
+
+/**
+ * Copy a string, escaping special characters.  Runs of harmless
+ * characters are copied in bulk.
+ *
+ * @param max_length the maximum output length (not counting the
+ * last escape sequence, which may exceed it by up to 3 characters)
+ */
+static char *
+AppendEscaped(char *p, char *end, StringView value,
+	      size_t max_length) noexcept
 {
-	char *p = buffer, *const buffer_limit = buffer + buffer_size - 4;
+	end = std::min(end, p + max_length + 3);
+	char *const limit = end - 3;
 
-	for (char ch : value) {
-		if (p >= buffer_limit)
+	const char *src = value.begin();
+	const char *const src_end = value.end();
+
+	while (p < limit && src < src_end) {
+		const char *harmful = FindHarmfulChar(src, src_end);
+		const size_t n = std::min(size_t(harmful - src),
+					  size_t(limit - p));
+		memcpy(p, src, n);
+		p += n;
+		src += n;
+
+		if (src == src_end || p >= limit)
 			break;
 
-		if (IsHarmlessChar(ch))
-			*p++ = ch;
-		else
-			p += sprintf(p, "\\x%02X", (unsigned char)ch);
+		static constexpr char hex_digits[] = "0123456789ABCDEF";
+		const unsigned char ch = *src++;
+		*p++ = '\\';
+		*p++ = 'x';
+		*p++ = hex_digits[ch >> 4];
+		*p++ = hex_digits[ch & 0xf];
 	}
 
-	*p = 0;
-	return buffer;
+	return p;
 }
 
-static void
-LogOneLineHttp(FileDescriptor fd, const Net::Log::Datagram &d,
-	       bool site)
+/**
+ * Format one line into the given buffer.
+ *
+ * @param stamp the formatted timestamp or nullptr
+ * @return the end of the line or nullptr if the datagram cannot be
+ * logged
+ */
+static char *
+FormatOneLine(char *p, char *end, const Net::Log::Datagram &d, bool site,
+	      const char *stamp) noexcept
 {
-	const char *method = d.valid_http_method &&
-		http_method_is_valid(d.http_method)
-		? http_method_to_string(d.http_method)
-		: "?";
+	/* these limits are the legacy dprintf() buffer sizes */
+	static constexpr size_t MAX_URI = 4096 - 4;
+	static constexpr size_t MAX_REFERER = 2048 - 4;
+	static constexpr size_t MAX_USER_AGENT = 1024 - 4;
+	static constexpr size_t MAX_MESSAGE = 4096 - 4;
+
+	/* room for the newline */
+	--end;
+
+	if (d.http_uri != nullptr && d.valid_http_status) {
+		const char *method = d.valid_http_method &&
+			http_method_is_valid(d.http_method)
+			? http_method_to_string(d.http_method)
+			: "?";
+
+		if (site) {
+			p = Append(p, end, OptionalString(d.site));
+			p = AppendChar(p, end, ' ');
+		}
+
+		p = Append(p, end, OptionalString(d.remote_host));
+		p = Append(p, end, " - - [");
+		p = Append(p, end, OptionalString(stamp));
+		p = Append(p, end, "] \"");
+		p = Append(p, end, method);
+		p = AppendChar(p, end, ' ');
+		p = AppendEscaped(p, end, d.http_uri, MAX_URI);
+		p = Append(p, end, " HTTP/1.1\" ");
+		p = AppendUnsigned(p, end, unsigned(d.http_status));
+		p = AppendChar(p, end, ' ');
+		p = AppendOptionalUnsigned(p, end, d.valid_length, d.length);
+		p = Append(p, end, " \"");
+		p = AppendEscaped(p, end, OptionalString(d.http_referer),
+				  MAX_REFERER);
+		p = Append(p, end, "\" \"");
+		p = AppendEscaped(p, end, OptionalString(d.user_agent),
+				  MAX_USER_AGENT);
+		p = Append(p, end, "\" ");
+		p = AppendOptionalUnsigned(p, end,
+					   d.valid_duration, d.duration);
+	} else if (d.message != nullptr) {
+		if (site) {
+			p = Append(p, end, OptionalString(d.site));
+			p = AppendChar(p, end, ' ');
+		}
 
+		p = AppendChar(p, end, '[');
+		p = Append(p, end, OptionalString(stamp));
+		p = Append(p, end, "] ");
+		p = AppendEscaped(p, end, d.message, MAX_MESSAGE);
+	} else
+		return nullptr;
+
+	*p++ = '\n';
+	return p;
+}
+
+void
+LogOneLine(FileDescriptor fd, const Net::Log::Datagram &d, bool site)
+{
 	StringBuffer<32> stamp_buffer;
-	const char *stamp =
-		FormatOptionalTimestamp(stamp_buffer, d.valid_timestamp,
-					d.timestamp);
-
-	char length_buffer[32];
-	const char *length = "-";
-	if (d.valid_length) {
-		snprintf(length_buffer, sizeof(length_buffer), "%llu",
-			 (unsigned long long)d.length);
-		length = length_buffer;
-	}
+	const char *stamp = d.valid_timestamp
+		? FormatTimestamp(stamp_buffer, d.timestamp / 1000000)
+		: nullptr;
+
+	char buffer[16384];
+	const char *end = FormatOneLine(buffer, buffer + sizeof(buffer),
+					d, site, stamp);
+	if (end != nullptr)
+		(void)fd.Write(buffer, end - buffer);
+}
+
+OneLineWriter::OneLineWriter(FileDescriptor _fd, bool _site,
+			     size_t _capacity)
+	:fd(_fd), site(_site),
+	 capacity(_capacity), buffer(new char[capacity])
+{
+	assert(capacity >= MAX_LINE);
+}
 
-	char duration_buffer[32];
-	const char *duration = "-";
-	if (d.valid_duration) {
-		snprintf(duration_buffer, sizeof(duration_buffer), "%llu",
-			 (unsigned long long)d.duration);
-		duration = duration_buffer;
+inline const char *
+OneLineWriter::FormatTimestamp(uint64_t value) noexcept
+{
+	const time_t t = value / 1000000;
+	if (t != last_time) {
+		::FormatTimestamp(last_stamp, t);
+		last_time = t;
 	}
 
-	char escaped_uri[4096], escaped_referer[2048], escaped_ua[1024];
-
-	if (site)
-		dprintf(fd.Get(),
-			"%s %s - - [%s] \"%s %s HTTP/1.1\" %u %s \"%s\" \"%s\" %s\n",
-			OptionalString(d.site),
-			OptionalString(d.remote_host),
-			stamp, method,
-			EscapeString(d.http_uri, escaped_uri, sizeof(escaped_uri)),
-			d.http_status, length,
-			EscapeString(OptionalString(d.http_referer),
-				     escaped_referer, sizeof(escaped_referer)),
-			EscapeString(OptionalString(d.user_agent),
-				     escaped_ua, sizeof(escaped_ua)),
-			duration);
-	else
-		dprintf(fd.Get(),
-			"%s - - [%s] \"%s %s HTTP/1.1\" %u %s \"%s\" \"%s\" %s\n",
-			OptionalString(d.remote_host),
-			stamp, method,
-			EscapeString(d.http_uri, escaped_uri, sizeof(escaped_uri)),
-			d.http_status, length,
-			EscapeString(OptionalString(d.http_referer),
-				     escaped_referer, sizeof(escaped_referer)),
-			EscapeString(OptionalString(d.user_agent),
-				     escaped_ua, sizeof(escaped_ua)),
-			duration);
-}
-
-static void
-LogOneLineMessage(FileDescriptor fd, const Net::Log::Datagram &d,
-		  bool site)
+	return last_stamp.c_str();
+}
+
+void
+OneLineWriter::Append(const Net::Log::Datagram &d)
 {
+	if (capacity - fill < MAX_LINE)
+		Flush();
 
-	StringBuffer<32> stamp_buffer;
-	const char *stamp =
-		FormatOptionalTimestamp(stamp_buffer, d.valid_timestamp,
-					d.timestamp);
-
-	char escaped_message[4096];
-
-	if (site)
-		dprintf(fd.Get(),
-			"%s [%s] %s\n",
-			OptionalString(d.site),
-			stamp,
-			EscapeString(d.message, escaped_message,
-				     sizeof(escaped_message)));
-	else
-		dprintf(fd.Get(),
-			"[%s] %s\n",
-			stamp,
-			EscapeString(d.message, escaped_message,
-				     sizeof(escaped_message)));}
+	const char *stamp = d.valid_timestamp
+		? FormatTimestamp(d.timestamp)
+		: nullptr;
 
+	char *const p = buffer.get() + fill;
+	const char *end = FormatOneLine(p, p + MAX_LINE, d, site, stamp);
+	if (end != nullptr)
+		fill = end - buffer.get();
+}
 
 void
-LogOneLine(FileDescriptor fd, const Net::Log::Datagram &d, bool site)
+OneLineWriter::Flush()
 {
-	if (d.http_uri != nullptr && d.valid_http_status)
-		LogOneLineHttp(fd, d, site);
-	else if (d.message != nullptr)
-		LogOneLineMessage(fd, d, site);
+	const char *p = buffer.get();
+	const size_t size = fill;
+	fill = 0;
+
+	size_t position = 0;
+	while (position < size) {
+		ssize_t nbytes = fd.Write(p + position, size - position);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw MakeErrno("Failed to write log");
+		}
+
+		position += nbytes;
+	}
 }
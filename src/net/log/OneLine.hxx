@@ -32,8 +32,15 @@
 
 #pragma once
 
+#include "io/FileDescriptor.hxx"
+#include "util/StringBuffer.hxx"
+
+#include <memory>
+
+#include <stddef.h>
+#include <time.h>
+
 namespace Net { namespace Log { struct Datagram; }}
-class FileDescriptor;
 
 /**
  * Print the #Net::Log::Datagram in one line, similar to Apache's
@@ -44,3 +51,70 @@ class FileDescriptor;
 void
 LogOneLine(FileDescriptor fd, const Net::Log::Datagram &d,
 	   bool site=true);
+
+/**
+ * Formats many #Net::Log::Datagram instances in the format of
+ * LogOneLine() into one buffer and writes them to the file
+ * descriptor with one system call.
+ *
+ * Buffered lines are not written automatically by the destructor;
+ * the caller must invoke Flush().
+ */
+class OneLineWriter {
+	/**
+	 * The maximum length of one formatted line.  Longer fields
+	 * are truncated.
+	 */
+	static constexpr size_t MAX_LINE = 16384;
+
+	FileDescriptor fd;
+
+	const bool site;
+
+	const size_t capacity;
+
+	const std::unique_ptr<char[]> buffer;
+
+	size_t fill = 0;
+
+	/**
+	 * Cache for the most recently formatted timestamp (in
+	 * seconds), because localtime_r() is expensive.
+	 */
+	time_t last_time = -1;
+	StringBuffer<32> last_stamp;
+
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+	/**
+	 * @param site log the site name?
+	 * @param _capacity the buffer size; must be at least 16 kB
+	 */
+	explicit OneLineWriter(FileDescriptor _fd, bool _site=true,
+			       size_t _capacity=DEFAULT_CAPACITY);
+
+	bool IsEmpty() const noexcept {
+		return fill == 0;
+	}
+
+	/**
+	 * Format the datagram into the buffer.  If there is not
+	 * enough room, the buffer is flushed first.  Datagrams which
+	 * cannot be logged in one line are ignored.
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void Append(const Net::Log::Datagram &d);
+
+	/**
+	 * Write all buffered lines.
+	 *
+	 * Throws std::system_error on error; the buffer is cleared
+	 * anyway.
+	 */
+	void Flush();
+
+private:
+	const char *FormatTimestamp(uint64_t value) noexcept;
+};
@@ -224,8 +224,8 @@ log_server_apply_attributes(const void *p, const uint8_t *end)
 	}
 }
 
-Datagram
-Net::Log::ParseDatagram(ConstBuffer<void> _d)
+ConstBuffer<void>
+Net::Log::VerifyDatagram(ConstBuffer<void> _d)
 {
 	auto d = ConstBuffer<uint8_t>::FromVoid(_d);
 
@@ -250,7 +250,7 @@ Net::Log::ParseDatagram(ConstBuffer<void> _d)
 		if (crc.checksum() != FromBE32(expected_crc))
 			throw ProtocolError();
 
-		return log_server_apply_attributes(d.data, d.data + d.size);
+		return d.ToVoid();
 	}
 
 	/* allow both little-endian and big-endian magic in the V1
@@ -259,6 +259,13 @@ Net::Log::ParseDatagram(ConstBuffer<void> _d)
 	if (*magic != ToLE32(MAGIC_V1) && *magic != ToBE32(MAGIC_V1))
 		throw ProtocolError();
 
+	return d.ToVoid();
+}
+
+Datagram
+Net::Log::ParseDatagram(ConstBuffer<void> _d)
+{
+	auto d = ConstBuffer<uint8_t>::FromVoid(VerifyDatagram(_d));
 	return log_server_apply_attributes(d.data, d.data + d.size);
 }
 
@@ -41,6 +41,17 @@ struct Datagram;
 
 class ProtocolError {};
 
+/**
+ * Verify the magic and (for protocol version 2) the CRC of a log
+ * datagram.
+ *
+ * Throws #ProtocolError on error.
+ *
+ * @return the attributes (i.e. the datagram without magic and CRC)
+ */
+ConstBuffer<void>
+VerifyDatagram(ConstBuffer<void> d);
+
 /**
  * Throws #ProtocolError on error.
  */
@@ -40,6 +40,7 @@
 #include "util/ByteOrder.hxx"
 #include "util/StaticArray.hxx"
 
+#include <string.h>
 #include <sys/socket.h>
 
 class SocketDescriptor;
@@ -81,14 +82,43 @@ MakeIovecAttribute()
 	return MakeIovecStatic<Attribute, value>();
 }
 
-void
-Send(SocketDescriptor s, const Datagram &d)
-{
-	StaticArray<struct iovec, 64> v;
+namespace {
 
-	v.push_back(MakeIovecStatic<uint32_t, ToBE32(MAGIC_V2)>());
+/**
+ * Build the list of iovecs for one log datagram.  Scalar attribute
+ * values are converted to network byte order and stored in this
+ * object, so it must be kept alive until the iovecs have been
+ * consumed.
+ */
+struct DatagramVector {
+	StaticArray<struct iovec, 64> v;
 
 	uint64_t timestamp;
+	uint8_t http_method;
+	uint16_t http_status;
+	uint64_t length;
+
+	struct {
+		uint64_t received, sent;
+	} traffic;
+
+	uint64_t duration;
+
+	uint32_t crc_value;
+
+	explicit DatagramVector(const Datagram &d) noexcept;
+
+	DatagramVector(const DatagramVector &) = delete;
+	DatagramVector &operator=(const DatagramVector &) = delete;
+
+	operator ConstBuffer<struct iovec>() const noexcept {
+		return {&v.front(), v.size()};
+	}
+};
+
+DatagramVector::DatagramVector(const Datagram &d) noexcept
+{
+	v.push_back(MakeIovecStatic<uint32_t, ToBE32(MAGIC_V2)>());
 
 	if (d.valid_timestamp) {
 		v.push_back(MakeIovecAttribute<Attribute::TIMESTAMP>());
@@ -116,7 +146,6 @@ Send(SocketDescriptor s, const Datagram &d)
 		v.push_back(MakeIovec(d.forwarded_to));
 	}
 
-	uint8_t http_method;
 	if (d.valid_http_method) {
 		v.push_back(MakeIovecAttribute<Attribute::HTTP_METHOD>());
 		http_method = uint8_t(d.http_method);
@@ -144,24 +173,18 @@ Send(SocketDescriptor s, const Datagram &d)
 		v.push_back(MakeIovecStatic<uint8_t, 0>());
 	}
 
-	uint16_t http_status;
 	if (d.valid_http_status) {
 		v.push_back(MakeIovecAttribute<Attribute::HTTP_STATUS>());
 		http_status = ToBE16(int(d.http_status));
 		v.push_back(MakeIovecT(http_status));
 	}
 
-	uint64_t length;
 	if (d.valid_length) {
 		v.push_back(MakeIovecAttribute<Attribute::LENGTH>());
 		length = ToBE64(d.length);
 		v.push_back(MakeIovecT(length));
 	}
 
-	struct {
-		uint64_t received, sent;
-	} traffic;
-
 	if (d.valid_traffic) {
 		v.push_back(MakeIovecAttribute<Attribute::TRAFFIC>());
 		traffic.received = ToBE64(d.traffic_received);
@@ -169,7 +192,6 @@ Send(SocketDescriptor s, const Datagram &d)
 		v.push_back(MakeIovecT(traffic));
 	}
 
-	uint64_t duration;
 	if (d.valid_duration) {
 		v.push_back(MakeIovecAttribute<Attribute::DURATION>());
 		duration = ToBE64(d.duration);
@@ -188,11 +210,36 @@ Send(SocketDescriptor s, const Datagram &d)
 	for (auto i = begin; i != end; ++i)
 		crc.process_bytes(i->iov_base, i->iov_len);
 
-	const uint32_t crc_value = ToBE32(crc.checksum());
+	crc_value = ToBE32(crc.checksum());
 	v.push_back(MakeIovecT(crc_value));
+}
+
+}
+
+void
+Send(SocketDescriptor s, const Datagram &d)
+{
+	const DatagramVector v(d);
+	SendMessage(s, ConstBuffer<struct iovec>(v), MSG_DONTWAIT);
+}
+
+size_t
+Serialize(void *_buffer, size_t size, const Datagram &d) noexcept
+{
+	const DatagramVector v(d);
+
+	uint8_t *buffer = (uint8_t *)_buffer;
+	size_t position = 0;
+
+	for (const auto &i : v.v) {
+		if (i.iov_len > size - position)
+			return 0;
+
+		memcpy(buffer + position, i.iov_base, i.iov_len);
+		position += i.iov_len;
+	}
 
-	SendMessage(s, ConstBuffer<struct iovec>(&v.front(), v.size()),
-		    MSG_DONTWAIT);
+	return position;
 }
 
 }}
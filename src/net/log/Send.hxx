@@ -32,6 +32,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 class SocketDescriptor;
 
 namespace Net {
@@ -47,4 +49,13 @@ struct Datagram;
 void
 Send(SocketDescriptor s, const Datagram &d);
 
+/**
+ * Serialize a log datagram into the given buffer, in the same format
+ * as Send().
+ *
+ * @return the size of the datagram, or 0 if the buffer is too small
+ */
+size_t
+Serialize(void *buffer, size_t size, const Datagram &d) noexcept;
+
 }}
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "BufferPool.hxx"
+#include "util/Poison.h"
+
+#include <assert.h>
+
+BufferPool::BufferPool(size_t _buffer_size, size_t slab_size) noexcept
+	:buffer_size(_buffer_size), slab_buffers(slab_size / _buffer_size)
+{
+	assert(buffer_size >= sizeof(FreeBuffer));
+	assert(slab_buffers > 0);
+}
+
+BufferPool::~BufferPool() noexcept = default;
+
+size_t
+BufferPool::GetTotalSize() noexcept
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	return n_total * buffer_size;
+}
+
+size_t
+BufferPool::GetUsedCount() noexcept
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	return n_total - n_free;
+}
+
+void
+BufferPool::AllocateSlab()
+{
+	LargeAllocation allocation(slab_buffers * buffer_size);
+	auto *p = (unsigned char *)allocation.get();
+	slabs.emplace(p, Slab{std::move(allocation), slab_buffers});
+
+	/* link the new buffers in address order */
+	FreeBuffer *head = free_list;
+	for (size_t i = slab_buffers; i > 0; --i) {
+		auto *b = (FreeBuffer *)(p + (i - 1) * buffer_size);
+		b->next = head;
+		head = b;
+	}
+
+	free_list = head;
+	n_total += slab_buffers;
+	n_free += slab_buffers;
+}
+
+BufferPool::Slab &
+BufferPool::FindSlab(const void *p) noexcept
+{
+	auto i = slabs.upper_bound(p);
+	assert(i != slabs.begin());
+	--i;
+
+	assert(p < (const unsigned char *)i->first + slab_buffers * buffer_size);
+	return i->second;
+}
+
+void
+BufferPool::ReleaseSlab(std::map<const void *, Slab>::iterator i) noexcept
+{
+	assert(i->second.n_free == slab_buffers);
+
+	const auto *begin = (const unsigned char *)i->first;
+	const auto *end = begin + slab_buffers * buffer_size;
+
+	for (FreeBuffer **b = &free_list; *b != nullptr;) {
+		const auto *p = (const unsigned char *)*b;
+		if (p >= begin && p < end)
+			*b = (*b)->next;
+		else
+			b = &(*b)->next;
+	}
+
+	slabs.erase(i);
+	n_total -= slab_buffers;
+	n_free -= slab_buffers;
+}
+
+BufferPool::FreeBuffer *
+BufferPool::GetBatch(size_t n, size_t &n_result)
+{
+	assert(n > 0);
+
+	const std::lock_guard<std::mutex> lock(mutex);
+
+	if (free_list == nullptr)
+		AllocateSlab();
+
+	FreeBuffer *head = free_list, *tail = head;
+	size_t i = 1;
+	while (i < n && tail->next != nullptr) {
+		tail = tail->next;
+		++i;
+	}
+
+	free_list = tail->next;
+	tail->next = nullptr;
+	n_free -= i;
+
+	for (auto *b = head; b != nullptr; b = b->next)
+		--FindSlab(b).n_free;
+
+	n_result = i;
+	return head;
+}
+
+void
+BufferPool::PutBatch(FreeBuffer *head, FreeBuffer *tail,
+		     size_t n) noexcept
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+
+	bool slab_freed = false;
+	for (auto *b = head;; b = b->next) {
+		if (++FindSlab(b).n_free == slab_buffers)
+			slab_freed = true;
+
+		if (b == tail)
+			break;
+	}
+
+	tail->next = free_list;
+	free_list = head;
+	n_free += n;
+
+	if (!slab_freed)
+		return;
+
+	/* release completely free slabs, but keep at least one
+	   slab's worth of free buffers */
+	for (auto i = slabs.begin();
+	     i != slabs.end() && n_free >= 2 * slab_buffers;) {
+		if (i->second.n_free == slab_buffers)
+			ReleaseSlab(i++);
+		else
+			++i;
+	}
+}
+
+void *
+BufferPool::Get()
+{
+	size_t n;
+	void *p = GetBatch(1, n);
+	PoisonUndefined(p, buffer_size);
+	return p;
+}
+
+void
+BufferPool::Put(void *p) noexcept
+{
+	auto *b = (FreeBuffer *)p;
+	PutBatch(b, b, 1);
+}
+
+void *
+BufferCache::Get()
+{
+	if (head == nullptr)
+		head = pool.GetBatch(BATCH, n);
+
+	assert(n > 0);
+
+	auto *b = head;
+	head = b->next;
+	--n;
+
+	PoisonUndefined(b, pool.GetBufferSize());
+	return b;
+}
+
+void
+BufferCache::Put(void *p) noexcept
+{
+	if (n >= MAX_BUFFERS)
+		Drain(BATCH);
+
+	auto *b = (BufferPool::FreeBuffer *)p;
+	b->next = head;
+	head = b;
+	++n;
+
+	PoisonInaccessible((unsigned char *)p + sizeof(*b),
+			   pool.GetBufferSize() - sizeof(*b));
+}
+
+void
+BufferCache::Drain(size_t count) noexcept
+{
+	assert(count > 0);
+	assert(count <= n);
+
+	/* keep the most recently freed buffers at the head of the
+	   list, return the oldest ones */
+	auto **i = &head;
+	for (size_t skip = n - count; skip > 0; --skip)
+		i = &(*i)->next;
+
+	auto *first = *i, *last = first;
+	while (last->next != nullptr)
+		last = last->next;
+
+	*i = nullptr;
+	n -= count;
+
+	pool.PutBatch(first, last, count);
+}
+
+void
+BufferCache::Flush() noexcept
+{
+	if (n > 0)
+		Drain(n);
+}
+
+BufferCache &
+GetDefaultBufferCache() noexcept
+{
+	/* 2 MB slabs, which may be backed by a transparent huge
+	   page */
+	static BufferPool pool(8192, 2 * 1024 * 1024);
+	static thread_local BufferCache cache(pool);
+	return cache;
+}
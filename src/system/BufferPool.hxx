@@ -0,0 +1,239 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "LargeAllocation.hxx"
+#include "util/Compiler.h"
+
+#include <map>
+#include <mutex>
+
+#include <stddef.h>
+
+class BufferCache;
+
+/**
+ * A thread-safe pool of fixed-size buffers.  Memory is allocated in
+ * large slabs (#LargeAllocation), and freed buffers are kept in a
+ * free list for reuse.  A slab whose buffers have all been returned
+ * is released, unless the pool would then have less than one slab's
+ * worth of free buffers left (to avoid allocating again right
+ * away).
+ *
+ * Threads which allocate and free buffers frequently (e.g. an
+ * #EventLoop thread) should use a #BufferCache, which avoids
+ * locking the pool for each operation.
+ */
+class BufferPool {
+	friend class BufferCache;
+
+	/**
+	 * The first bytes of a free buffer link it into the free
+	 * list.
+	 */
+	struct FreeBuffer {
+		FreeBuffer *next;
+	};
+
+	const size_t buffer_size;
+
+	/**
+	 * The number of buffers per slab.
+	 */
+	const size_t slab_buffers;
+
+	std::mutex mutex;
+
+	FreeBuffer *free_list = nullptr;
+
+	struct Slab {
+		LargeAllocation allocation;
+
+		/**
+		 * The number of this slab's buffers in #free_list.
+		 */
+		size_t n_free;
+	};
+
+	/**
+	 * All slabs, indexed by their address.
+	 */
+	std::map<const void *, Slab> slabs;
+
+	/**
+	 * The number of buffers in all slabs.
+	 */
+	size_t n_total = 0;
+
+	/**
+	 * The number of buffers in #free_list.
+	 */
+	size_t n_free = 0;
+
+public:
+	/**
+	 * @param buffer_size the size of each buffer
+	 * @param slab_size the size of each slab
+	 */
+	BufferPool(size_t _buffer_size, size_t slab_size) noexcept;
+
+	~BufferPool() noexcept;
+
+	BufferPool(const BufferPool &) = delete;
+	BufferPool &operator=(const BufferPool &) = delete;
+
+	size_t GetBufferSize() const noexcept {
+		return buffer_size;
+	}
+
+	/**
+	 * Returns the total amount of memory allocated by this pool.
+	 */
+	size_t GetTotalSize() noexcept;
+
+	/**
+	 * Returns the number of buffers which are not in the pool's
+	 * free list (i.e. in use or in a #BufferCache).
+	 */
+	size_t GetUsedCount() noexcept;
+
+	/**
+	 * Throws std::bad_alloc on error.
+	 */
+	void *Get();
+
+	void Put(void *p) noexcept;
+
+private:
+	/**
+	 * Take up to #n buffers from the free list, allocating a new
+	 * slab if it is empty.
+	 *
+	 * Throws std::bad_alloc on error.
+	 *
+	 * @return the head of a list of at least one buffer
+	 */
+	FreeBuffer *GetBatch(size_t n, size_t &n_result);
+
+	/**
+	 * Return a list of buffers.
+	 */
+	void PutBatch(FreeBuffer *head, FreeBuffer *tail, size_t n) noexcept;
+
+	/**
+	 * Caller must lock the mutex.
+	 */
+	void AllocateSlab();
+
+	/**
+	 * Find the slab containing the given buffer.  Caller must
+	 * lock the mutex.
+	 */
+	gcc_pure
+	Slab &FindSlab(const void *p) noexcept;
+
+	/**
+	 * Remove all buffers of the given (completely free) slab from
+	 * the free list and release it.  Caller must lock the mutex.
+	 */
+	void ReleaseSlab(std::map<const void *, Slab>::iterator i) noexcept;
+};
+
+/**
+ * A small LIFO free list in front of a #BufferPool, to be used by
+ * only one thread (e.g. one per #EventLoop).  Recently freed buffers
+ * are handed out first, because they are likely still in the CPU
+ * cache.  Buffers are moved to and from the #BufferPool in batches.
+ */
+class BufferCache {
+	BufferPool &pool;
+
+	BufferPool::FreeBuffer *head = nullptr;
+
+	/**
+	 * The number of buffers in the list at #head.
+	 */
+	size_t n = 0;
+
+	/**
+	 * The maximum number of buffers kept in this cache.
+	 */
+	static constexpr size_t MAX_BUFFERS = 64;
+
+	/**
+	 * The number of buffers moved from/to the #BufferPool at a
+	 * time.
+	 */
+	static constexpr size_t BATCH = MAX_BUFFERS / 2;
+
+public:
+	explicit BufferCache(BufferPool &_pool) noexcept
+		:pool(_pool) {}
+
+	~BufferCache() noexcept {
+		Flush();
+	}
+
+	BufferCache(const BufferCache &) = delete;
+	BufferCache &operator=(const BufferCache &) = delete;
+
+	size_t GetBufferSize() const noexcept {
+		return pool.GetBufferSize();
+	}
+
+	/**
+	 * Throws std::bad_alloc on error.
+	 */
+	void *Get();
+
+	void Put(void *p) noexcept;
+
+	/**
+	 * Return all cached buffers to the #BufferPool.
+	 */
+	void Flush() noexcept;
+
+private:
+	/**
+	 * Remove #count buffers from the list and return them to the
+	 * #BufferPool.
+	 */
+	void Drain(size_t count) noexcept;
+};
+
+/**
+ * Returns the calling thread's #BufferCache for a process-wide pool
+ * of 8 kB buffers (e.g. for socket input buffers).
+ */
+BufferCache &
+GetDefaultBufferCache() noexcept;
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "IoUring.hxx"
+#include "Error.hxx"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p) noexcept
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	       unsigned flags) noexcept
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, nullptr, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg,
+		  unsigned nr_args) noexcept
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *
+MapRing(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(nullptr, size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, fd, offset);
+	if (p == MAP_FAILED)
+		throw MakeErrno("Failed to map io_uring");
+
+	return p;
+}
+
+template<typename T>
+static T *
+RingPointer(void *ring, unsigned offset) noexcept
+{
+	return (T *)((char *)ring + offset);
+}
+
+IoUring::IoUring(unsigned entries, unsigned flags)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+
+	fd = UniqueFileDescriptor(FileDescriptor(io_uring_setup(entries, &p)));
+	if (!fd.IsDefined())
+		throw MakeErrno("io_uring_setup() failed");
+
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_ring_size > sq_ring_size)
+			sq_ring_size = cq_ring_size;
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = MapRing(fd.Get(), sq_ring_size, IORING_OFF_SQ_RING);
+
+	try {
+		cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+			? sq_ring
+			: MapRing(fd.Get(), cq_ring_size, IORING_OFF_CQ_RING);
+
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		try {
+			sqes = (struct io_uring_sqe *)
+				MapRing(fd.Get(), sqes_size, IORING_OFF_SQES);
+		} catch (...) {
+			if (cq_ring != sq_ring)
+				munmap(cq_ring, cq_ring_size);
+			throw;
+		}
+	} catch (...) {
+		munmap(sq_ring, sq_ring_size);
+		throw;
+	}
+
+	sq_head = RingPointer<unsigned>(sq_ring, p.sq_off.head);
+	sq_tail = RingPointer<unsigned>(sq_ring, p.sq_off.tail);
+	sq_array = RingPointer<unsigned>(sq_ring, p.sq_off.array);
+	sq_mask = *RingPointer<unsigned>(sq_ring, p.sq_off.ring_mask);
+	sq_entries = *RingPointer<unsigned>(sq_ring, p.sq_off.ring_entries);
+	sqe_tail = *sq_tail;
+
+	cq_head = RingPointer<unsigned>(cq_ring, p.cq_off.head);
+	cq_tail = RingPointer<unsigned>(cq_ring, p.cq_off.tail);
+	cq_mask = *RingPointer<unsigned>(cq_ring, p.cq_off.ring_mask);
+	cqes = RingPointer<struct io_uring_cqe>(cq_ring, p.cq_off.cqes);
+}
+
+IoUring::~IoUring() noexcept
+{
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+}
+
+struct io_uring_sqe *
+IoUring::GetSubmitEntry() noexcept
+{
+	const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sqe_tail - head >= sq_entries)
+		return nullptr;
+
+	const unsigned i = sqe_tail++ & sq_mask;
+	sq_array[i] = i;
+
+	struct io_uring_sqe *sqe = &sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+IoUring::Submit(unsigned wait_nr) noexcept
+{
+	const unsigned n = sqe_tail - *sq_tail;
+	if (n == 0 && wait_nr == 0)
+		return 0;
+
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+	int result;
+	do {
+		result = io_uring_enter(fd.Get(), n, wait_nr,
+					wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (result < 0 && errno == EINTR);
+
+	return result;
+}
+
+struct io_uring_cqe *
+IoUring::PeekCompletion() noexcept
+{
+	const unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return nullptr;
+
+	return &cqes[head & cq_mask];
+}
+
+void
+IoUring::SeenCompletion() noexcept
+{
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool
+IoUring::RegisterBufferRing(struct io_uring_buf_ring *br,
+			    unsigned entries, unsigned group) noexcept
+{
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = entries;
+	reg.bgid = group;
+
+	return io_uring_register(fd.Get(), IORING_REGISTER_PBUF_RING,
+				 &reg, 1) == 0;
+}
+
+bool
+IoUring::UnregisterBufferRing(unsigned group) noexcept
+{
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = group;
+
+	return io_uring_register(fd.Get(), IORING_UNREGISTER_PBUF_RING,
+				 &reg, 1) == 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+
+#ifndef __linux__
+#error This header is Linux-specific.
+#endif
+
+/**
+ * A minimal wrapper for a Linux io_uring instance, using the system
+ * calls directly (without liburing).  It is not thread-safe; all
+ * methods must be called from the same thread.
+ */
+class IoUring {
+	UniqueFileDescriptor fd;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries;
+
+	/**
+	 * The local submission queue tail; entries between
+	 * #sq_tail and this one have been obtained with
+	 * GetSubmitEntry(), but not yet submitted.
+	 */
+	unsigned sqe_tail;
+
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+public:
+	/**
+	 * Throws std::system_error on error.
+	 *
+	 * @param entries the size of the submission queue
+	 * @param flags IORING_SETUP_* flags
+	 */
+	explicit IoUring(unsigned entries, unsigned flags=0);
+
+	~IoUring() noexcept;
+
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	FileDescriptor GetFileDescriptor() const noexcept {
+		return FileDescriptor(fd.Get());
+	}
+
+	/**
+	 * Obtain a cleared submission queue entry.  It will be
+	 * submitted with the next Submit() call.
+	 *
+	 * @return nullptr if the submission queue is full
+	 */
+	struct io_uring_sqe *GetSubmitEntry() noexcept;
+
+	/**
+	 * Are there entries which have not yet been submitted?
+	 */
+	bool HasPending() const noexcept {
+		return sqe_tail != *sq_tail;
+	}
+
+	/**
+	 * Submit all entries obtained with GetSubmitEntry() to the
+	 * kernel.
+	 *
+	 * @param wait_nr the number of completions to wait for
+	 * @return the number of submitted entries or -1 on error
+	 * (errno is set)
+	 */
+	int Submit(unsigned wait_nr=0) noexcept;
+
+	/**
+	 * @return the oldest completion queue entry or nullptr if
+	 * there is none; after processing it, call SeenCompletion()
+	 */
+	struct io_uring_cqe *PeekCompletion() noexcept;
+
+	/**
+	 * Release the entry returned by PeekCompletion().
+	 */
+	void SeenCompletion() noexcept;
+
+	/**
+	 * Register a ring of provided buffers
+	 * (IORING_REGISTER_PBUF_RING, Linux 5.19).
+	 *
+	 * @param br the page-aligned ring memory
+	 * @param entries the number of ring entries; must be a power
+	 * of two
+	 * @param group the buffer group id
+	 * @return false on error (errno is set)
+	 */
+	bool RegisterBufferRing(struct io_uring_buf_ring *br,
+				unsigned entries, unsigned group) noexcept;
+
+	/**
+	 * @return false on error (errno is set)
+	 */
+	bool UnregisterBufferRing(unsigned group) noexcept;
+};
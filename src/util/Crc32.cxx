@@ -0,0 +1,264 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Crc32.hxx"
+#include "ByteOrder.hxx"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CLMUL
+#include <immintrin.h>
+#endif
+
+static constexpr uint32_t CRC32_POLYNOMIAL = 0xedb88320;
+
+struct Crc32Tables {
+	uint32_t t[8][256];
+
+	constexpr Crc32Tables() noexcept:t() {
+		for (unsigned i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (unsigned j = 0; j < 8; ++j)
+				c = (c >> 1) ^ (c & 1 ? CRC32_POLYNOMIAL : 0);
+			t[0][i] = c;
+		}
+
+		for (unsigned k = 1; k < 8; ++k)
+			for (unsigned i = 0; i < 256; ++i)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+	}
+};
+
+static constexpr Crc32Tables crc32_tables;
+
+static inline uint32_t
+Load32(const uint8_t *p) noexcept
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+uint32_t
+Crc32::UpdateTable(uint32_t crc, const void *data, size_t size) noexcept
+{
+	const auto &t = crc32_tables.t;
+	const uint8_t *p = (const uint8_t *)data;
+
+	if (IsLittleEndian()) {
+		while (size >= 8) {
+			const uint32_t one = Load32(p) ^ crc;
+			const uint32_t two = Load32(p + 4);
+			crc = t[7][one & 0xff] ^
+				t[6][(one >> 8) & 0xff] ^
+				t[5][(one >> 16) & 0xff] ^
+				t[4][one >> 24] ^
+				t[3][two & 0xff] ^
+				t[2][(two >> 8) & 0xff] ^
+				t[1][(two >> 16) & 0xff] ^
+				t[0][two >> 24];
+			p += 8;
+			size -= 8;
+		}
+	}
+
+	while (size-- > 0)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#ifdef HAVE_CLMUL
+
+/**
+ * Fold 64 byte blocks with carry-less multiplication, then reduce
+ * to 32 bits with a Barrett reduction.  This is the algorithm
+ * described in Intel's paper "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction"; the constants are for
+ * the reflected CRC-32 polynomial.
+ *
+ * @param size the number of bytes; must be at least 64 and a
+ * multiple of 16
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+FoldClmul(uint32_t crc, const uint8_t *p, size_t size) noexcept
+{
+	assert(size >= 64);
+	assert(size % 16 == 0);
+
+	alignas(16) static constexpr uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+	alignas(16) static constexpr uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+	alignas(16) static constexpr uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+	alignas(16) static constexpr uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+
+	p += 64;
+	size -= 64;
+
+	/* fold four 128 bit lanes in parallel */
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+		p += 64;
+		size -= 64;
+	}
+
+	/* fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold the remaining 128 bit blocks */
+	while (size >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		p += 16;
+		size -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+bool
+Crc32::HasClmul() noexcept
+{
+	static const bool value = __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("sse4.1");
+	return value;
+}
+
+uint32_t
+Crc32::UpdateClmul(uint32_t crc, const void *data, size_t size) noexcept
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	if (size >= 64) {
+		const size_t n = size & ~size_t(15);
+		crc = FoldClmul(crc, p, n);
+		p += n;
+		size -= n;
+	}
+
+	return UpdateTable(crc, p, size);
+}
+
+#else
+
+bool
+Crc32::HasClmul() noexcept
+{
+	return false;
+}
+
+uint32_t
+Crc32::UpdateClmul(uint32_t crc, const void *data, size_t size) noexcept
+{
+	return UpdateTable(crc, data, size);
+}
+
+#endif
+
+uint32_t
+Crc32::Update(uint32_t crc, const void *data, size_t size) noexcept
+{
+	/* the folding kernel has a setup cost which is only worth it
+	   for larger buffers */
+	if (size >= 64 && HasClmul())
+		return UpdateClmul(crc, data, size);
+
+	return UpdateTable(crc, data, size);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Implementation of the CRC-32 algorithm (polynomial 0x04c11db7,
+ * reflected, as used by zlib and Ethernet).  It is API-compatible
+ * with boost::crc_32_type, but much faster: it uses "slicing-by-8"
+ * tables, and on x86 CPUs with the PCLMULQDQ instruction, a carry-less
+ * multiplication folding kernel.
+ */
+
+#ifndef CRC32_HXX
+#define CRC32_HXX
+
+#include "Compiler.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Crc32 {
+	uint32_t state = 0xffffffff;
+
+public:
+	typedef uint32_t value_type;
+
+	void reset() noexcept {
+		state = 0xffffffff;
+	}
+
+	void process_bytes(const void *data, size_t size) noexcept {
+		state = Update(state, data, size);
+	}
+
+	gcc_pure
+	value_type checksum() const noexcept {
+		return ~state;
+	}
+
+	/**
+	 * Calculate the CRC-32 of the given buffer.
+	 */
+	gcc_pure
+	static value_type Calculate(const void *data, size_t size) noexcept {
+		return ~Update(0xffffffff, data, size);
+	}
+
+	/**
+	 * Update the (non-inverted) CRC state, using the fastest
+	 * implementation supported by this CPU.
+	 */
+	gcc_pure gcc_hot
+	static uint32_t Update(uint32_t state,
+			       const void *data, size_t size) noexcept;
+
+	/**
+	 * The portable "slicing-by-8" implementation.
+	 */
+	gcc_pure gcc_hot
+	static uint32_t UpdateTable(uint32_t state,
+				    const void *data, size_t size) noexcept;
+
+	/**
+	 * Does this CPU support UpdateClmul()?
+	 */
+	gcc_const
+	static bool HasClmul() noexcept;
+
+	/**
+	 * The PCLMULQDQ implementation; may only be called if
+	 * HasClmul() returns true.
+	 */
+	gcc_pure gcc_hot
+	static uint32_t UpdateClmul(uint32_t state,
+				    const void *data, size_t size) noexcept;
+};
+
+#endif
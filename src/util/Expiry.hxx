@@ -45,26 +45,32 @@ class Expiry {
 	typedef clock_type::duration duration_type;
 	value_type value;
 
-	constexpr Expiry(value_type _value):value(_value) {}
-
 public:
 	Expiry() = default;
 
+	/**
+	 * Construct from a time point, e.g. a cached one from
+	 * EventLoop::SteadyNow(), to be passed to Touched(), Touch()
+	 * or IsExpired() instead of calling Now() each time.
+	 */
+	explicit constexpr Expiry(value_type _value) noexcept
+		:value(_value) {}
+
 	static Expiry Now() noexcept {
-		return clock_type::now();
+		return Expiry(clock_type::now());
 	}
 
 	static constexpr Expiry AlreadyExpired() noexcept {
-		return value_type::min();
+		return Expiry(value_type::min());
 	}
 
 	static constexpr Expiry Never() noexcept {
-		return value_type::max();
+		return Expiry(value_type::max());
 	}
 
 	static constexpr Expiry Touched(Expiry now,
 					duration_type duration) noexcept {
-		return now.value + duration;
+		return Expiry(now.value + duration);
 	}
 
 	static Expiry Touched(duration_type duration) noexcept {
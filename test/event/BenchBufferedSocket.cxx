@@ -0,0 +1,565 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for #BufferedSocket over AF_LOCAL and loopback TCP
+ * socket pairs.  For each transport, it measures bulk throughput
+ * (reading, writing and "direct" splice() transfers) and the
+ * round-trip latency of small messages.
+ *
+ * The system call counts are the number of successful receive,
+ * send and splice() calls made on behalf of the #BufferedSocket;
+ * calls which failed with EAGAIN and the peer's calls are not
+ * counted.
+ */
+
+#include "event/net/BufferedSocket.hxx"
+#include "event/Loop.hxx"
+#include "io/Splice.hxx"
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/**
+ * The size of each chunk sent by the bulk benchmarks.
+ */
+static constexpr size_t CHUNK_SIZE = 65536;
+
+/**
+ * The size of each ping-pong message.
+ */
+static constexpr size_t MESSAGE_SIZE = 64;
+
+static constexpr double MEGABYTE = 1024 * 1024;
+
+struct Transport {
+	const char *name;
+
+	/**
+	 * Create a connected pair of sockets.  The first one is
+	 * non-blocking and will be used with #BufferedSocket, the
+	 * second one is blocking.
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void (*create)(int sv[2]);
+};
+
+static void
+CreateLocalPair(int sv[2])
+{
+	if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0)
+		throw MakeErrno("socketpair() failed");
+
+	SocketDescriptor(sv[0]).SetNonBlocking();
+}
+
+static void
+CreateTcpPair(int sv[2])
+{
+	const int listener = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		throw MakeErrno("Failed to create socket");
+
+	struct sockaddr_in sin{};
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sin_size = sizeof(sin);
+
+	if (bind(listener, (const struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(listener, 1) < 0 ||
+	    getsockname(listener, (struct sockaddr *)&sin, &sin_size) < 0) {
+		const int e = errno;
+		close(listener);
+		throw MakeErrno(e, "Failed to listen");
+	}
+
+	sv[0] = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sv[0] < 0 ||
+	    connect(sv[0], (const struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		const int e = errno;
+		close(listener);
+		throw MakeErrno(e, "Failed to connect");
+	}
+
+	sv[1] = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+	close(listener);
+	if (sv[1] < 0)
+		throw MakeErrno("Failed to accept");
+
+	SocketDescriptor(sv[0]).SetNoDelay();
+	SocketDescriptor(sv[1]).SetNoDelay();
+	SocketDescriptor(sv[0]).SetNonBlocking();
+}
+
+static constexpr Transport transports[] = {
+	{ "local", CreateLocalPair },
+	{ "tcp", CreateTcpPair },
+};
+
+struct Result {
+	double bytes = 0, syscalls = 0, round_trips = 0;
+
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+
+	double elapsed;
+
+	void Stop() noexcept {
+		const std::chrono::duration<double> d =
+			std::chrono::steady_clock::now() - start;
+		elapsed = d.count();
+	}
+
+	void Print(const char *transport, const char *mode) const noexcept {
+		printf("%-5s %-9s %10.1f MB/s %10.1f syscalls/MB",
+		       transport, mode,
+		       bytes / MEGABYTE / elapsed,
+		       syscalls / (bytes / MEGABYTE));
+
+		if (round_trips > 0)
+			printf(" %8.2f us/round-trip",
+			       elapsed * 1e6 / round_trips);
+
+		printf("\n");
+	}
+};
+
+/**
+ * Common code for all benchmark handlers: errors stop the
+ * #EventLoop and are rethrown by Run().
+ */
+class BenchHandler : public BufferedSocketHandler {
+protected:
+	EventLoop &loop;
+
+	std::exception_ptr error;
+
+public:
+	BufferedSocket socket;
+
+	explicit BenchHandler(EventLoop &_loop) noexcept
+		:loop(_loop), socket(_loop) {}
+
+	~BenchHandler() noexcept {
+		if (socket.IsValid()) {
+			if (socket.IsConnected())
+				socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	void Init(int fd) noexcept {
+		socket.Init(SocketDescriptor(fd), FdType::FD_SOCKET,
+			    nullptr, nullptr, *this);
+	}
+
+	void Run() {
+		loop.Dispatch();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	/* virtual methods from class BufferedSocketHandler */
+	BufferedResult OnBufferedData() override {
+		socket.Consumed(socket.GetAvailable());
+		return BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		error = std::make_exception_ptr(std::runtime_error("Peer closed the socket"));
+		loop.Break();
+		return false;
+	}
+
+	bool OnBufferedWrite() override {
+		socket.UnscheduleWrite();
+		return true;
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+		loop.Break();
+	}
+};
+
+/**
+ * Send #size bytes to the (blocking) socket in a new thread.
+ */
+static std::thread
+StartSender(int fd, size_t size)
+{
+	return std::thread([fd, size](){
+			std::unique_ptr<char[]> buffer(new char[CHUNK_SIZE]());
+			size_t position = 0;
+			while (position < size) {
+				ssize_t nbytes = send(fd, buffer.get(),
+						      std::min(size - position,
+							       CHUNK_SIZE),
+						      MSG_NOSIGNAL);
+				if (nbytes <= 0)
+					break;
+
+				position += nbytes;
+			}
+		});
+}
+
+/**
+ * Receive #size bytes from the (blocking) socket in a new thread.
+ */
+static std::thread
+StartReceiver(int fd, size_t size)
+{
+	return std::thread([fd, size](){
+			std::unique_ptr<char[]> buffer(new char[CHUNK_SIZE]);
+			size_t position = 0;
+			while (position < size) {
+				ssize_t nbytes = recv(fd, buffer.get(),
+						      CHUNK_SIZE, 0);
+				if (nbytes <= 0)
+					break;
+
+				position += nbytes;
+			}
+		});
+}
+
+/**
+ * Receives data into the input buffer and discards it.
+ */
+class ReadHandler final : public BenchHandler {
+	const size_t size;
+
+	size_t received = 0;
+
+public:
+	ReadHandler(EventLoop &_loop, size_t _size) noexcept
+		:BenchHandler(_loop), size(_size) {}
+
+	BufferedResult OnBufferedData() override {
+		received += socket.GetAvailable();
+		socket.Consumed(socket.GetAvailable());
+
+		if (received >= size)
+			loop.Break();
+
+		return BufferedResult::OK;
+	}
+};
+
+static Result
+BenchRead(const Transport &transport, size_t size)
+{
+	int sv[2];
+	transport.create(sv);
+
+	EventLoop loop;
+	ReadHandler handler(loop, size);
+	handler.Init(sv[0]);
+
+	Result result;
+	auto sender = StartSender(sv[1], size);
+	handler.socket.Read(false);
+	handler.Run();
+	result.Stop();
+
+	sender.join();
+	close(sv[1]);
+
+	result.bytes = size;
+	result.syscalls = handler.socket.GetReadStats().reads;
+	return result;
+}
+
+/**
+ * Writes chunks until the socket blocks.
+ */
+class WriteHandler final : public BenchHandler {
+	const size_t size;
+
+	std::unique_ptr<char[]> buffer;
+
+public:
+	size_t sent = 0;
+	unsigned writes = 0;
+
+	WriteHandler(EventLoop &_loop, size_t _size)
+		:BenchHandler(_loop), size(_size),
+		 buffer(new char[CHUNK_SIZE]()) {}
+
+	bool OnBufferedWrite() override {
+		while (sent < size) {
+			ssize_t nbytes = socket.Write(buffer.get(),
+						      std::min(size - sent,
+							       CHUNK_SIZE));
+			++writes;
+
+			if (nbytes == WRITE_BLOCKING)
+				return true;
+
+			if (nbytes < 0)
+				throw MakeErrno("Failed to send");
+
+			sent += nbytes;
+		}
+
+		socket.UnscheduleWrite();
+		loop.Break();
+		return true;
+	}
+};
+
+static Result
+BenchWrite(const Transport &transport, size_t size)
+{
+	int sv[2];
+	transport.create(sv);
+
+	EventLoop loop;
+	WriteHandler handler(loop, size);
+	handler.Init(sv[0]);
+
+	Result result;
+	auto receiver = StartReceiver(sv[1], size);
+	if (handler.OnBufferedWrite() && handler.sent < size)
+		handler.Run();
+	result.Stop();
+
+	receiver.join();
+	close(sv[1]);
+
+	result.bytes = size;
+	result.syscalls = handler.writes;
+	return result;
+}
+
+/**
+ * Transfers data from the socket to /dev/null with splice() (via a
+ * pipe) in BufferedSocketHandler::OnBufferedDirect().
+ */
+class DirectHandler final : public BenchHandler {
+	const size_t size;
+
+	int pipe_fds[2];
+	int null_fd;
+
+public:
+	size_t received = 0;
+	unsigned splices = 0;
+
+	DirectHandler(EventLoop &_loop, size_t _size)
+		:BenchHandler(_loop), size(_size) {
+		if (pipe2(pipe_fds, O_CLOEXEC|O_NONBLOCK) < 0)
+			throw MakeErrno("pipe2() failed");
+
+		null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+		if (null_fd < 0)
+			throw MakeErrno("Failed to open /dev/null");
+	}
+
+	~DirectHandler() noexcept {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		close(null_fd);
+	}
+
+	DirectResult OnBufferedDirect(SocketDescriptor fd,
+				      FdType) override {
+		ssize_t nbytes = SpliceToPipe(fd.Get(), pipe_fds[1],
+					      CHUNK_SIZE);
+		if (nbytes < 0)
+			return errno == EAGAIN
+				? DirectResult::EMPTY
+				: DirectResult::ERRNO;
+
+		if (nbytes == 0)
+			return DirectResult::END;
+
+		++splices;
+
+		size_t remaining = nbytes;
+		while (remaining > 0) {
+			ssize_t n = Splice(pipe_fds[0], null_fd, remaining);
+			if (n <= 0)
+				return DirectResult::ERRNO;
+
+			++splices;
+			remaining -= n;
+		}
+
+		received += nbytes;
+		if (received >= size)
+			loop.Break();
+
+		return DirectResult::OK;
+	}
+};
+
+static Result
+BenchDirect(const Transport &transport, size_t size)
+{
+	int sv[2];
+	transport.create(sv);
+
+	EventLoop loop;
+	DirectHandler handler(loop, size);
+	handler.Init(sv[0]);
+	handler.socket.SetDirect(true);
+
+	Result result;
+	auto sender = StartSender(sv[1], size);
+	handler.socket.Read(false);
+	handler.Run();
+	result.Stop();
+
+	sender.join();
+	close(sv[1]);
+
+	result.bytes = size;
+	result.syscalls = handler.splices;
+	return result;
+}
+
+/**
+ * One side of the ping-pong benchmark.  The client sends a message
+ * and waits for the server to echo it back.
+ */
+class PingPongHandler final : public BenchHandler {
+	const bool client;
+
+	unsigned remaining;
+
+public:
+	unsigned writes = 0;
+
+	PingPongHandler(EventLoop &_loop, bool _client,
+			unsigned _round_trips) noexcept
+		:BenchHandler(_loop), client(_client),
+		 remaining(_round_trips) {}
+
+	/**
+	 * Throws std::system_error on error.
+	 */
+	void Send(const void *data, size_t length) {
+		++writes;
+		if (socket.Write(data, length) != ssize_t(length))
+			throw MakeErrno("Failed to send");
+	}
+
+	BufferedResult OnBufferedData() override {
+		auto r = socket.ReadBuffer();
+
+		if (!client) {
+			/* echo */
+			Send(r.data, r.size);
+			socket.Consumed(r.size);
+			return BufferedResult::OK;
+		}
+
+		if (r.size < MESSAGE_SIZE)
+			return BufferedResult::MORE;
+
+		socket.Consumed(MESSAGE_SIZE);
+
+		if (--remaining == 0) {
+			loop.Break();
+			return BufferedResult::OK;
+		}
+
+		Send(r.data, MESSAGE_SIZE);
+		return BufferedResult::OK;
+	}
+};
+
+static Result
+BenchPingPong(const Transport &transport, unsigned round_trips)
+{
+	int sv[2];
+	transport.create(sv);
+	SocketDescriptor(sv[1]).SetNonBlocking();
+
+	EventLoop loop;
+	PingPongHandler client(loop, true, round_trips);
+	PingPongHandler server(loop, false, round_trips);
+	client.Init(sv[0]);
+	server.Init(sv[1]);
+
+	Result result;
+
+	static constexpr char message[MESSAGE_SIZE] = {};
+	client.Send(message, sizeof(message));
+	client.socket.Read(false);
+	server.socket.Read(false);
+	client.Run();
+	result.Stop();
+
+	result.bytes = 2.0 * MESSAGE_SIZE * round_trips;
+	result.round_trips = round_trips;
+	result.syscalls = client.socket.GetReadStats().reads +
+		server.socket.GetReadStats().reads +
+		client.writes + server.writes;
+	return result;
+}
+
+int
+main(int argc, char **argv)
+try {
+	const size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+	const unsigned round_trips = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000;
+	const size_t size = megabytes * 1024 * 1024;
+
+	for (const auto &t : transports) {
+		BenchRead(t, size).Print(t.name, "read");
+		BenchWrite(t, size).Print(t.name, "write");
+		BenchDirect(t, size).Print(t.name, "direct");
+		BenchPingPong(t, round_trips).Print(t.name, "ping-pong");
+	}
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmark for #EventLoop.  This program is built twice: once
+ * with the libevent backend and once with the native epoll backend
+ * (#ENABLE_EPOLL), to compare the two.
+ */
+
+#include "event/Loop.hxx"
+#include "event/SocketEvent.hxx"
+#include "event/TimerEvent.hxx"
+#include "event/Duration.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef ENABLE_EPOLL
+static constexpr const char *backend = "epoll";
+#else
+static constexpr const char *backend = "libevent";
+#endif
+
+/**
+ * One end of a socketpair which echoes each byte back to its peer
+ * until the configured number of round trips has been reached.
+ */
+class PingPong {
+	SocketEvent event;
+
+	unsigned remaining;
+
+public:
+	PingPong(EventLoop &loop, int fd, unsigned _remaining)
+		:event(loop, fd, SocketEvent::READ|SocketEvent::PERSIST,
+		       BIND_THIS_METHOD(OnSocketReady)),
+		 remaining(_remaining) {
+		event.Add();
+	}
+
+	~PingPong() noexcept {
+		event.Delete();
+	}
+
+	bool Send() noexcept {
+		static constexpr char ch = 'x';
+		return write(event.GetFd(), &ch, sizeof(ch)) == sizeof(ch);
+	}
+
+private:
+	void OnSocketReady(unsigned) {
+		char ch;
+		if (read(event.GetFd(), &ch, sizeof(ch)) != sizeof(ch)) {
+			event.Delete();
+			return;
+		}
+
+		if (remaining == 0) {
+			/* wake up the peer, which will then see
+			   end-of-file */
+			shutdown(event.GetFd(), SHUT_RDWR);
+			event.Delete();
+			return;
+		}
+
+		--remaining;
+		if (!Send())
+			event.Delete();
+	}
+};
+
+static double
+Elapsed(std::chrono::steady_clock::time_point start)
+{
+	const std::chrono::duration<double> d =
+		std::chrono::steady_clock::now() - start;
+	return d.count();
+}
+
+static void
+BenchPingPong(unsigned n_pairs, unsigned n_round_trips)
+{
+	EventLoop loop;
+
+	std::vector<UniqueSocketDescriptor> sockets;
+	std::vector<std::unique_ptr<PingPong>> pairs;
+
+	for (unsigned i = 0; i < n_pairs; ++i) {
+		int sv[2];
+		if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+			       0, sv) < 0)
+			throw MakeErrno("socketpair() failed");
+
+		sockets.emplace_back(sv[0]);
+		sockets.emplace_back(sv[1]);
+
+		pairs.emplace_back(new PingPong(loop, sv[0], n_round_trips));
+		pairs.emplace_back(new PingPong(loop, sv[1], n_round_trips));
+		if (!pairs.back()->Send())
+			throw MakeErrno("Failed to send");
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	loop.Dispatch();
+	const double elapsed = Elapsed(start);
+
+	const double n_events = 2.0 * n_pairs * n_round_trips;
+	printf("%s ping-pong: %u pairs, %.0f events in %.3fs (%.0f events/s)\n",
+	       backend, n_pairs, n_events, elapsed, n_events / elapsed);
+}
+
+static void
+NoCallback()
+{
+}
+
+static void
+BenchTimers(unsigned n_timers, unsigned n_iterations)
+{
+	EventLoop loop;
+
+	std::vector<std::unique_ptr<TimerEvent>> timers;
+	for (unsigned i = 0; i < n_timers; ++i)
+		timers.emplace_back(new TimerEvent(loop, BIND_FUNCTION(NoCallback)));
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (unsigned j = 0; j < n_iterations; ++j) {
+		for (unsigned i = 0; i < n_timers; ++i)
+			timers[i]->Add(MakeEventDuration(60 + i % 60));
+		for (auto &i : timers)
+			i->Cancel();
+	}
+
+	const double elapsed = Elapsed(start);
+	const double n_ops = 2.0 * n_timers * n_iterations;
+	printf("%s timers: %.0f add/cancel operations in %.3fs (%.0f ops/s)\n",
+	       backend, n_ops, elapsed, n_ops / elapsed);
+}
+
+int
+main(int argc, char **argv)
+try {
+	const unsigned n_pairs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+	const unsigned n_round_trips = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+
+	BenchPingPong(n_pairs, n_round_trips);
+	BenchTimers(1000, 1000);
+	return EXIT_SUCCESS;
+} catch (const std::exception &e) {
+	PrintException(e);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/BufferedSocket.hxx"
+#include "event/TimerEvent.hxx"
+#include "event/Loop.hxx"
+
+#include <gtest/gtest.h>
+
+#include <exception>
+#include <memory>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace {
+
+class CorkHandler final : public BufferedSocketHandler {
+	EventLoop &loop;
+
+public:
+	BufferedSocket socket;
+
+	unsigned drained = 0, writable = 0;
+	std::exception_ptr error;
+
+	CorkHandler(EventLoop &_loop, SocketDescriptor fd)
+		:loop(_loop), socket(_loop) {
+		socket.Init(fd, FdType::FD_SOCKET, nullptr, nullptr, *this);
+		socket.SetAutoCork(true);
+	}
+
+	~CorkHandler() noexcept {
+		if (socket.IsValid()) {
+			if (socket.IsConnected())
+				socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	BufferedResult OnBufferedData() override {
+		return BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		return true;
+	}
+
+	bool OnBufferedDrained() noexcept override {
+		++drained;
+		loop.Break();
+		return true;
+	}
+
+	bool OnBufferedWrite() override {
+		++writable;
+		socket.UnscheduleWrite();
+		return true;
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+	}
+};
+
+/**
+ * Run one #EventLoop iteration.
+ */
+static void
+RunOnce(EventLoop &loop)
+{
+	TimerEvent timer(loop, BIND_METHOD(loop, &EventLoop::Break));
+	static constexpr struct timeval zero{0, 0};
+	timer.Add(zero);
+	loop.Dispatch();
+}
+
+}
+
+TEST(AutoCork, Coalesce)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK, 0, sv), 0);
+
+	EventLoop loop;
+	CorkHandler handler(loop, SocketDescriptor(sv[0]));
+
+	EXPECT_EQ(handler.socket.Write("foo", 3), 3);
+	EXPECT_EQ(handler.socket.Write("bar", 3), 3);
+
+	const struct iovec v[] = {
+		{const_cast<char *>("a"), 1},
+		{const_cast<char *>("bc"), 2},
+	};
+	EXPECT_EQ(handler.socket.WriteV(v, 2), 3);
+
+	/* nothing has been sent yet */
+	char buffer[64];
+	EXPECT_EQ(recv(sv[1], buffer, sizeof(buffer), 0), -1);
+	EXPECT_EQ(errno, EAGAIN);
+	EXPECT_FALSE(handler.socket.IsCorkEmpty());
+
+	RunOnce(loop);
+
+	EXPECT_TRUE(handler.socket.IsCorkEmpty());
+	ssize_t nbytes = recv(sv[1], buffer, sizeof(buffer), 0);
+	ASSERT_EQ(nbytes, 9);
+	EXPECT_EQ(memcmp(buffer, "foobarabc", 9), 0);
+	EXPECT_EQ(handler.error, nullptr);
+
+	close(sv[1]);
+}
+
+TEST(AutoCork, Large)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK, 0, sv), 0);
+
+	EventLoop loop;
+	CorkHandler handler(loop, SocketDescriptor(sv[0]));
+
+	static constexpr size_t LARGE = 65536;
+	std::unique_ptr<char[]> large(new char[LARGE]);
+	memset(large.get(), 'x', LARGE);
+
+	/* a small write is buffered, and a large one is sent together
+	   with it, preserving the order */
+	EXPECT_EQ(handler.socket.Write("head", 4), 4);
+	ssize_t nbytes = handler.socket.Write(large.get(), LARGE);
+	ASSERT_GT(nbytes, 0);
+	EXPECT_TRUE(handler.socket.IsCorkEmpty());
+
+	char buffer[8];
+	ASSERT_EQ(recv(sv[1], buffer, 4, 0), 4);
+	EXPECT_EQ(memcmp(buffer, "head", 4), 0);
+	ASSERT_EQ(recv(sv[1], buffer, 1, 0), 1);
+	EXPECT_EQ(buffer[0], 'x');
+
+	close(sv[1]);
+}
+
+TEST(AutoCork, Blocking)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK, 0, sv), 0);
+
+	EventLoop loop;
+	CorkHandler handler(loop, SocketDescriptor(sv[0]));
+
+	/* fill the socket buffer */
+	static constexpr size_t LARGE = 65536;
+	std::unique_ptr<char[]> large(new char[LARGE]);
+	memset(large.get(), 'x', LARGE);
+	size_t filled = 0;
+	while (true) {
+		ssize_t nbytes = send(sv[0], large.get(), LARGE, MSG_DONTWAIT);
+		if (nbytes < 0)
+			break;
+		filled += nbytes;
+	}
+
+	EXPECT_EQ(handler.socket.Write("tail", 4), 4);
+	RunOnce(loop);
+
+	/* the socket is full: the data is still in the cork
+	   buffer */
+	EXPECT_FALSE(handler.socket.IsCorkEmpty());
+	EXPECT_EQ(handler.drained, 0u);
+
+	/* drain the peer; the write event flushes the rest */
+	std::thread reader([&sv, filled](){
+			std::unique_ptr<char[]> buffer(new char[LARGE]);
+			size_t received = 0;
+			while (received < filled + 4) {
+				ssize_t nbytes = recv(sv[1], buffer.get(),
+						      LARGE, MSG_WAITALL);
+				if (nbytes > 0)
+					received += nbytes;
+				else if (nbytes < 0 && errno != EAGAIN)
+					break;
+			}
+		});
+
+	loop.Dispatch();
+	EXPECT_TRUE(handler.socket.IsCorkEmpty());
+
+	reader.join();
+	close(sv[1]);
+
+	EXPECT_EQ(handler.drained, 1u);
+	/* the handler did not ask for OnBufferedWrite() */
+	EXPECT_EQ(handler.writable, 0u);
+	EXPECT_EQ(handler.error, nullptr);
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the #EventLoop dispatch order.  This program is built
+ * twice: once with the libevent backend and once with the native
+ * epoll backend (#ENABLE_EPOLL), to verify that both behave the
+ * same.
+ */
+
+#include "event/Loop.hxx"
+#include "event/SocketEvent.hxx"
+#include "event/TimerEvent.hxx"
+
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+class SocketPair {
+public:
+	int fds[2];
+
+	SocketPair() noexcept {
+		if (socketpair(AF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+			fds[0] = fds[1] = -1;
+	}
+
+	~SocketPair() noexcept {
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	bool Send() noexcept {
+		static constexpr char ch = 'x';
+		return write(fds[1], &ch, sizeof(ch)) == sizeof(ch);
+	}
+};
+
+class ReadableSocket {
+	EventLoop &loop;
+	SocketEvent event;
+
+public:
+	unsigned n_calls = 0;
+
+	/**
+	 * Call EventLoop::Break() from the callback?
+	 */
+	bool do_break = false;
+
+	ReadableSocket(EventLoop &_loop, int fd) noexcept
+		:loop(_loop),
+		 event(_loop, fd, SocketEvent::READ|SocketEvent::PERSIST,
+		       BIND_THIS_METHOD(OnSocketReady)) {
+		event.Add();
+	}
+
+	~ReadableSocket() noexcept {
+		event.Delete();
+	}
+
+private:
+	void OnSocketReady(unsigned) noexcept {
+		char ch;
+		if (read(event.GetFd(), &ch, sizeof(ch)) <= 0)
+			event.Delete();
+
+		++n_calls;
+		if (do_break)
+			loop.Break();
+	}
+};
+
+struct Counter {
+	unsigned n = 0;
+
+	void OnTimer() noexcept {
+		++n;
+	}
+};
+
+static constexpr struct timeval zero{0, 0};
+
+}
+
+TEST(EventLoop, SocketBeforeTimer)
+{
+	EventLoop loop;
+
+	SocketPair sp;
+	ASSERT_GE(sp.fds[0], 0);
+	ReadableSocket socket(loop, sp.fds[0]);
+	ASSERT_TRUE(sp.Send());
+
+	/* a timer which is due in the same iteration breaks the
+	   loop; the ready socket must be dispatched anyway */
+	TimerEvent timer(loop, BIND_METHOD(loop, &EventLoop::Break));
+	timer.Add(zero);
+	loop.Dispatch();
+
+	EXPECT_EQ(socket.n_calls, 1u);
+}
+
+TEST(EventLoop, BreakFromSocket)
+{
+	EventLoop loop;
+
+	SocketPair a, b;
+	ASSERT_GE(a.fds[0], 0);
+	ASSERT_GE(b.fds[0], 0);
+	ReadableSocket sa(loop, a.fds[0]), sb(loop, b.fds[0]);
+	sa.do_break = sb.do_break = true;
+	ASSERT_TRUE(a.Send());
+	ASSERT_TRUE(b.Send());
+
+	/* Break() stops the iteration after the current callback */
+	loop.Dispatch();
+	EXPECT_EQ(sa.n_calls + sb.n_calls, 1u);
+
+	/* ... but the other socket is not lost */
+	loop.Dispatch();
+	EXPECT_EQ(sa.n_calls, 1u);
+	EXPECT_EQ(sb.n_calls, 1u);
+}
+
+TEST(EventLoop, TimerAfterBreak)
+{
+	EventLoop loop;
+
+	SocketPair sp;
+	ASSERT_GE(sp.fds[0], 0);
+	ReadableSocket socket(loop, sp.fds[0]);
+	socket.do_break = true;
+	ASSERT_TRUE(sp.Send());
+
+	Counter counter;
+	TimerEvent timer(loop, BIND_METHOD(counter, &Counter::OnTimer));
+	timer.Add(zero);
+
+	loop.Dispatch();
+	EXPECT_EQ(socket.n_calls, 1u);
+
+	/* the timer is not lost if a socket callback breaks the
+	   loop */
+	loop.LoopOnceNonBlock();
+	EXPECT_EQ(counter.n, 1u);
+}
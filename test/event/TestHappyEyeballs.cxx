@@ -0,0 +1,310 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/HappyEyeballs.hxx"
+#include "event/Loop.hxx"
+#include "event/TimerEvent.hxx"
+#include "net/AddressInfo.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/IPv6Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace {
+
+struct Handler final : ConnectSocketHandler {
+	EventLoop &loop;
+
+	UniqueSocketDescriptor fd;
+	bool success = false, timeout = false, error = false;
+
+	explicit Handler(EventLoop &_loop):loop(_loop) {}
+
+	void OnSocketConnectSuccess(UniqueSocketDescriptor &&_fd) noexcept override {
+		fd = std::move(_fd);
+		success = true;
+		loop.Break();
+	}
+
+	void OnSocketConnectTimeout() noexcept override {
+		timeout = true;
+		loop.Break();
+	}
+
+	void OnSocketConnectError(std::exception_ptr) noexcept override {
+		error = true;
+		loop.Break();
+	}
+};
+
+/**
+ * A listener on a random loopback port.
+ */
+struct Listener {
+	UniqueSocketDescriptor fd;
+	unsigned port;
+
+	explicit Listener(SocketAddress address=IPv4Address(127, 0, 0, 1, 0),
+			  int backlog=16) {
+		fd.CreateNonBlock(address.GetFamily(), SOCK_STREAM, 0);
+		fd.Bind(address);
+		fd.Listen(backlog);
+		port = fd.GetLocalAddress().GetPort();
+	}
+};
+
+/**
+ * A listener whose accept queue is full: the kernel drops all
+ * further SYN packets, so connection attempts neither succeed nor
+ * fail.
+ */
+struct BlackholeListener : Listener {
+	UniqueSocketDescriptor filler;
+
+	BlackholeListener()
+		:Listener(IPv4Address(127, 0, 0, 1, 0), 0) {
+		filler.Create(AF_INET, SOCK_STREAM, 0);
+		filler.Connect(IPv4Address(127, 0, 0, 1, port));
+	}
+};
+
+/**
+ * Obtain a port on which nobody listens.
+ */
+static unsigned
+ClosedPort()
+{
+	Listener l;
+	return l.port;
+}
+
+/**
+ * Verifies that the operation is still in progress.
+ */
+struct PendingCheck {
+	HappyEyeballsConnect &connect;
+	Handler &handler;
+	bool checked = false;
+
+	PendingCheck(HappyEyeballsConnect &_connect, Handler &_handler)
+		:connect(_connect), handler(_handler) {}
+
+	void OnTimer() noexcept {
+		EXPECT_TRUE(connect.IsPending());
+		EXPECT_FALSE(handler.success);
+		EXPECT_FALSE(handler.error);
+		checked = true;
+	}
+};
+
+static struct addrinfo *
+Lookup(const char *host, unsigned port)
+{
+	struct addrinfo hints{};
+	hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *ai;
+	if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &ai) != 0)
+		return nullptr;
+	return ai;
+}
+
+/**
+ * Build an #AddressInfoList from several getaddrinfo() results.
+ */
+static AddressInfoList
+MakeList(std::initializer_list<struct addrinfo *> l)
+{
+	struct addrinfo *head = nullptr, **tail = &head;
+	for (auto *ai : l) {
+		if (ai == nullptr)
+			continue;
+
+		*tail = ai;
+		while (*tail != nullptr)
+			tail = &(*tail)->ai_next;
+	}
+
+	return AddressInfoList(head);
+}
+
+}
+
+static constexpr struct timeval timeout{10, 0};
+
+TEST(HappyEyeballs, Single)
+{
+	EventLoop loop;
+	Listener listener;
+	Handler handler(loop);
+	HappyEyeballsConnect connect(loop, handler);
+
+	connect.Connect(MakeList({Lookup("127.0.0.1", listener.port)}),
+			timeout);
+	loop.Dispatch();
+
+	EXPECT_TRUE(handler.success);
+	EXPECT_TRUE(handler.fd.IsDefined());
+	EXPECT_FALSE(connect.IsPending());
+}
+
+TEST(HappyEyeballs, FallbackAfterRefused)
+{
+	EventLoop loop;
+	Listener listener;
+	Handler handler(loop);
+
+	/* a long stagger delay: the fallback must be started by the
+	   failure, not by the timer */
+	HappyEyeballsConnect connect(loop, handler, {60, 0});
+
+	const unsigned closed = ClosedPort();
+	connect.Connect(MakeList({
+				Lookup("::1", closed),
+				Lookup("127.0.0.1", closed),
+				Lookup("::1", closed),
+				Lookup("127.0.0.1", listener.port),
+			}),
+		timeout);
+	loop.Dispatch();
+
+	EXPECT_TRUE(handler.success);
+	EXPECT_FALSE(handler.error);
+	EXPECT_FALSE(connect.IsPending());
+}
+
+TEST(HappyEyeballs, Stagger)
+{
+	EventLoop loop;
+	BlackholeListener blackhole;
+	Listener listener;
+	Handler handler(loop);
+	HappyEyeballsConnect connect(loop, handler);
+
+	/* halfway through the stagger delay, the first attempt must
+	   still be running, and no second one may have succeeded */
+	PendingCheck check{connect, handler};
+	TimerEvent check_timer(loop, BIND_METHOD(check, &PendingCheck::OnTimer));
+	static constexpr struct timeval half_stagger{0, 125000};
+	check_timer.Add(half_stagger);
+
+	const auto start = std::chrono::steady_clock::now();
+	connect.Connect(MakeList({
+				Lookup("127.0.0.1", blackhole.port),
+				Lookup("127.0.0.1", listener.port),
+			}),
+		timeout);
+	loop.Dispatch();
+	const auto duration = std::chrono::steady_clock::now() - start;
+
+	EXPECT_TRUE(check.checked);
+	EXPECT_TRUE(handler.success);
+	EXPECT_FALSE(handler.error);
+	EXPECT_FALSE(connect.IsPending());
+
+	/* the second attempt was started by the stagger timer, not
+	   by a failure of the first one (with some tolerance for the
+	   event loop's cached clock) */
+	EXPECT_GE(duration, std::chrono::milliseconds(240));
+
+	ASSERT_TRUE(handler.fd.IsDefined());
+	EXPECT_EQ(handler.fd.GetPeerAddress().GetPort(), listener.port);
+}
+
+TEST(HappyEyeballs, Interleave)
+{
+	EventLoop loop;
+	Listener listener4;
+	Listener listener6(IPv6Address(0, 0, 0, 0, 0, 0, 0, 1, 0));
+	Handler handler(loop);
+
+	/* failures start the next attempt immediately */
+	HappyEyeballsConnect connect(loop, handler, {60, 0});
+
+	/* Connect() reorders the list to ::1/closed, 127.0.0.1,
+	   ::1; in the original order, the IPv6 listener would
+	   win */
+	const unsigned closed = ClosedPort();
+	connect.Connect(MakeList({
+				Lookup("::1", closed),
+				Lookup("::1", listener6.port),
+				Lookup("127.0.0.1", listener4.port),
+			}),
+		timeout);
+	loop.Dispatch();
+
+	EXPECT_TRUE(handler.success);
+	ASSERT_TRUE(handler.fd.IsDefined());
+
+	const auto peer = handler.fd.GetPeerAddress();
+	EXPECT_EQ(peer.GetFamily(), AF_INET);
+	EXPECT_EQ(peer.GetPort(), listener4.port);
+}
+
+TEST(HappyEyeballs, AllFailed)
+{
+	EventLoop loop;
+	Handler handler(loop);
+	HappyEyeballsConnect connect(loop, handler);
+
+	const unsigned closed = ClosedPort();
+	connect.Connect(MakeList({
+				Lookup("127.0.0.1", closed),
+				Lookup("::1", closed),
+			}),
+		timeout);
+	loop.Dispatch();
+
+	EXPECT_FALSE(handler.success);
+	EXPECT_TRUE(handler.error);
+	EXPECT_FALSE(connect.IsPending());
+}
+
+TEST(HappyEyeballs, Empty)
+{
+	EventLoop loop;
+	Handler handler(loop);
+	HappyEyeballsConnect connect(loop, handler);
+
+	connect.Connect(AddressInfoList(), timeout);
+	EXPECT_TRUE(handler.error);
+	EXPECT_FALSE(connect.IsPending());
+}
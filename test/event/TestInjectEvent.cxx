@@ -0,0 +1,110 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/InjectEvent.hxx"
+#include "event/Loop.hxx"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+namespace {
+
+struct Counter {
+	InjectEvent event;
+	unsigned n = 0;
+
+	explicit Counter(EventLoop &loop)
+		:event(loop, BIND_THIS_METHOD(OnInject)) {}
+
+	void OnInject() noexcept {
+		++n;
+		event.GetEventLoop().Break();
+	}
+};
+
+}
+
+TEST(InjectEvent, Basic)
+{
+	EventLoop loop;
+	Counter c(loop);
+
+	/* two injections before the loop runs are coalesced */
+	c.event.Schedule();
+	c.event.Schedule();
+	loop.Dispatch();
+	EXPECT_EQ(c.n, 1u);
+
+	/* a canceled event is not invoked */
+	c.event.Schedule();
+	c.event.Cancel();
+	loop.LoopOnceNonBlock();
+	EXPECT_EQ(c.n, 1u);
+
+	/* ... but it can be scheduled again */
+	c.event.Schedule();
+	c.event.Cancel();
+	c.event.Schedule();
+	loop.Dispatch();
+	EXPECT_EQ(c.n, 2u);
+}
+
+TEST(InjectEvent, Thread)
+{
+	EventLoop loop;
+	Counter c(loop);
+
+	std::thread thread([&c](){
+			c.event.Schedule();
+		});
+
+	loop.Dispatch();
+	thread.join();
+
+	EXPECT_EQ(c.n, 1u);
+}
+
+TEST(InjectEvent, DestroyPending)
+{
+	EventLoop loop;
+	Counter c(loop);
+
+	{
+		Counter d(loop);
+		d.event.Schedule();
+		c.event.Schedule();
+	}
+
+	loop.Dispatch();
+	EXPECT_EQ(c.n, 1u);
+}
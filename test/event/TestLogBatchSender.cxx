@@ -0,0 +1,199 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/log/BatchSender.hxx"
+#include "event/Loop.hxx"
+#include "net/log/Datagram.hxx"
+#include "net/log/Parser.hxx"
+#include "net/log/Send.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <sys/socket.h>
+
+namespace {
+
+static Net::Log::Datagram
+MakeDatagram(const char *site)
+{
+	Net::Log::Datagram d;
+	d.site = site;
+	d.http_uri = "/foo";
+	d.valid_http_status = true;
+	d.http_status = HTTP_STATUS_OK;
+	return d;
+}
+
+struct Pair {
+	UniqueSocketDescriptor sender, receiver;
+
+	Pair() {
+		UniqueSocketDescriptor::CreateSocketPairNonBlock(AF_LOCAL, SOCK_DGRAM, 0,
+								 sender, receiver);
+	}
+
+	/**
+	 * Send datagrams with the site "fill" until the receive queue
+	 * is full.
+	 */
+	void Fill() {
+		char buffer[256];
+		const size_t size = Net::Log::Serialize(buffer, sizeof(buffer),
+							MakeDatagram("fill"));
+		while (send(sender.Get(), buffer, size, MSG_DONTWAIT) > 0) {}
+	}
+
+	/**
+	 * Receive all pending datagrams and return the "site" of
+	 * each one.
+	 */
+	std::vector<std::string> ReceiveSites() {
+		std::vector<std::string> result;
+
+		char buffer[8192];
+		ssize_t nbytes;
+		while ((nbytes = recv(receiver.Get(), buffer, sizeof(buffer),
+				      MSG_DONTWAIT)) > 0) {
+			const auto d = Net::Log::ParseDatagram(ConstBuffer<void>(buffer, nbytes));
+			result.emplace_back(d.site != nullptr ? d.site : "");
+		}
+
+		return result;
+	}
+};
+
+
+}
+
+TEST(LogBatchSender, Deferred)
+{
+	EventLoop loop;
+	Pair p;
+	Net::Log::BatchSender sender(loop, p.sender, 16, 8);
+
+	sender.Send(MakeDatagram("a"));
+	sender.Send(MakeDatagram("b"));
+
+	/* nothing is sent until the event loop runs */
+	EXPECT_EQ(sender.GetPending(), 2u);
+	EXPECT_TRUE(p.ReceiveSites().empty());
+
+	loop.LoopNonBlock();
+
+	EXPECT_EQ(sender.GetPending(), 0u);
+	EXPECT_EQ(p.ReceiveSites(), (std::vector<std::string>{"a", "b"}));
+	EXPECT_EQ(sender.GetStats().sent, 2u);
+	EXPECT_EQ(sender.GetStats().flushes, 1u);
+}
+
+TEST(LogBatchSender, Threshold)
+{
+	EventLoop loop;
+	Pair p;
+	Net::Log::BatchSender sender(loop, p.sender, 16, 3);
+
+	sender.Send(MakeDatagram("a"));
+	sender.Send(MakeDatagram("b"));
+	EXPECT_EQ(sender.GetPending(), 2u);
+	sender.Send(MakeDatagram("c"));
+	EXPECT_EQ(sender.GetPending(), 0u);
+
+	EXPECT_EQ(p.ReceiveSites(), (std::vector<std::string>{"a", "b", "c"}));
+}
+
+TEST(LogBatchSender, Overflow)
+{
+	EventLoop loop;
+	Pair p;
+	Net::Log::BatchSender sender(loop, p.sender, 4, 100);
+
+	for (unsigned i = 0; i < 6; ++i)
+		sender.Send(MakeDatagram("x"));
+
+	EXPECT_EQ(sender.GetStats().dropped, 2u);
+
+	sender.Flush();
+	EXPECT_EQ(p.ReceiveSites().size(), 4u);
+	EXPECT_EQ(sender.GetStats().sent, 4u);
+}
+
+TEST(LogBatchSender, Oversized)
+{
+	EventLoop loop;
+	Pair p;
+	Net::Log::BatchSender sender(loop, p.sender, 4, 100, 64);
+
+	const std::string large(200, 'x');
+
+	sender.Send(MakeDatagram("a"));
+	sender.Send(MakeDatagram(large.c_str()));
+	sender.Send(MakeDatagram("b"));
+	sender.Flush();
+
+	EXPECT_EQ(p.ReceiveSites(),
+		  (std::vector<std::string>{"a", large, "b"}));
+	EXPECT_EQ(sender.GetStats().oversized, 1u);
+	EXPECT_EQ(sender.GetStats().sent, 3u);
+}
+
+TEST(LogBatchSender, OversizedCongested)
+{
+	EventLoop loop;
+	Pair p;
+	Net::Log::BatchSender sender(loop, p.sender, 4, 100, 64);
+
+	const std::string large(200, 'x');
+
+	p.Fill();
+	sender.Send(MakeDatagram("a"));
+	sender.Flush();
+	EXPECT_EQ(sender.GetPending(), 1u);
+
+	/* "a" is still queued; sending this one directly would
+	   overtake it */
+	sender.Send(MakeDatagram(large.c_str()));
+	EXPECT_EQ(sender.GetStats().dropped, 1u);
+	EXPECT_EQ(sender.GetStats().oversized, 0u);
+
+	const auto fill = p.ReceiveSites();
+	EXPECT_FALSE(fill.empty());
+	EXPECT_EQ(fill.back(), "fill");
+
+	sender.Flush();
+	EXPECT_EQ(p.ReceiveSites(), (std::vector<std::string>{"a"}));
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/LoopStats.hxx"
+#include "event/Loop.hxx"
+#include "event/DeferEvent.hxx"
+#include "event/TimerEvent.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+using std::chrono::microseconds;
+
+TEST(EventLoopStats, Histogram)
+{
+	EventLoopStats stats;
+
+	stats.AddIteration(microseconds(100), microseconds(0));
+	stats.AddIteration(microseconds(100), microseconds(15));
+	stats.AddIteration(microseconds(100), microseconds(16));
+	stats.AddIteration(microseconds(100), microseconds(40));
+	stats.AddIteration(std::chrono::seconds(10), std::chrono::seconds(10));
+
+	EXPECT_EQ(stats.busy_histogram[0], 2u);
+	EXPECT_EQ(stats.busy_histogram[1], 1u);
+	EXPECT_EQ(stats.busy_histogram[2], 1u);
+	EXPECT_EQ(stats.busy_histogram[EventLoopStats::HISTOGRAM_SIZE - 1], 1u);
+	EXPECT_EQ(stats.poll_time, microseconds(100 + 85 + 84 + 60));
+
+	const auto s = stats.ToString();
+	EXPECT_NE(strstr(s.c_str(), " histogram=2,1,1,0,"), nullptr);
+	EXPECT_NE(strstr(s.c_str(), ",0,1"), nullptr);
+
+	stats.Clear();
+	EXPECT_EQ(stats.busy_histogram[0], 0u);
+	EXPECT_EQ(stats.poll_time, EventLoopStats::Duration::zero());
+}
+
+class StatsTest {
+	DeferEvent defer;
+	TimerEvent timer;
+
+	unsigned remaining;
+
+public:
+	StatsTest(EventLoop &loop, unsigned n) noexcept
+		:defer(loop, BIND_THIS_METHOD(OnDeferred)),
+		 timer(loop, BIND_THIS_METHOD(OnTimer)),
+		 remaining(n) {
+		defer.Schedule();
+	}
+
+private:
+	void OnDeferred() noexcept {
+		if (--remaining > 0)
+			defer.Schedule();
+		else {
+			static constexpr struct timeval tv{0, 1000};
+			timer.Add(tv);
+		}
+	}
+
+	void OnTimer() noexcept {
+		/* keep the EventLoop busy for a while */
+		const auto until = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(2);
+		while (std::chrono::steady_clock::now() < until) {}
+	}
+};
+
+TEST(EventLoopStats, Loop)
+{
+	EventLoop loop;
+	loop.EnableStatistics();
+
+	StatsTest test(loop, 3);
+	loop.Dispatch();
+
+	const auto &stats = loop.GetStatistics();
+	EXPECT_GE(stats.iterations, 1u);
+	EXPECT_EQ(stats.max_deferred_callbacks, 3u);
+	EXPECT_GE(stats.callbacks, 4u);
+	EXPECT_GE(stats.longest_callback, std::chrono::milliseconds(2));
+	EXPECT_GE(stats.busy_time, stats.longest_callback);
+
+	loop.ResetStatistics();
+	EXPECT_EQ(loop.GetStatistics().iterations, 0u);
+}
+
+class IdleTest {
+	TimerEvent timer;
+
+	unsigned remaining = 2;
+
+public:
+	std::chrono::steady_clock::duration clock_error;
+
+	explicit IdleTest(EventLoop &loop) noexcept
+		:timer(loop, BIND_THIS_METHOD(OnTimer)) {
+		Schedule();
+	}
+
+private:
+	void Schedule() noexcept {
+		static constexpr struct timeval tv{0, 100000};
+		timer.Add(tv);
+	}
+
+	void OnTimer() noexcept {
+		clock_error = std::chrono::steady_clock::now() -
+			timer.GetEventLoop().SteadyNow();
+
+		if (--remaining > 0)
+			Schedule();
+	}
+};
+
+/**
+ * The time spent waiting for a timer must not be accounted to its
+ * callback, and the callback must see a fresh clock.
+ */
+TEST(EventLoopStats, Idle)
+{
+	EventLoop loop;
+	loop.EnableStatistics();
+
+	IdleTest test(loop);
+	loop.Dispatch();
+
+	const auto &stats = loop.GetStatistics();
+	EXPECT_EQ(stats.callbacks, 2u);
+	EXPECT_LT(stats.longest_callback, std::chrono::milliseconds(20));
+	EXPECT_LT(stats.busy_time, std::chrono::milliseconds(20));
+	EXPECT_GE(stats.poll_time, std::chrono::milliseconds(80));
+	EXPECT_LT(test.clock_error, std::chrono::milliseconds(20));
+}
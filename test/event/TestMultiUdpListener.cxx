@@ -0,0 +1,224 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/MultiUdpListener.hxx"
+#include "event/net/UdpHandler.hxx"
+#include "event/Loop.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <sys/socket.h>
+
+namespace {
+
+static UniqueSocketDescriptor
+CreateUdp()
+{
+	UniqueSocketDescriptor fd;
+	fd.CreateNonBlock(AF_INET, SOCK_DGRAM, 0);
+	fd.Bind(IPv4Address(127, 0, 0, 1, 0));
+	return fd;
+}
+
+/**
+ * Echo every datagram back to its sender.
+ */
+struct EchoHandler final : UdpHandler {
+	MultiUdpListener *listener = nullptr;
+
+	unsigned n_received = 0;
+
+	bool OnUdpDatagram(const void *data, size_t length,
+			   SocketAddress address, int) override {
+		++n_received;
+		listener->Reply(address, data, length);
+		return true;
+	}
+
+	void OnUdpError(std::exception_ptr) noexcept override {
+		ADD_FAILURE();
+	}
+};
+
+/**
+ * Send #n datagrams to the listener and collect the echoes.
+ */
+struct Client {
+	EventLoop &loop;
+	UniqueSocketDescriptor fd = CreateUdp();
+	SocketEvent event;
+
+	unsigned n_expected, n_received = 0;
+
+	Client(EventLoop &_loop, SocketAddress server, unsigned n)
+		:loop(_loop),
+		 event(loop, fd.Get(), SocketEvent::READ|SocketEvent::PERSIST,
+		       BIND_THIS_METHOD(OnReadable)),
+		 n_expected(n) {
+		event.Add();
+
+		for (unsigned i = 0; i < n; ++i)
+			EXPECT_EQ(sendto(fd.Get(), &i, sizeof(i), 0,
+					 server.GetAddress(), server.GetSize()),
+				  ssize_t(sizeof(i)));
+	}
+
+	~Client() noexcept {
+		event.Delete();
+	}
+
+	void OnReadable(unsigned) noexcept {
+		unsigned value;
+		while (recv(fd.Get(), &value, sizeof(value), MSG_DONTWAIT) == sizeof(value)) {
+			EXPECT_EQ(value, n_received);
+			if (++n_received == n_expected) {
+				loop.Break();
+				break;
+			}
+		}
+	}
+};
+
+static void
+RunEcho(bool batch)
+{
+	EventLoop loop;
+	EchoHandler handler;
+
+	auto server = CreateUdp();
+	const auto address = server.GetLocalAddress();
+
+	MultiReceiveMessage multi(16, 64);
+	std::unique_ptr<MultiUdpListener> listener;
+	if (batch)
+		listener.reset(new MultiUdpListener(loop, std::move(server),
+						    std::move(multi),
+						    MultiSendMessage(4, 64),
+						    handler));
+	else
+		listener.reset(new MultiUdpListener(loop, std::move(server),
+						    std::move(multi),
+						    handler));
+	handler.listener = listener.get();
+
+	Client client(loop, address, 32);
+
+	loop.Dispatch();
+
+	EXPECT_EQ(handler.n_received, 32u);
+	EXPECT_EQ(client.n_received, 32u);
+}
+
+}
+
+TEST(MultiUdpListener, Reply)
+{
+	RunEcho(false);
+}
+
+TEST(MultiUdpListener, BatchedReply)
+{
+	RunEcho(true);
+}
+
+TEST(MultiSendMessage, Queue)
+{
+	auto a = CreateUdp(), b = CreateUdp();
+	const auto address = b.GetLocalAddress();
+
+	MultiSendMessage m(2, 4);
+	EXPECT_TRUE(m.IsEmpty());
+	EXPECT_TRUE(m.Add(address, "abc", 3));
+	EXPECT_FALSE(m.Add(address, "too long", 8));
+	EXPECT_TRUE(m.Add(address, "def", 3));
+	EXPECT_TRUE(m.IsFull());
+	EXPECT_FALSE(m.Add(address, "x", 1));
+	EXPECT_EQ(m.GetPending(), 2u);
+
+	EXPECT_EQ(m.Send(a), 2u);
+	EXPECT_TRUE(m.IsEmpty());
+	EXPECT_FALSE(m.IsFull());
+
+	char buffer[8];
+	EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 3);
+	EXPECT_EQ(memcmp(buffer, "abc", 3), 0);
+	EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 3);
+	EXPECT_EQ(memcmp(buffer, "def", 3), 0);
+}
+
+TEST(MultiSendMessage, Ring)
+{
+	UniqueSocketDescriptor a, b;
+	ASSERT_TRUE(UniqueSocketDescriptor::CreateSocketPairNonBlock(AF_LOCAL, SOCK_DGRAM, 0,
+								     a, b));
+
+	/* fill the receive queue */
+	unsigned n_fill = 0;
+	while (send(a.Get(), "", 0, MSG_DONTWAIT) == 0)
+		++n_fill;
+	ASSERT_GT(n_fill, 0u);
+
+	char buffer[8];
+
+	MultiSendMessage m(3, 4);
+	EXPECT_TRUE(m.Add(SocketAddress::Null(), "a", 1));
+	EXPECT_TRUE(m.Add(SocketAddress::Null(), "b", 1));
+	EXPECT_TRUE(m.Add(SocketAddress::Null(), "c", 1));
+	EXPECT_EQ(m.Send(a), 0u);
+
+	/* make room for one datagram */
+	EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 0);
+	--n_fill;
+	EXPECT_EQ(m.Send(a), 1u);
+	EXPECT_EQ(m.GetPending(), 2u);
+
+	/* the slot of "a" is reused while "b" and "c" are still
+	   queued */
+	EXPECT_TRUE(m.Add(SocketAddress::Null(), "d", 1));
+	EXPECT_TRUE(m.IsFull());
+
+	while (n_fill-- > 0)
+		EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 0);
+	EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 1);
+	EXPECT_EQ(buffer[0], 'a');
+
+	EXPECT_EQ(m.Send(a), 3u);
+	EXPECT_TRUE(m.IsEmpty());
+
+	for (char expected : {'b', 'c', 'd'}) {
+		EXPECT_EQ(recv(b.Get(), buffer, sizeof(buffer), MSG_DONTWAIT), 1);
+		EXPECT_EQ(buffer[0], expected);
+	}
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/BufferedSocket.hxx"
+#include "event/Loop.hxx"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+static constexpr size_t TOTAL = 1024 * 1024;
+
+static constexpr uint8_t
+Pattern(size_t i)
+{
+	return uint8_t(i % 251);
+}
+
+/**
+ * Receives #TOTAL bytes and verifies that they arrive in order.
+ */
+class ReadSizeHandler final : public BufferedSocketHandler {
+	EventLoop &loop;
+
+	/**
+	 * Consume at most this number of bytes per
+	 * OnBufferedData() call.
+	 */
+	const size_t max_consume;
+
+public:
+	BufferedSocket socket;
+
+	size_t received = 0;
+	bool corrupt = false;
+	std::exception_ptr error;
+
+	ReadSizeHandler(EventLoop &_loop, SocketDescriptor fd,
+			size_t _max_consume)
+		:loop(_loop), max_consume(_max_consume), socket(_loop) {
+		socket.Init(fd, FdType::FD_SOCKET, nullptr, nullptr, *this);
+	}
+
+	~ReadSizeHandler() noexcept {
+		if (socket.IsValid()) {
+			if (socket.IsConnected())
+				socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	BufferedResult OnBufferedData() override {
+		auto r = socket.ReadBuffer();
+		const size_t n = std::min(r.size, max_consume);
+		const uint8_t *p = (const uint8_t *)r.data;
+
+		for (size_t i = 0; i < n; ++i)
+			if (p[i] != Pattern(received + i))
+				corrupt = true;
+
+		received += n;
+		socket.Consumed(n);
+
+		if (received >= TOTAL)
+			loop.Break();
+
+		return n < r.size
+			? BufferedResult::AGAIN_OPTIONAL
+			: BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		return true;
+	}
+
+	bool OnBufferedWrite() override {
+		return true;
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+		loop.Break();
+	}
+};
+
+static void
+Receive(size_t max_consume, BufferedSocketStats &stats)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK, 0, sv), 0);
+
+	EventLoop loop;
+	ReadSizeHandler handler(loop, SocketDescriptor(sv[0]), max_consume);
+
+	std::thread writer([&sv](){
+			std::unique_ptr<uint8_t[]> data(new uint8_t[TOTAL]);
+			for (size_t i = 0; i < TOTAL; ++i)
+				data[i] = Pattern(i);
+
+			size_t position = 0;
+			while (position < TOTAL) {
+				ssize_t nbytes = send(sv[1], data.get() + position,
+						      TOTAL - position, 0);
+				if (nbytes > 0)
+					position += nbytes;
+				else if (nbytes < 0 && errno != EAGAIN)
+					break;
+			}
+		});
+
+	handler.socket.Read(false);
+	loop.Dispatch();
+
+	writer.join();
+	close(sv[1]);
+
+	EXPECT_EQ(handler.error, nullptr);
+	EXPECT_EQ(handler.received, TOTAL);
+	EXPECT_FALSE(handler.corrupt);
+
+	stats = handler.socket.GetReadStats();
+}
+
+}
+
+TEST(ReadSize, Bulk)
+{
+	BufferedSocketStats stats;
+	Receive(TOTAL, stats);
+
+	EXPECT_GT(stats.reads, 0u);
+	EXPECT_EQ(stats.bytes, TOTAL);
+	EXPECT_DOUBLE_EQ(stats.GetAverageReadSize(),
+			 double(stats.bytes) / double(stats.reads));
+}
+
+TEST(ReadSize, SlowConsumer)
+{
+	/* the handler consumes only small chunks; data received into
+	   the spare buffer must still arrive in order */
+	BufferedSocketStats stats;
+	Receive(1000, stats);
+
+	EXPECT_EQ(stats.bytes, TOTAL);
+}
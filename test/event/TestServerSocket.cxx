@@ -0,0 +1,223 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/ServerSocket.hxx"
+#include "event/TimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+namespace {
+
+class CountingServerSocket final : public ServerSocket {
+public:
+	std::vector<UniqueSocketDescriptor> accepted;
+
+	/**
+	 * Call RemoveEvent() after this number of connections.
+	 */
+	size_t limit = 0;
+
+	using ServerSocket::ServerSocket;
+
+protected:
+	void OnAccept(UniqueSocketDescriptor &&_fd,
+		      SocketAddress) override {
+		accepted.emplace_back(std::move(_fd));
+		if (accepted.size() == limit)
+			RemoveEvent();
+	}
+
+	void OnAcceptError(std::exception_ptr ep) override {
+		std::rethrow_exception(ep);
+	}
+};
+
+/**
+ * Destroys itself after the first connection.
+ */
+class OneShotServerSocket final : public ServerSocket {
+	unsigned &counter;
+
+public:
+	OneShotServerSocket(EventLoop &event_loop, unsigned &_counter)
+		:ServerSocket(event_loop), counter(_counter) {}
+
+protected:
+	void OnAccept(UniqueSocketDescriptor &&,
+		      SocketAddress) override {
+		++counter;
+		delete this;
+	}
+
+	void OnAcceptError(std::exception_ptr ep) override {
+		std::rethrow_exception(ep);
+	}
+};
+
+/**
+ * Run one #EventLoop iteration.
+ */
+static void
+RunOnce(EventLoop &loop)
+{
+	TimerEvent timer(loop, BIND_METHOD(loop, &EventLoop::Break));
+	static constexpr struct timeval zero{0, 0};
+	timer.Add(zero);
+	loop.Dispatch();
+}
+
+static std::vector<int>
+Connect(SocketAddress address, unsigned n)
+{
+	std::vector<int> result;
+	for (unsigned i = 0; i < n; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		EXPECT_EQ(connect(fd, address.GetAddress(), address.GetSize()), 0);
+		result.push_back(fd);
+	}
+
+	return result;
+}
+
+static void
+CloseAll(const std::vector<int> &fds)
+{
+	for (int fd : fds)
+		close(fd);
+}
+
+}
+
+TEST(ServerSocket, AcceptBatch)
+{
+	EventLoop loop;
+	CountingServerSocket server(loop);
+	server.Listen(IPv4Address(127, 0, 0, 1, 0));
+	server.SetAcceptBatch(4);
+
+	const auto clients = Connect(server.GetLocalAddress(), 10);
+
+	unsigned length, backlog;
+	if (server.GetAcceptQueue(length, backlog)) {
+		EXPECT_EQ(length, 10u);
+		EXPECT_GT(backlog, 0u);
+	}
+
+	RunOnce(loop);
+	EXPECT_EQ(server.accepted.size(), 4u);
+	EXPECT_EQ(server.GetStats().callbacks, 1u);
+	EXPECT_EQ(server.GetStats().full_batches, 1u);
+
+	RunOnce(loop);
+	RunOnce(loop);
+	EXPECT_EQ(server.accepted.size(), 10u);
+	EXPECT_EQ(server.GetStats().accepted, 10u);
+	EXPECT_EQ(server.GetStats().errors, 0u);
+
+	CloseAll(clients);
+}
+
+TEST(ServerSocket, RemoveEvent)
+{
+	EventLoop loop;
+	CountingServerSocket server(loop);
+	server.Listen(IPv4Address(127, 0, 0, 1, 0));
+	server.limit = 2;
+
+	const auto clients = Connect(server.GetLocalAddress(), 5);
+
+	/* the batch stops as soon as the handler disables
+	   accepting */
+	RunOnce(loop);
+	EXPECT_EQ(server.accepted.size(), 2u);
+	EXPECT_EQ(server.GetStats().full_batches, 0u);
+
+	CloseAll(clients);
+}
+
+TEST(ServerSocket, DestroyInHandler)
+{
+	EventLoop loop;
+	unsigned counter = 0;
+	auto *server = new OneShotServerSocket(loop, counter);
+	server->Listen(IPv4Address(127, 0, 0, 1, 0));
+
+	/* more connections than the handler survives; the batch
+	   must stop after the first one */
+	const auto clients = Connect(server->GetLocalAddress(), 3);
+	RunOnce(loop);
+	EXPECT_EQ(counter, 1u);
+
+	CloseAll(clients);
+}
+
+TEST(ServerSocket, CpuSteering)
+{
+	/* stay on one CPU, so the connections are received there */
+	const int cpu = sched_getcpu();
+	ASSERT_GE(cpu, 0);
+
+	cpu_set_t old_cpus, cpus;
+	ASSERT_EQ(sched_getaffinity(0, sizeof(old_cpus), &old_cpus), 0);
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	ASSERT_EQ(sched_setaffinity(0, sizeof(cpus), &cpus), 0);
+
+	EventLoop loop;
+	CountingServerSocket a(loop), b(loop);
+	a.Listen(IPv4Address(127, 0, 0, 1, 0), true);
+	b.Listen(a.GetLocalAddress(), true);
+
+	/* socket 0 ("a") would get connections on a CPU which does
+	   not exist */
+	const int map[] = { CPU_SETSIZE, cpu };
+	ASSERT_TRUE(a.GetSocket().SetReusePortCpuMap(map, 2));
+
+	const auto clients = Connect(a.GetLocalAddress(), 8);
+	RunOnce(loop);
+
+	EXPECT_EQ(a.accepted.size(), 0u);
+	EXPECT_EQ(b.accepted.size(), 8u);
+
+	CloseAll(clients);
+	sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/ShardedServerSocket.hxx"
+#include "event/LoopPool.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+static constexpr unsigned N_LOOPS = 3;
+
+class CountingShardedServerSocket final : public ShardedServerSocket {
+	EventLoopPool &pool;
+
+public:
+	std::atomic<unsigned> accepted[N_LOOPS];
+	std::atomic<unsigned> wrong_thread{0};
+	std::atomic<unsigned> errors{0};
+
+	std::thread::id thread_ids[N_LOOPS];
+
+	explicit CountingShardedServerSocket(EventLoopPool &_pool) noexcept
+		:ShardedServerSocket(_pool), pool(_pool) {
+		for (auto &i : accepted)
+			i = 0;
+	}
+
+	unsigned GetTotal() const noexcept {
+		unsigned total = 0;
+		for (const auto &i : accepted)
+			total += i;
+		return total;
+	}
+
+protected:
+	void OnAccept(EventLoop &event_loop,
+		      UniqueSocketDescriptor &&,
+		      SocketAddress) override {
+		for (unsigned i = 0; i < pool.size(); ++i) {
+			if (&pool.GetEventLoop(i) != &event_loop)
+				continue;
+
+			/* each shard is only ever invoked by the thread
+			   of its own EventLoop */
+			if (thread_ids[i] == std::thread::id())
+				thread_ids[i] = std::this_thread::get_id();
+			else if (thread_ids[i] != std::this_thread::get_id())
+				++wrong_thread;
+
+			++accepted[i];
+		}
+	}
+
+	void OnAcceptError(EventLoop &, std::exception_ptr) override {
+		++errors;
+	}
+};
+
+/**
+ * Find a free TCP port on the loopback interface.
+ */
+static unsigned
+FindFreePort()
+{
+	UniqueSocketDescriptor fd;
+	if (!fd.Create(AF_INET, SOCK_STREAM, 0) ||
+	    !fd.Bind(IPv4Address(127, 0, 0, 1, 0)))
+		return 0;
+
+	return fd.GetLocalAddress().GetPort();
+}
+
+}
+
+TEST(ShardedServerSocket, AcceptOnEachShard)
+{
+	EventLoopPool pool(N_LOOPS, false);
+	ASSERT_EQ(pool.size(), N_LOOPS);
+
+	CountingShardedServerSocket server(pool);
+
+	const unsigned port = FindFreePort();
+	ASSERT_GT(port, 0u);
+	const IPv4Address address(127, 0, 0, 1, port);
+	server.Listen(address);
+
+	pool.Start();
+
+	/* the kernel distributes connections among the SO_REUSEPORT
+	   group by hashing the client port; with this many
+	   connections, each shard gets some */
+	static constexpr unsigned N_CONNECTIONS = 100;
+	std::vector<int> clients;
+	for (unsigned i = 0; i < N_CONNECTIONS; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(connect(fd, SocketAddress(address).GetAddress(),
+				  SocketAddress(address).GetSize()), 0);
+		clients.push_back(fd);
+	}
+
+	const auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::seconds(10);
+	while (server.GetTotal() < N_CONNECTIONS &&
+	       std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	pool.Stop();
+
+	EXPECT_EQ(server.GetTotal(), N_CONNECTIONS);
+	for (unsigned i = 0; i < N_LOOPS; ++i)
+		EXPECT_GT(server.accepted[i], 0u);
+
+	for (unsigned i = 0; i < N_LOOPS; ++i)
+		for (unsigned j = i + 1; j < N_LOOPS; ++j)
+			EXPECT_NE(server.thread_ids[i], server.thread_ids[j]);
+
+	EXPECT_EQ(server.wrong_thread, 0u);
+	EXPECT_EQ(server.errors, 0u);
+
+	for (int fd : clients)
+		close(fd);
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/SocketPool.hxx"
+#include "event/Loop.hxx"
+#include "net/IPv4Address.hxx"
+
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * A connected socket pair; the first one is given to the
+ * #SocketPool, the second one is the "peer".
+ */
+struct Pair {
+	UniqueSocketDescriptor fd, peer;
+
+	Pair() {
+		UniqueSocketDescriptor::CreateSocketPairNonBlock(AF_LOCAL, SOCK_STREAM, 0,
+								 fd, peer);
+	}
+};
+
+}
+
+static const IPv4Address a(192, 168, 1, 1, 80), b(192, 168, 1, 2, 80);
+
+TEST(SocketPool, Lifo)
+{
+	EventLoop loop;
+	SocketPool pool(loop, 4, std::chrono::minutes(1));
+
+	EXPECT_FALSE(pool.Get(a).IsDefined());
+
+	Pair p1, p2, p3;
+	const int fd1 = p1.fd.Get(), fd2 = p2.fd.Get(), fd3 = p3.fd.Get();
+	pool.Put(a, std::move(p1.fd));
+	pool.Put(a, std::move(p2.fd));
+	pool.Put(b, std::move(p3.fd));
+	EXPECT_EQ(pool.GetIdleCount(), 3u);
+
+	auto fd = pool.Get(a);
+	EXPECT_EQ(fd.Get(), fd2);
+	fd = pool.Get(a);
+	EXPECT_EQ(fd.Get(), fd1);
+	EXPECT_FALSE(pool.Get(a).IsDefined());
+
+	fd = pool.Get(b);
+	EXPECT_EQ(fd.Get(), fd3);
+	EXPECT_EQ(pool.GetIdleCount(), 0u);
+
+	EXPECT_EQ(pool.GetStats().hits, 3u);
+	EXPECT_EQ(pool.GetStats().misses, 2u);
+}
+
+TEST(SocketPool, Limit)
+{
+	EventLoop loop;
+	SocketPool pool(loop, 2, std::chrono::minutes(1));
+
+	Pair p1, p2, p3;
+	const int fd2 = p2.fd.Get(), fd3 = p3.fd.Get();
+	pool.Put(a, std::move(p1.fd));
+	pool.Put(a, std::move(p2.fd));
+	pool.Put(a, std::move(p3.fd));
+
+	/* the oldest one was closed */
+	EXPECT_EQ(pool.GetIdleCount(), 2u);
+	EXPECT_EQ(pool.GetStats().discarded, 1u);
+
+	EXPECT_EQ(pool.Get(a).Get(), fd3);
+	EXPECT_EQ(pool.Get(a).Get(), fd2);
+}
+
+TEST(SocketPool, ClosedByPeer)
+{
+	EventLoop loop;
+	SocketPool pool(loop, 4, std::chrono::minutes(1));
+
+	Pair p1, p2, p3;
+	const int fd1 = p1.fd.Get();
+	pool.Put(a, std::move(p1.fd));
+	pool.Put(a, std::move(p2.fd));
+	pool.Put(a, std::move(p3.fd));
+
+	/* peer closes the connection */
+	p3.peer.Close();
+
+	/* unexpected data from the peer */
+	ASSERT_EQ(send(p2.peer.Get(), "x", 1, 0), 1);
+
+	EXPECT_EQ(pool.Get(a).Get(), fd1);
+	EXPECT_EQ(pool.GetStats().discarded, 2u);
+	EXPECT_EQ(pool.GetIdleCount(), 0u);
+}
+
+TEST(SocketPool, Expired)
+{
+	EventLoop loop;
+	SocketPool pool(loop, 4, std::chrono::steady_clock::duration::zero());
+
+	Pair p;
+	pool.Put(a, std::move(p.fd));
+	EXPECT_FALSE(pool.Get(a).IsDefined());
+	EXPECT_EQ(pool.GetStats().discarded, 1u);
+}
+
+TEST(SocketPool, Disabled)
+{
+	EventLoop loop;
+	SocketPool pool(loop, 0, std::chrono::minutes(1));
+
+	/* the pool takes ownership and closes the socket */
+	Pair p;
+	pool.Put(a, std::move(p.fd));
+	EXPECT_FALSE(p.fd.IsDefined());
+	EXPECT_EQ(pool.GetStats().discarded, 1u);
+
+	char buffer[1];
+	EXPECT_EQ(recv(p.peer.Get(), buffer, sizeof(buffer), 0), 0);
+
+	EXPECT_FALSE(pool.Get(a).IsDefined());
+}
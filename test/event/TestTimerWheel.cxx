@@ -0,0 +1,130 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/TimerWheel.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/Loop.hxx"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace {
+
+struct Timer {
+	CoarseTimerEvent event;
+	std::vector<unsigned> &log;
+	const unsigned id;
+
+	Timer(EventLoop &loop, std::vector<unsigned> &_log, unsigned _id)
+		:event(loop, BIND_THIS_METHOD(OnTimer)), log(_log), id(_id) {}
+
+	void OnTimer() noexcept {
+		log.push_back(id);
+	}
+};
+
+}
+
+TEST(TimerWheel, Basic)
+{
+	using namespace std::chrono;
+	typedef TimerWheel::Clock Clock;
+
+	EventLoop loop;
+	TimerWheel wheel;
+	std::vector<unsigned> log;
+
+	/* the start time must not be before the wheel's construction
+	   time; round it up to a tick */
+	const auto start = TimerWheel::TickToTimePoint(duration_cast<TimerWheel::Tick>(Clock::now().time_since_epoch()).count() + 1);
+
+	Timer a(loop, log, 1), b(loop, log, 2), c(loop, log, 3),
+		d(loop, log, 4);
+
+	wheel.Insert(a.event, start + seconds(2), start);
+	wheel.Insert(b.event, start + seconds(1), start);
+	wheel.Insert(c.event, start + seconds(3), start);
+
+	/* more than one round of the wheel */
+	wheel.Insert(d.event, start + TimerWheel::Tick(TimerWheel::N_BUCKETS + 6),
+		     start);
+
+	EXPECT_EQ(wheel.GetTimeout(start), Clock::duration(seconds(1)));
+
+	wheel.Remove(c.event);
+
+	wheel.Run(start + milliseconds(999));
+	EXPECT_TRUE(log.empty());
+
+	wheel.Run(start + seconds(1));
+	ASSERT_EQ(log.size(), 1u);
+	EXPECT_EQ(log[0], 2u);
+
+	/* timers are rounded up to the next tick */
+	wheel.Run(start + seconds(2) - milliseconds(1));
+	EXPECT_EQ(log.size(), 1u);
+
+	wheel.Run(start + seconds(10));
+	ASSERT_EQ(log.size(), 2u);
+	EXPECT_EQ(log[1], 1u);
+
+	/* the bucket of "d" has been visited, but it is due in the
+	   next round */
+	EXPECT_FALSE(wheel.IsEmpty());
+	wheel.Run(start + TimerWheel::Tick(TimerWheel::N_BUCKETS + 5));
+	EXPECT_EQ(log.size(), 2u);
+
+	wheel.Run(start + TimerWheel::Tick(TimerWheel::N_BUCKETS + 6));
+	ASSERT_EQ(log.size(), 3u);
+	EXPECT_EQ(log[2], 4u);
+	EXPECT_TRUE(wheel.IsEmpty());
+	EXPECT_LT(wheel.GetTimeout(start).count(), 0);
+}
+
+TEST(TimerWheel, EventLoop)
+{
+	EventLoop loop;
+	std::vector<unsigned> log;
+
+	Timer a(loop, log, 1), b(loop, log, 2), c(loop, log, 3);
+	a.event.Add(std::chrono::milliseconds(500));
+	b.event.Add(std::chrono::milliseconds(10));
+	c.event.Add(std::chrono::milliseconds(20));
+	c.event.Cancel();
+
+	loop.Dispatch();
+
+	ASSERT_EQ(log.size(), 2u);
+	EXPECT_EQ(log[0], 2u);
+	EXPECT_EQ(log[1], 1u);
+}
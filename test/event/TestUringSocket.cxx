@@ -0,0 +1,364 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/UringQueue.hxx"
+#include "event/net/BufferedSocket.hxx"
+#include "event/Loop.hxx"
+#include "event/TimerEvent.hxx"
+
+#include <gtest/gtest.h>
+
+#include <exception>
+#include <system_error>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+/**
+ * Sends everything it receives back to the peer.
+ */
+class EchoHandler final : public BufferedSocketHandler {
+	BufferedSocket socket;
+
+public:
+	size_t received = 0;
+	bool ended = false;
+	std::exception_ptr error;
+
+	EchoHandler(EventLoop &loop, UringQueue &queue, SocketDescriptor fd)
+		:socket(loop) {
+		socket.Init(fd, FdType::FD_SOCKET, nullptr, nullptr, *this);
+		socket.EnableUring(queue);
+		socket.ScheduleReadNoTimeout(false);
+	}
+
+	~EchoHandler() noexcept {
+		if (socket.IsValid()) {
+			if (socket.IsConnected())
+				socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	BufferedResult OnBufferedData() override {
+		auto r = socket.ReadBuffer();
+		ssize_t nbytes = socket.Write(r.data, r.size);
+		if (nbytes < 0) {
+			if (nbytes == WRITE_BLOCKING)
+				return BufferedResult::BLOCKING;
+
+			throw std::system_error(errno, std::system_category(),
+						"Write() failed");
+		}
+
+		received += nbytes;
+		socket.Consumed(nbytes);
+
+		if (size_t(nbytes) < r.size) {
+			socket.ScheduleWrite();
+			return BufferedResult::BLOCKING;
+		}
+
+		return BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		socket.Close();
+		return true;
+	}
+
+	bool OnBufferedEnd() noexcept override {
+		ended = true;
+		socket.Destroy();
+		return true;
+	}
+
+	bool OnBufferedWrite() override {
+		socket.UnscheduleWrite();
+		return socket.Read(false);
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+		socket.Close();
+		socket.Destroy();
+	}
+};
+
+/**
+ * Counts the bytes it receives, or (if "stall" is set) never
+ * consumes anything, which makes the #BufferedSocket unschedule
+ * reading once its input buffer is full.
+ */
+class SinkHandler final : public BufferedSocketHandler {
+	EventLoop &loop;
+	BufferedSocket socket;
+
+	const bool stall;
+
+public:
+	size_t received = 0;
+	bool ended = false;
+	std::exception_ptr error;
+
+	SinkHandler(EventLoop &_loop, UringQueue &queue, SocketDescriptor fd,
+		    bool _stall)
+		:loop(_loop), socket(_loop), stall(_stall) {
+		socket.Init(fd, FdType::FD_SOCKET, nullptr, nullptr, *this);
+		socket.EnableUring(queue);
+		socket.ScheduleReadNoTimeout(false);
+	}
+
+	~SinkHandler() noexcept {
+		if (socket.IsValid()) {
+			if (socket.IsConnected())
+				socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	BufferedResult OnBufferedData() override {
+		if (stall)
+			return BufferedResult::BLOCKING;
+
+		const size_t n = socket.ReadBuffer().size;
+		received += n;
+		socket.Consumed(n);
+		return BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		socket.Close();
+		return true;
+	}
+
+	bool OnBufferedEnd() noexcept override {
+		ended = true;
+		socket.Destroy();
+		loop.Break();
+		return true;
+	}
+
+	bool OnBufferedWrite() override {
+		return true;
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+		socket.Close();
+		socket.Destroy();
+		loop.Break();
+	}
+};
+
+/**
+ * Breaks the #EventLoop if the test takes too long.
+ */
+class Watchdog {
+	EventLoop &loop;
+	TimerEvent timer;
+
+public:
+	bool timed_out = false;
+
+	explicit Watchdog(EventLoop &_loop) noexcept
+		:loop(_loop), timer(loop, BIND_THIS_METHOD(OnTimeout)) {
+		static constexpr struct timeval tv{5, 0};
+		timer.Add(tv);
+	}
+
+	void Cancel() noexcept {
+		timer.Cancel();
+	}
+
+private:
+	void OnTimeout() noexcept {
+		timed_out = true;
+		loop.Break();
+	}
+};
+
+static void
+SendAll(int fd, size_t total) noexcept
+{
+	char buffer[3000];
+	memset(buffer, 'x', sizeof(buffer));
+
+	for (size_t position = 0; position < total;) {
+		ssize_t nbytes = send(fd, buffer,
+				      std::min(sizeof(buffer), total - position),
+				      MSG_NOSIGNAL);
+		if (nbytes <= 0)
+			break;
+		position += nbytes;
+	}
+}
+
+}
+
+TEST(UringSocket, Echo)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+
+	/* the peer uses blocking I/O in two threads */
+	const int peer = sv[1];
+	SocketDescriptor(sv[0]).SetNonBlocking();
+
+	EventLoop loop;
+
+	std::unique_ptr<UringQueue> queue;
+	try {
+		queue.reset(new UringQueue(loop, 64, 16, 4096));
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "io_uring not available: %s\n", e.what());
+		close(sv[0]);
+		close(peer);
+		return;
+	}
+
+	EchoHandler handler(loop, *queue, SocketDescriptor(sv[0]));
+
+	static constexpr size_t TOTAL = 4 * 1024 * 1024;
+
+	std::thread writer([peer](){
+			char buffer[3000];
+			for (size_t i = 0; i < sizeof(buffer); ++i)
+				buffer[i] = char(i);
+
+			for (size_t position = 0; position < TOTAL;) {
+				size_t n = std::min(sizeof(buffer),
+						    TOTAL - position);
+				ssize_t nbytes = send(peer, buffer, n, MSG_NOSIGNAL);
+				if (nbytes <= 0)
+					break;
+				position += nbytes;
+			}
+		});
+
+	size_t echoed = 0;
+	std::thread reader([peer, &echoed](){
+			char buffer[8192];
+			while (echoed < TOTAL) {
+				ssize_t nbytes = recv(peer, buffer,
+						      sizeof(buffer), 0);
+				if (nbytes <= 0)
+					break;
+				echoed += nbytes;
+			}
+
+			shutdown(peer, SHUT_RDWR);
+		});
+
+	loop.Dispatch();
+
+	writer.join();
+	reader.join();
+	close(peer);
+
+	EXPECT_EQ(handler.error, nullptr);
+	EXPECT_TRUE(handler.ended);
+	EXPECT_EQ(handler.received, TOTAL);
+	EXPECT_EQ(echoed, TOTAL);
+}
+
+/**
+ * A socket which does not consume its input must not take all
+ * provided buffers away from the other sockets of the #UringQueue.
+ */
+TEST(UringSocket, StalledReader)
+{
+	int a[2], b[2];
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM, 0, a), 0);
+	ASSERT_EQ(socketpair(AF_LOCAL, SOCK_STREAM, 0, b), 0);
+	SocketDescriptor(a[0]).SetNonBlocking();
+	SocketDescriptor(b[0]).SetNonBlocking();
+
+	EventLoop loop;
+
+	std::unique_ptr<UringQueue> queue;
+	try {
+		queue.reset(new UringQueue(loop, 64, 16, 4096));
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "io_uring not available: %s\n", e.what());
+		close(a[0]);
+		close(a[1]);
+		close(b[0]);
+		close(b[1]);
+		return;
+	}
+
+	SinkHandler stalled(loop, *queue, SocketDescriptor(a[0]), true);
+	SinkHandler sink(loop, *queue, SocketDescriptor(b[0]), false);
+
+	/* the stalled socket's peer tries to send far more than the
+	   provided buffers can hold; it blocks until it is shut down
+	   below */
+	const int stalled_peer = a[1];
+	std::thread stalled_writer([stalled_peer](){
+			SendAll(stalled_peer, 16 * 1024 * 1024);
+		});
+
+	static constexpr size_t TOTAL = 256 * 1024;
+
+	/* give the stalled socket some time before the other one
+	   starts receiving */
+	const int peer = b[1];
+	std::thread writer([peer](){
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			SendAll(peer, TOTAL);
+			shutdown(peer, SHUT_WR);
+		});
+
+	Watchdog watchdog(loop);
+
+	loop.Dispatch();
+	watchdog.Cancel();
+
+	shutdown(stalled_peer, SHUT_RDWR);
+	shutdown(peer, SHUT_RDWR);
+	stalled_writer.join();
+	writer.join();
+	close(stalled_peer);
+	close(peer);
+
+	EXPECT_FALSE(watchdog.timed_out);
+	EXPECT_EQ(sink.error, nullptr);
+	EXPECT_TRUE(sink.ended);
+	EXPECT_EQ(sink.received, TOTAL);
+	EXPECT_EQ(stalled.received, 0u);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event/net/BufferedSocket.hxx"
+#include "event/Loop.hxx"
+
+#include <gtest/gtest.h>
+
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <thread>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <string.h>
+
+namespace {
+
+/**
+ * Sends one large buffer with BufferedSocket::WriteZeroCopy() and
+ * waits until the kernel has released it.
+ */
+class ZeroCopySender final : public BufferedSocketHandler {
+	EventLoop &loop;
+	BufferedSocket socket;
+
+	const uint8_t *const data;
+	const size_t size;
+
+	/**
+	 * The zero-copy counter before the last WriteZeroCopy() call.
+	 */
+	uint32_t last_counter;
+
+public:
+	size_t position = 0;
+	unsigned completions = 0;
+	bool zerocopy;
+	std::exception_ptr error;
+
+	ZeroCopySender(EventLoop &_loop, SocketDescriptor fd,
+		       const uint8_t *_data, size_t _size)
+		:loop(_loop), socket(_loop), data(_data), size(_size) {
+		socket.Init(fd, FdType::FD_TCP, nullptr, nullptr, *this);
+		zerocopy = socket.EnableZeroCopy(4096);
+		last_counter = socket.GetZeroCopyCounter();
+	}
+
+	~ZeroCopySender() noexcept {
+		if (socket.IsValid()) {
+			socket.Close();
+			socket.Destroy();
+		}
+	}
+
+	void Send() {
+		while (position < size) {
+			last_counter = socket.GetZeroCopyCounter();
+
+			ssize_t nbytes = socket.WriteZeroCopy(data + position,
+							      std::min<size_t>(size - position,
+									       65536));
+			if (nbytes == WRITE_BLOCKING)
+				return;
+
+			if (nbytes < 0)
+				throw std::system_error(errno, std::system_category(),
+							"WriteZeroCopy() failed");
+
+			position += nbytes;
+		}
+
+		socket.UnscheduleWrite();
+		CheckDone();
+	}
+
+	bool IsDone() const noexcept {
+		return position == size &&
+			socket.IsZeroCopyComplete(last_counter);
+	}
+
+	void CheckDone() noexcept {
+		if (IsDone())
+			loop.Break();
+	}
+
+	BufferedResult OnBufferedData() override {
+		return BufferedResult::OK;
+	}
+
+	bool OnBufferedClosed() noexcept override {
+		return true;
+	}
+
+	bool OnBufferedWrite() override {
+		Send();
+		return true;
+	}
+
+	bool OnBufferedZeroCopy() noexcept override {
+		++completions;
+		CheckDone();
+		return true;
+	}
+
+	void OnBufferedError(std::exception_ptr e) noexcept override {
+		error = e;
+		loop.Break();
+	}
+};
+
+}
+
+TEST(ZeroCopy, Tcp)
+{
+	const int listener = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_GE(listener, 0);
+
+	struct sockaddr_in sin{};
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sin_size = sizeof(sin);
+	ASSERT_EQ(bind(listener, (const struct sockaddr *)&sin, sizeof(sin)), 0);
+	ASSERT_EQ(listen(listener, 1), 0);
+	ASSERT_EQ(getsockname(listener, (struct sockaddr *)&sin, &sin_size), 0);
+
+	const int sender_fd = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_EQ(connect(sender_fd, (const struct sockaddr *)&sin, sizeof(sin)), 0);
+	const int peer = accept(listener, nullptr, nullptr);
+	ASSERT_GE(peer, 0);
+	close(listener);
+
+	SocketDescriptor(sender_fd).SetNonBlocking();
+
+	static constexpr size_t TOTAL = 4 * 1024 * 1024;
+	std::unique_ptr<uint8_t[]> data(new uint8_t[TOTAL]);
+	for (size_t i = 0; i < TOTAL; ++i)
+		data[i] = uint8_t(i * 7);
+
+	size_t received = 0;
+	bool equal = true;
+	std::thread reader([peer, &data, &received, &equal](){
+			uint8_t buffer[16384];
+			while (received < TOTAL) {
+				ssize_t nbytes = recv(peer, buffer,
+						      sizeof(buffer), 0);
+				if (nbytes <= 0)
+					break;
+
+				if (memcmp(buffer, &data[received], nbytes) != 0)
+					equal = false;
+				received += nbytes;
+			}
+		});
+
+	EventLoop loop;
+	ZeroCopySender sender(loop, SocketDescriptor(sender_fd),
+			      data.get(), TOTAL);
+	sender.Send();
+	if (!sender.IsDone())
+		loop.Dispatch();
+
+	reader.join();
+	close(peer);
+
+	EXPECT_EQ(sender.error, nullptr);
+	EXPECT_EQ(sender.position, TOTAL);
+	EXPECT_EQ(received, TOTAL);
+	EXPECT_TRUE(equal);
+
+	if (sender.zerocopy) {
+		/* the first MSG_ZEROCOPY send must have been
+		   completed */
+		EXPECT_GT(sender.completions, 0u);
+	}
+}
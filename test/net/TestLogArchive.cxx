@@ -0,0 +1,248 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "net/log/ArchiveWriter.hxx"
+#include "net/log/ArchiveReader.hxx"
+#include "net/log/Datagram.hxx"
+#include "util/ByteOrder.hxx"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace Net::Log;
+
+namespace {
+
+/**
+ * A temporary file which is deleted by the destructor.
+ */
+struct TempFile {
+	char path[64] = "/tmp/TestLogArchive.XXXXXX";
+
+	TempFile() {
+		int fd = mkstemp(path);
+		if (fd < 0)
+			throw std::runtime_error("mkstemp() failed");
+		close(fd);
+	}
+
+	~TempFile() {
+		unlink(path);
+	}
+};
+
+}
+
+static Datagram
+MakeAccess(uint64_t timestamp, const char *site, const char *uri,
+	   http_status_t status)
+{
+	Datagram d;
+	d.timestamp = timestamp;
+	d.valid_timestamp = true;
+	d.site = site;
+	d.http_uri = uri;
+	d.http_method = HTTP_METHOD_GET;
+	d.valid_http_method = true;
+	d.http_status = status;
+	d.valid_http_status = true;
+	d.type = Type::HTTP_ACCESS;
+	return d;
+}
+
+TEST(LogArchive, RoundTrip)
+{
+	TempFile file;
+
+	ArchiveWriter writer;
+
+	writer.Append(MakeAccess(1000000, "foo", "/a", HTTP_STATUS_OK));
+	writer.Append(MakeAccess(999000, "bar", "/b", HTTP_STATUS_NOT_FOUND));
+
+	Datagram d3 = MakeAccess(2000000, "foo", "/a", HTTP_STATUS_OK);
+	d3.valid_http_status = false;
+	d3.length = 12345;
+	d3.valid_length = true;
+	d3.traffic_received = 100;
+	d3.traffic_sent = 200;
+	d3.valid_traffic = true;
+	d3.duration = 42;
+	d3.valid_duration = true;
+	d3.user_agent = "agent";
+	writer.Append(d3);
+
+	Datagram d4("hello world");
+	writer.Append(d4);
+
+	EXPECT_EQ(writer.size(), 4u);
+	writer.Write(file.path);
+
+	ArchiveReader reader(file.path);
+	EXPECT_EQ(reader.size(), 4u);
+	EXPECT_EQ(reader.GetMinTimestamp(), 999000u);
+	EXPECT_EQ(reader.GetMaxTimestamp(), 2000000u);
+	EXPECT_TRUE(reader.Overlaps(0, 999000));
+	EXPECT_FALSE(reader.Overlaps(2000001, 3000000));
+	EXPECT_FALSE(reader.HasColumn(Attribute::REMOTE_HOST));
+	EXPECT_TRUE(reader.HasColumn(Attribute::SITE));
+
+	auto cursor = reader.Select();
+	Datagram d;
+
+	ASSERT_TRUE(cursor.Next(d));
+	EXPECT_TRUE(d.valid_timestamp);
+	EXPECT_EQ(d.timestamp, 1000000u);
+	EXPECT_STREQ(d.site, "foo");
+	EXPECT_STREQ(d.http_uri, "/a");
+	EXPECT_EQ(d.remote_host, nullptr);
+	EXPECT_TRUE(d.valid_http_method);
+	EXPECT_EQ(d.http_method, HTTP_METHOD_GET);
+	EXPECT_TRUE(d.valid_http_status);
+	EXPECT_EQ(d.http_status, HTTP_STATUS_OK);
+	EXPECT_FALSE(d.valid_length);
+	EXPECT_EQ(d.type, Type::HTTP_ACCESS);
+
+	ASSERT_TRUE(cursor.Next(d));
+	EXPECT_EQ(d.timestamp, 999000u);
+	EXPECT_STREQ(d.site, "bar");
+	EXPECT_EQ(d.http_status, HTTP_STATUS_NOT_FOUND);
+
+	ASSERT_TRUE(cursor.Next(d));
+	EXPECT_EQ(d.timestamp, 2000000u);
+	EXPECT_STREQ(d.site, "foo");
+	EXPECT_FALSE(d.valid_http_status);
+	EXPECT_TRUE(d.valid_length);
+	EXPECT_EQ(d.length, 12345u);
+	EXPECT_TRUE(d.valid_traffic);
+	EXPECT_EQ(d.traffic_received, 100u);
+	EXPECT_EQ(d.traffic_sent, 200u);
+	EXPECT_TRUE(d.valid_duration);
+	EXPECT_EQ(d.duration, 42u);
+	EXPECT_STREQ(d.user_agent, "agent");
+
+	ASSERT_TRUE(cursor.Next(d));
+	EXPECT_FALSE(d.valid_timestamp);
+	EXPECT_EQ(d.site, nullptr);
+	EXPECT_EQ(d.type, Type::UNSPECIFIED);
+	EXPECT_TRUE(d.message.Equals("hello world"));
+
+	EXPECT_FALSE(cursor.Next(d));
+}
+
+TEST(LogArchive, SelectColumns)
+{
+	TempFile file;
+
+	ArchiveWriter writer;
+	for (unsigned i = 0; i < 100; ++i) {
+		const auto uri = "/" + std::to_string(i % 7);
+		writer.Append(MakeAccess(1000 + i * 10, "site", uri.c_str(),
+					 HTTP_STATUS_OK));
+	}
+	writer.Write(file.path);
+
+	ArchiveReader reader(file.path);
+
+	/* only select the URI; the timestamp must not be decoded
+	   into the datagram */
+	auto cursor = reader.Select(Archive::MakeColumnMask(Attribute::HTTP_URI));
+	Datagram d;
+	for (unsigned i = 0; i < 100; ++i) {
+		ASSERT_TRUE(cursor.Next(d));
+		EXPECT_FALSE(d.valid_timestamp);
+		EXPECT_EQ(d.site, nullptr);
+		EXPECT_EQ(std::string(d.http_uri), "/" + std::to_string(i % 7));
+	}
+
+	EXPECT_FALSE(cursor.Next(d));
+
+	/* the timestamps are decoded correctly even if the first
+	   ones were skipped */
+	auto cursor2 = reader.Select(Archive::MakeColumnMask(Attribute::TIMESTAMP));
+	for (unsigned i = 0; i < 100; ++i) {
+		ASSERT_TRUE(cursor2.Next(d));
+		EXPECT_EQ(d.timestamp, 1000 + i * 10);
+	}
+}
+
+TEST(LogArchive, Malformed)
+{
+	TempFile file;
+
+	FILE *f = fopen(file.path, "w");
+	ASSERT_NE(f, nullptr);
+	fputs("this is not a log archive segment", f);
+	fclose(f);
+
+	EXPECT_THROW(ArchiveReader reader(file.path), std::runtime_error);
+
+	/* a valid segment with a corrupt dictionary */
+
+	ArchiveWriter writer;
+	writer.Append(Datagram("hello world"));
+	writer.Write(file.path);
+
+	std::string contents;
+	f = fopen(file.path, "rb");
+	ASSERT_NE(f, nullptr);
+	char buffer[4096];
+	size_t nbytes;
+	while ((nbytes = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		contents.append(buffer, nbytes);
+	fclose(f);
+
+	/* the dictionary has one string; its two offsets precede the
+	   string data */
+	const auto strings = contents.find("hello world");
+	ASSERT_NE(strings, std::string::npos);
+	ASSERT_GE(strings, 8u);
+
+	/* let the first offset point behind the end of the string,
+	   which would make its length negative */
+	const uint32_t bad_offset = ToLE32(13);
+	memcpy(&contents[strings - 8], &bad_offset, sizeof(bad_offset));
+
+	f = fopen(file.path, "wb");
+	ASSERT_NE(f, nullptr);
+	fwrite(contents.data(), 1, contents.size(), f);
+	fclose(f);
+
+	EXPECT_THROW(ArchiveReader reader(file.path), std::runtime_error);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "net/log/AsyncShipper.hxx"
+#include "net/log/Datagram.hxx"
+#include "net/log/Parser.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+static UniqueSocketDescriptor
+CreateReceiver()
+{
+	UniqueSocketDescriptor fd;
+	fd.Create(AF_INET, SOCK_DGRAM, 0);
+	fd.Bind(IPv4Address(127, 0, 0, 1, 0));
+
+	/* make room for all test datagrams */
+	const int size = 1024 * 1024;
+	fd.SetOption(SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	return fd;
+}
+
+/**
+ * Receive one datagram (waiting up to 5 seconds) and return its
+ * "site" attribute.
+ */
+static std::string
+ReceiveSite(SocketDescriptor fd)
+{
+	struct pollfd pfd = {fd.Get(), POLLIN, 0};
+	if (poll(&pfd, 1, 5000) <= 0)
+		return "timeout";
+
+	char buffer[8192];
+	ssize_t nbytes = recv(fd.Get(), buffer, sizeof(buffer), 0);
+	if (nbytes <= 0)
+		return "error";
+
+	const auto d = Net::Log::ParseDatagram(ConstBuffer<void>(buffer, nbytes));
+	return d.site != nullptr ? d.site : "";
+}
+
+TEST(LogAsyncShipper, Send)
+{
+	auto receiver = CreateReceiver();
+
+	{
+		Net::Log::AsyncShipper shipper(receiver.GetLocalAddress(),
+					       256);
+
+		Net::Log::Datagram d;
+		for (unsigned i = 0; i < 100; ++i) {
+			const auto site = std::to_string(i);
+			d.site = site.c_str();
+			shipper.Send(d);
+		}
+
+		for (unsigned i = 0; i < 100; ++i)
+			ASSERT_EQ(ReceiveSite(receiver), std::to_string(i));
+
+		const auto stats = shipper.GetStats();
+		EXPECT_EQ(stats.sent, 100u);
+		EXPECT_EQ(stats.dropped, 0u);
+		EXPECT_EQ(stats.connects, 1u);
+	}
+}
+
+TEST(LogAsyncShipper, Oversized)
+{
+	auto receiver = CreateReceiver();
+
+	Net::Log::AsyncShipper shipper(receiver.GetLocalAddress(), 4, 64);
+
+	const std::string large(200, 'x');
+	Net::Log::Datagram d;
+	d.site = large.c_str();
+	shipper.Send(d);
+
+	d.site = "small";
+	shipper.Send(d);
+
+	EXPECT_EQ(ReceiveSite(receiver), "small");
+	EXPECT_EQ(shipper.GetStats().oversized, 1u);
+}
+
+TEST(LogAsyncShipper, FlushOnDestruction)
+{
+	auto receiver = CreateReceiver();
+
+	{
+		Net::Log::AsyncShipper shipper(receiver.GetLocalAddress(), 16);
+
+		Net::Log::Datagram d;
+		d.site = "a";
+		shipper.Send(d);
+		d.site = "b";
+		shipper.Send(d);
+	}
+
+	EXPECT_EQ(ReceiveSite(receiver), "a");
+	EXPECT_EQ(ReceiveSite(receiver), "b");
+}
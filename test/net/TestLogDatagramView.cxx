@@ -0,0 +1,170 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "net/log/DatagramView.hxx"
+#include "net/log/Datagram.hxx"
+#include "net/log/Parser.hxx"
+#include "net/log/Send.hxx"
+#include "util/ByteOrder.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <string.h>
+
+using namespace Net::Log;
+
+static Datagram
+MakeDatagram()
+{
+	Datagram d;
+	d.timestamp = 1234567890;
+	d.valid_timestamp = true;
+	d.remote_host = "192.0.2.1";
+	d.host = "example.com";
+	d.site = "example";
+	d.http_method = HTTP_METHOD_POST;
+	d.valid_http_method = true;
+	d.http_uri = "/foo?bar";
+	d.user_agent = "test";
+	d.http_status = HTTP_STATUS_CREATED;
+	d.valid_http_status = true;
+	d.length = 42;
+	d.valid_length = true;
+	d.traffic_received = 100;
+	d.traffic_sent = 200;
+	d.valid_traffic = true;
+	d.duration = 999;
+	d.valid_duration = true;
+	return d;
+}
+
+TEST(LogDatagramView, Accessors)
+{
+	uint8_t buffer[1024];
+	const size_t size = Serialize(buffer, sizeof(buffer), MakeDatagram());
+	ASSERT_GT(size, 0u);
+
+	const DatagramView view(ConstBuffer<void>(buffer, size));
+
+	EXPECT_STREQ(view.GetSite(), "example");
+
+	uint64_t u64;
+	ASSERT_TRUE(view.GetTimestamp(u64));
+	EXPECT_EQ(u64, 1234567890u);
+
+	EXPECT_STREQ(view.GetRemoteHost(), "192.0.2.1");
+	EXPECT_STREQ(view.GetHost(), "example.com");
+	EXPECT_STREQ(view.GetHttpUri(), "/foo?bar");
+	EXPECT_STREQ(view.GetUserAgent(), "test");
+	EXPECT_EQ(view.GetHttpReferer(), nullptr);
+	EXPECT_EQ(view.GetForwardedTo(), nullptr);
+	EXPECT_TRUE(view.GetMessage().IsNull());
+
+	http_method_t method;
+	ASSERT_TRUE(view.GetHttpMethod(method));
+	EXPECT_EQ(method, HTTP_METHOD_POST);
+
+	http_status_t status;
+	ASSERT_TRUE(view.GetHttpStatus(status));
+	EXPECT_EQ(status, HTTP_STATUS_CREATED);
+
+	uint64_t received, sent;
+	ASSERT_TRUE(view.GetTraffic(received, sent));
+	EXPECT_EQ(received, 100u);
+	EXPECT_EQ(sent, 200u);
+
+	ASSERT_TRUE(view.GetDuration(u64));
+	EXPECT_EQ(u64, 999u);
+
+	/* guessed from the presence of HTTP_URI */
+	EXPECT_EQ(view.GetType(), Type::HTTP_ACCESS);
+
+	/* the strings point into the buffer */
+	EXPECT_GE((const void *)view.GetSite(), (const void *)buffer);
+	EXPECT_LT((const void *)view.GetSite(), (const void *)(buffer + size));
+}
+
+TEST(LogDatagramView, CompareParser)
+{
+	uint8_t buffer[1024];
+	const size_t size = Serialize(buffer, sizeof(buffer), MakeDatagram());
+	const ConstBuffer<void> b(buffer, size);
+
+	const auto expected = ParseDatagram(b);
+	const auto actual = DatagramView(b).ToDatagram();
+
+	EXPECT_EQ(actual.timestamp, expected.timestamp);
+	EXPECT_STREQ(actual.remote_host, expected.remote_host);
+	EXPECT_STREQ(actual.host, expected.host);
+	EXPECT_STREQ(actual.site, expected.site);
+	EXPECT_STREQ(actual.http_uri, expected.http_uri);
+	EXPECT_STREQ(actual.user_agent, expected.user_agent);
+	EXPECT_EQ(actual.http_method, expected.http_method);
+	EXPECT_EQ(actual.http_status, expected.http_status);
+	EXPECT_EQ(actual.length, expected.length);
+	EXPECT_EQ(actual.traffic_received, expected.traffic_received);
+	EXPECT_EQ(actual.traffic_sent, expected.traffic_sent);
+	EXPECT_EQ(actual.duration, expected.duration);
+	EXPECT_EQ(actual.type, expected.type);
+	EXPECT_EQ(actual.valid_length, expected.valid_length);
+}
+
+TEST(LogDatagramView, BadCrc)
+{
+	uint8_t buffer[1024];
+	const size_t size = Serialize(buffer, sizeof(buffer), MakeDatagram());
+	buffer[size / 2] ^= 1;
+
+	EXPECT_THROW(DatagramView(ConstBuffer<void>(buffer, size)),
+		     ProtocolError);
+}
+
+TEST(LogDatagramView, Lazy)
+{
+	/* a version 1 datagram (without CRC) with a malformed
+	   attribute after the site */
+	std::string s;
+	const uint32_t magic = ToBE32(MAGIC_V1);
+	s.append((const char *)&magic, sizeof(magic));
+	s.push_back(char(Attribute::SITE));
+	s.append("foo", 4);
+	s.push_back(char(Attribute::USER_AGENT));
+	s.append("unterminated");
+
+	const DatagramView view(ConstBuffer<void>(s.data(), s.size()));
+
+	/* the malformed attribute is not looked at until needed */
+	EXPECT_STREQ(view.GetSite(), "foo");
+	EXPECT_THROW(view.GetUserAgent(), ProtocolError);
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "net/log/OneLine.hxx"
+#include "net/log/Datagram.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+class OneLineTest : public ::testing::Test {
+protected:
+	UniqueFileDescriptor r, w;
+
+	void SetUp() override {
+		setenv("TZ", "UTC", 1);
+		tzset();
+
+		ASSERT_TRUE(UniqueFileDescriptor::CreatePipe(r, w));
+		r.SetNonBlocking();
+	}
+
+	std::string ReadAll() {
+		std::string result;
+		char buffer[65536];
+		ssize_t nbytes;
+		while ((nbytes = r.Read(buffer, sizeof(buffer))) > 0)
+			result.append(buffer, nbytes);
+		return result;
+	}
+};
+
+static Net::Log::Datagram
+MakeHttp(const char *uri)
+{
+	Net::Log::Datagram d;
+	d.timestamp = 1500000000000000ULL;
+	d.valid_timestamp = true;
+	d.site = "example";
+	d.remote_host = "192.0.2.1";
+	d.http_method = HTTP_METHOD_GET;
+	d.valid_http_method = true;
+	d.http_uri = uri;
+	d.http_status = HTTP_STATUS_OK;
+	d.valid_http_status = true;
+	d.user_agent = "Foo/1.0";
+	d.length = 1234;
+	d.valid_length = true;
+	d.duration = 5678;
+	d.valid_duration = true;
+	return d;
+}
+
+/**
+ * The escaping rules of LogOneLine(), one character at a time.
+ */
+static std::string
+ReferenceEscape(const char *s, size_t max_length)
+{
+	std::string result;
+	for (; *s != 0 && result.length() < max_length; ++s) {
+		const signed char ch = *s;
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			result.push_back(ch);
+		else {
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "\\x%02X",
+				 (unsigned char)ch);
+			result.append(buffer);
+		}
+	}
+
+	return result;
+}
+
+TEST_F(OneLineTest, Http)
+{
+	LogOneLine(w.ToFileDescriptor(), MakeHttp("/foo?bar"));
+	LogOneLine(w.ToFileDescriptor(), MakeHttp("/foo"), false);
+
+	EXPECT_EQ(ReadAll(),
+		  "example 192.0.2.1 - - [14/Jul/2017:02:40:00 +0000] \"GET /foo?bar HTTP/1.1\" 200 1234 \"-\" \"Foo/1.0\" 5678\n"
+		  "192.0.2.1 - - [14/Jul/2017:02:40:00 +0000] \"GET /foo HTTP/1.1\" 200 1234 \"-\" \"Foo/1.0\" 5678\n");
+}
+
+TEST_F(OneLineTest, Optional)
+{
+	Net::Log::Datagram d;
+	d.http_uri = "/";
+	d.http_status = HTTP_STATUS_NOT_FOUND;
+	d.valid_http_status = true;
+
+	LogOneLine(w.ToFileDescriptor(), d);
+
+	EXPECT_EQ(ReadAll(),
+		  "- - - - [-] \"? / HTTP/1.1\" 404 - \"-\" \"-\" -\n");
+}
+
+TEST_F(OneLineTest, Message)
+{
+	Net::Log::Datagram d;
+	d.timestamp = 1500000000000000ULL;
+	d.valid_timestamp = true;
+	d.site = "example";
+	d.message = "hello \"world\"\n";
+
+	LogOneLine(w.ToFileDescriptor(), d);
+	LogOneLine(w.ToFileDescriptor(), d, false);
+
+	/* neither HTTP nor message: ignored */
+	LogOneLine(w.ToFileDescriptor(), Net::Log::Datagram());
+
+	EXPECT_EQ(ReadAll(),
+		  "example [14/Jul/2017:02:40:00 +0000] hello \\x22world\\x22\\x0A\n"
+		  "[14/Jul/2017:02:40:00 +0000] hello \\x22world\\x22\\x0A\n");
+}
+
+TEST_F(OneLineTest, Escape)
+{
+	/* put special characters at all positions relative to the
+	   16 and 32 byte blocks */
+	for (size_t i = 0; i < 100; ++i) {
+		std::string uri(100, 'a');
+		uri[i] = i % 3 == 0 ? '"' : (i % 3 == 1 ? '\\' : '\x80');
+		uri[(i * 7) % 100] = '\x01';
+
+		LogOneLine(w.ToFileDescriptor(), MakeHttp(uri.c_str()), false);
+
+		const std::string expected =
+			"192.0.2.1 - - [14/Jul/2017:02:40:00 +0000] \"GET " +
+			ReferenceEscape(uri.c_str(), 4092) +
+			" HTTP/1.1\" 200 1234 \"-\" \"Foo/1.0\" 5678\n";
+		EXPECT_EQ(ReadAll(), expected);
+	}
+}
+
+TEST_F(OneLineTest, Truncate)
+{
+	for (size_t n : {4090, 4091, 4092, 4093, 5000}) {
+		std::string uri(6000, 'a');
+		uri[n] = '\x7f';
+		uri[n + 1] = '\n';
+
+		LogOneLine(w.ToFileDescriptor(), MakeHttp(uri.c_str()), false);
+
+		const std::string expected =
+			"192.0.2.1 - - [14/Jul/2017:02:40:00 +0000] \"GET " +
+			ReferenceEscape(uri.c_str(), 4092) +
+			" HTTP/1.1\" 200 1234 \"-\" \"Foo/1.0\" 5678\n";
+		EXPECT_EQ(ReadAll(), expected);
+	}
+}
+
+TEST_F(OneLineTest, Writer)
+{
+	UniqueFileDescriptor r2, w2;
+	ASSERT_TRUE(UniqueFileDescriptor::CreatePipe(r2, w2));
+	r2.SetNonBlocking();
+
+	OneLineWriter writer(w2.ToFileDescriptor(), true, 16384);
+	EXPECT_TRUE(writer.IsEmpty());
+
+	const std::string uri(3000, 'x');
+	std::string expected;
+
+	for (unsigned i = 0; i < 10; ++i) {
+		auto d = MakeHttp(uri.c_str());
+		d.timestamp += i * 700000;
+		d.valid_length = i % 2 == 0;
+		writer.Append(d);
+
+		LogOneLine(w.ToFileDescriptor(), d);
+	}
+
+	EXPECT_FALSE(writer.IsEmpty());
+	writer.Flush();
+	EXPECT_TRUE(writer.IsEmpty());
+
+	expected = ReadAll();
+	std::swap(r, r2);
+	EXPECT_EQ(ReadAll(), expected);
+}
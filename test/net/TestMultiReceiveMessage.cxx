@@ -0,0 +1,173 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "net/MultiReceiveMessage.hxx"
+#include "net/SendMessage.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <sys/socket.h>
+
+static UniqueSocketDescriptor
+CreateUdp()
+{
+	UniqueSocketDescriptor fd;
+	fd.CreateNonBlock(AF_INET, SOCK_DGRAM, 0);
+	fd.Bind(IPv4Address(127, 0, 0, 1, 0));
+	return fd;
+}
+
+/**
+ * Send 10 segments of 100 bytes (and a short one) with UDP_SEGMENT
+ * and verify that they are received as separate datagrams.
+ */
+static void
+TestSegmented(bool gro)
+{
+	auto sender = CreateUdp(), receiver = CreateUdp();
+	const auto address = receiver.GetLocalAddress();
+
+	if (gro && !receiver.SetUdpGro()) {
+		std::cerr << "UDP_GRO not supported" << std::endl;
+		return;
+	}
+
+	char payload[1050];
+	for (size_t i = 0; i < sizeof(payload); ++i)
+		payload[i] = i / 100;
+
+	const struct iovec v{payload, sizeof(payload)};
+	try {
+		SendSegmentedMessage(sender,
+				     MessageHeader({&v, 1}).SetAddress(address),
+				     100, 0);
+	} catch (const std::system_error &e) {
+		std::cerr << "UDP_SEGMENT not supported: " << e.what() << std::endl;
+		return;
+	}
+
+	MultiReceiveMessage multi(16, gro ? 65536 : 2048, 0, 0, gro);
+
+	unsigned n = 0;
+	while (n < 11 && multi.Receive(receiver)) {
+		for (const auto &d : multi) {
+			ASSERT_LT(n, 11u);
+			EXPECT_EQ(d.payload.size, n < 10 ? 100u : 50u);
+			EXPECT_EQ(memcmp(d.payload.data, payload + n * 100,
+					 d.payload.size), 0);
+			EXPECT_EQ(d.address.GetPort(),
+				  sender.GetLocalAddress().GetPort());
+			++n;
+		}
+
+		if (multi.begin() == multi.end())
+			break;
+	}
+
+	EXPECT_EQ(n, 11u);
+}
+
+TEST(MultiReceiveMessage, Segmented)
+{
+	TestSegmented(false);
+}
+
+TEST(MultiReceiveMessage, Gro)
+{
+	TestSegmented(true);
+}
+
+static void
+Send(SocketDescriptor s, SocketAddress address, const char *data)
+{
+	ASSERT_EQ(sendto(s.Get(), data, strlen(data), 0,
+			 address.GetAddress(), address.GetSize()),
+		  ssize_t(strlen(data)));
+}
+
+TEST(MultiReceiveMessage, Retain)
+{
+	auto sender = CreateUdp(), receiver = CreateUdp();
+	const auto address = receiver.GetLocalAddress();
+
+	MultiReceiveMessage multi(4, 256);
+	multi.SetMaxSpareSlots(1);
+	EXPECT_EQ(multi.GetSlotCount(), 4u);
+
+	Send(sender, address, "foo");
+	ASSERT_TRUE(multi.Receive(receiver));
+	ASSERT_EQ(std::distance(multi.begin(), multi.end()), 1);
+	auto foo = multi.Retain(*multi.begin());
+	multi.Clear();
+
+	/* the retained payload is not overwritten; only its slot is
+	   replaced */
+	Send(sender, address, "barbaz");
+	ASSERT_TRUE(multi.Receive(receiver));
+	ASSERT_EQ(std::distance(multi.begin(), multi.end()), 1);
+	EXPECT_EQ(multi.GetSlotCount(), 5u);
+	EXPECT_NE(multi.begin()->payload.data, foo.payload.data);
+	auto bar = multi.Retain(*multi.begin());
+	multi.Clear();
+
+	Send(sender, address, "x");
+	ASSERT_TRUE(multi.Receive(receiver));
+	EXPECT_EQ(multi.GetSlotCount(), 6u);
+	multi.Clear();
+
+	ASSERT_EQ(foo.payload.size, 3u);
+	EXPECT_EQ(memcmp(foo.payload.data, "foo", 3), 0);
+	ASSERT_EQ(bar.payload.size, 6u);
+	EXPECT_EQ(memcmp(bar.payload.data, "barbaz", 6), 0);
+
+	/* after releasing, one slot is kept as a spare, and the
+	   other one is freed */
+	foo = {};
+	bar = {};
+
+	Send(sender, address, "y");
+	ASSERT_TRUE(multi.Receive(receiver));
+	EXPECT_EQ(multi.GetSlotCount(), 5u);
+
+	/* the spare slot replaces the next retained one */
+	auto y = multi.Retain(*multi.begin());
+	multi.Clear();
+
+	Send(sender, address, "z");
+	ASSERT_TRUE(multi.Receive(receiver));
+	EXPECT_EQ(multi.GetSlotCount(), 5u);
+	EXPECT_EQ(memcmp(y.payload.data, "y", 1), 0);
+}
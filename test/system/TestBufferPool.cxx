@@ -0,0 +1,139 @@
+/*
+ * Copyright 2007-2017 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "system/BufferPool.hxx"
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include <string.h>
+
+TEST(BufferPoolTest, Basic)
+{
+    BufferPool pool(4096, 16 * 4096);
+    EXPECT_EQ(pool.GetTotalSize(), 0u);
+
+    void *a = pool.Get();
+    EXPECT_EQ(pool.GetTotalSize(), 16u * 4096);
+    EXPECT_EQ(pool.GetUsedCount(), 1u);
+    memset(a, 0xaa, 4096);
+
+    void *b = pool.Get();
+    EXPECT_NE(a, b);
+
+    pool.Put(a);
+    EXPECT_EQ(pool.GetUsedCount(), 1u);
+
+    /* the most recently freed buffer is reused first */
+    EXPECT_EQ(pool.Get(), a);
+
+    pool.Put(a);
+    pool.Put(b);
+    EXPECT_EQ(pool.GetUsedCount(), 0u);
+}
+
+TEST(BufferPoolTest, Grow)
+{
+    BufferPool pool(1024, 4 * 1024);
+
+    std::set<void *> buffers;
+    for (unsigned i = 0; i < 10; ++i)
+        EXPECT_TRUE(buffers.insert(pool.Get()).second);
+
+    EXPECT_EQ(pool.GetTotalSize(), 12u * 1024);
+    EXPECT_EQ(pool.GetUsedCount(), 10u);
+
+    for (void *p : buffers)
+        pool.Put(p);
+
+    EXPECT_EQ(pool.GetUsedCount(), 0u);
+}
+
+TEST(BufferPoolTest, Release)
+{
+    BufferPool pool(1024, 4 * 1024);
+
+    std::set<void *> buffers;
+    for (unsigned i = 0; i < 16; ++i)
+        buffers.insert(pool.Get());
+
+    EXPECT_EQ(pool.GetTotalSize(), 16u * 1024);
+
+    /* a partially used slab is not released */
+    void *kept = *buffers.begin();
+    buffers.erase(buffers.begin());
+    for (void *p : buffers)
+        pool.Put(p);
+
+    EXPECT_EQ(pool.GetUsedCount(), 1u);
+    EXPECT_EQ(pool.GetTotalSize(), 8u * 1024);
+
+    /* one free slab is kept for reuse */
+    pool.Put(kept);
+    EXPECT_EQ(pool.GetUsedCount(), 0u);
+    EXPECT_EQ(pool.GetTotalSize(), 4u * 1024);
+
+    void *a = pool.Get();
+    EXPECT_EQ(pool.GetTotalSize(), 4u * 1024);
+    pool.Put(a);
+}
+
+TEST(BufferPoolTest, Cache)
+{
+    BufferPool pool(1024, 256 * 1024);
+
+    {
+        BufferCache cache(pool);
+
+        void *a = cache.Get();
+        /* the cache has fetched a whole batch */
+        EXPECT_GT(pool.GetUsedCount(), 1u);
+
+        cache.Put(a);
+        EXPECT_EQ(cache.Get(), a);
+
+        std::set<void *> buffers{a};
+        for (unsigned i = 0; i < 200; ++i)
+            EXPECT_TRUE(buffers.insert(cache.Get()).second);
+
+        EXPECT_GE(pool.GetUsedCount(), buffers.size());
+
+        for (void *p : buffers)
+            cache.Put(p);
+
+        /* the cache holds only a limited number of buffers */
+        EXPECT_LT(pool.GetUsedCount(), 100u);
+    }
+
+    EXPECT_EQ(pool.GetUsedCount(), 0u);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for #Crc32 compared to boost::crc_32_type, for buffer
+ * sizes typical for log datagrams and for bulk data.
+ */
+
+#include "util/Crc32.hxx"
+
+#include <boost/crc.hpp>
+
+#include <chrono>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+template<typename F>
+static void
+Run(const char *name, size_t size, F &&f)
+{
+	static std::vector<uint8_t> buffer(65536, 0x5a);
+
+	const size_t total = 256 * 1024 * 1024;
+	const size_t n = total / size;
+
+	uint32_t result = 0;
+
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < n; ++i) {
+		/* feed the previous result into the next iteration so
+		   the compiler cannot hoist the calculation */
+		memcpy(buffer.data(), &result, sizeof(result));
+		result = f(buffer.data(), size);
+	}
+	const std::chrono::duration<double> duration =
+		std::chrono::steady_clock::now() - start;
+
+	printf("%-6s %6zu bytes %10.1f MB/s (%08x)\n", name, size,
+	       n * size / duration.count() / (1024 * 1024), result);
+}
+
+int
+main(int, char **)
+{
+	static constexpr size_t sizes[] = {64, 256, 1500, 65536};
+
+	for (size_t size : sizes) {
+		Run("boost", size, [](const void *data, size_t length){
+				boost::crc_32_type crc;
+				crc.process_bytes(data, length);
+				return crc.checksum();
+			});
+
+		Run("table", size, [](const void *data, size_t length){
+				return ~Crc32::UpdateTable(0xffffffff, data, length);
+			});
+
+		if (Crc32::HasClmul())
+			Run("clmul", size, [](const void *data, size_t length){
+					return ~Crc32::UpdateClmul(0xffffffff, data, length);
+				});
+	}
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2007-2018 Content Management AG
+ * All rights reserved.
+ *
+ * author: Max Kellermann <mk@cm4all.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * FOUNDATION OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "util/Crc32.hxx"
+
+#include <boost/crc.hpp>
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+static uint32_t
+BoostCrc32(const void *data, size_t size)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+TEST(Crc32, Check)
+{
+	/* the standard check value */
+	EXPECT_EQ(Crc32::Calculate("123456789", 9), 0xcbf43926u);
+	EXPECT_EQ(Crc32::Calculate("", 0), 0u);
+}
+
+TEST(Crc32, CompareBoost)
+{
+	uint8_t buffer[4096 + 64];
+	srand(42);
+	for (auto &i : buffer)
+		i = rand();
+
+	static constexpr size_t sizes[] = {
+		0, 1, 7, 8, 9, 15, 16, 63, 64, 65, 79, 80, 127, 128,
+		200, 1000, 1024, 4095, 4096,
+	};
+
+	for (size_t offset = 0; offset < 16; ++offset) {
+		for (size_t size : sizes) {
+			const uint8_t *p = buffer + offset;
+			const uint32_t expected = BoostCrc32(p, size);
+
+			EXPECT_EQ(Crc32::Calculate(p, size), expected);
+			EXPECT_EQ(~Crc32::UpdateTable(0xffffffff, p, size),
+				  expected);
+
+			if (Crc32::HasClmul()) {
+				EXPECT_EQ(~Crc32::UpdateClmul(0xffffffff, p, size),
+					  expected);
+			}
+		}
+	}
+}
+
+TEST(Crc32, Incremental)
+{
+	uint8_t buffer[1000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = i * 7;
+
+	Crc32 crc;
+	crc.reset();
+	crc.process_bytes(buffer, 3);
+	crc.process_bytes(buffer + 3, 100);
+	crc.process_bytes(buffer + 103, sizeof(buffer) - 103);
+
+	EXPECT_EQ(crc.checksum(), BoostCrc32(buffer, sizeof(buffer)));
+}